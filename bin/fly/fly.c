@@ -37,7 +37,9 @@
 #include <netinet/in.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,8 +47,11 @@
 
 #include <ft/ctype.h>
 #include <ft/endian.h>
+#include <ft/ip4.h>
 #include <ft/log.h>
 
+#include "fly.h"
+
 #define FLY_DEFAULT_PORT 80
 static const char data[] = "Sed ut perspiciatis, unde omnis iste natus error sit voluptatem accusantium doloremque laudantium, totam rem aperiam eaque ipsa, quae ab illo inventore veritatis et quasi architecto beatae vitae dicta sunt, explicabo.  Nemo enim ipsam voluptatem, quia voluptas sit, aspernatur aut odit aut fugit, sed quia consequuntur magni dolores eos, qui ratione voluptatem sequi nesciunt, neque porro quisquam est, qui dolorem ipsum, quia dolor sit amet consectetur adipisci velit, sed quia non numquam eius modi tempora incidunt, ut labore et dolore magnam aliquam quaerat voluptatem.  Ut enim ad minima veniam, quis nostrum exercitationem ullam corporis suscipit laboriosam, nisi ut aliquid ex ea commodi consequatur? Quis autem vel eum iure reprehenderit, qui in ea voluptate velit esse, quam nihil molestiae consequatur, vel illum, qui dolorem eum fugiat, quo voluptas nulla pariatur?\nAt vero eos et accusamus et iusto odio dignissimos ducimus, qui blanditiis praesentium voluptatum deleniti atque corrupti, quos dolores et quas molestias excepturi sint, obcaecati cupiditate non provident, similique sunt in culpa, qui officia deserunt mollitia animi, id est laborum et dolorum fuga.  Et harum quidem rerum facilis est et expedita distinctio.  Nam libero tempore, cum soluta nobis est eligendi optio, cumque nihil impedit, quo minus id, quod maxime placeat, facere possimus, omnis voluptas assumenda est, omnis dolor repellendus.  Temporibus autem quibusdam et aut officiis debitis aut rerum necessitatibus saepe eveniet, ut et voluptates repudiandae sint et molestiae non recusandae.  Itaque earum rerum hic tenetur a sapiente delectus, ut aut reiciendis voluptatibus maiores alias consequatur aut perferendis doloribus asperiores repellat...\n";
 
@@ -94,6 +99,66 @@ parse_ip_port(const char *str, struct sockaddr_in *sin4)
 	return (0);
 }
 
+/*
+ * Parse a non-negative decimal number no greater than max.
+ */
+static int
+parse_number(const char *str, unsigned long max, unsigned long *n)
+{
+
+	for (*n = 0; is_digit(*str); ++str) {
+		*n = *n * 10 + *str - '0';
+		if (*n > max)
+			return (-1);
+	}
+	return (*str == '\0' ? 0 : -1);
+}
+
+/*
+ * Parse a comma-separated list of ports and port ranges.
+ */
+static int
+parse_ports(const char *str, uint16_t **ports, size_t *nports)
+{
+	unsigned long first, last;
+	uint16_t *p, *tmp;
+	size_t n, size;
+
+	p = NULL;
+	n = size = 0;
+	while (*str != '\0') {
+		for (first = 0; is_digit(*str); ++str)
+			if ((first = first * 10 + *str - '0') > 65535)
+				goto fail;
+		last = first;
+		if (*str == '-')
+			for (++str, last = 0; is_digit(*str); ++str)
+				if ((last = last * 10 + *str - '0') > 65535)
+					goto fail;
+		if (first == 0 || last < first ||
+		    (*str != '\0' && *str++ != ','))
+			goto fail;
+		while (first <= last) {
+			if (n == size) {
+				size = size ? size * 2 : 16;
+				tmp = realloc(p, size * sizeof *p);
+				if (tmp == NULL)
+					goto fail;
+				p = tmp;
+			}
+			p[n++] = first++;
+		}
+	}
+	if (n == 0)
+		goto fail;
+	*ports = p;
+	*nports = n;
+	return (0);
+fail:
+	free(p);
+	return (-1);
+}
+
 static int
 fly(const char *target, int linger, int timeout)
 {
@@ -164,22 +229,64 @@ fly(const char *target, int linger, int timeout)
 	return (0);
 }
 
+/*
+ * Set up load mode from the command line and run it.
+ */
+static int
+load(struct fly_load *fl, int argc, char *argv[])
+{
+	ip4_addr first, last;
+	const char *e;
+	int i, ret;
+
+	if ((fl->targets = calloc(argc, sizeof *fl->targets)) == NULL) {
+		ft_error("malloc(): %s", strerror(errno));
+		return (-1);
+	}
+	for (i = 0; i < argc; ++i) {
+		e = ip4_parse_range(argv[i], &first, &last);
+		if (e == NULL || *e != '\0') {
+			ft_error("invalid address range: %s", argv[i]);
+			free(fl->targets);
+			return (-1);
+		}
+		fl->targets[i].first = be32toh(first.q);
+		fl->targets[i].last = be32toh(last.q);
+	}
+	fl->ntargets = argc;
+	fl->data = data;
+	fl->len = sizeof data - 1;
+	ret = fly_load(fl);
+	free(fl->targets);
+	return (ret);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: fly [-dlv] ip[:port]\n");
+	fprintf(stderr, "usage: fly [-dlv] [-t timeout] ip[:port]\n"
+	    "       fly -c conns [-dv] [-n count] [-p ports] [-t timeout] "
+	    "[-w hold] range ...\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
+	struct fly_load fl = { .hold = 30 };
+	static uint16_t http = FLY_DEFAULT_PORT;
 	int linger = 0, timeout = 10;
+	unsigned long n;
 	int opt, ret;
 
-	while ((opt = getopt(argc, argv, "dlv")) != -1)
+	while ((opt = getopt(argc, argv, "c:dln:p:t:vw:")) != -1)
 		switch (opt) {
+		case 'c':
+			if (parse_number(optarg, 1000000, &n) != 0 || n == 0)
+				usage();
+			fl.conns = n;
+			break;
 		case 'd':
 			if (ft_log_level > FT_LOG_LEVEL_DEBUG)
 				ft_log_level = FT_LOG_LEVEL_DEBUG;
@@ -187,10 +294,30 @@ main(int argc, char *argv[])
 		case 'l':
 			linger = 1;
 			break;
+		case 'n':
+			if (parse_number(optarg, ULONG_MAX / 10, &n) != 0)
+				usage();
+			fl.total = n;
+			break;
+		case 'p':
+			free(fl.ports);
+			if (parse_ports(optarg, &fl.ports, &fl.nports) != 0)
+				usage();
+			break;
+		case 't':
+			if (parse_number(optarg, 3600, &n) != 0 || n == 0)
+				usage();
+			timeout = n;
+			break;
 		case 'v':
 			if (ft_log_level > FT_LOG_LEVEL_VERBOSE)
 				ft_log_level = FT_LOG_LEVEL_VERBOSE;
 			break;
+		case 'w':
+			if (parse_number(optarg, 86400, &n) != 0)
+				usage();
+			fl.hold = n;
+			break;
 		default:
 			usage();
 		}
@@ -198,7 +325,23 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
+	if (fl.conns > 0) {
+		if (argc < 1 || linger)
+			usage();
+		if (fl.ports == NULL) {
+			fl.ports = &http;
+			fl.nports = 1;
+		}
+		fl.timeout = timeout;
+		ft_log_init("fly", NULL);
+		ret = load(&fl, argc, argv);
+		ft_log_exit();
+		if (fl.ports != &http)
+			free(fl.ports);
+		exit(ret == 0 ? 0 : 1);
+	}
+
+	if (argc != 1 || fl.total > 0 || fl.ports != NULL)
 		usage();
 
 	ft_log_init("fly", NULL);
@@ -0,0 +1,611 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif HAVE_SYS_EVENT_H
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ft/endian.h>
+#include <ft/hist.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "fly.h"
+
+/*
+ * Load mode
+ *
+ * Keep a fixed number of non-blocking connections going at once,
+ * cycling through every combination of target address and port.  Once
+ * a connection is established, we send our data and hold on to it for
+ * a while.  A tarpit will have advertised a zero window, so when we let
+ * go, the data should still be sitting in our send queue.
+ */
+
+/* ask the kernel how much of our data is still unacknowledged */
+#if defined(FIONWRITE)
+#define FLY_OUTQ	FIONWRITE
+#elif defined(__linux__) && defined(TIOCOUTQ)
+#define FLY_OUTQ	TIOCOUTQ
+#endif
+
+#define FLY_EVENTS	256
+#define FLY_SCAN	(50 * 1000 * 1000)	/* deadline scan interval */
+#define FLY_REPORT	(1000 * 1000 * 1000)	/* progress report interval */
+
+/* are there more connections to make? */
+#define FLY_MORE()	(fl->total == 0 || res.attempts < fl->total)
+
+enum fly_state { fly_idle, fly_connecting, fly_holding };
+
+struct fly_conn {
+	int		 fd;
+	enum fly_state	 state;
+	uint64_t	 start;		/* when we called connect() */
+	uint64_t	 deadline;
+};
+
+static const struct fly_load *fl;
+
+/* connection slots and the stack of idle ones */
+static struct fly_conn *conns;
+static struct fly_conn **idle;
+static unsigned int nconns, nidle;
+
+/* next target */
+static size_t cur_range, cur_port;
+static uint32_t cur_addr;
+
+/* results */
+static struct {
+	unsigned long	 attempts;
+	unsigned long	 established;
+	unsigned long	 refused;	/* connection refused */
+	unsigned long	 timedout;	/* no SYN/ACK in time */
+	unsigned long	 failed;	/* other errors */
+	unsigned long	 held;		/* data still queued when let go */
+	unsigned long	 acked;		/* data acknowledged */
+	unsigned long	 answered;	/* peer sent data */
+	unsigned long	 closed;	/* peer closed the connection */
+	unsigned long	 reset;		/* peer reset the connection */
+	unsigned int	 holding;	/* currently held */
+	unsigned int	 peak;		/* most held at once */
+	uint64_t	 first, last;	/* first attempt and last connect */
+	ft_hist		 latency;	/* connect() to SYN/ACK, in ns */
+} res;
+
+static volatile sig_atomic_t stop;
+
+static void
+fly_signal(int sig)
+{
+
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t
+fly_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Event notification: epoll on Linux, kqueue elsewhere.  A connection
+ * is watched for writability until it is established, and for
+ * readability after that.
+ */
+static int eq = -1;
+
+#if HAVE_SYS_EPOLL_H
+static struct epoll_event evs[FLY_EVENTS];
+
+static int
+fly_ev_init(void)
+{
+
+	return (eq = epoll_create1(EPOLL_CLOEXEC));
+}
+
+static int
+fly_ev_watch(struct fly_conn *fc, int writable)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = writable ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = fc;
+	if (!writable && epoll_ctl(eq, EPOLL_CTL_MOD, fc->fd, &ev) == 0)
+		return (0);
+	/* not yet watched if connect() succeeded immediately */
+	return (epoll_ctl(eq, EPOLL_CTL_ADD, fc->fd, &ev));
+}
+
+static int
+fly_ev_wait(struct fly_conn **ready, int ms)
+{
+	int i, n;
+
+	if ((n = epoll_wait(eq, evs, FLY_EVENTS, ms)) < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; ++i)
+		ready[i] = evs[i].data.ptr;
+	return (n);
+}
+#elif HAVE_SYS_EVENT_H
+static struct kevent evs[FLY_EVENTS];
+
+static int
+fly_ev_init(void)
+{
+
+	return (eq = kqueue());
+}
+
+static int
+fly_ev_watch(struct fly_conn *fc, int writable)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, fc->fd, writable ? EVFILT_WRITE : EVFILT_READ,
+	    writable ? EV_ADD | EV_ONESHOT : EV_ADD, 0, 0, fc);
+	return (kevent(eq, &ev, 1, NULL, 0, NULL));
+}
+
+static int
+fly_ev_wait(struct fly_conn **ready, int ms)
+{
+	struct timespec ts;
+	int i, n;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000L;
+	if ((n = kevent(eq, NULL, 0, evs, FLY_EVENTS, &ts)) < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; ++i)
+		ready[i] = evs[i].udata;
+	return (n);
+}
+#else
+static int
+fly_ev_init(void)
+{
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+static int
+fly_ev_watch(struct fly_conn *fc, int writable)
+{
+
+	(void)fc;
+	(void)writable;
+	errno = ENOSYS;
+	return (-1);
+}
+
+static int
+fly_ev_wait(struct fly_conn **ready, int ms)
+{
+
+	(void)ready;
+	(void)ms;
+	errno = ENOSYS;
+	return (-1);
+}
+#endif
+
+/*
+ * Return the next target in the rotation.
+ */
+static void
+fly_next_target(struct sockaddr_in *sin4)
+{
+
+	memset(sin4, 0, sizeof *sin4);
+#if HAVE_STRUCT_SOCKADDR_IN_SIN_LEN
+	sin4->sin_len = sizeof *sin4;
+#endif
+	sin4->sin_family = AF_INET;
+	sin4->sin_addr.s_addr = htobe32(cur_addr);
+	sin4->sin_port = htobe16(fl->ports[cur_port]);
+	/* spread successive connections across addresses */
+	if (cur_addr++ == fl->targets[cur_range].last) {
+		if (++cur_range == fl->ntargets) {
+			cur_range = 0;
+			cur_port = (cur_port + 1) % fl->nports;
+		}
+		cur_addr = fl->targets[cur_range].first;
+	}
+}
+
+static void
+fly_close(struct fly_conn *fc)
+{
+
+	if (fc->state == fly_holding)
+		res.holding--;
+	close(fc->fd);
+	fc->fd = -1;
+	fc->state = fly_idle;
+	idle[nidle++] = fc;
+}
+
+static void
+fly_failed(struct fly_conn *fc, int err)
+{
+
+	switch (err) {
+	case ECONNREFUSED:
+		res.refused++;
+		break;
+	case ETIMEDOUT:
+		res.timedout++;
+		break;
+	default:
+		ft_debug("connect(): %s", strerror(err));
+		res.failed++;
+	}
+	fly_close(fc);
+}
+
+/*
+ * The connection has been established.  Record the latency, send our
+ * data, and start holding.
+ */
+static void
+fly_established(struct fly_conn *fc, uint64_t now)
+{
+
+	ft_hist_add(&res.latency, now - fc->start);
+	res.established++;
+	res.last = now;
+	if (write(fc->fd, fl->data, fl->len) < 0 && errno != EAGAIN) {
+		if (errno == ECONNRESET || errno == EPIPE)
+			res.reset++;
+		else
+			res.failed++;
+		fly_close(fc);
+		return;
+	}
+	fc->state = fly_holding;
+	fc->deadline = now + fl->hold * 1000000000ULL;
+	if (++res.holding > res.peak)
+		res.peak = res.holding;
+	if (fly_ev_watch(fc, 0) != 0) {
+		ft_debug("watch: %s", strerror(errno));
+		res.failed++;
+		fly_close(fc);
+	}
+}
+
+/*
+ * Let go of a connection we have been holding, and check whether the
+ * peer ever accepted our data.
+ */
+static void
+fly_release(struct fly_conn *fc)
+{
+	int outq;
+
+	outq = -1;
+#ifdef FLY_OUTQ
+	if (ioctl(fc->fd, FLY_OUTQ, &outq) != 0)
+		outq = -1;
+#endif
+	/* if we can't tell, holding on this long will have to do */
+	if (outq != 0)
+		res.held++;
+	else
+		res.acked++;
+	fly_close(fc);
+}
+
+/*
+ * Start a new connection.  Returns -1 if we failed to even create a
+ * socket, which is usually a sign that we should back off.
+ */
+static int
+fly_connect(struct fly_conn *fc, uint64_t now)
+{
+	struct sockaddr_in sin4;
+	struct linger l;
+	int sd;
+
+	fly_next_target(&sin4);
+	if ((sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		ft_debug("socket(): %s", strerror(errno));
+		return (-1);
+	}
+	res.attempts++;
+	if (res.first == 0)
+		res.first = now;
+	/* reset rather than linger on close */
+	l.l_onoff = 1;
+	l.l_linger = 0;
+	if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0 ||
+	    setsockopt(sd, SOL_SOCKET, SO_LINGER, &l, sizeof l) != 0) {
+		ft_debug("socket setup: %s", strerror(errno));
+		res.failed++;
+		close(sd);
+		idle[nidle++] = fc;
+		return (0);
+	}
+	fc->fd = sd;
+	fc->start = now;
+	fc->deadline = now + fl->timeout * 1000000000ULL;
+	fc->state = fly_connecting;
+	if (connect(sd, (struct sockaddr *)&sin4, sizeof sin4) == 0) {
+		fly_established(fc, now);
+		return (0);
+	}
+	if (errno != EINPROGRESS) {
+		fly_failed(fc, errno);
+		return (0);
+	}
+	if (fly_ev_watch(fc, 1) != 0) {
+		ft_debug("watch: %s", strerror(errno));
+		res.failed++;
+		fly_close(fc);
+	}
+	return (0);
+}
+
+/*
+ * Handle an event on a connection.
+ */
+static void
+fly_event(struct fly_conn *fc, uint64_t now)
+{
+	char buf[1024];
+	socklen_t len;
+	ssize_t rlen;
+	int err;
+
+	switch (fc->state) {
+	case fly_idle:
+		break;
+	case fly_connecting:
+		len = sizeof err;
+		if (getsockopt(fc->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+			err = errno;
+		if (err == 0)
+			fly_established(fc, now);
+		else
+			fly_failed(fc, err);
+		break;
+	case fly_holding:
+		if ((rlen = read(fc->fd, buf, sizeof buf)) < 0 &&
+		    errno == EAGAIN)
+			break;
+		if (rlen > 0)
+			res.answered++;
+		else if (rlen == 0)
+			res.closed++;
+		else if (errno == ECONNRESET)
+			res.reset++;
+		else
+			res.failed++;
+		fly_close(fc);
+		break;
+	}
+}
+
+/*
+ * Time out connections that took too long to connect, and let go of
+ * those we have held long enough.
+ */
+static void
+fly_scan(uint64_t now, int all)
+{
+	struct fly_conn *fc;
+	unsigned int i;
+
+	for (i = 0; i < nconns; ++i) {
+		fc = &conns[i];
+		if (fc->state == fly_idle || (!all && now < fc->deadline))
+			continue;
+		if (fc->state == fly_connecting) {
+			if (!all)
+				res.timedout++;
+			fly_close(fc);
+		} else {
+			fly_release(fc);
+		}
+	}
+}
+
+static double
+fly_ms(uint64_t ns)
+{
+
+	return (ns / 1000000.0);
+}
+
+static void
+fly_report(uint64_t start, uint64_t end)
+{
+	double secs, cps;
+
+	secs = (end - start) / 1e9;
+	cps = res.last > res.first ?
+	    res.established / ((res.last - res.first) / 1e9) : 0.0;
+	printf("%lu attempts in %.3f s: %lu established, %lu refused, "
+	    "%lu timed out, %lu failed\n", res.attempts, secs,
+	    res.established, res.refused, res.timedout, res.failed);
+	printf("%.0f connects/s, peak %u held at once\n", cps, res.peak);
+	printf("held %lu (%.1f%% of established), acked %lu, answered %lu, "
+	    "closed %lu, reset %lu\n", res.held, res.established > 0 ?
+	    100.0 * res.held / res.established : 0.0, res.acked,
+	    res.answered, res.closed, res.reset);
+	if (res.latency.count > 0) {
+		printf("SYN/ACK latency: p50 %.3f ms, p90 %.3f ms, "
+		    "p99 %.3f ms, max %.3f ms\n",
+		    fly_ms(ft_hist_quantile(&res.latency, 0.5)),
+		    fly_ms(ft_hist_quantile(&res.latency, 0.9)),
+		    fly_ms(ft_hist_quantile(&res.latency, 0.99)),
+		    fly_ms(res.latency.max));
+	}
+}
+
+int
+fly_load(const struct fly_load *cfg)
+{
+	struct fly_conn *ready[FLY_EVENTS];
+	struct rlimit rl;
+	uint64_t now, start, next_scan, next_report;
+	rlim_t need;
+	unsigned int i;
+	int busy, n, ret;
+
+	fl = cfg;
+	nconns = fl->conns;
+	if (fl->total > 0 && fl->total < nconns)
+		nconns = fl->total;
+
+	/* we need one descriptor per connection, plus a few */
+	need = nconns + 16;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+		rl.rlim_cur = need < rl.rlim_max ? need : rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+			nconns = rl.rlim_cur > 32 ? rl.rlim_cur - 16 : 16;
+			ft_warning("descriptor limit is %lu, "
+			    "using %u connections",
+			    (unsigned long)rl.rlim_cur, nconns);
+		}
+	}
+
+	ret = -1;
+	conns = calloc(nconns, sizeof *conns);
+	idle = calloc(nconns, sizeof *idle);
+	if (conns == NULL || idle == NULL) {
+		ft_error("malloc(): %s", strerror(errno));
+		goto fail;
+	}
+	if (fly_ev_init() < 0) {
+		ft_error("event queue: %s", strerror(errno));
+		goto fail;
+	}
+	for (i = 0, nidle = 0; i < nconns; ++i) {
+		conns[i].fd = -1;
+		idle[nidle++] = &conns[nconns - i - 1];
+	}
+	cur_range = cur_port = 0;
+	cur_addr = fl->targets[0].first;
+	memset(&res, 0, sizeof res);
+	signal(SIGINT, fly_signal);
+	signal(SIGTERM, fly_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	ft_verbose("%u connections at a time, holding for %u s",
+	    nconns, fl->hold);
+	start = now = fly_now();
+	next_scan = now + FLY_SCAN;
+	next_report = now + FLY_REPORT;
+	stop = 0;
+	while (!stop) {
+		for (busy = 0; nidle > 0 && FLY_MORE(); )
+			if (fly_connect(idle[--nidle], now) != 0) {
+				nidle++;
+				busy = 1;
+				break;
+			}
+		if (nidle == nconns) {
+			if (!FLY_MORE())
+				break;
+			if (busy) {
+				ft_error("unable to create sockets");
+				goto fail;
+			}
+			continue;
+		}
+		if ((n = fly_ev_wait(ready, FLY_SCAN / 1000000)) < 0) {
+			ft_error("event wait: %s", strerror(errno));
+			goto fail;
+		}
+		now = fly_now();
+		for (i = 0; i < (unsigned int)n; ++i)
+			fly_event(ready[i], now);
+		if (now >= next_scan) {
+			fly_scan(now, 0);
+			next_scan = now + FLY_SCAN;
+		}
+		if (now >= next_report) {
+			ft_verbose("%u active, %u held, %lu established, "
+			    "%lu attempts", nconns - nidle, res.holding,
+			    res.established, res.attempts);
+			next_report = now + FLY_REPORT;
+		}
+	}
+	/* let go of whatever we still hold */
+	fly_scan(now, 1);
+	fly_report(start, fly_now());
+	ret = 0;
+fail:
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	for (i = 0; conns != NULL && i < nconns; ++i)
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+	if (eq >= 0)
+		close(eq);
+	eq = -1;
+	free(conns);
+	free(idle);
+	conns = NULL;
+	idle = NULL;
+	return (ret);
+}
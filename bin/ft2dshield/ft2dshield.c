@@ -31,7 +31,13 @@
 #include "config.h"
 #endif
 
+#include <sys/types.h>
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,16 +45,65 @@
 #include <time.h>
 #include <unistd.h>
 
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #include <ft/endian.h>
+#include <ft/hash.h>
 #include <ft/ip4.h>
+#include <ft/logrec.h>
 
 #define DSHIELD_RECIPIENT "reports@dshield.org"
 
+/*
+ * Input is read and output written in large blocks.  No output line is
+ * longer than FT2D_LINEMAX, so we only need to check for room once per
+ * line.
+ */
+#define FT2D_BUFSIZE	(1024 * 1024)
+#define FT2D_LINEMAX	256
+
+/*
+ * Maximum number of worker threads.  In input order, workers stay at
+ * most FT2D_AHEAD files per worker ahead of the one being written out,
+ * so memory use depends on the size of the largest files rather than
+ * that of the entire input.
+ */
+#define FT2D_MAXJOBS	256
+#define FT2D_AHEAD	2
+
+/*
+ * Maximum number of distinct entries in an aggregation window, and the
+ * size of the hash table which indexes them.
+ */
+#define FT2D_AGGMAX	65536
+#define FT2D_AGGSLOTS	(FT2D_AGGMAX * 2)
+
 static const char *sender;
 static const char *recipient;
 
 static unsigned long userid;
 static ip4s_node *included;
+static int convert;
+static int merge;
+
+/*
+ * Input file.  The first block is read into zbuf to find out if the
+ * file is compressed; if it is, zbuf holds compressed data waiting to
+ * be inflated into the input buffer, otherwise it is handed over as is.
+ */
+struct ft2in {
+	const char	*fn;
+	unsigned char	*zbuf;
+	int		 fd;
+	int		 eof;		/* nothing more to read */
+	int		 gz;		/* gzip-compressed */
+	size_t		 zoff, zlen;	/* unconsumed data in zbuf */
+#if WITH_ZLIB
+	z_stream	 zs;
+#endif
+};
 
 struct ftlog {
 	struct timeval	 tv;
@@ -61,95 +116,168 @@ struct ftlog {
 	char		 flags[10];
 };
 
-static int
-ftlogparse(struct ftlog *ftl, const char *s)
-{
-	char *e, *f;
-	long l;
-	int i;
+/*
+ * Aggregation key: everything but the time, the source port and the
+ * length.  For ICMP, the type is included along with the code.
+ */
+struct ftaggkey {
+	ip4_addr	 sa;
+	ip4_addr	 da;
+	uint16_t	 type;
+	uint16_t	 dp;
+	uint8_t		 proto;
+	char		 flags[10];
+};
 
-	memset(ftl, 0, sizeof *ftl);
+struct ftagg {
+	struct ftaggkey	 key;
+	struct ftlog	 ftl;		/* first entry seen */
+	unsigned long	 count;
+};
 
-	/* time (seconds) */
-	ftl->tv.tv_sec = strtoul(s, &e, 10);
-	if (e == s || *e != '.')
-		return (-1);
-	s = e + 1;
+/*
+ * A log entry kept by a worker for the main thread to merge or
+ * aggregate, along with the offset of its text in the worker's output.
+ */
+struct ft2ent {
+	struct ftlog	 ftl;
+	unsigned long	 count;
+	size_t		 off;
+};
 
-	/* time (microseconds) */
-	ftl->tv.tv_usec = strtoul(s, &e, 10);
-	if (e == s || *e != ',')
-		return (-1);
-	s = e + 1;
+/*
+ * Per-thread state.  The main thread writes its output as it goes,
+ * while workers keep theirs, and optionally the entries it came from,
+ * until the main thread is ready for it.
+ */
+struct ft2ctx {
+	char		*ibuf;
+	unsigned char	*zbuf;
+	char		*obuf;
+	size_t		 olen, osize;
+	int		 keep;		/* keep output instead of writing */
+	int		 track;		/* keep entries too */
+	struct ft2ent	*ents;
+	size_t		 nents, esize;
+	char		 tstr[64];	/* last formatted timestamp */
+	size_t		 tlen;
+	time_t		 tlast;
+};
 
-	/* source address (dotted quad) */
-	for (i = 0; i < 4; ++i) {
-		l = strtol(s, &e, 10);
-		if (e == s || *e != (i == 3 ? ',' : '.') || l < 0 || l > 255)
-			return (-1);
-		ftl->sa.o[i] = l;
-		s = e + 1;
+/*
+ * Input files to be processed by worker threads, and what became of
+ * them.  Everything but done is private to whoever holds the job.
+ */
+struct ft2job {
+	const char	*fn;
+	char		*obuf;
+	size_t		 olen;
+	struct ft2ent	*ents;
+	size_t		 nents, pos;
+	int		 done;
+};
+
+static pthread_mutex_t jobmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+static struct ft2job *jobs;
+static size_t njobs, nextjob, nwritten;
+static unsigned long nworkers = 1;
+
+static unsigned long window;		/* aggregation window, 0 if off */
+static struct ftagg *aggents;		/* in order of first appearance */
+static uint32_t *aggslots;		/* index + 1 into aggents, or 0 */
+static size_t naggs;
+static time_t aggwin = -1;		/* current window */
+
+/*
+ * Parse a decimal number no greater than max, followed by the given
+ * character, or by the end of the line if term is -1.  Returns a
+ * pointer to the character following the terminator, or NULL.
+ */
+static inline const char *
+ftlognum(const char *s, const char *e, int term, uint64_t max, uint64_t *v)
+{
+	const char *b;
+	uint64_t n;
+
+	for (b = s, n = 0; s < e && *s >= '0' && *s <= '9'; ++s)
+		if ((n = n * 10 + (*s - '0')) > max)
+			return (NULL);
+	if (s == b)
+		return (NULL);
+	if (term < 0) {
+		if (s != e)
+			return (NULL);
+	} else {
+		if (s == e || *s != term)
+			return (NULL);
+		s++;
 	}
+	*v = n;
+	return (s);
+}
 
-	/* source port */
-	l = strtol(s, &e, 10);
-	if (e == s || *e != ',' || l < 0 || l > 65535)
-		return (-1);
-	ftl->sp = l;
-	s = e + 1;
+/*
+ * Parse a dotted quad followed by a comma.
+ */
+static inline const char *
+ftlogip4(const char *s, const char *e, ip4_addr *addr)
+{
+	uint64_t v;
+	int i;
 
-	/* destination address (dotted quad) */
 	for (i = 0; i < 4; ++i) {
-		l = strtol(s, &e, 10);
-		if (e == s || *e != (i == 3 ? ',' : '.') || l < 0 || l > 255)
-			return (-1);
-		ftl->da.o[i] = l;
-		s = e + 1;
+		if ((s = ftlognum(s, e, i == 3 ? ',' : '.', 255, &v)) == NULL)
+			return (NULL);
+		addr->o[i] = v;
 	}
+	return (s);
+}
 
-	/* destination port */
-	l = strtol(s, &e, 10);
-	if (e == s || *e != ',' || l < 0 || l > 65535)
-		return (-1);
-	ftl->dp = l;
-	s = e + 1;
+/*
+ * Parse a protocol name followed by a comma.
+ */
+static inline const char *
+ftlogproto(const char *s, const char *e, ip_proto *proto)
+{
 
-	/* protocol */
-	if ((e = strchr(s, ',')) == NULL)
-		return (-1);
-	if (e - s == 4 && strncmp(s, "ICMP", 4) == 0)
-		ftl->proto = ip_proto_icmp;
-	else if (e - s == 3 && strncmp(s, "TCP", 3) == 0)
-		ftl->proto = ip_proto_tcp;
-	else if (e - s == 3 && strncmp(s, "UDP", 3) == 0)
-		ftl->proto = ip_proto_udp;
-	else
-		return (-1);
-	s = e + 1;
+	if (e - s >= 5 && memcmp(s, "ICMP,", 5) == 0) {
+		*proto = ip_proto_icmp;
+		return (s + 5);
+	} else if (e - s >= 4 && memcmp(s, "TCP,", 4) == 0) {
+		*proto = ip_proto_tcp;
+		return (s + 4);
+	} else if (e - s >= 4 && memcmp(s, "UDP,", 4) == 0) {
+		*proto = ip_proto_udp;
+		return (s + 4);
+	}
+	return (NULL);
+}
 
-	/* length */
-	l = strtol(s, &e, 10);
-	if (e == s || *e != ',' || l < 0 || l > 65535)
-		return (-1);
-	ftl->len = l;
-	s = e + 1;
+/*
+ * Parse the protocol-specific information which ends a line.
+ */
+static int
+ftloginfo(struct ftlog *ftl, const char *s, const char *e)
+{
+	uint64_t v;
+	char *f;
+	int i;
 
-	/* additional */
+	f = ftl->flags;
 	if (ftl->proto == ip_proto_icmp) {
 		/* ICMP: store type in sp, code in dp */
-		l = strtol(s, &e, 10);
-		if (e == s || *e != '.' || l < 0 || l > 255)
+		if ((s = ftlognum(s, e, '.', 255, &v)) == NULL)
 			return (-1);
-		ftl->sp = l;
-		s = e + 1;
-		l = strtol(s, &e, 10);
-		if (e == s || *e != '\0' || l < 0 || l > 255)
+		ftl->sp = v;
+		if ((s = ftlognum(s, e, -1, 255, &v)) == NULL)
 			return (-1);
-		ftl->dp = l;
-		s = e;
+		ftl->dp = v;
 	} else if (ftl->proto == ip_proto_tcp) {
 		/* TCP: flags */
-		for (i = 0, f = ftl->flags; i < 9; ++i) {
+		if (e - s != 9)
+			return (-1);
+		for (i = 0; i < 9; ++i) {
 			switch (s[i]) {
 			case 'S': case 'A': case 'F':
 			case 'U': case 'R': case 'P':
@@ -166,52 +294,383 @@ ftlogparse(struct ftlog *ftl, const char *s)
 				return (-1);
 			}
 		}
-		s += i;
-	} else if (ftl->proto == ip_proto_udp) {
-		/* nothing */
 	} else {
-		/* impossiburu */
+		/* UDP: nothing */
+		if (s != e)
+			return (-1);
+	}
+	*f = '\0';
+	return (0);
+}
+
+/*
+ * Parse a line of text, which runs from s to e and is not terminated.
+ */
+static int
+ftlogparse(struct ftlog *ftl, const char *s, const char *e)
+{
+	uint64_t v;
+
+	/* time (seconds and microseconds) */
+	if ((s = ftlognum(s, e, '.', 1ULL << 40, &v)) == NULL)
+		return (-1);
+	ftl->tv.tv_sec = v;
+	if ((s = ftlognum(s, e, ',', 999999, &v)) == NULL)
+		return (-1);
+	ftl->tv.tv_usec = v;
+
+	/* source and destination */
+	if ((s = ftlogip4(s, e, &ftl->sa)) == NULL ||
+	    (s = ftlognum(s, e, ',', 65535, &v)) == NULL)
+		return (-1);
+	ftl->sp = v;
+	if ((s = ftlogip4(s, e, &ftl->da)) == NULL ||
+	    (s = ftlognum(s, e, ',', 65535, &v)) == NULL)
+		return (-1);
+	ftl->dp = v;
+
+	/* protocol */
+	if ((s = ftlogproto(s, e, &ftl->proto)) == NULL)
+		return (-1);
+
+	/* length */
+	if ((s = ftlognum(s, e, ',', 65535, &v)) == NULL)
+		return (-1);
+	ftl->len = v;
+
+	/* additional */
+	return (ftloginfo(ftl, s, e));
+}
+
+/*
+ * Parse a summary line, which runs from s to e, is not terminated and
+ * starts with FT_LOGSUM_PREFIX.  The source port and length are lost
+ * in summaries and are set to 0.
+ */
+static int
+ftsumparse(struct ftlog *ftl, unsigned long *count, const char *s,
+    const char *e)
+{
+	uint64_t v, ndst;
+
+	if (s == e || *s++ != FT_LOGSUM_PREFIX)
+		return (-1);
+
+	/* first and last time */
+	if ((s = ftlognum(s, e, '.', 1ULL << 40, &v)) == NULL)
+		return (-1);
+	ftl->tv.tv_sec = v;
+	if ((s = ftlognum(s, e, ',', 999999, &v)) == NULL)
 		return (-1);
+	ftl->tv.tv_usec = v;
+	if ((s = ftlognum(s, e, '.', 1ULL << 40, &v)) == NULL ||
+	    (s = ftlognum(s, e, ',', 999999, &v)) == NULL)
+		return (-1);
+
+	/* source, first destination and port */
+	if ((s = ftlogip4(s, e, &ftl->sa)) == NULL ||
+	    (s = ftlogip4(s, e, &ftl->da)) == NULL ||
+	    (s = ftlognum(s, e, ',', 65535, &v)) == NULL)
+		return (-1);
+	ftl->sp = 0;
+	ftl->dp = v;
+
+	/* protocol, count and number of destinations */
+	if ((s = ftlogproto(s, e, &ftl->proto)) == NULL ||
+	    (s = ftlognum(s, e, ',', UINT32_MAX, &v)) == NULL ||
+	    (s = ftlognum(s, e, ',', UINT32_MAX, &ndst)) == NULL ||
+	    v == 0 || ndst == 0 || ndst > v)
+		return (-1);
+	*count = v;
+	ftl->len = 0;
+
+	/* additional */
+	return (ftloginfo(ftl, s, e));
+}
+
+/*
+ * Fill in a log entry from a binary log record, skipping the detour
+ * through the text format.
+ */
+static int
+ftlogrec(struct ftlog *ftl, const ft_logrec *lr)
+{
+	static const char tcpfl[] = "NCEUAPRSF";
+	unsigned int bit, mask;
+	char *f;
+
+	ftl->tv.tv_sec = lr->sec;
+	ftl->tv.tv_usec = lr->usec;
+	ftl->sa = lr->sa;
+	ftl->sp = lr->sp;
+	ftl->da = lr->da;
+	ftl->dp = lr->dp;
+	ftl->proto = lr->proto;
+	ftl->len = lr->len;
+	f = ftl->flags;
+	switch (lr->proto) {
+	case ip_proto_icmp:
+		ftl->sp = lr->flags >> 8;
+		ftl->dp = lr->flags & 0xff;
+		break;
+	case ip_proto_tcp:
+		for (bit = 0, mask = 0x100; mask > 0; ++bit, mask >>= 1)
+			if ((lr->flags & mask) && bit > 2)
+				*f++ = tcpfl[bit];
+		break;
+	case ip_proto_udp:
+		break;
+	default:
+		return (-1);
+	}
+	*f = '\0';
+	return (0);
+}
+
+/*
+ * Fill in a log entry from a binary summary record.
+ */
+static int
+ftlogsum(struct ftlog *ftl, const ft_logsum *ls)
+{
+	ft_logrec lr;
+
+	memset(&lr, 0, sizeof lr);
+	lr.sec = ls->fsec;
+	lr.usec = ls->fusec;
+	lr.sa = ls->sa;
+	lr.da = ls->da;
+	lr.dp = ls->dp;
+	lr.proto = ls->proto;
+	lr.flags = ls->flags;
+	return (ftlogrec(ftl, &lr));
+}
+
+/*
+ * Write out and empty the output buffer.  If that fails, there is no
+ * point in going on.  If the output is being kept, grow the buffer
+ * instead.
+ */
+static int
+ftlogflush(struct ft2ctx *c)
+{
+	size_t len;
+	char *tmp;
+
+	if (c->keep) {
+		len = c->osize ? c->osize * 2 : FT2D_BUFSIZE;
+		if ((tmp = realloc(c->obuf, len)) == NULL) {
+			warn("realloc()");
+			return (-1);
+		}
+		c->obuf = tmp;
+		c->osize = len;
+		return (0);
 	}
-	if (*s != '\0')
+	len = c->olen;
+	c->olen = 0;
+	if (len > 0 && fwrite(c->obuf, 1, len, stdout) != len) {
+		warn("write");
 		return (-1);
+	}
 	return (0);
 }
 
+static const char ftlog_dec2[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static inline char *
+ftlogfmt(char *p, unsigned long u)
+{
+	char tmp[20], *q;
+	size_t len;
+
+	q = tmp + sizeof tmp;
+	while (u >= 100) {
+		q -= 2;
+		memcpy(q, ftlog_dec2 + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		q -= 2;
+		memcpy(q, ftlog_dec2 + u * 2, 2);
+	} else {
+		*--q = '0' + u;
+	}
+	len = tmp + sizeof tmp - q;
+	memcpy(p, q, len);
+	return (p + len);
+}
+
+static inline char *
+ftlogfmtip4(char *p, const ip4_addr *a)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i) {
+		p = ftlogfmt(p, a->o[i]);
+		*p++ = i < 3 ? '.' : '\t';
+	}
+	return (p);
+}
+
+/*
+ * Format a timestamp.  Log entries come in chronological order, so the
+ * previous result is usually still good, and if it isn't, the date
+ * usually is.
+ */
+static const char *
+ftlogtime(struct ft2ctx *c, time_t t, size_t *lenp)
+{
+	struct tm tm;
+	char *p;
+	int sod;
+
+	if (t == c->tlast) {
+		/* same second */
+	} else if (c->tlast >= 0 && t >= 0 && t / 86400 == c->tlast / 86400) {
+		/* same day: patch in the time, which precedes " +0000" */
+		sod = t % 86400;
+		p = c->tstr + c->tlen - 14;
+		memcpy(p, ftlog_dec2 + (sod / 3600) * 2, 2);
+		memcpy(p + 3, ftlog_dec2 + (sod / 60 % 60) * 2, 2);
+		memcpy(p + 6, ftlog_dec2 + (sod % 60) * 2, 2);
+	} else {
+		gmtime_r(&t, &tm);
+		c->tlen = strftime(c->tstr, sizeof c->tstr,
+		    "%Y-%m-%d %H:%M:%S %z", &tm);
+	}
+	c->tlast = t;
+	*lenp = c->tlen;
+	return (c->tstr);
+}
+
 static int
-ftlogprint(const struct ftlog *ftl)
+ftlogprint(struct ft2ctx *c, const struct ftlog *ftl, unsigned long count)
 {
-	char tstr[64];
-	const char *proto;
-	struct tm *tm;
-	time_t t;
-	int ret;
+	const char *tstr;
+	char *p;
+	size_t len;
 
-	t = ftl->tv.tv_sec;
-	tm = gmtime(&t);
-	strftime(tstr, sizeof tstr, "%Y-%m-%d %H:%M:%S %z", tm);
+	if (c->olen + FT2D_LINEMAX > c->osize && ftlogflush(c) != 0)
+		return (-1);
+	p = c->obuf + c->olen;
+	tstr = ftlogtime(c, ftl->tv.tv_sec, &len);
+	memcpy(p, tstr, len);
+	p += len;
+	*p++ = '\t';
+	p = ftlogfmt(p, userid);
+	*p++ = '\t';
+	p = ftlogfmt(p, count);
+	*p++ = '\t';
+	p = ftlogfmtip4(p, &ftl->sa);
+	p = ftlogfmt(p, ftl->sp);
+	*p++ = '\t';
+	p = ftlogfmtip4(p, &ftl->da);
+	p = ftlogfmt(p, ftl->dp);
 	switch (ftl->proto) {
 	case ip_proto_icmp:
-		proto = "ICMP";
+		memcpy(p, "\tICMP\t", 6);
+		p += 6;
 		break;
 	case ip_proto_tcp:
-		proto = "TCP";
+		memcpy(p, "\tTCP\t", 5);
+		p += 5;
 		break;
 	case ip_proto_udp:
-		proto = "UDP";
+		memcpy(p, "\tUDP\t", 5);
+		p += 5;
 		break;
 	default:
 		/* impossibiru */
 		return (-1);
 	}
-	ret = printf("%s\t%lu\t%u\t%u.%u.%u.%u\t%u\t%u.%u.%u.%u\t%u\t%s\t%s\n",
-	    tstr, userid, 1U,
-	    ftl->sa.o[0], ftl->sa.o[1], ftl->sa.o[2], ftl->sa.o[3], ftl->sp,
-	    ftl->da.o[0], ftl->da.o[1], ftl->da.o[2], ftl->da.o[3], ftl->dp,
-	    proto, ftl->flags);
+	len = strlen(ftl->flags);
+	memcpy(p, ftl->flags, len);
+	p += len;
+	*p++ = '\n';
+	c->olen = p - c->obuf;
+	return (0);
+}
+
+/*
+ * Copy a line of text to the output as is.  The line is not terminated
+ * unless nl is zero, in which case it includes its newline.
+ */
+static int
+ftlogcopy(struct ft2ctx *c, const char *s, size_t len, int nl)
+{
+
+	if (c->olen + FT2D_LINEMAX > c->osize && ftlogflush(c) != 0)
+		return (-1);
+	memcpy(c->obuf + c->olen, s, len);
+	c->olen += len;
+	if (nl)
+		c->obuf[c->olen++] = '\n';
+	return (0);
+}
+
+/*
+ * Print and forget everything in the current aggregation window.
+ */
+static int
+ftaggflush(struct ft2ctx *c)
+{
+	size_t n;
+	int ret;
+
+	for (n = 0, ret = 0; n < naggs && ret == 0; ++n)
+		ret = ftlogprint(c, &aggents[n].ftl, aggents[n].count);
+	if (naggs > 0)
+		memset(aggslots, 0, FT2D_AGGSLOTS * sizeof *aggslots);
+	naggs = 0;
 	return (ret);
 }
 
+/*
+ * Add a log entry to the current aggregation window.  The window is
+ * flushed when an entry from outside it comes along, or when it holds
+ * FT2D_AGGMAX distinct entries, so memory use is fixed regardless of
+ * the size of the input.
+ */
+static int
+ftaggadd(struct ft2ctx *c, const struct ftlog *ftl, unsigned long count)
+{
+	struct ftaggkey key;
+	struct ftagg *fa;
+	uint32_t i, n;
+	time_t win;
+
+	win = ftl->tv.tv_sec / window;
+	if ((win != aggwin || naggs == FT2D_AGGMAX) && ftaggflush(c) != 0)
+		return (-1);
+	aggwin = win;
+	memset(&key, 0, sizeof key);
+	key.sa = ftl->sa;
+	key.da = ftl->da;
+	key.type = ftl->proto == ip_proto_icmp ? ftl->sp : 0;
+	key.dp = ftl->dp;
+	key.proto = ftl->proto;
+	strncpy(key.flags, ftl->flags, sizeof key.flags);
+	i = ft_hash64(ft_hash_seed, &key, sizeof key) & (FT2D_AGGSLOTS - 1);
+	for (; (n = aggslots[i]) != 0; i = (i + 1) & (FT2D_AGGSLOTS - 1)) {
+		fa = &aggents[n - 1];
+		if (memcmp(&fa->key, &key, sizeof key) == 0) {
+			fa->count += count;
+			return (0);
+		}
+	}
+	fa = &aggents[naggs++];
+	memcpy(&fa->key, &key, sizeof key);	/* with padding */
+	fa->ftl = *ftl;
+	fa->count = count;
+	aggslots[i] = naggs;
+	return (0);
+}
+
 static void
 ft2header(void)
 {
@@ -232,65 +691,592 @@ ft2header(void)
 	printf("\n");
 }
 
+/*
+ * Keep a log entry for the main thread, along with the offset at which
+ * its text, if any, is about to be written.
+ */
 static int
-ft2dshield(const char *fn)
+ft2keep(struct ft2ctx *c, const struct ftlog *ftl, unsigned long count)
+{
+	struct ft2ent *tmp;
+	size_t size;
+
+	if (c->nents == c->esize) {
+		size = c->esize ? c->esize * 2 : 4096;
+		if ((tmp = realloc(c->ents, size * sizeof *tmp)) == NULL) {
+			warn("realloc()");
+			return (-1);
+		}
+		c->ents = tmp;
+		c->esize = size;
+	}
+	c->ents[c->nents].ftl = *ftl;
+	c->ents[c->nents].count = count;
+	c->ents[c->nents].off = c->olen;
+	c->nents++;
+	return (0);
+}
+
+/*
+ * Filter and print a log entry.  Workers leave aggregation to the main
+ * thread, since windows can span files.
+ */
+static inline int
+ft2entry(struct ft2ctx *c, const struct ftlog *ftl, unsigned long count,
+    const char *line, size_t len)
+{
+
+	if (included != NULL && !ip4s_lookup(included, be32toh(ftl->sa.q)))
+		return (0);
+	if (c->track && ft2keep(c, ftl, count) != 0)
+		return (-1);
+	if (convert)
+		return (ftlogcopy(c, line, len, 1));
+	if (window > 0)
+		return (c->track ? 0 : ftaggadd(c, ftl, count));
+	return (ftlogprint(c, ftl, count));
+}
+
+/*
+ * Process a text log line, which runs from s to e.  Summary lines are
+ * reported with their packet count.
+ */
+static int
+ft2line(struct ft2ctx *c, const char *fn, int lno, const char *s,
+    const char *e)
 {
 	struct ftlog logent;
-	FILE *f;
-	char line[128];
-	int len, lno, ret;
+	unsigned long count;
+	int sum, ret;
 
-	/* open */
+	sum = (s < e && *s == FT_LOGSUM_PREFIX);
+	if (e - s >= (sum ? FT_LOGSUM_TEXTMAX : FT_LOGREC_TEXTMAX)) {
+		warnx("%s:%d: line too long", fn, lno);
+		return (0);
+	}
+	count = 1;
+	if (sum)
+		ret = ftsumparse(&logent, &count, s, e);
+	else
+		ret = ftlogparse(&logent, s, e);
+	if (ret != 0) {
+		warnx("%s:%d: unparseable log entry", fn, lno);
+		return (0);
+	}
+	return (ft2entry(c, &logent, count, s, e - s));
+}
+
+/*
+ * Process a binary log record.
+ */
+static int
+ft2rec(struct ft2ctx *c, const char *fn, int lno, const char *rec)
+{
+	char line[FT_LOGSUM_TEXTMAX];
+	struct ftlog logent;
+	ft_logrec lr;
+	ft_logsum ls;
+	unsigned long count;
+	int len;
+
+	len = 0;
+	if ((uint8_t)*rec == FT_LOGSUM_MAGIC) {
+		if (ft_logsum_dec(&ls, rec) != 0 ||
+		    ftlogsum(&logent, &ls) != 0 ||
+		    (convert && (len = ft_logsum_text(line, sizeof line,
+		    &ls)) < 0))
+			goto invalid;
+		count = ls.count;
+	} else {
+		if (ft_logrec_dec(&lr, rec) != 0 ||
+		    ftlogrec(&logent, &lr) != 0 ||
+		    (convert && (len = ft_logrec_text(line, sizeof line,
+		    &lr)) < 0))
+			goto invalid;
+		count = 1;
+	}
+	return (ft2entry(c, &logent, count, line, len));
+invalid:
+	warnx("%s: record %d: invalid log record", fn, lno);
+	return (0);
+}
+
+/*
+ * Refill zbuf from the input file.
+ */
+static int
+ft2fill(struct ft2in *in)
+{
+	ssize_t rlen;
+
+	do {
+		rlen = read(in->fd, in->zbuf, FT2D_BUFSIZE);
+	} while (rlen < 0 && errno == EINTR);
+	if (rlen < 0) {
+		warn("%s", in->fn);
+		return (-1);
+	}
+	in->eof = (rlen == 0);
+	in->zoff = 0;
+	in->zlen = rlen;
+	return (0);
+}
+
+/*
+ * Open an input file and check whether it is compressed.
+ */
+static int
+ft2open(struct ft2in *in, const char *fn, unsigned char *zbuf)
+{
+
+	memset(in, 0, sizeof *in);
+	in->zbuf = zbuf;
 	if (fn == NULL) {
-		fn = "stdin";
-		f = stdin;
+		in->fn = "stdin";
+		in->fd = STDIN_FILENO;
 	} else {
-		if ((f = fopen(fn, "r")) == NULL) {
+		in->fn = fn;
+		if ((in->fd = open(fn, O_RDONLY)) < 0) {
 			warn("%s", fn);
 			return (-1);
 		}
 	}
-
-	/* read line by line */
-	lno = 0;
-	while ((fgets(line, sizeof line, f)) != NULL) {
-		for (len = 0; line[len] != '\0' && line[len] != '\n'; ++len)
-			/* nothing */ ;
-		if (line[len] != '\n') {
-			warnx("%s:%d: line too long", fn, lno + 1);
-			continue;
+	if (ft2fill(in) != 0)
+		goto fail;
+	if (in->zlen >= 2 && zbuf[0] == 0x1f && zbuf[1] == 0x8b) {
+#if WITH_ZLIB
+		/* accept both gzip and zlib headers */
+		if (inflateInit2(&in->zs, 15 + 32) != Z_OK) {
+			warnx("%s: %s", in->fn, in->zs.msg ? in->zs.msg :
+			    "failed to initialize decompressor");
+			goto fail;
 		}
-		lno++;
-		line[len] = '\0';
-		if (ftlogparse(&logent, line) != 0) {
-			warnx("%s:%d: unparseable log entry", fn, lno);
-			continue;
+		in->gz = 1;
+#else
+		warnx("%s: compressed input is not supported", in->fn);
+		goto fail;
+#endif
+	}
+	return (0);
+fail:
+	if (in->fd != STDIN_FILENO)
+		close(in->fd);
+	return (-1);
+}
+
+/*
+ * Read up to size bytes of decompressed data.  Returns 0 at the end of
+ * the input.  A compressed stream which breaks off after a flush point,
+ * as the one flytrap is currently writing does, simply ends there.
+ */
+static ssize_t
+ft2read(struct ft2in *in, char *buf, size_t size)
+{
+	ssize_t rlen;
+#if WITH_ZLIB
+	size_t n;
+	int zret;
+#endif
+
+	if (!in->gz) {
+		if (in->zoff < in->zlen) {
+			rlen = in->zlen - in->zoff < size ?
+			    in->zlen - in->zoff : size;
+			memcpy(buf, in->zbuf + in->zoff, rlen);
+			in->zoff += rlen;
+			return (rlen);
 		}
-		if (included != NULL &&
-		    !ip4s_lookup(included, be32toh(logent.sa.q)))
-			continue;
-		if (ftlogprint(&logent) < 0) {
-			warnx("%s:%d: failed to print entry", fn, lno);
-			continue;
+		if (in->eof)
+			return (0);
+		do {
+			rlen = read(in->fd, buf, size);
+		} while (rlen < 0 && errno == EINTR);
+		if (rlen < 0)
+			warn("%s", in->fn);
+		return (rlen);
+	}
+#if WITH_ZLIB
+	for (;;) {
+		if (in->zoff == in->zlen && !in->eof && ft2fill(in) != 0)
+			return (-1);
+		in->zs.next_in = in->zbuf + in->zoff;
+		in->zs.avail_in = in->zlen - in->zoff;
+		in->zs.next_out = (unsigned char *)buf;
+		in->zs.avail_out = size;
+		zret = inflate(&in->zs, Z_NO_FLUSH);
+		in->zoff = in->zlen - in->zs.avail_in;
+		n = size - in->zs.avail_out;
+		if (zret == Z_STREAM_END) {
+			/* another member may follow */
+			inflateReset(&in->zs);
+		} else if (zret != Z_OK && zret != Z_BUF_ERROR) {
+			warnx("%s: %s", in->fn, in->zs.msg ? in->zs.msg :
+			    "invalid compressed data");
+			return (-1);
 		}
+		if (n > 0)
+			return (n);
+		if (in->eof && in->zoff == in->zlen)
+			return (0);
 	}
+#else
+	return (-1);
+#endif
+}
+
+static void
+ft2close(struct ft2in *in)
+{
+
+#if WITH_ZLIB
+	if (in->gz)
+		inflateEnd(&in->zs);
+#endif
+	if (in->fd != STDIN_FILENO)
+		close(in->fd);
+}
+
+/*
+ * Convert a log file, reading it in large blocks and processing every
+ * complete line or record in the buffer before reading more.
+ */
+static int
+ft2dshield(struct ft2ctx *c, const char *name)
+{
+	struct ft2in in;
+	const char *fn, *p, *q, *end;
+	size_t len, rsize;
+	ssize_t rlen;
+	int binary, eof, lno, ret;
+
+	/* open */
+	if (ft2open(&in, name, c->zbuf) != 0)
+		return (-1);
+	fn = in.fn;
 
-	/* error or just EOF? */
-	if ((ret = ferror(f)) != 0)
-		warn("%s", fn);
+	binary = -1;
+	eof = lno = ret = 0;
+	len = 0;
+	while (!eof && ret == 0) {
+		rlen = ft2read(&in, c->ibuf + len, FT2D_BUFSIZE - len);
+		if (rlen < 0) {
+			ret = -1;
+			break;
+		}
+		eof = (rlen == 0);
+		len += rlen;
+		if (len == 0)
+			break;
+
+		/* binary or text? */
+		if (binary < 0)
+			binary = ((uint8_t)c->ibuf[0] == FT_LOGREC_MAGIC ||
+			    (uint8_t)c->ibuf[0] == FT_LOGSUM_MAGIC);
+
+		/* process what we have */
+		p = c->ibuf;
+		end = c->ibuf + len;
+		if (binary) {
+			/* summary records are longer than packet records */
+			for (; p < end && ret == 0; p += rsize) {
+				rsize = (uint8_t)*p == FT_LOGSUM_MAGIC ?
+				    FT_LOGSUM_SIZE : FT_LOGREC_SIZE;
+				if (end - p < (ptrdiff_t)rsize)
+					break;
+				ret = ft2rec(c, fn, ++lno, p);
+			}
+			if (eof && p < end && ret == 0)
+				warnx("%s: record %d: truncated", fn, lno + 1);
+		} else {
+			while ((q = memchr(p, '\n', end - p)) != NULL &&
+			    ret == 0) {
+				ret = ft2line(c, fn, ++lno, p, q);
+				p = q + 1;
+			}
+			if (p == c->ibuf && len == FT2D_BUFSIZE) {
+				/* a single line filled the buffer */
+				warnx("%s:%d: line too long", fn, lno + 1);
+				ret = -1;
+			} else if (eof && p < end && ret == 0) {
+				/* last line is not terminated */
+				ret = ft2line(c, fn, ++lno, p, end);
+			}
+		}
+		len = end - p;
+		memmove(c->ibuf, p, len);
+	}
+	if (!c->keep && ftlogflush(c) != 0)
+		ret = -1;
 
 	/* close */
-	if (f != stdin)
-		fclose(f);
+	ft2close(&in);
 
-	return (ret ? -1 : 0);
+	return (ret);
+}
+
+/*
+ * Set up a thread's buffers.  Workers only get an output buffer once
+ * they have something to put in it.
+ */
+static void
+ft2init(struct ft2ctx *c, int keep)
+{
+
+	memset(c, 0, sizeof *c);
+	if ((c->ibuf = malloc(FT2D_BUFSIZE)) == NULL ||
+	    (c->zbuf = malloc(FT2D_BUFSIZE)) == NULL)
+		err(1, "malloc()");
+	if (!keep) {
+		if ((c->obuf = malloc(FT2D_BUFSIZE)) == NULL)
+			err(1, "malloc()");
+		c->osize = FT2D_BUFSIZE;
+	}
+	c->keep = keep;
+	c->track = keep && (merge || window > 0);
+	c->tlast = -1;
+}
+
+/*
+ * Worker thread: process input files in the order they were given,
+ * handing what came out of each over to the main thread.
+ */
+static void *
+ft2worker(void *arg)
+{
+	struct ft2ctx *c = arg;
+	struct ft2job *j;
+
+	pthread_mutex_lock(&jobmtx);
+	for (;;) {
+		while (!merge && nextjob < njobs &&
+		    nextjob >= nwritten + FT2D_AHEAD * nworkers)
+			pthread_cond_wait(&jobcond, &jobmtx);
+		if (nextjob == njobs)
+			break;
+		j = &jobs[nextjob++];
+		pthread_mutex_unlock(&jobmtx);
+		ft2dshield(c, j->fn);
+		j->obuf = c->obuf;
+		j->olen = c->olen;
+		j->ents = c->ents;
+		j->nents = c->nents;
+		c->obuf = NULL;
+		c->olen = c->osize = 0;
+		c->ents = NULL;
+		c->nents = c->esize = 0;
+		pthread_mutex_lock(&jobmtx);
+		j->done = 1;
+		pthread_cond_broadcast(&jobcond);
+	}
+	pthread_mutex_unlock(&jobmtx);
+	return (NULL);
+}
+
+/*
+ * Write out, or aggregate, everything a worker got out of a file.
+ */
+static int
+ft2emit(struct ft2ctx *c, struct ft2job *j)
+{
+	size_t n;
+	int ret;
+
+	ret = 0;
+	if (window > 0) {
+		for (n = 0; n < j->nents && ret == 0; ++n)
+			ret = ftaggadd(c, &j->ents[n].ftl, j->ents[n].count);
+	} else if (j->olen > 0) {
+		if (ftlogflush(c) != 0 ||
+		    fwrite(j->obuf, 1, j->olen, stdout) != j->olen) {
+			warn("write");
+			ret = -1;
+		}
+	}
+	return (ret);
+}
+
+/*
+ * Order jobs by the time of their next entry, then by position on the
+ * command line, so entries with the same time keep their input order.
+ */
+static inline int
+ft2before(const struct ft2job *a, const struct ft2job *b)
+{
+	const struct timeval *ta, *tb;
+
+	ta = &a->ents[a->pos].ftl.tv;
+	tb = &b->ents[b->pos].ftl.tv;
+	if (ta->tv_sec != tb->tv_sec)
+		return (ta->tv_sec < tb->tv_sec);
+	if (ta->tv_usec != tb->tv_usec)
+		return (ta->tv_usec < tb->tv_usec);
+	return (a < b);
+}
+
+static void
+ft2sift(struct ft2job **heap, size_t n, size_t i)
+{
+	struct ft2job *tmp;
+	size_t k;
+
+	while ((k = 2 * i + 1) < n) {
+		if (k + 1 < n && ft2before(heap[k + 1], heap[k]))
+			k++;
+		if (!ft2before(heap[k], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[k];
+		heap[k] = tmp;
+		i = k;
+	}
+}
+
+/*
+ * Merge the entries from all files in chronological order.  Each file
+ * is assumed to be in chronological order already, as flytrap's logs
+ * are.
+ */
+static int
+ft2merge(struct ft2ctx *c)
+{
+	struct ft2job **heap, *j;
+	size_t i, n, off, end;
+	int ret;
+
+	if ((heap = calloc(njobs, sizeof *heap)) == NULL) {
+		warn("calloc()");
+		return (-1);
+	}
+	for (i = n = 0; i < njobs; ++i)
+		if (jobs[i].nents > 0)
+			heap[n++] = &jobs[i];
+	for (i = n / 2; i-- > 0; )
+		ft2sift(heap, n, i);
+	for (ret = 0; n > 0 && ret == 0; ) {
+		j = heap[0];
+		if (window > 0) {
+			ret = ftaggadd(c, &j->ents[j->pos].ftl,
+			    j->ents[j->pos].count);
+		} else {
+			off = j->ents[j->pos].off;
+			end = j->pos + 1 < j->nents ?
+			    j->ents[j->pos + 1].off : j->olen;
+			ret = ftlogcopy(c, j->obuf + off, end - off, 0);
+		}
+		if (++j->pos == j->nents)
+			heap[0] = heap[--n];
+		ft2sift(heap, n, 0);
+	}
+	free(heap);
+	return (ret);
+}
+
+/*
+ * Process multiple files in parallel, then write out the results either
+ * in input order or merged in chronological order.
+ */
+static void
+ft2parallel(struct ft2ctx *c, char *fns[], size_t n)
+{
+	struct ft2ctx *ctxs;
+	pthread_t *tids;
+	unsigned long i, nthreads;
+	int ret;
+
+	if ((jobs = calloc(n, sizeof *jobs)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < n; ++i)
+		jobs[i].fn = fns[i];
+	njobs = n;
+	nthreads = nworkers < n ? nworkers : n;
+	ctxs = calloc(nthreads, sizeof *ctxs);
+	tids = calloc(nthreads, sizeof *tids);
+	if (ctxs == NULL || tids == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < nthreads; ++i) {
+		ft2init(&ctxs[i], 1);
+		if ((errno = pthread_create(&tids[i], NULL, ft2worker,
+		    &ctxs[i])) != 0)
+			err(1, "pthread_create()");
+	}
+
+	/* write out each file's results as soon as they are ready */
+	for (i = 0, ret = 0; !merge && i < n; ++i) {
+		pthread_mutex_lock(&jobmtx);
+		while (!jobs[i].done)
+			pthread_cond_wait(&jobcond, &jobmtx);
+		pthread_mutex_unlock(&jobmtx);
+		if (ret == 0)
+			ret = ft2emit(c, &jobs[i]);
+		free(jobs[i].obuf);
+		free(jobs[i].ents);
+		jobs[i].obuf = NULL;
+		jobs[i].ents = NULL;
+		pthread_mutex_lock(&jobmtx);
+		nwritten = i + 1;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&jobmtx);
+	}
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(tids[i], NULL);
+		free(ctxs[i].ibuf);
+		free(ctxs[i].zbuf);
+	}
+
+	/* or merge them once they are all in */
+	if (merge)
+		ft2merge(c);
+	for (i = 0; i < n; ++i) {
+		free(jobs[i].obuf);
+		free(jobs[i].ents);
+	}
+	free(ctxs);
+	free(tids);
+	free(jobs);
+	jobs = NULL;
+	njobs = 0;
+}
+
+/*
+ * Read a list of ranges from a file, for -i @file and -x @file.
+ */
+static ip4s_range *
+read_ranges(const char *fn, size_t *np)
+{
+	ip4s_range *r;
+	FILE *f;
+	int lineno;
+
+	if ((f = fopen(fn, "r")) == NULL)
+		err(1, "%s", fn);
+	lineno = 1;
+	if ((r = ip4s_range_read(f, np, &lineno)) == NULL) {
+		if (errno == EINVAL)
+			errx(1, "%s:%d: invalid address or range", fn, lineno);
+		err(1, "%s", fn);
+	}
+	fclose(f);
+	return (r);
 }
 
 static void
 include_range(const char *range)
 {
 	ip4_addr first, last;
+	ip4s_range *r;
+	size_t n;
 
+	if (*range == '@') {
+		r = read_ranges(range + 1, &n);
+		if (included == NULL) {
+			if ((included = ip4s_new()) == NULL)
+				err(1, "ip4s_new()");
+		}
+		if (ip4s_insertv(included, r, n) != 0)
+			err(1, "ip4s_insertv()");
+		free(r);
+		return;
+	}
 	if (ip4_parse_range(range, &first, &last) == NULL)
 		errx(1, "invalid address or range: %s", range);
 	if (included == NULL) {
@@ -305,7 +1291,22 @@ static void
 exclude_range(const char *range)
 {
 	ip4_addr first, last;
+	ip4s_range *r;
+	size_t n;
 
+	if (*range == '@') {
+		r = read_ranges(range + 1, &n);
+		if (included == NULL) {
+			if ((included = ip4s_new()) == NULL)
+				err(1, "ip4s_new()");
+			if (ip4s_insert(included, 0U, ~0U) != 0)
+				err(1, "ip4s_insert()");
+		}
+		if (ip4s_removev(included, r, n) != 0)
+			err(1, "ip4s_removev()");
+		free(r);
+		return;
+	}
 	if (ip4_parse_range(range, &first, &last) == NULL)
 		errx(1, "invalid address or range: %s", range);
 	if (included == NULL) {
@@ -323,22 +1324,48 @@ usage(void)
 {
 
 	fprintf(stderr, "usage: ft2dshield "
-	    "[-h] [-i addr|range|subnet] [-o output] [-r recipient] "
-	    "[-s sender] [-u userid] [-x addr|range|subnet] [file ...]\n");
+	    "[-chm] [-a seconds] [-i addr|range|subnet] [-j jobs]\n"
+	    "                  [-o output] [-r recipient] [-s sender] "
+	    "[-u userid]\n"
+	    "                  [-x addr|range|subnet] [file ...]\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
+	struct ft2ctx ctx;
+	long ncpu;
 	char *e;
 	int i, opt;
 
-	while ((opt = getopt(argc, argv, "hi:o:r:s:u:x:")) != -1)
+	while ((opt = getopt(argc, argv, "a:chi:j:mo:r:s:u:x:")) != -1)
 		switch (opt) {
+		case 'a':
+			window = strtoul(optarg, &e, 10);
+			if (e == optarg || *e != '\0' || window == 0)
+				usage();
+			break;
+		case 'c':
+			convert = 1;
+			break;
 		case 'i':
 			include_range(optarg);
 			break;
+		case 'j':
+			nworkers = strtoul(optarg, &e, 10);
+			if (e == optarg || *e != '\0' ||
+			    nworkers > FT2D_MAXJOBS)
+				usage();
+			if (nworkers == 0) {
+				ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+				nworkers = ncpu < 1 ? 1 :
+				    ncpu > FT2D_MAXJOBS ? FT2D_MAXJOBS : ncpu;
+			}
+			break;
+		case 'm':
+			merge = 1;
+			break;
 		case 'o':
 			if ((freopen(optarg, "a", stdout)) == NULL)
 				err(1, "%s", optarg);
@@ -369,6 +1396,19 @@ main(int argc, char *argv[])
 		usage();
 	if (sender != NULL && userid == 0)
 		usage();
+	if (sender != NULL && convert)
+		usage();
+	if (window > 0 && convert)
+		usage();
+
+	/* set up the aggregation table if requested */
+	if (window > 0) {
+		ft_hash_randomize();
+		aggents = calloc(FT2D_AGGMAX, sizeof *aggents);
+		aggslots = calloc(FT2D_AGGSLOTS, sizeof *aggslots);
+		if (aggents == NULL || aggslots == NULL)
+			err(1, "calloc()");
+	}
 
 	/* print email header if requested */
 	if (sender != NULL) {
@@ -378,11 +1418,18 @@ main(int argc, char *argv[])
 	}
 
 	/* iterate over input files */
+	ft2init(&ctx, 0);
 	if (argc == 0)
-		ft2dshield(NULL);
+		ft2dshield(&ctx, NULL);
+	else if (nworkers > 1 || merge)
+		ft2parallel(&ctx, argv, argc);
 	else
 		for (i = 0; i < argc; ++i)
-			ft2dshield(argv[i]);
+			ft2dshield(&ctx, argv[i]);
+
+	/* print whatever is left in the last aggregation window */
+	if (ftaggflush(&ctx) == 0)
+		ftlogflush(&ctx);
 
 	/* done */
 	exit(0);
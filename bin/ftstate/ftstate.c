@@ -0,0 +1,261 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ft/shm.h>
+
+#define FTSTATE_DEFAULT	"/flytrap"
+
+/*
+ * If the writer is in the middle of an update, try again this many
+ * times, a millisecond apart, before giving up.
+ */
+#define FTSTATE_TRIES	1000
+
+static const char *ifname;
+static int nonzero;
+
+/*
+ * Format a time in milliseconds since the epoch.
+ */
+static const char *
+fmttime(uint64_t ms, char *buf, size_t size)
+{
+	struct tm tm;
+	time_t t;
+
+	if (ms == 0)
+		return ("-");
+	t = ms / 1000;
+	strftime(buf, size, "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+	return (buf);
+}
+
+/*
+ * Check whether an interface passes the -i filter.
+ */
+static int
+selected(const ft_shm_hdr *h, const ft_shm_iface *fi, uint32_t index)
+{
+
+	if (ifname == NULL)
+		return (1);
+	if (index >= h->niface)
+		return (0);
+	return (strncmp(fi[index].name, ifname, sizeof fi->name) == 0);
+}
+
+static const char *
+ifacename(const ft_shm_hdr *h, const ft_shm_iface *fi, uint32_t index,
+    char *buf, size_t size)
+{
+
+	if (index >= h->niface)
+		return ("-");
+	snprintf(buf, size, "%.*s", (int)sizeof fi->name, fi[index].name);
+	return (buf);
+}
+
+/*
+ * Print the ARP entries, one per line.
+ */
+static void
+print_arp(const ft_shm_hdr *h)
+{
+	const ft_shm_iface *fi;
+	const ft_shm_arp *a;
+	char abuf[16], fbuf[32], lbuf[32], ibuf[FT_SHM_IFNAMSIZ + 1];
+	uint32_t k;
+
+	fi = (const ft_shm_iface *)(const void *)
+	    ((const char *)h + h->iface_off);
+	a = (const ft_shm_arp *)(const void *)((const char *)h + h->arp_off);
+	printf("%-15s %-17s %-8s %4s %-8s %3s %-19s %s\n", "address",
+	    "ether", "iface", "vlan", "state", "req", "first seen",
+	    "last seen");
+	for (k = 0; k < h->narp; ++k, ++a) {
+		if (!selected(h, fi, a->iface))
+			continue;
+		snprintf(abuf, sizeof abuf, "%u.%u.%u.%u", a->addr >> 24,
+		    (a->addr >> 16) & 0xff, (a->addr >> 8) & 0xff,
+		    a->addr & 0xff);
+		printf("%-15s %02x:%02x:%02x:%02x:%02x:%02x %-8s %4u %-8s %3u"
+		    " %-19s %s\n", abuf,
+		    a->ether[0], a->ether[1], a->ether[2],
+		    a->ether[3], a->ether[4], a->ether[5],
+		    ifacename(h, fi, a->iface, ibuf, sizeof ibuf), a->vlan,
+		    (a->flags & FT_SHM_RESERVED) ? "reserved" :
+		    (a->flags & FT_SHM_CLAIMED) ? "claimed" : "seen",
+		    a->nreq, fmttime(a->first, fbuf, sizeof fbuf),
+		    fmttime(a->last, lbuf, sizeof lbuf));
+	}
+	if (h->arp_updated == 0)
+		warnx("no ARP snapshot has been published yet");
+	if (h->arp_dropped > 0)
+		warnx("%u ARP entries did not fit in the segment",
+		    h->arp_dropped);
+}
+
+/*
+ * Print the counters, one per line.
+ */
+static void
+print_counters(const ft_shm_hdr *h)
+{
+	const ft_shm_iface *fi;
+	const ft_shm_counter *c;
+	char ibuf[FT_SHM_IFNAMSIZ + 1];
+	uint32_t k;
+
+	fi = (const ft_shm_iface *)(const void *)
+	    ((const char *)h + h->iface_off);
+	c = (const ft_shm_counter *)(const void *)
+	    ((const char *)h + h->counter_off);
+	for (k = 0; k < h->ncounter; ++k, ++c) {
+		if (c->iface != FT_SHM_NOIFACE && !selected(h, fi, c->iface))
+			continue;
+		if (nonzero && c->value == 0)
+			continue;
+		printf("%-8s %-*.*s %llu\n",
+		    ifacename(h, fi, c->iface, ibuf, sizeof ibuf),
+		    FT_SHM_NAMESIZE, FT_SHM_NAMESIZE, c->name,
+		    (unsigned long long)c->value);
+	}
+}
+
+/*
+ * Map the segment and take a consistent copy of it.
+ */
+static ft_shm_hdr *
+snapshot(const char *name)
+{
+	static const struct timespec pause = { 0, 1000000 };
+	struct stat st;
+	void *seg, *buf;
+	unsigned int n;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		err(1, "%s", name);
+	if (fstat(fd, &st) != 0)
+		err(1, "%s", name);
+	if ((seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)
+		err(1, "%s", name);
+	close(fd);
+	if ((buf = malloc(st.st_size)) == NULL)
+		err(1, "malloc()");
+	for (n = 0; ft_shm_read(seg, st.st_size, buf, 1) != 0; ++n) {
+		if (errno != EAGAIN)
+			errx(1, "%s: not a flytrap segment or wrong version",
+			    name);
+		if (n == FTSTATE_TRIES)
+			errx(1, "%s: segment busy", name);
+		nanosleep(&pause, NULL);
+	}
+	munmap(seg, st.st_size);
+	return (buf);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: ftstate [-acnh] [-i iface] [-s name]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *name;
+	ft_shm_hdr *h;
+	int arp, counters, opt;
+
+	name = FTSTATE_DEFAULT;
+	arp = counters = 0;
+	while ((opt = getopt(argc, argv, "achi:ns:")) != -1)
+		switch (opt) {
+		case 'a':
+			arp = 1;
+			break;
+		case 'c':
+			counters = 1;
+			break;
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'n':
+			nonzero = 1;
+			break;
+		case 's':
+			name = optarg;
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		usage();
+	if (!arp && !counters)
+		arp = 1;
+
+	h = snapshot(name);
+	if (h->pid != 0 && kill(h->pid, 0) != 0 && errno == ESRCH)
+		warnx("%s: flytrap (pid %u) is no longer running", name,
+		    h->pid);
+	if (h->updated == 0)
+		warnx("%s: nothing has been published yet", name);
+	if (counters)
+		print_counters(h);
+	if (arp)
+		print_arp(h);
+	free(h);
+	exit(0);
+}
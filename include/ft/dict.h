@@ -35,23 +35,25 @@ struct ft_dict_ent;
 struct ft_dict;
 
 static inline const char *
-ft_dict_key(struct ft_dict_ent *e)
+ft_dict_key(const struct ft_dict_ent *e)
 {
 
-	return (((struct _ft_dict_ent *)e)->key);
+	return (((const struct _ft_dict_ent *)e)->key);
 }
 
 static inline const void *
-ft_dict_value(struct ft_dict_ent *e)
+ft_dict_value(const struct ft_dict_ent *e)
 {
 
-	return (((struct _ft_dict_ent *)e)->value);
+	return (((const struct _ft_dict_ent *)e)->value);
 }
 
 struct ft_dict *ft_dict_create(void);
 void ft_dict_destroy(struct ft_dict *);
 int ft_dict_insert(struct ft_dict *, const char *, void *);
 int ft_dict_remove(struct ft_dict *, const char *);
+const struct ft_dict_ent *ft_dict_find(const struct ft_dict *, const char *);
+void *ft_dict_lookup(const struct ft_dict *, const char *);
 const struct ft_dict_ent *ft_dict_first(const struct ft_dict *);
 const struct ft_dict_ent *ft_dict_next(const struct ft_dict *,
     const struct ft_dict_ent *);
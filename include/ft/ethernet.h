@@ -37,6 +37,7 @@ typedef enum ether_type {
 	ether_type_arp	 = 0x0806,
 	ether_type_vlan	 = 0x8100,
 	ether_type_ipv6	 = 0x86dd,
+	ether_type_qinq	 = 0x88a8,
 } ether_type;
 
 typedef struct ether_hdr {
@@ -45,8 +46,21 @@ typedef struct ether_hdr {
 	uint16_t	 type;
 } __attribute__((__packed__)) ether_hdr;
 
+typedef struct ether_tag {
+	uint16_t	 tci;		/* priority, DEI and VLAN ID */
+	uint16_t	 type;		/* inner ethertype */
+} __attribute__((__packed__)) ether_tag;
+
+#define ETHER_VID(tci)	 ((tci) & 0x0fff)
+
 typedef struct ether_ftr {
 	uint32_t	 fcs;
 } __attribute__((__packed__)) ether_ftr;
 
+/* CRC register after running over a frame and its valid FCS */
+#define ETHER_CRC32_RESIDUE 0xdebb20e3U
+
+uint32_t	 ether_crc32(const void *, size_t);
+int		 ether_crc32_select(const char *);
+
 #endif
@@ -32,5 +32,124 @@
 
 uint8_t ft_hash(const void *, size_t);
 uint8_t ft_strhash(const char *);
+uint64_t ft_strhash64(const char *);
+
+/*
+ * Seeded 64-bit hash, built on the 64 x 64 -> 128-bit multiply-and-fold
+ * primitive from wyhash.  It is not cryptographic, but without knowing
+ * the seed, it is impractical to pick keys which will collide in a
+ * table.  Tables facing the network should pass ft_hash_seed, or a
+ * value derived from it, after calling ft_hash_randomize() at startup.
+ */
+#define FT_HASH_P0	0xa0761d6478bd642fULL
+#define FT_HASH_P1	0xe7037ed1a0b428dbULL
+#define FT_HASH_P2	0x8ebc6af09c88c6e3ULL
+
+extern uint64_t ft_hash_seed;
+
+void ft_hash_randomize(void);
+uint64_t ft_hash64(uint64_t, const void *, size_t);
+
+/*
+ * Multiply two 64-bit numbers into *a (low half) and *b (high half)
+ */
+static inline void
+ft_hash_mul128(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 r;
+
+	r = (unsigned __int128)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha, hb, la, lb, hi, rh, rm0, rm1, rl, t, lo, c;
+
+	ha = *a >> 32;
+	hb = *b >> 32;
+	la = (uint32_t)*a;
+	lb = (uint32_t)*b;
+	rh = ha * hb;
+	rm0 = ha * lb;
+	rm1 = hb * la;
+	rl = la * lb;
+	t = rl + (rm0 << 32);
+	c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static inline uint64_t
+ft_hash_mix(uint64_t a, uint64_t b)
+{
+
+	ft_hash_mul128(&a, &b);
+	return (a ^ b);
+}
+
+/*
+ * Fixed-width fast paths for a 64-bit value, which includes an IPv4
+ * address, and for an IPv4 flow.  Addresses and ports may be in either
+ * byte order, as long as it is always the same one.
+ */
+static inline uint64_t
+ft_hash_u64(uint64_t seed, uint64_t v)
+{
+	uint64_t a, b;
+
+	a = v ^ seed ^ FT_HASH_P0;
+	b = seed ^ FT_HASH_P1;
+	ft_hash_mul128(&a, &b);
+	return (ft_hash_mix(a ^ FT_HASH_P0, b ^ FT_HASH_P2));
+}
+
+static inline uint32_t
+ft_hash_ip4(uint64_t seed, uint32_t addr)
+{
+
+	return ((uint32_t)(ft_hash_u64(seed, addr) >> 32));
+}
+
+static inline uint64_t
+ft_hash_ip4_flow64(uint64_t seed, uint32_t src, uint32_t dst,
+    uint16_t sport, uint16_t dport)
+{
+	uint64_t a, b;
+
+	a = ((uint64_t)src << 32 | dst) ^ seed ^ FT_HASH_P0;
+	b = ((uint64_t)sport << 16 | dport) ^ seed ^ FT_HASH_P1;
+	ft_hash_mul128(&a, &b);
+	return (ft_hash_mix(a ^ FT_HASH_P0, b ^ FT_HASH_P2));
+}
+
+static inline uint32_t
+ft_hash_ip4_flow(uint64_t seed, uint32_t src, uint32_t dst,
+    uint16_t sport, uint16_t dport)
+{
+
+	return ((uint32_t)(ft_hash_ip4_flow64(seed, src, dst, sport, dport) >>
+	    32));
+}
+
+static inline uint32_t
+ft_hash32(uint64_t seed, const void *data, size_t len)
+{
+
+	return ((uint32_t)(ft_hash64(seed, data, len) >> 32));
+}
+
+/*
+ * Reduce a 32-bit hash to [0, n) without a division
+ */
+static inline uint32_t
+ft_hash_reduce(uint32_t h, uint32_t n)
+{
+
+	return ((uint32_t)(((uint64_t)h * n) >> 32));
+}
 
 #endif
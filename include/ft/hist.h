@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_HIST_H_INCLUDED
+#define FT_HIST_H_INCLUDED
+
+/*
+ * Log-linear histogram, in the style of HdrHistogram.  Values below
+ * 2 * FT_HIST_SUB are counted exactly; above that, each power of two is
+ * split into FT_HIST_SUB buckets, so any value is recorded with a
+ * relative error of less than 1 / FT_HIST_SUB.  Values of 2^FT_HIST_BITS
+ * or more all end up in the last bucket.
+ */
+#define FT_HIST_SUB_BITS	4
+#define FT_HIST_SUB		(1U << FT_HIST_SUB_BITS)
+#define FT_HIST_BITS		40
+#define FT_HIST_BUCKETS		((FT_HIST_BITS - FT_HIST_SUB_BITS + 1) * \
+				    FT_HIST_SUB)
+
+typedef struct ft_hist {
+	unsigned long	 count;
+	uint64_t	 max;
+	unsigned long	 bucket[FT_HIST_BUCKETS];
+} ft_hist;
+
+static inline unsigned int
+ft_hist_index(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < 2 * FT_HIST_SUB)
+		return (v);
+	if (v >> FT_HIST_BITS)
+		return (FT_HIST_BUCKETS - 1);
+	shift = 63 - __builtin_clzll(v) - FT_HIST_SUB_BITS;
+	return (shift * FT_HIST_SUB + (unsigned int)(v >> shift));
+}
+
+static inline void
+ft_hist_add(ft_hist *h, uint64_t v)
+{
+
+	h->bucket[ft_hist_index(v)]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint64_t ft_hist_value(unsigned int);
+void	 ft_hist_merge(ft_hist *, const ft_hist *);
+uint64_t ft_hist_quantile(const ft_hist *, double);
+
+#endif
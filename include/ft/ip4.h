@@ -121,6 +121,8 @@ typedef struct udp4_hdr {
 const char	*ip4_parse(const char *, ip4_addr *);
 const char	*ip4_parse_range(const char *, ip4_addr *, ip4_addr *);
 uint16_t	 ip4_cksum(uint16_t, const void *, size_t);
+uint16_t	 ip4_cksum_adjust(uint16_t, uint16_t, uint16_t);
+int		 ip4_cksum_select(const char *);
 
 typedef struct ip4s_node ip4s_node;
 
@@ -134,4 +136,46 @@ unsigned long	 ip4s_count(const ip4s_node *);
 void		 ip4s_fprint(FILE *, const ip4s_node *);
 #endif
 
+typedef struct ip4s_range {
+	uint32_t	 first;
+	uint32_t	 last;
+} ip4s_range;
+
+size_t		 ip4s_range_merge(ip4s_range *, size_t);
+#ifdef BUFSIZ
+ip4s_range	*ip4s_range_read(FILE *, size_t *, int *);
+#endif
+ip4s_node	*ip4s_build(ip4s_range *, size_t);
+int		 ip4s_insertv(ip4s_node *, ip4s_range *, size_t);
+int		 ip4s_removev(ip4s_node *, ip4s_range *, size_t);
+
+ip4s_node	*ip4s_union(const ip4s_node *, const ip4s_node *);
+ip4s_node	*ip4s_intersect(const ip4s_node *, const ip4s_node *);
+ip4s_node	*ip4s_difference(const ip4s_node *, const ip4s_node *);
+
+/* deep enough for a tree which splits four bits at a time */
+#define IP4S_ITER_DEPTH	 9
+
+typedef struct ip4s_iter {
+	const ip4s_node	*tree;
+	uint32_t	 node[IP4S_ITER_DEPTH];
+	unsigned int	 sub[IP4S_ITER_DEPTH];
+	int		 depth;
+	int		 pending;
+	ip4s_range	 next;
+} ip4s_iter;
+
+void		 ip4s_iter_init(ip4s_iter *, const ip4s_node *);
+int		 ip4s_iter_next(ip4s_iter *, ip4s_range *);
+
+typedef struct ip4s_frozen ip4s_frozen;
+
+ip4s_frozen	*ip4s_freeze(const ip4s_node *);
+void		 ip4s_frozen_destroy(ip4s_frozen *);
+int		 ip4s_frozen_lookup(const ip4s_frozen *, uint32_t);
+size_t		 ip4s_frozen_lookupv(const ip4s_frozen *, const uint32_t *,
+    uint8_t *, size_t);
+unsigned long	 ip4s_frozen_count(const ip4s_frozen *);
+size_t		 ip4s_frozen_ranges(const ip4s_frozen *, ip4s_range *, size_t);
+
 #endif
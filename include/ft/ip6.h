@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_IP6_H_INCLUDED
+#define FT_IP6_H_INCLUDED
+
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+
+#define ip6_proto_icmp6	 0x3a
+
+typedef struct ip6_hdr {
+#define ip6_hdr_ver(ih) (be32toh((ih)->ver_tc_fl) >> 28)
+	uint32_t	 ver_tc_fl;
+	uint16_t	 len;		/* payload length */
+	uint8_t		 nxt;
+	uint8_t		 hlim;
+	ipv6_addr	 srcip;
+	ipv6_addr	 dstip;
+} __attribute__((__packed__)) ip6_hdr;
+
+typedef enum icmp6_type {
+	icmp6_type_nd_solicit	 = 135,
+	icmp6_type_nd_advert	 = 136,
+} icmp6_type;
+
+typedef struct icmp6_hdr {
+	uint8_t		 type;
+	uint8_t		 code;
+	uint16_t	 sum;
+} __attribute__((__packed__)) icmp6_hdr;
+
+/*
+ * Neighbor solicitations and advertisements (RFC 4861) share a layout:
+ * flags, which are reserved in a solicitation, followed by the target
+ * address and then options.
+ */
+#define ND_ADVERT_ROUTER	 0x80000000U
+#define ND_ADVERT_SOLICITED	 0x40000000U
+#define ND_ADVERT_OVERRIDE	 0x20000000U
+
+typedef struct nd_pkt {
+	icmp6_hdr	 hdr;
+	uint32_t	 flags;
+	ipv6_addr	 target;
+	uint8_t		 opt[];
+} __attribute__((__packed__)) nd_pkt;
+
+typedef enum nd_opt_type {
+	nd_opt_source_lla	 = 1,
+	nd_opt_target_lla	 = 2,
+} nd_opt_type;
+
+/* options are measured in units of eight bytes */
+typedef struct nd_opt_lla {
+	uint8_t		 type;
+	uint8_t		 len;
+	ether_addr	 lla;
+} __attribute__((__packed__)) nd_opt_lla;
+
+#define ND_HOP_LIMIT	 255
+
+#endif
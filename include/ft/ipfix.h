@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_IPFIX_H_INCLUDED
+#define FT_IPFIX_H_INCLUDED
+
+/*
+ * IPFIX (RFC 7011) message encoder.  Log records are exported as data
+ * records of a single template, FT_IPFIX_TEMPLATE, which describes
+ * each one as a flow of one packet.  Messages are built in a buffer
+ * supplied by the caller; nothing is allocated.
+ */
+#define FT_IPFIX_VERSION	10
+#define FT_IPFIX_HDRSIZE	16	/* message header */
+#define FT_IPFIX_SETSIZE	4	/* set header */
+#define FT_IPFIX_TEMPLATE	256	/* our template ID */
+#define FT_IPFIX_TMPLSIZE	44	/* template set, including header */
+#define FT_IPFIX_RECSIZE	33	/* data record */
+
+/* smallest buffer which holds a template and a record */
+#define FT_IPFIX_MINSIZE						\
+	(FT_IPFIX_HDRSIZE + FT_IPFIX_TMPLSIZE +				\
+	    FT_IPFIX_SETSIZE + FT_IPFIX_RECSIZE)
+
+typedef struct ft_ipfix {
+	uint8_t		*buf;
+	size_t		 size;
+	size_t		 len;		/* length of the message so far */
+	size_t		 set;		/* offset of the open data set, or 0 */
+	uint32_t	 domain;	/* observation domain ID */
+	uint32_t	 seq;		/* data records in earlier messages */
+	uint32_t	 nrecs;		/* data records in this message */
+} ft_ipfix;
+
+struct ft_logrec;
+
+void	 ft_ipfix_init(ft_ipfix *, void *, size_t, uint32_t);
+int	 ft_ipfix_template(ft_ipfix *);
+int	 ft_ipfix_record(ft_ipfix *, const struct ft_logrec *);
+size_t	 ft_ipfix_finish(ft_ipfix *, uint32_t);
+
+#endif
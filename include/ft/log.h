@@ -39,20 +39,41 @@ typedef enum {
 	FT_LOG_LEVEL_MAX
 } ft_log_level_t;
 
+/*
+ * Every ft_debug() etc. has its own state, so a message which is logged
+ * over and over, e.g. for every packet in a flood, can be held back
+ * without affecting others; see ft_log.c.
+ */
+typedef struct ft_log_site {
+	const char		*file;
+	unsigned int		 line;
+	ft_log_level_t		 level;
+	unsigned int		 window;	/* current second */
+	unsigned int		 count;		/* messages in window */
+	unsigned int		 suppressed;	/* messages held back */
+	int			 listed;	/* on the list of sites */
+	struct ft_log_site	*next;
+} ft_log_site;
+
 #ifdef FT_LOGV_REQUIRED
 void ft_logv(ft_log_level_t, const char *, va_list);
 #endif
 void ft_log(ft_log_level_t, const char *, ...);
+void ft_log_at(ft_log_site *, ft_log_level_t, const char *, ...);
+void ft_log_flush(void);
 void ft_fatal(const char *, ...);
 int ft_log_init(const char *, const char *);
 int ft_log_exit(void);
 
 extern ft_log_level_t ft_log_level;
+extern unsigned int ft_log_ratelimit;
 
 #define ft_log_if(level, ...)						\
 	do {								\
+		static ft_log_site ft_log_site_ =			\
+		    { __FILE__, __LINE__, level, 0, 0, 0, 0, 0 };	\
 		if (level >= ft_log_level)				\
-			ft_log(level, __VA_ARGS__);			\
+			ft_log_at(&ft_log_site_, level, __VA_ARGS__);	\
 	} while (0)
 #define ft_debug(...)							\
 	ft_log_if(FT_LOG_LEVEL_DEBUG, __VA_ARGS__)
@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_LOGREC_H_INCLUDED
+#define FT_LOGREC_H_INCLUDED
+
+/*
+ * Binary log record.  Every record is exactly FT_LOGREC_SIZE bytes long
+ * and stored in network byte order.  The first byte is always
+ * FT_LOGREC_MAGIC, which can never start a line in a text log, so the
+ * two formats can be told apart by looking at the first byte of a file.
+ */
+#define FT_LOGREC_MAGIC		0xf7
+#define FT_LOGREC_VERSION	1
+#define FT_LOGREC_SIZE		32
+
+/* upper bound on the length of a text log line, including the NUL */
+#define FT_LOGREC_TEXTMAX	128
+
+typedef struct ft_logrec {
+	uint64_t	 sec;
+	uint32_t	 usec;
+	ip4_addr	 sa;
+	uint16_t	 sp;
+	ip4_addr	 da;
+	uint16_t	 dp;
+	uint8_t		 proto;
+	uint16_t	 flags;		/* TCP flags, ICMP type and code */
+	uint16_t	 len;
+} ft_logrec;
+
+/*
+ * Summary record, which stands for count packets with the same source
+ * address, destination port, protocol and flags, seen between the first
+ * and last timestamps and sent to an estimated ndst distinct
+ * destinations, of which da is the first.  In binary logs, summary
+ * records are FT_LOGSUM_SIZE bytes long and start with FT_LOGSUM_MAGIC;
+ * in text logs, summary lines start with FT_LOGSUM_PREFIX.
+ */
+#define FT_LOGSUM_MAGIC		0xf8
+#define FT_LOGSUM_VERSION	1
+#define FT_LOGSUM_SIZE		48
+#define FT_LOGSUM_PREFIX	'+'
+
+/* upper bound on the length of a summary line, including the NUL */
+#define FT_LOGSUM_TEXTMAX	136
+
+typedef struct ft_logsum {
+	uint64_t	 fsec;
+	uint32_t	 fusec;
+	uint64_t	 lsec;
+	uint32_t	 lusec;
+	ip4_addr	 sa;
+	ip4_addr	 da;
+	uint16_t	 dp;
+	uint8_t		 proto;
+	uint16_t	 flags;		/* TCP flags, ICMP type and code */
+	uint32_t	 count;
+	uint32_t	 ndst;
+} ft_logsum;
+
+void	 ft_logrec_enc(void *, const ft_logrec *);
+int	 ft_logrec_dec(ft_logrec *, const void *);
+int	 ft_logrec_text(char *, size_t, const ft_logrec *);
+void	 ft_logsum_enc(void *, const ft_logsum *);
+int	 ft_logsum_dec(ft_logsum *, const void *);
+int	 ft_logsum_text(char *, size_t, const ft_logsum *);
+
+#endif
@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_SHM_H_INCLUDED
+#define FT_SHM_H_INCLUDED
+
+/*
+ * Layout of the shared memory segment in which flytrap publishes its
+ * ARP tables and counters for other processes to read.  Everything is
+ * in host byte order, since the segment never leaves the machine.
+ *
+ * The segment is guarded by a sequence lock: the writer increments
+ * seq before and after each update, so it is odd while an update is in
+ * progress.  Readers copy what they need out of the segment and start
+ * over if seq was odd or has changed in the meantime.  Readers never
+ * write to the segment, so they cannot hold up the writer.
+ */
+#define FT_SHM_MAGIC		0x46545348U	/* "FTSH" */
+#define FT_SHM_VERSION		1
+#define FT_SHM_IFNAMSIZ		16
+#define FT_SHM_NAMESIZE		32
+#define FT_SHM_NOIFACE		UINT32_MAX	/* not tied to an interface */
+
+/* ARP entry flags */
+#define FT_SHM_CLAIMED		0x01
+#define FT_SHM_RESERVED		0x02
+
+typedef struct ft_shm_hdr {
+	uint32_t	 magic;
+	uint16_t	 version;
+	uint16_t	 hdrsize;	/* sizeof(ft_shm_hdr) */
+	uint64_t	 seq;		/* odd while being updated */
+	uint64_t	 size;		/* size of the segment */
+	uint64_t	 updated;	/* time of the last update (ms) */
+	uint64_t	 arp_updated;	/* time of the ARP snapshot (ms) */
+	uint32_t	 pid;		/* writer's process ID */
+	uint32_t	 niface;	/* interface names */
+	uint32_t	 ncounter;	/* counters */
+	uint32_t	 narp;		/* ARP entries */
+	uint32_t	 maxarp;	/* room for this many ARP entries */
+	uint32_t	 arp_dropped;	/* ARP entries which did not fit */
+	uint32_t	 iface_off;	/* offsets from the start */
+	uint32_t	 counter_off;
+	uint32_t	 arp_off;
+	uint32_t	 reserved;
+} ft_shm_hdr;
+
+typedef struct ft_shm_iface {
+	char		 name[FT_SHM_IFNAMSIZ];
+} ft_shm_iface;
+
+typedef struct ft_shm_counter {
+	char		 name[FT_SHM_NAMESIZE];
+	uint32_t	 iface;		/* interface index or FT_SHM_NOIFACE */
+	uint32_t	 gauge;		/* gauge rather than counter */
+	uint64_t	 value;
+} ft_shm_counter;
+
+typedef struct ft_shm_arp {
+	uint64_t	 first;		/* first seen (ms) */
+	uint64_t	 last;		/* last seen (ms) */
+	uint32_t	 addr;		/* IPv4 address */
+	uint32_t	 vlan;		/* VLAN key, 0 if untagged */
+	uint32_t	 iface;		/* interface index */
+	uint8_t		 ether[6];	/* last known owner */
+	uint8_t		 flags;
+	uint8_t		 nreq;		/* unanswered requests */
+	uint32_t	 reserved;
+} ft_shm_arp;
+
+size_t	 ft_shm_size(uint32_t, uint32_t, uint32_t);
+void	 ft_shm_init(void *, uint32_t, uint32_t, uint32_t);
+void	 ft_shm_begin(ft_shm_hdr *);
+void	 ft_shm_end(ft_shm_hdr *);
+int	 ft_shm_read(const void *, size_t, void *, unsigned int);
+
+#endif
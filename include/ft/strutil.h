@@ -50,6 +50,29 @@ char *ft_readword(FILE *, int *, size_t *);
 #define readword(arg, ...) ft_readword(arg, __VA_ARGS__)
 char **ft_readlinev(FILE *, int *, int *);
 #define readlinev(arg, ...) ft_readlinev(arg, __VA_ARGS__)
+char *ft_readall(FILE *, size_t *);
+#define readall(arg, ...) ft_readall(arg, __VA_ARGS__)
 #endif
 
+/*
+ * Words split out of a buffer by ft_splitline().  Each one points into
+ * the buffer and is NUL-terminated.  The vector is reused from one line
+ * to the next and only grows if a line has more words than any before.
+ */
+typedef struct ft_word {
+	char		*str;
+	size_t		 len;
+} ft_word;
+
+typedef struct ft_wordv {
+	ft_word		*words;
+	size_t		 nwords;
+	size_t		 size;
+} ft_wordv;
+
+int ft_splitline(char **, char *, int *, ft_wordv *);
+#define splitline(arg, ...) ft_splitline(arg, __VA_ARGS__)
+void ft_wordv_free(ft_wordv *);
+#define wordv_free(arg) ft_wordv_free(arg)
+
 #endif
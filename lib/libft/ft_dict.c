@@ -41,18 +41,116 @@
 #include <ft/dict.h>
 #include <ft/hash.h>
 
+/*
+ * Open addressing with Robin Hood probing: an entry displaces any entry
+ * it passes which is closer to its home slot than the newcomer is to
+ * its own, which keeps probe sequences short even at high load.
+ * Removal shifts the rest of the cluster back by one slot, so there are
+ * no tombstones.  The full hash is kept in each slot so we rarely need
+ * to compare keys which do not match.
+ *
+ * Entries move when the table grows or when other entries are removed,
+ * so a dictionary must not be modified while iterating over it.
+ */
+#define FT_DICT_MINSIZE	16
+
 struct ft_dict_ent {
-	const char		*key;
+	const char		*key;		/* NULL if the slot is empty */
 	void			*value;
-	unsigned int		 h;
-	struct ft_dict_ent	*next;
+	uint64_t		 h;
 };
 
 struct ft_dict {
-	struct ft_dict_ent	*entries[256];
+	struct ft_dict_ent	*slots;
+	unsigned int		 size;		/* always a power of two */
 	unsigned int		 nentries;
 };
 
+/*
+ * How far an entry is from its home slot
+ */
+static inline unsigned int
+ft_dict_dist(const struct ft_dict *d, unsigned int idx, uint64_t h)
+{
+
+	return ((idx - (unsigned int)h) & (d->size - 1));
+}
+
+/*
+ * Place an entry which is known not to be present yet
+ */
+static void
+ft_dict_place(struct ft_dict *d, struct ft_dict_ent e)
+{
+	struct ft_dict_ent tmp;
+	unsigned int dist, idx, mask;
+
+	mask = d->size - 1;
+	for (idx = e.h & mask, dist = 0; d->slots[idx].key != NULL;
+	     idx = (idx + 1) & mask, ++dist) {
+		if (ft_dict_dist(d, idx, d->slots[idx].h) < dist) {
+			tmp = d->slots[idx];
+			d->slots[idx] = e;
+			e = tmp;
+			dist = ft_dict_dist(d, idx, e.h);
+		}
+	}
+	d->slots[idx] = e;
+}
+
+/*
+ * Double the size of the table, or allocate it if it is empty
+ */
+static int
+ft_dict_grow(struct ft_dict *d)
+{
+	struct ft_dict_ent *oslots;
+	unsigned int i, osize;
+
+	osize = d->size;
+	if (osize > UINT_MAX / 2) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	oslots = d->slots;
+	d->size = osize ? osize * 2 : FT_DICT_MINSIZE;
+	if ((d->slots = calloc(d->size, sizeof *d->slots)) == NULL) {
+		d->slots = oslots;
+		d->size = osize;
+		return (-1);
+	}
+	for (i = 0; i < osize; ++i)
+		if (oslots[i].key != NULL)
+			ft_dict_place(d, oslots[i]);
+	free(oslots);
+	return (0);
+}
+
+/*
+ * Find the slot holding the specified key, or return -1
+ */
+static int
+ft_dict_slot(const struct ft_dict *d, const char *key, uint64_t h,
+    unsigned int *slot)
+{
+	const struct ft_dict_ent *e;
+	unsigned int dist, idx, mask;
+
+	if (d->size == 0)
+		return (-1);
+	mask = d->size - 1;
+	for (idx = h & mask, dist = 0; ; idx = (idx + 1) & mask, ++dist) {
+		e = &d->slots[idx];
+		/* an empty slot or a richer entry means it isn't here */
+		if (e->key == NULL || ft_dict_dist(d, idx, e->h) < dist)
+			return (-1);
+		if (e->h == h && strcmp(e->key, key) == 0) {
+			*slot = idx;
+			return (0);
+		}
+	}
+}
+
 /*
  * Create a dictionary
  */
@@ -73,16 +171,8 @@ ft_dict_create(void)
 void
 ft_dict_destroy(struct ft_dict *d)
 {
-	struct ft_dict_ent *e;
-	unsigned int h;
-
-	for (h = 0; h < sizeof d->entries / sizeof *d->entries; ++h) {
-		while (d->entries[h] != NULL) {
-			e = d->entries[h];
-			d->entries[h] = e->next;
-			free(e);
-		}
-	}
+
+	free(d->slots);
 	free(d);
 }
 
@@ -92,23 +182,21 @@ ft_dict_destroy(struct ft_dict *d)
 int
 ft_dict_insert(struct ft_dict *d, const char *key, void *value)
 {
-	struct ft_dict_ent **epp;
-	unsigned int h;
-
-	h = ft_strhash(key);
-	assert(h < sizeof d->entries / sizeof *d->entries);
-	for (epp = &d->entries[h]; *epp != NULL; epp = &(*epp)->next) {
-		assert((*epp)->h == h);
-		if (strcmp((*epp)->key, key) == 0) {
-			errno = EEXIST;
-			return (-1);
-		}
+	struct ft_dict_ent e;
+	unsigned int idx;
+
+	e.h = ft_strhash64(key);
+	if (ft_dict_slot(d, key, e.h, &idx) == 0) {
+		errno = EEXIST;
+		return (-1);
 	}
-	if ((*epp = calloc(1, sizeof **epp)) == NULL)
+	/* keep the load factor at or below 7/8 */
+	if ((d->nentries + 1) * 8ULL > d->size * 7ULL &&
+	    ft_dict_grow(d) != 0)
 		return (-1);
-	(*epp)->key = key;
-	(*epp)->h = h;
-	(*epp)->value = value;
+	e.key = key;
+	e.value = value;
+	ft_dict_place(d, e);
 	d->nentries++;
 	return (0);
 }
@@ -119,23 +207,50 @@ ft_dict_insert(struct ft_dict *d, const char *key, void *value)
 int
 ft_dict_remove(struct ft_dict *d, const char *key)
 {
-	struct ft_dict_ent *ep, **epp;
-	unsigned int h;
-
-	h = ft_strhash(key);
-	assert(h < sizeof d->entries / sizeof *d->entries);
-	for (epp = &d->entries[h]; *epp != NULL; epp = &(*epp)->next) {
-		assert((*epp)->h == h);
-		if (strcmp((*epp)->key, key) == 0) {
-			ep = *epp;
-			*epp = ep->next;
-			free(ep);
-			d->nentries--;
-			return (0);
-		}
+	unsigned int idx, next, mask;
+
+	if (ft_dict_slot(d, key, ft_strhash64(key), &idx) != 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+	/* shift the rest of the cluster back */
+	mask = d->size - 1;
+	for (next = (idx + 1) & mask; d->slots[next].key != NULL &&
+	     ft_dict_dist(d, next, d->slots[next].h) > 0;
+	     idx = next, next = (next + 1) & mask)
+		d->slots[idx] = d->slots[next];
+	d->slots[idx].key = NULL;
+	d->nentries--;
+	return (0);
+}
+
+/*
+ * Look up an entry in a dictionary
+ */
+const struct ft_dict_ent *
+ft_dict_find(const struct ft_dict *d, const char *key)
+{
+	unsigned int idx;
+
+	if (ft_dict_slot(d, key, ft_strhash64(key), &idx) != 0) {
+		errno = ENOENT;
+		return (NULL);
 	}
-	errno = ENOENT;
-	return (-1);
+	return (&d->slots[idx]);
+}
+
+/*
+ * Look up a value in a dictionary.  Callers which store NULL values
+ * should use ft_dict_find() instead.
+ */
+void *
+ft_dict_lookup(const struct ft_dict *d, const char *key)
+{
+	const struct ft_dict_ent *e;
+
+	if ((e = ft_dict_find(d, key)) == NULL)
+		return (NULL);
+	return (e->value);
 }
 
 /*
@@ -144,15 +259,8 @@ ft_dict_remove(struct ft_dict *d, const char *key)
 const struct ft_dict_ent *
 ft_dict_first(const struct ft_dict *d)
 {
-	unsigned int h;
 
-	for (h = 0; h < sizeof d->entries / sizeof *d->entries; ++h) {
-		if (d->entries[h] != NULL) {
-			assert(d->entries[h]->h == h);
-			return (d->entries[h]);
-		}
-	}
-	return (NULL);
+	return (ft_dict_next(d, NULL));
 }
 
 /*
@@ -161,18 +269,16 @@ ft_dict_first(const struct ft_dict *d)
 const struct ft_dict_ent *
 ft_dict_next(const struct ft_dict *d, const struct ft_dict_ent *e)
 {
-	unsigned int h;
-
-	if (e == NULL)
-		return (ft_dict_first(d));
-	assert(e->h < sizeof d->entries / sizeof *d->entries);
-	if (e->next != NULL)
-		return (e->next);
-	for (h = e->h + 1; h < sizeof d->entries / sizeof *d->entries; ++h) {
-		if (d->entries[h] != NULL) {
-			assert(d->entries[h]->h == h);
-			return (d->entries[h]);
-		}
+	unsigned int idx;
+
+	if (e == NULL) {
+		idx = 0;
+	} else {
+		assert(e >= d->slots && e < d->slots + d->size);
+		idx = e - d->slots + 1;
 	}
+	for (; idx < d->size; ++idx)
+		if (d->slots[idx].key != NULL)
+			return (&d->slots[idx]);
 	return (NULL);
 }
@@ -31,8 +31,16 @@
 # include "config.h"
 #endif
 
+#include <sys/types.h>
+#if HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+#include <sys/time.h>
+
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <ft/hash.h>
 
@@ -97,3 +105,115 @@ ft_strhash(const char *str)
 		h = T[h ^ (uint8_t)*str];
 	return (h);
 }
+
+/*
+ * 64-bit FNV-1a, with the MurmurHash3 finalizer on top so that the low
+ * bits, which index hash tables, depend on every bit of the input.
+ */
+uint64_t
+ft_strhash64(const char *str)
+{
+	uint64_t h;
+
+	for (h = 0xcbf29ce484222325ULL; *str != '\0'; ++str)
+		h = (h ^ (uint8_t)*str) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+uint64_t ft_hash_seed = FT_HASH_P2;
+
+/*
+ * Pick a new random seed.  This should be done once, at startup, before
+ * any tables which use it are populated.
+ */
+void
+ft_hash_randomize(void)
+{
+	struct timeval tv;
+	uint64_t seed;
+	int fd;
+
+#if HAVE_GETENTROPY
+	if (getentropy(&seed, sizeof seed) == 0) {
+		ft_hash_seed = seed;
+		return;
+	}
+#endif
+	if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (read(fd, &seed, sizeof seed) == (ssize_t)sizeof seed) {
+			close(fd);
+			ft_hash_seed = seed;
+			return;
+		}
+		close(fd);
+	}
+	/* better than nothing */
+	gettimeofday(&tv, NULL);
+	ft_hash_seed = ft_hash_u64(ft_hash_seed, (uint64_t)tv.tv_sec << 32 ^
+	    (uint64_t)tv.tv_usec << 12 ^ (uint64_t)getpid());
+}
+
+static inline uint64_t
+ft_hash_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof v);
+	return (v);
+}
+
+static inline uint64_t
+ft_hash_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof v);
+	return (v);
+}
+
+/*
+ * Seeded hash of an arbitrary buffer, following the structure of
+ * wyhash: inputs of up to 16 bytes are read as two possibly overlapping
+ * words, longer ones are folded 16 bytes at a time.  Unaligned reads
+ * are in host byte order, so results differ between big- and
+ * little-endian machines.
+ */
+uint64_t
+ft_hash64(uint64_t seed, const void *data, size_t len)
+{
+	const uint8_t *p;
+	uint64_t a, b;
+	size_t n;
+
+	p = data;
+	seed ^= ft_hash_mix(seed ^ FT_HASH_P0, FT_HASH_P1);
+	if (len <= 16) {
+		if (len >= 4) {
+			n = (len >> 3) << 2;
+			a = ft_hash_read32(p) << 32 | ft_hash_read32(p + n);
+			b = ft_hash_read32(p + len - 4) << 32 |
+			    ft_hash_read32(p + len - 4 - n);
+		} else if (len > 0) {
+			a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 |
+			    p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		for (n = len; n > 16; n -= 16, p += 16)
+			seed = ft_hash_mix(ft_hash_read64(p) ^ FT_HASH_P1,
+			    ft_hash_read64(p + 8) ^ seed);
+		a = ft_hash_read64(p + n - 16);
+		b = ft_hash_read64(p + n - 8);
+	}
+	a ^= FT_HASH_P1;
+	b ^= seed;
+	ft_hash_mul128(&a, &b);
+	return (ft_hash_mix(a ^ FT_HASH_P0 ^ len, b ^ FT_HASH_P1));
+}
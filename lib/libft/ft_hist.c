@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include <ft/hist.h>
+
+/*
+ * Return the highest value which falls into the given bucket.
+ */
+uint64_t
+ft_hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < 2 * FT_HIST_SUB)
+		return (idx);
+	shift = idx / FT_HIST_SUB - 1;
+	return ((((uint64_t)(idx - shift * FT_HIST_SUB) + 1) << shift) - 1);
+}
+
+/*
+ * Add the contents of one histogram to another.  The source may be
+ * updated by another thread while we read it, in which case the result
+ * is a consistent-enough view of some recent state.
+ */
+void
+ft_hist_merge(ft_hist *dst, const ft_hist *src)
+{
+	unsigned long n;
+	uint64_t max;
+	unsigned int k;
+
+	for (k = 0; k < FT_HIST_BUCKETS; ++k) {
+		n = __atomic_load_n(&src->bucket[k], __ATOMIC_RELAXED);
+		dst->bucket[k] += n;
+		dst->count += n;
+	}
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+/*
+ * Return the value below which the given fraction of all recorded
+ * values fall, rounded up to the top of its bucket but never above the
+ * highest value recorded.  Returns 0 for an empty histogram.
+ */
+uint64_t
+ft_hist_quantile(const ft_hist *h, double q)
+{
+	unsigned long rank, seen;
+	unsigned int k;
+	uint64_t v;
+
+	if (h->count == 0)
+		return (0);
+	if (q <= 0.0)
+		rank = 1;
+	else if (q >= 1.0)
+		rank = h->count;
+	else if ((rank = (unsigned long)(q * h->count)) < q * h->count ||
+	    rank == 0)
+		rank++;
+	for (seen = 0, k = 0; k < FT_HIST_BUCKETS; ++k)
+		if ((seen += h->bucket[k]) >= rank)
+			break;
+	if (k >= FT_HIST_BUCKETS - 1)
+		return (h->max);
+	v = ft_hist_value(k);
+	return (v < h->max ? v : h->max);
+}
@@ -34,6 +34,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <ft/ctype.h>
 #include <ft/endian.h>
@@ -107,18 +108,238 @@ ip4_parse_range(const char *line, ip4_addr *first, ip4_addr *last)
 
 /*
  * IPv4 16-bit checksum
+ *
+ * The one's complement sum does not depend on byte order (RFC 1071), so
+ * the bulk of the data is summed in native byte order using the widest
+ * loads available, and the result is byte-swapped at the end.  Every
+ * implementation returns an unfolded sum of an even number of bytes.
  */
+#if HAVE_IMMINTRIN_H && HAVE___BUILTIN_CPU_SUPPORTS && \
+    (defined(__x86_64__) || defined(__i386__))
+#define IP4_CKSUM_X86 1
+#include <immintrin.h>
+#elif HAVE_ARM_NEON_H && defined(__ARM_NEON)
+#define IP4_CKSUM_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* max blocks per pass before 32-bit vector lanes could overflow */
+#define IP4_CKSUM_BLOCKS 16384
+
+static uint64_t
+ip4_cksum_generic(const uint8_t *p, size_t len)
+{
+	uint32_t w[4];
+	uint64_t sum;
+	uint16_t h;
+
+	sum = 0;
+	for (; len >= 16; p += 16, len -= 16) {
+		memcpy(w, p, 16);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+	}
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(w, p, 4);
+		sum += w[0];
+	}
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		sum += h;
+	}
+	return (sum);
+}
+
+#if IP4_CKSUM_X86
+__attribute__((__target__("sse2")))
+static uint64_t
+ip4_cksum_sse2(const uint8_t *p, size_t len)
+{
+	__m128i acc, v, zero;
+	uint32_t lane[4];
+	uint64_t sum;
+	size_t n;
+
+	sum = 0;
+	zero = _mm_setzero_si128();
+	while (len >= 16) {
+		n = len / 16;
+		if (n > IP4_CKSUM_BLOCKS)
+			n = IP4_CKSUM_BLOCKS;
+		len -= n * 16;
+		for (acc = zero; n > 0; --n, p += 16) {
+			v = _mm_loadu_si128((const __m128i *)p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		_mm_storeu_si128((__m128i *)lane, acc);
+		sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	return (sum + ip4_cksum_generic(p, len));
+}
+
+__attribute__((__target__("avx2")))
+static uint64_t
+ip4_cksum_avx2(const uint8_t *p, size_t len)
+{
+	__m256i acc, v, zero;
+	uint32_t lane[8];
+	uint64_t sum;
+	size_t n;
+
+	sum = 0;
+	zero = _mm256_setzero_si256();
+	while (len >= 32) {
+		n = len / 32;
+		if (n > IP4_CKSUM_BLOCKS)
+			n = IP4_CKSUM_BLOCKS;
+		len -= n * 32;
+		for (acc = zero; n > 0; --n, p += 32) {
+			v = _mm256_loadu_si256((const __m256i *)p);
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpackhi_epi16(v, zero));
+		}
+		_mm256_storeu_si256((__m256i *)lane, acc);
+		sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3] +
+		    lane[4] + lane[5] + lane[6] + lane[7];
+	}
+	return (sum + ip4_cksum_generic(p, len));
+}
+#endif
+
+#if IP4_CKSUM_NEON
+static uint64_t
+ip4_cksum_neon(const uint8_t *p, size_t len)
+{
+	uint32x4_t acc;
+	uint64_t sum;
+	size_t n;
+
+	sum = 0;
+	while (len >= 16) {
+		n = len / 16;
+		if (n > IP4_CKSUM_BLOCKS)
+			n = IP4_CKSUM_BLOCKS;
+		len -= n * 16;
+		for (acc = vdupq_n_u32(0); n > 0; --n, p += 16)
+			acc = vpadalq_u16(acc,
+			    vreinterpretq_u16_u8(vld1q_u8(p)));
+		sum += (uint64_t)vgetq_lane_u32(acc, 0) +
+		    vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) +
+		    vgetq_lane_u32(acc, 3);
+	}
+	return (sum + ip4_cksum_generic(p, len));
+}
+#endif
+
+static const struct ip4_cksum_impl {
+	const char	*name;
+	uint64_t	(*func)(const uint8_t *, size_t);
+} ip4_cksum_impls[] = {
+	/* best first */
+#if IP4_CKSUM_X86
+	{ "avx2",	ip4_cksum_avx2 },
+	{ "sse2",	ip4_cksum_sse2 },
+#endif
+#if IP4_CKSUM_NEON
+	{ "neon",	ip4_cksum_neon },
+#endif
+	{ "generic",	ip4_cksum_generic },
+	{ NULL,		NULL }
+};
+
+static uint64_t ip4_cksum_init(const uint8_t *, size_t);
+static uint64_t (*ip4_cksum_func)(const uint8_t *, size_t) = ip4_cksum_init;
+
+/*
+ * Check whether the CPU supports an implementation.
+ */
+static int
+ip4_cksum_usable(const struct ip4_cksum_impl *ci)
+{
+
+#if IP4_CKSUM_X86
+	if (ci->func == ip4_cksum_avx2)
+		return (__builtin_cpu_supports("avx2"));
+	if (ci->func == ip4_cksum_sse2)
+		return (__builtin_cpu_supports("sse2"));
+#endif
+	(void)ci;
+	return (1);
+}
+
+/*
+ * Select a checksum implementation by name, or the best one available
+ * if the name is NULL.  Returns -1 if the named implementation does not
+ * exist or is not supported by the CPU.
+ */
+int
+ip4_cksum_select(const char *name)
+{
+	const struct ip4_cksum_impl *ci;
+
+	for (ci = ip4_cksum_impls; ci->name != NULL; ++ci) {
+		if (name != NULL && strcmp(ci->name, name) != 0)
+			continue;
+		if (ip4_cksum_usable(ci)) {
+			__atomic_store_n(&ip4_cksum_func, ci->func,
+			    __ATOMIC_RELAXED);
+			return (0);
+		}
+		if (name != NULL)
+			break;
+	}
+	return (-1);
+}
+
+/*
+ * Pick the best implementation on first use.
+ */
+static uint64_t
+ip4_cksum_init(const uint8_t *p, size_t len)
+{
+
+	ip4_cksum_select(NULL);
+	return (__atomic_load_n(&ip4_cksum_func, __ATOMIC_RELAXED)(p, len));
+}
+
 uint16_t
 ip4_cksum(uint16_t isum, const void *data, size_t len)
 {
-	const uint16_t *w;
-	uint32_t sum;
-
-	for (w = data, sum = isum; len > 1; len -= 2, ++w)
-		sum += be16toh(*w);
-	if (len)
-		sum += *(const uint8_t *)w << 8;
-	while (sum > 0xffff)
-		sum -= 0xffff;
-	return (sum);
+	const uint8_t *p;
+	uint64_t sum;
+
+	/* short buffers, e.g. pseudo-header fields, are not worth a call */
+	p = data;
+	if (len < 64)
+		sum = ip4_cksum_generic(p, len & ~(size_t)1);
+	else
+		sum = __atomic_load_n(&ip4_cksum_func,
+		    __ATOMIC_RELAXED)(p, len & ~(size_t)1);
+	sum = (sum & 0xffffffffU) + (sum >> 32);
+	sum = (sum & 0xffffffffU) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = be16toh((uint16_t)sum) + isum;
+	if (len & 1)
+		sum += p[len - 1] << 8;
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ((sum & 0xffff) + (sum >> 16));
+}
+
+/*
+ * Adjust a checksum for a change of one 16-bit word from o to n, as
+ * described in RFC 1624.  Like the return value of ip4_cksum(), the
+ * sum is not complemented; to adjust the contents of a checksum field,
+ * complement it before and after.
+ */
+uint16_t
+ip4_cksum_adjust(uint16_t sum, uint16_t o, uint16_t n)
+{
+	uint32_t s;
+
+	s = (uint32_t)sum + (uint16_t)~o + n;
+	s = (s & 0xffff) + (s >> 16);
+	return ((s & 0xffff) + (s >> 16));
 }
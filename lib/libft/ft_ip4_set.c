@@ -31,13 +31,16 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <ft/ctype.h>
+#include <ft/endian.h>
 #include <ft/ip4.h>
+#include <ft/strutil.h>
 
 /*
  * How many bits to process at a time.  Lower values improve aggregation
@@ -47,25 +50,313 @@
 #define IP4S_SUBS	 (1U << IP4S_BITS)
 
 /*
- * A node in the tree.
+ * Below this many ranges, bulk insertion into or removal from a
+ * non-trivial tree is done one range at a time; above it, the ranges
+ * are built into a tree of their own and combined with the original,
+ * which costs time proportional to the size of both trees rather than
+ * to the number of ranges times the depth.
  */
-struct ip4s_node {
+#define IP4S_BULK_MIN	 64
+
+#if 32 / IP4S_BITS + 1 > IP4S_ITER_DEPTH
+#error "IP4S_ITER_DEPTH is too small for IP4S_BITS"
+#endif
+
+/*
+ * The nodes of a tree are kept in an array and refer to each other by
+ * index, in the same manner as the ARP table.  Each interior node splits
+ * its subnet into IP4S_SUBS children, of which only those present are
+ * stored, in order, in a segment of the kids array; the map has one bit
+ * per child, and a child's position in the segment is the number of
+ * bits set below its own.  Segments come in IP4S_CLASSES power-of-two
+ * sizes and are recycled through per-class free lists, and free nodes
+ * are chained through their kids field.  A node with an empty map is a
+ * leaf, which is full unless it is the root of an empty tree.  Node 0
+ * is always the root.
+ */
+#define IP4S_NONE	 UINT32_MAX
+#define IP4S_CLASSES	 (IP4S_BITS + 1)
+
+#if IP4S_BITS > 4
+#error "IP4S_BITS is too large for the child map"
+#endif
+
+struct ip4s_inode {
 	uint32_t	 addr;		/* network address */
+	uint32_t	 kids;		/* child segment or next free node */
+	uint32_t	 count;		/* addresses in subtree, if interior */
+	uint16_t	 map;		/* children present */
 	uint8_t		 plen;		/* prefix length */
-	int		 leaf:1;	/* leaf node flag */
-	unsigned long	 coverage;	/* addresses in subtree */
-	ip4s_node	*sub[IP4S_SUBS];/* subtrees */
+	uint8_t		 cls:3;		/* size class of child segment */
+	uint8_t		 full:1;	/* full leaf */
 };
 
 /*
- * Print the leaf nodes of a tree in order.
+ * A tree.
  */
-void
-ip4s_fprint(FILE *f, const ip4s_node *n)
+struct ip4s_node {
+	struct ip4s_inode *nodes;
+	uint32_t	 nnodes, maxnodes;
+	uint32_t	 nfree;		/* free nodes */
+	uint32_t	*kids;
+	uint32_t	 nkids, maxkids;
+	uint32_t	 kfree[IP4S_CLASSES]; /* free segments by size */
+};
+
+static inline unsigned int
+ip4s_popcount(uint16_t map)
 {
-	unsigned int i;
+#if HAVE___BUILTIN_POPCOUNT
+	return (__builtin_popcount(map));
+#else
+	unsigned int n;
+
+	for (n = 0; map != 0; map &= map - 1)
+		++n;
+	return (n);
+#endif
+}
+
+/*
+ * Return the index of a child which is known to be present.
+ */
+static inline uint32_t
+ip4s_kid(const ip4s_node *t, const struct ip4s_inode *n, unsigned int i)
+{
+
+	return (t->kids[n->kids + ip4s_popcount(n->map & ((1U << i) - 1))]);
+}
+
+/*
+ * Return the number of addresses covered by a node.
+ */
+static inline unsigned long
+ip4s_coverage(const ip4s_node *t, uint32_t ni)
+{
+	const struct ip4s_inode *n = &t->nodes[ni];
+
+	if (n->map != 0)
+		return (n->count);
+	return (n->full ? (0xffffffffLU >> n->plen) + 1LU : 0);
+}
+
+/*
+ * Grow one of the arrays in a tree.
+ */
+static int
+ip4s_grow(void *pp, uint32_t *max, size_t size, uint32_t min)
+{
+	void *p;
+	uint32_t nmax;
+
+	nmax = *max ? *max * 2 : min;
+	if (nmax <= *max || (p = realloc(*(void **)pp, nmax * size)) == NULL)
+		return (-1);
+	*(void **)pp = p;
+	*max = nmax;
+	return (0);
+}
+
+/*
+ * Allocate a leaf node.  Any pointers into the node array are invalid
+ * afterwards.
+ */
+static uint32_t
+ip4s_node_alloc(ip4s_node *t, uint32_t addr, unsigned int plen, int full)
+{
+	struct ip4s_inode *n;
+	uint32_t ni;
+
+	if ((ni = t->nfree) != IP4S_NONE) {
+		t->nfree = t->nodes[ni].kids;
+	} else {
+		if (t->nnodes == t->maxnodes && ip4s_grow(&t->nodes,
+		    &t->maxnodes, sizeof *t->nodes, 64) != 0)
+			return (IP4S_NONE);
+		ni = t->nnodes++;
+	}
+	n = &t->nodes[ni];
+	memset(n, 0, sizeof *n);
+	n->addr = addr;
+	n->plen = plen;
+	n->full = full;
+	n->kids = IP4S_NONE;
+	return (ni);
+}
+
+/*
+ * Return a node to the free list.
+ */
+static void
+ip4s_node_free(ip4s_node *t, uint32_t ni)
+{
+
+	t->nodes[ni].kids = t->nfree;
+	t->nfree = ni;
+}
+
+/*
+ * Allocate a child segment of the given size class.
+ */
+static uint32_t
+ip4s_kids_alloc(ip4s_node *t, unsigned int cls)
+{
+	uint32_t k;
+
+	if ((k = t->kfree[cls]) != IP4S_NONE) {
+		t->kfree[cls] = t->kids[k];
+		return (k);
+	}
+	while (t->nkids + (1U << cls) > t->maxkids)
+		if (ip4s_grow(&t->kids, &t->maxkids, sizeof *t->kids, 64) != 0)
+			return (IP4S_NONE);
+	k = t->nkids;
+	t->nkids += 1U << cls;
+	return (k);
+}
+
+/*
+ * Return a child segment to its free list.
+ */
+static void
+ip4s_kids_free(ip4s_node *t, uint32_t k, unsigned int cls)
+{
+
+	t->kids[k] = t->kfree[cls];
+	t->kfree[cls] = k;
+}
+
+/*
+ * Make room for one more child in a node's segment.
+ */
+static int
+ip4s_kids_reserve(ip4s_node *t, uint32_t ni)
+{
+	unsigned int n;
+	uint32_t k;
+
+	n = ip4s_popcount(t->nodes[ni].map);
+	if (n == 0) {
+		if ((k = ip4s_kids_alloc(t, 0)) == IP4S_NONE)
+			return (-1);
+		t->nodes[ni].kids = k;
+		t->nodes[ni].cls = 0;
+	} else if (n == 1U << t->nodes[ni].cls) {
+		if ((k = ip4s_kids_alloc(t, t->nodes[ni].cls + 1)) == IP4S_NONE)
+			return (-1);
+		memcpy(t->kids + k, t->kids + t->nodes[ni].kids,
+		    n * sizeof *t->kids);
+		ip4s_kids_free(t, t->nodes[ni].kids, t->nodes[ni].cls);
+		t->nodes[ni].kids = k;
+		t->nodes[ni].cls++;
+	}
+	return (0);
+}
+
+/*
+ * Add a leaf as the given child of a node and return its index.  The
+ * parent's count is not updated.
+ */
+static uint32_t
+ip4s_add(ip4s_node *t, uint32_t ni, unsigned int i, int full)
+{
+	struct ip4s_inode *n;
+	unsigned int cnt, pos, splen;
+	uint32_t ci;
+
+	splen = t->nodes[ni].plen + IP4S_BITS;
+	if (ip4s_kids_reserve(t, ni) != 0 ||
+	    (ci = ip4s_node_alloc(t, t->nodes[ni].addr | (i << (32 - splen)),
+	    splen, full)) == IP4S_NONE)
+		return (IP4S_NONE);
+	n = &t->nodes[ni];
+	pos = ip4s_popcount(n->map & ((1U << i) - 1));
+	cnt = ip4s_popcount(n->map);
+	memmove(t->kids + n->kids + pos + 1, t->kids + n->kids + pos,
+	    (cnt - pos) * sizeof *t->kids);
+	t->kids[n->kids + pos] = ci;
+	n->map |= 1U << i;
+	return (ci);
+}
 
-	if (n->leaf) {
+/*
+ * Delete all children of a node, leaving an empty leaf.
+ */
+static void
+ip4s_delete(ip4s_node *t, uint32_t ni)
+{
+	struct ip4s_inode *n = &t->nodes[ni];
+	unsigned int cnt, k;
+	uint32_t ci;
+
+	n->full = 0;
+	if (n->map == 0)
+		return;
+	cnt = ip4s_popcount(n->map);
+	for (k = 0; k < cnt; ++k) {
+		ci = t->kids[n->kids + k];
+		ip4s_delete(t, ci);
+		ip4s_node_free(t, ci);
+	}
+	ip4s_kids_free(t, n->kids, n->cls);
+	n->map = 0;
+	n->count = 0;
+}
+
+/*
+ * Bring a node up to date after its children have changed: recompute
+ * its count, drop empty children and aggregate it if it is full.
+ */
+static void
+ip4s_settle(ip4s_node *t, uint32_t ni)
+{
+	struct ip4s_inode *n = &t->nodes[ni];
+	unsigned long count, c;
+	unsigned int i, j, k;
+	uint32_t ci, *kids;
+	uint16_t map;
+
+	if (n->map == 0)
+		return;
+	kids = t->kids + n->kids;
+	count = 0;
+	map = 0;
+	for (i = j = k = 0; i < IP4S_SUBS; ++i) {
+		if (!(n->map & (1U << i)))
+			continue;
+		ci = kids[j++];
+		if ((c = ip4s_coverage(t, ci)) == 0) {
+			ip4s_node_free(t, ci);
+			continue;
+		}
+		kids[k++] = ci;
+		map |= 1U << i;
+		count += c;
+	}
+	n->map = map;
+	if (map == 0) {
+		ip4s_kids_free(t, n->kids, n->cls);
+		n->count = 0;
+	} else if (count == (0xffffffffLU >> n->plen) + 1LU) {
+		ip4s_delete(t, ni);
+		n->full = 1;
+	} else {
+		n->count = count;
+	}
+}
+
+/*
+ * Print the leaf nodes of a subtree in order.
+ */
+static void
+ip4s_fprint_node(FILE *f, const ip4s_node *t, uint32_t ni)
+{
+	const struct ip4s_inode *n = &t->nodes[ni];
+	unsigned int cnt, k;
+
+	if (n->map == 0) {
+		if (!n->full)
+			return;
 		fprintf(f, "%u.%u.%u.%u",
 		    (n->addr >> 24) & 0xff,
 		    (n->addr >> 16) & 0xff,
@@ -75,81 +366,80 @@ ip4s_fprint(FILE *f, const ip4s_node *n)
 			fprintf(f, "/%u", n->plen);
 		fprintf(f, "\n");
 	} else {
-		for (i = 0; i < IP4S_SUBS; ++i)
-			if (n->sub[i] != NULL)
-				ip4s_fprint(f, n->sub[i]);
+		cnt = ip4s_popcount(n->map);
+		for (k = 0; k < cnt; ++k)
+			ip4s_fprint_node(f, t, t->kids[n->kids + k]);
 	}
 }
 
 /*
- * Allocate a new, empty tree.
+ * Print the leaf nodes of a tree in order.
  */
-ip4s_node *
-ip4s_new(void)
+void
+ip4s_fprint(FILE *f, const ip4s_node *t)
 {
-	ip4s_node *n;
 
-	if ((n = calloc(1, sizeof(ip4s_node))) == NULL)
-		return (NULL);
-	n->leaf = 1;
-	return (n);
+	ip4s_fprint_node(f, t, 0);
 }
 
 /*
- * Delete all children of a node.
+ * Allocate a new, empty tree.
  */
-static void
-ip4s_delete(ip4s_node *n)
+ip4s_node *
+ip4s_new(void)
 {
-	unsigned int i;
+	ip4s_node *t;
+	unsigned int c;
 
-	for (i = 0; i < IP4S_SUBS; ++i) {
-		if (n->sub[i] != NULL) {
-			ip4s_delete(n->sub[i]);
-			free(n->sub[i]);
-			n->sub[i] = NULL;
-		}
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (NULL);
+	t->nfree = IP4S_NONE;
+	for (c = 0; c < IP4S_CLASSES; ++c)
+		t->kfree[c] = IP4S_NONE;
+	if (ip4s_node_alloc(t, 0, 0, 0) == IP4S_NONE) {
+		free(t);
+		return (NULL);
 	}
+	return (t);
 }
 
 /*
  * Destroy a tree.
  */
 void
-ip4s_destroy(ip4s_node *n)
+ip4s_destroy(ip4s_node *t)
 {
 
-	ip4s_delete(n);
-	free(n);
+	if (t == NULL)
+		return;
+	free(t->nodes);
+	free(t->kids);
+	free(t);
 }
 
 /*
- * Insert a range of addresses (specified as first and last) into a tree.
+ * Insert a range of addresses into a subtree.
  */
-int
-ip4s_insert(ip4s_node *n, uint32_t first, uint32_t last)
+static int
+ip4s_insert_node(ip4s_node *t, uint32_t ni, uint32_t first, uint32_t last)
 {
-	ip4s_node *sn;
-	uint32_t mask, fsub, lsub;
-	unsigned int i, splen;
+	struct ip4s_inode *n;
+	uint32_t ci, mask;
+	unsigned int i, fsub, lsub, splen;
 	int ret;
 
-	/*
-	 * Compute the host mask for this subnet.  This is the inverse of
-	 * the netmask.
-	 */
-	mask = 0xffffffffLU >> n->plen;
-
 	/*
 	 * Shortcut: already full!
 	 */
-	if (n->coverage == mask + 1LU)
+	n = &t->nodes[ni];
+	if (n->map == 0 && n->full)
 		return (0);
 
 	/*
-	 * Clip the range to our subnet so the caller doesn't have to (see
-	 * loop below).
+	 * Compute the host mask for this subnet and clip the range to it
+	 * so the caller doesn't have to (see loop below).
 	 */
+	mask = 0xffffffffLU >> n->plen;
 	if (first < n->addr)
 		first = n->addr;
 	if (last > (n->addr | mask))
@@ -159,9 +449,8 @@ ip4s_insert(ip4s_node *n, uint32_t first, uint32_t last)
 	 * Shortcut: the inserted range covers the entire subnet.
 	 */
 	if (first == n->addr && last == (n->addr | mask)) {
-		ip4s_delete(n);
-		n->leaf = 1;
-		n->coverage = mask + 1LU; /* equivalent to size of subnet */
+		ip4s_delete(t, ni);
+		n->full = 1;
 		return (0);
 	}
 
@@ -174,67 +463,55 @@ ip4s_insert(ip4s_node *n, uint32_t first, uint32_t last)
 	lsub = (last >> (32 - splen)) % IP4S_SUBS;
 
 	/*
-	 * Descend into each covered child.
+	 * Descend into each covered child, creating it if necessary, then
+	 * adjust our count and perform aggregation.
 	 */
-	for (i = fsub; i <= lsub; ++i) {
-		/*
-		 * Create a new node.
-		 */
-		if ((sn = n->sub[i]) == NULL) {
-			if ((sn = calloc(1, sizeof *sn)) == NULL)
-				return (-1);
-			sn->addr = n->addr | (i << (32 - splen));
-			sn->plen = splen;
-			sn->leaf = 1;
-			n->sub[i] = sn;
-			n->leaf = 0;
-		}
-		/*
-		 * Insert into subnet and adjust our coverage number.
-		 */
-		ret = ip4s_insert(sn, first, last);
-		n->coverage += sn->coverage;
-		if (ret != 0)
-			return (ret);
+	for (ret = 0, i = fsub; i <= lsub && ret == 0; ++i) {
+		n = &t->nodes[ni];
+		if (n->map & (1U << i))
+			ci = ip4s_kid(t, n, i);
+		else
+			ci = ip4s_add(t, ni, i, 0);
+		ret = ci == IP4S_NONE ? -1 :
+		    ip4s_insert_node(t, ci, first, last);
 	}
+	ip4s_settle(t, ni);
+	return (ret);
+}
 
-	/*
-	 * Perform aggregation
-	 */
-	if (n->coverage == mask + 1LU) {
-		ip4s_delete(n);
-		n->leaf = 1;
-	}
+/*
+ * Insert a range of addresses (specified as first and last) into a tree.
+ */
+int
+ip4s_insert(ip4s_node *t, uint32_t first, uint32_t last)
+{
 
-	return (0);
+	return (ip4s_insert_node(t, 0, first, last));
 }
 
 /*
- * Remove a range of addresses (specified as first and last) from a tree.
+ * Remove a range of addresses from a subtree.
  */
-int
-ip4s_remove(ip4s_node *n, uint32_t first, uint32_t last)
+static int
+ip4s_remove_node(ip4s_node *t, uint32_t ni, uint32_t first, uint32_t last)
 {
-	ip4s_node *sn;
-	uint32_t addr, fsub, lsub, mask, smask;
-	unsigned int i, splen;
+	struct ip4s_inode *n;
+	uint32_t addr, mask, smask;
+	unsigned int i, fsub, lsub, splen;
+	int ret;
 
 	/*
 	 * Shortcut: already empty!
 	 */
-	if (n->coverage == 0)
+	n = &t->nodes[ni];
+	if (n->map == 0 && !n->full)
 		return (0);
 
 	/*
-	 * Compute the host mask for this subnet.  This is the inverse of
-	 * the netmask.
+	 * Compute the host mask for this subnet and clip the range to it
+	 * so the caller doesn't have to (see loop below).
 	 */
 	mask = 0xffffffffLU >> n->plen;
-
-	/*
-	 * Clip the range to our subnet so the caller doesn't have to (see
-	 * loop below).
-	 */
 	if (first < n->addr)
 		first = n->addr;
 	if (last > (n->addr | mask))
@@ -245,9 +522,7 @@ ip4s_remove(ip4s_node *n, uint32_t first, uint32_t last)
 	 * to our parent (if any) to delete us.
 	 */
 	if (first == n->addr && last == (n->addr | mask)) {
-		ip4s_delete(n);
-		n->leaf = 1;
-		n->coverage = 0;
+		ip4s_delete(t, ni);
 		return (0);
 	}
 
@@ -264,71 +539,822 @@ ip4s_remove(ip4s_node *n, uint32_t first, uint32_t last)
 	 * If we are a full leaf, we have to create child nodes for the
 	 * subtrees we aren't removing.
 	 */
-	if (n->leaf && n->coverage == mask + 1LU) {
-		n->coverage = 0;
-		n->leaf = 0;
-		for (i = 0; i < IP4S_SUBS; ++i) {
-			addr = n->addr | (i << (32 - splen));
-			if (!(first <= addr && last >= (addr | smask))) {
-				if ((sn = calloc(1, sizeof *sn)) == NULL)
-					return (-1);
-				sn->addr = addr;
-				sn->plen = splen;
-				sn->leaf = 1;
-				sn->coverage = smask + 1LU;
-				n->sub[i] = sn;
-				n->coverage += sn->coverage;
-			}
+	ret = 0;
+	if (n->map == 0) {
+		n->full = 0;
+		for (i = 0; i < IP4S_SUBS && ret == 0; ++i) {
+			addr = t->nodes[ni].addr | (i << (32 - splen));
+			if (!(first <= addr && last >= (addr | smask)) &&
+			    ip4s_add(t, ni, i, 1) == IP4S_NONE)
+				ret = -1;
+		}
+	}
+
+	/*
+	 * Descend into covered children, then adjust our count and drop
+	 * the ones which are now empty.
+	 */
+	for (i = fsub; i <= lsub && ret == 0; ++i) {
+		n = &t->nodes[ni];
+		if (n->map & (1U << i))
+			ret = ip4s_remove_node(t, ip4s_kid(t, n, i),
+			    first, last);
+	}
+	ip4s_settle(t, ni);
+	return (ret);
+}
+
+/*
+ * Remove a range of addresses (specified as first and last) from a tree.
+ */
+int
+ip4s_remove(ip4s_node *t, uint32_t first, uint32_t last)
+{
+
+	return (ip4s_remove_node(t, 0, first, last));
+}
+
+/*
+ * Look up an address in a tree.
+ */
+int
+ip4s_lookup(const ip4s_node *t, uint32_t addr)
+{
+	const struct ip4s_inode *n;
+	unsigned int i;
+
+	for (n = &t->nodes[0]; n->map != 0; n = &t->nodes[ip4s_kid(t, n, i)]) {
+		i = (addr >> (32 - n->plen - IP4S_BITS)) % IP4S_SUBS;
+		if (!(n->map & (1U << i)))
+			return (0);
+	}
+	return (n->full);
+}
+
+/*
+ * Return the number of addresses in a tree.
+ */
+unsigned long
+ip4s_count(const ip4s_node *t)
+{
+
+	return (ip4s_coverage(t, 0));
+}
+
+/*
+ * Compare two ranges by their first address.
+ */
+static int
+ip4s_range_cmp(const void *a, const void *b)
+{
+	const ip4s_range *ra = a, *rb = b;
+
+	return (ra->first < rb->first ? -1 : ra->first > rb->first);
+}
+
+/*
+ * Sort an array of ranges and merge overlapping or adjacent ones, in
+ * place.  Returns the number of ranges left.
+ */
+size_t
+ip4s_range_merge(ip4s_range *r, size_t n)
+{
+	size_t i, j;
+
+	if (n == 0)
+		return (0);
+	qsort(r, n, sizeof *r, ip4s_range_cmp);
+	for (i = 0, j = 1; j < n; ++j) {
+		if (r[i].last == 0xffffffffU || r[j].first <= r[i].last + 1) {
+			if (r[j].last > r[i].last)
+				r[i].last = r[j].last;
+		} else {
+			r[++i] = r[j];
 		}
 	}
+	return (i + 1);
+}
+
+/*
+ * Read addresses, ranges and subnets from a file, separated by
+ * whitespace or newlines.  Comments start with # and run to the end of
+ * the line.  Returns an array of ranges, or NULL with errno set to
+ * EINVAL and *lineno set to the offending line if an entry could not be
+ * parsed.  An empty file results in an empty array, not NULL.
+ */
+ip4s_range *
+ip4s_range_read(FILE *f, size_t *np, int *lineno)
+{
+	ip4s_range *r, *tmp;
+	ip4_addr first, last;
+	ft_wordv wv = { NULL, 0, 0 };
+	const char *e;
+	char *buf, *p, *end;
+	size_t i, len, n, size;
+	int line, ret, serrno;
 
 	/*
-	 * Either completely remove or descend into covered children.
+	 * Large lists are common, so read the whole file at once and
+	 * split it in place rather than allocate each word separately.
 	 */
-	for (i = fsub; i <= lsub; ++i) {
-		if ((sn = n->sub[i]) != NULL) {
-			n->coverage -= sn->coverage;
-			ip4s_remove(sn, first, last);
-			n->coverage += sn->coverage;
-			if (sn->coverage == 0) {
-				free(sn);
-				n->sub[i] = NULL;
+	if ((buf = ft_readall(f, &len)) == NULL)
+		return (NULL);
+	n = 0;
+	size = 64;
+	if ((r = malloc(size * sizeof *r)) == NULL)
+		goto fail;
+	p = buf;
+	end = buf + len;
+	line = lineno != NULL ? *lineno : 0;
+	while ((ret = ft_splitline(&p, end, lineno, &wv)) > 0) {
+		for (i = 0; i < wv.nwords; ++i) {
+			e = ip4_parse_range(wv.words[i].str, &first, &last);
+			if (e == NULL || *e != '\0') {
+				if (lineno != NULL)
+					*lineno = line;
+				errno = EINVAL;
+				goto fail;
+			}
+			if (n == size) {
+				size *= 2;
+				if ((tmp = realloc(r, size * sizeof *r)) == NULL)
+					goto fail;
+				r = tmp;
 			}
+			r[n].first = be32toh(first.q);
+			r[n].last = be32toh(last.q);
+			n++;
 		}
+		line = lineno != NULL ? *lineno : 0;
 	}
+	if (ret < 0)
+		goto fail;
+	ft_wordv_free(&wv);
+	free(buf);
+	*np = n;
+	return (r);
+fail:
+	serrno = errno;
+	ft_wordv_free(&wv);
+	free(buf);
+	free(r);
+	errno = serrno;
+	return (NULL);
+}
 
+/*
+ * Build a subtree from a slice of sorted, disjoint ranges, all of which
+ * intersect the subnet.
+ */
+static int
+ip4s_build_node(ip4s_node *t, uint32_t ni, const ip4s_range *r, size_t n)
+{
+	uint32_t addr, ci, mask, sub, smask;
+	unsigned int i, splen;
+	size_t lo, hi;
+	int ret;
+
+	addr = t->nodes[ni].addr;
+	mask = 0xffffffffLU >> t->nodes[ni].plen;
+	if (n == 1 && r[0].first <= addr && r[0].last >= (addr | mask)) {
+		/* fully covered */
+		t->nodes[ni].full = 1;
+		return (0);
+	}
+	splen = t->nodes[ni].plen + IP4S_BITS;
+	smask = mask >> IP4S_BITS;
+	for (ret = 0, lo = 0, i = 0; i < IP4S_SUBS && ret == 0; ++i) {
+		sub = addr | (i << (32 - splen));
+		while (lo < n && r[lo].last < sub)
+			lo++;
+		for (hi = lo; hi < n && r[hi].first <= (sub | smask); ++hi)
+			/* nothing */ ;
+		if (hi == lo)
+			continue;
+		if ((ci = ip4s_add(t, ni, i, 0)) == IP4S_NONE)
+			ret = -1;
+		else
+			ret = ip4s_build_node(t, ci, r + lo, hi - lo);
+	}
+	ip4s_settle(t, ni);
+	return (ret);
+}
+
+/*
+ * Build a tree from an array of ranges in a single pass.  The array is
+ * sorted and merged in place first.
+ */
+ip4s_node *
+ip4s_build(ip4s_range *r, size_t n)
+{
+	ip4s_node *t;
+
+	n = ip4s_range_merge(r, n);
+	if ((t = ip4s_new()) == NULL)
+		return (NULL);
+	if (n > 0 && ip4s_build_node(t, 0, r, n) != 0) {
+		ip4s_destroy(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+/*
+ * Set operations.  Both trees have the same shape, since every node
+ * splits its subnet into the same IP4S_SUBS children, so the result can
+ * be built in a single simultaneous traversal, descending only where
+ * the outcome is not already decided by one side being empty or full.
+ * When a side is a full leaf, the leaf itself stands in for each of its
+ * (nonexistent) children.
+ */
+enum ip4s_op { ip4s_op_union, ip4s_op_intersect, ip4s_op_difference };
+
+static inline int
+ip4s_is_full(const ip4s_node *t, uint32_t ni)
+{
+
+	return (ni != IP4S_NONE && t->nodes[ni].map == 0 && t->nodes[ni].full);
+}
+
+static inline int
+ip4s_is_empty(const ip4s_node *t, uint32_t ni)
+{
+
+	return (ni == IP4S_NONE || ip4s_coverage(t, ni) == 0);
+}
+
+static inline uint32_t
+ip4s_child(const ip4s_node *t, uint32_t ni, unsigned int i)
+{
+	const struct ip4s_inode *n;
+
+	if (ni == IP4S_NONE)
+		return (IP4S_NONE);
+	n = &t->nodes[ni];
+	if (n->map == 0)
+		return (n->full ? ni : IP4S_NONE);
+	if (!(n->map & (1U << i)))
+		return (IP4S_NONE);
+	return (ip4s_kid(t, n, i));
+}
+
+/*
+ * Copy a subtree into a node of another tree which covers the same
+ * subnet or, if the source is a full leaf, part of it.
+ */
+static int
+ip4s_copy_node(ip4s_node *res, uint32_t ri, const ip4s_node *t, uint32_t ni)
+{
+	const struct ip4s_inode *n = &t->nodes[ni];
+	unsigned int i;
+	uint32_t ci;
+
+	if (n->map == 0) {
+		res->nodes[ri].full = n->full;
+		return (0);
+	}
+	for (i = 0; i < IP4S_SUBS; ++i) {
+		if (!(n->map & (1U << i)))
+			continue;
+		if ((ci = ip4s_add(res, ri, i, 0)) == IP4S_NONE ||
+		    ip4s_copy_node(res, ci, t, ip4s_kid(t, n, i)) != 0)
+			return (-1);
+	}
+	res->nodes[ri].count = n->count;
 	return (0);
 }
 
 /*
- * Look up an address in a tree.
+ * Combine the parts of two trees which cover a node's subnet into that
+ * node.  The node is left empty if the result is, and it is up to the
+ * caller to delete it.
+ */
+static int
+ip4s_combine(enum ip4s_op op, ip4s_node *res, uint32_t ri,
+    const ip4s_node *ta, uint32_t a, const ip4s_node *tb, uint32_t b)
+{
+	const ip4s_node *tc;
+	uint32_t ca, cb, ci, copy;
+	unsigned int i;
+
+	copy = IP4S_NONE;
+	tc = NULL;
+	switch (op) {
+	case ip4s_op_union:
+		if (ip4s_is_full(ta, a) || ip4s_is_full(tb, b)) {
+			res->nodes[ri].full = 1;
+			return (0);
+		} else if (ip4s_is_empty(ta, a) && ip4s_is_empty(tb, b)) {
+			return (0);
+		} else if (ip4s_is_empty(ta, a)) {
+			tc = tb, copy = b;
+		} else if (ip4s_is_empty(tb, b)) {
+			tc = ta, copy = a;
+		}
+		break;
+	case ip4s_op_intersect:
+		if (ip4s_is_empty(ta, a) || ip4s_is_empty(tb, b))
+			return (0);
+		else if (ip4s_is_full(ta, a))
+			tc = tb, copy = b;
+		else if (ip4s_is_full(tb, b))
+			tc = ta, copy = a;
+		break;
+	case ip4s_op_difference:
+		if (ip4s_is_empty(ta, a) || ip4s_is_full(tb, b))
+			return (0);
+		else if (ip4s_is_empty(tb, b))
+			tc = ta, copy = a;
+		break;
+	}
+	if (copy != IP4S_NONE)
+		return (ip4s_copy_node(res, ri, tc, copy));
+	/* neither side is empty or full, so neither is a leaf */
+	for (i = 0; i < IP4S_SUBS; ++i) {
+		ca = ip4s_child(ta, a, i);
+		cb = ip4s_child(tb, b, i);
+		if (ca == IP4S_NONE && (cb == IP4S_NONE || op != ip4s_op_union))
+			continue;
+		if ((ci = ip4s_add(res, ri, i, 0)) == IP4S_NONE ||
+		    ip4s_combine(op, res, ci, ta, ca, tb, cb) != 0)
+			return (-1);
+	}
+	ip4s_settle(res, ri);
+	return (0);
+}
+
+static ip4s_node *
+ip4s_op(enum ip4s_op op, const ip4s_node *a, const ip4s_node *b)
+{
+	ip4s_node *t;
+
+	if ((t = ip4s_new()) == NULL)
+		return (NULL);
+	if (ip4s_combine(op, t, 0, a, 0, b, 0) != 0) {
+		ip4s_destroy(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+/*
+ * Return a new tree containing every address in either tree.
+ */
+ip4s_node *
+ip4s_union(const ip4s_node *a, const ip4s_node *b)
+{
+
+	return (ip4s_op(ip4s_op_union, a, b));
+}
+
+/*
+ * Return a new tree containing every address in both trees.
+ */
+ip4s_node *
+ip4s_intersect(const ip4s_node *a, const ip4s_node *b)
+{
+
+	return (ip4s_op(ip4s_op_intersect, a, b));
+}
+
+/*
+ * Return a new tree containing every address in the first tree but not
+ * in the second.
+ */
+ip4s_node *
+ip4s_difference(const ip4s_node *a, const ip4s_node *b)
+{
+
+	return (ip4s_op(ip4s_op_difference, a, b));
+}
+
+/*
+ * Replace the contents of a tree with those of another, which is then
+ * freed.
+ */
+static void
+ip4s_replace(ip4s_node *t, ip4s_node *nt)
+{
+
+	free(t->nodes);
+	free(t->kids);
+	*t = *nt;
+	free(nt);
+}
+
+/*
+ * Build a tree from an array of sorted, disjoint ranges, combine it with
+ * an existing tree, and replace the existing tree with the result.
+ */
+static int
+ip4s_combinev(enum ip4s_op op, ip4s_node *n, ip4s_range *r, size_t cnt)
+{
+	ip4s_node *rn, *nn;
+
+	if ((rn = ip4s_build(r, cnt)) == NULL)
+		return (-1);
+	nn = ip4s_op(op, n, rn);
+	ip4s_destroy(rn);
+	if (nn == NULL)
+		return (-1);
+	ip4s_replace(n, nn);
+	return (0);
+}
+
+/*
+ * Insert an array of ranges into a tree.  The array is sorted and
+ * merged in place first.  If the tree is empty, it is built from
+ * scratch in a single pass.
  */
 int
-ip4s_lookup(const ip4s_node *n, uint32_t addr)
+ip4s_insertv(ip4s_node *n, ip4s_range *r, size_t cnt)
 {
-	uint32_t mask, sub;
+	ip4s_node *nn;
+	size_t i;
 
-	mask = 0xffffffffLU >> n->plen;
+	cnt = ip4s_range_merge(r, cnt);
+	if (ip4s_count(n) == 0) {
+		if ((nn = ip4s_build(r, cnt)) == NULL)
+			return (-1);
+		ip4s_replace(n, nn);
+		return (0);
+	}
+	if (cnt >= IP4S_BULK_MIN)
+		return (ip4s_combinev(ip4s_op_union, n, r, cnt));
+	for (i = 0; i < cnt; ++i)
+		if (ip4s_insert(n, r[i].first, r[i].last) != 0)
+			return (-1);
+	return (0);
+}
 
-	/* within our subtree? */
-	if (addr >= n->addr && addr <= (n->addr | mask)) {
-		/* fully covered? */
-		if (n->coverage == mask + 1LU)
+/*
+ * Remove an array of ranges from a tree.  The array is sorted and
+ * merged in place first.  If the tree is full, its complement is built
+ * from scratch in a single pass.
+ */
+int
+ip4s_removev(ip4s_node *n, ip4s_range *r, size_t cnt)
+{
+	ip4s_range *c;
+	ip4s_node *nn;
+	uint32_t next;
+	size_t i, j;
+
+	cnt = ip4s_range_merge(r, cnt);
+	if (ip4s_count(n) == 1LU << 32) {
+		if ((c = malloc((cnt + 1) * sizeof *c)) == NULL)
+			return (-1);
+		for (next = 0, i = j = 0; i < cnt; ++i) {
+			if (r[i].first > next) {
+				c[j].first = next;
+				c[j++].last = r[i].first - 1;
+			}
+			next = r[i].last + 1;
+			if (next == 0)
+				break;
+		}
+		if (i == cnt && (cnt == 0 || next != 0)) {
+			c[j].first = next;
+			c[j++].last = 0xffffffffU;
+		}
+		nn = ip4s_build(c, j);
+		free(c);
+		if (nn == NULL)
+			return (-1);
+		ip4s_replace(n, nn);
+		return (0);
+	}
+	if (cnt >= IP4S_BULK_MIN)
+		return (ip4s_combinev(ip4s_op_difference, n, r, cnt));
+	for (i = 0; i < cnt; ++i)
+		if (ip4s_remove(n, r[i].first, r[i].last) != 0)
+			return (-1);
+	return (0);
+}
+
+/*
+ * Prepare to iterate over the ranges in a tree.  The tree must not be
+ * modified until the iteration is complete.
+ */
+void
+ip4s_iter_init(ip4s_iter *it, const ip4s_node *t)
+{
+
+	it->tree = t;
+	it->depth = 0;
+	it->node[0] = 0;
+	it->sub[0] = 0;
+	it->pending = 0;
+}
+
+/*
+ * Find the next non-empty leaf, without recursion.
+ */
+static int
+ip4s_iter_leaf(ip4s_iter *it, ip4s_range *r)
+{
+	const ip4s_node *t = it->tree;
+	const struct ip4s_inode *n;
+
+	while (it->depth >= 0) {
+		n = &t->nodes[it->node[it->depth]];
+		if (n->map == 0) {
+			it->depth--;
+			if (!n->full)
+				continue;
+			r->first = n->addr;
+			r->last = n->addr | (0xffffffffLU >> n->plen);
 			return (1);
-		/* descend */
-		sub = (addr >> (32 - n->plen - IP4S_BITS)) % IP4S_SUBS;
-		if (n->sub[sub] != NULL)
-			return (ip4s_lookup(n->sub[sub], addr));
+		}
+		if (it->sub[it->depth] == ip4s_popcount(n->map)) {
+			it->depth--;
+			continue;
+		}
+		it->node[it->depth + 1] =
+		    t->kids[n->kids + it->sub[it->depth]++];
+		it->sub[++it->depth] = 0;
 	}
 	return (0);
 }
 
 /*
- * Return the number of addresses in a tree.
+ * Retrieve the next range from a tree.  Adjacent leaves are merged, so
+ * the ranges come out sorted, disjoint and non-adjacent.  Returns 1 if
+ * a range was stored in r and 0 if there are no more.
+ */
+int
+ip4s_iter_next(ip4s_iter *it, ip4s_range *r)
+{
+	ip4s_range next;
+
+	if (!it->pending && !ip4s_iter_leaf(it, &it->next))
+		return (0);
+	*r = it->next;
+	it->pending = 0;
+	while (r->last != 0xffffffffU && ip4s_iter_leaf(it, &next)) {
+		if (next.first != r->last + 1) {
+			it->next = next;
+			it->pending = 1;
+			break;
+		}
+		r->last = next.last;
+	}
+	return (1);
+}
+
+/*
+ * A frozen set is a read-only copy of a tree in DIR-16-8-8 form.  The
+ * first level is indexed by the top 16 bits of the address, the second
+ * by the next 8 bits, and the third is a 256-bit bitmap indexed by the
+ * last 8 bits.  Entries in the first two levels are either IP4F_NONE,
+ * IP4F_FULL, or the index of a chunk in the next level plus IP4F_BASE.
+ * Any lookup costs at most three memory accesses, and most only one.
+ */
+#define IP4F_NONE	 0
+#define IP4F_FULL	 1
+#define IP4F_BASE	 2
+
+struct ip4s_frozen {
+	uint32_t	 l1[1U << 16];
+	uint32_t	*l2;		/* 256-entry chunks */
+	uint32_t	 nl2, maxl2;
+	uint32_t	*l3;		/* 256-bit chunks */
+	uint32_t	 nl3, maxl3;
+	unsigned long	 count;
+};
+
+/*
+ * Allocate a zeroed chunk of the given size (in words) from a level.
+ */
+static uint32_t
+ip4s_freeze_chunk(uint32_t **level, uint32_t *n, uint32_t *max,
+    unsigned int size)
+{
+	uint32_t *p;
+	uint32_t nmax;
+
+	if (*n == *max) {
+		nmax = *max ? *max * 2 : 16;
+		if ((p = realloc(*level, (size_t)nmax * size * sizeof *p)) == NULL)
+			return (IP4F_NONE);
+		*level = p;
+		*max = nmax;
+	}
+	memset(*level + (size_t)*n * size, 0, size * sizeof **level);
+	return ((*n)++ + IP4F_BASE);
+}
+
+/*
+ * Add a fully covered subnet to a frozen set.
+ */
+static int
+ip4s_freeze_subnet(ip4s_frozen *f, uint32_t first, unsigned int plen)
+{
+	uint32_t last, i, v, *e;
+
+	last = first | (0xffffffffLU >> plen);
+	if (plen <= 16) {
+		for (i = first >> 16; i <= last >> 16; ++i)
+			f->l1[i] = IP4F_FULL;
+		return (0);
+	}
+	e = &f->l1[first >> 16];
+	if (*e == IP4F_NONE) {
+		v = ip4s_freeze_chunk(&f->l2, &f->nl2, &f->maxl2, 256);
+		if (v == IP4F_NONE)
+			return (-1);
+		*e = v;
+	}
+	e = f->l2 + (size_t)(*e - IP4F_BASE) * 256;
+	if (plen <= 24) {
+		for (i = (first >> 8) & 0xff; i <= ((last >> 8) & 0xff); ++i)
+			e[i] = IP4F_FULL;
+		return (0);
+	}
+	e += (first >> 8) & 0xff;
+	if (*e == IP4F_NONE) {
+		/* careful, e points into l2, which does not move here */
+		v = ip4s_freeze_chunk(&f->l3, &f->nl3, &f->maxl3, 8);
+		if (v == IP4F_NONE)
+			return (-1);
+		*e = v;
+	}
+	e = f->l3 + (size_t)(*e - IP4F_BASE) * 8;
+	for (i = first & 0xff; i <= (last & 0xff); ++i)
+		e[i / 32] |= 1U << (i % 32);
+	return (0);
+}
+
+static int
+ip4s_freeze_node(ip4s_frozen *f, const ip4s_node *t, uint32_t ni)
+{
+	const struct ip4s_inode *n = &t->nodes[ni];
+	unsigned int cnt, k;
+
+	if (n->map == 0)
+		return (n->full ? ip4s_freeze_subnet(f, n->addr, n->plen) : 0);
+	cnt = ip4s_popcount(n->map);
+	for (k = 0; k < cnt; ++k)
+		if (ip4s_freeze_node(f, t, t->kids[n->kids + k]) != 0)
+			return (-1);
+	return (0);
+}
+
+/*
+ * Create a frozen copy of a tree.  The tree is not modified and can be
+ * destroyed afterwards.
+ */
+ip4s_frozen *
+ip4s_freeze(const ip4s_node *t)
+{
+	ip4s_frozen *f;
+
+	if ((f = calloc(1, sizeof *f)) == NULL)
+		return (NULL);
+	if (ip4s_freeze_node(f, t, 0) != 0) {
+		ip4s_frozen_destroy(f);
+		return (NULL);
+	}
+	f->count = ip4s_count(t);
+	return (f);
+}
+
+/*
+ * Destroy a frozen set.
+ */
+void
+ip4s_frozen_destroy(ip4s_frozen *f)
+{
+
+	if (f == NULL)
+		return;
+	free(f->l2);
+	free(f->l3);
+	free(f);
+}
+
+/*
+ * Finish a lookup given the first-level entry for the address.
+ */
+static inline int
+ip4s_frozen_resolve(const ip4s_frozen *f, uint32_t v, uint32_t addr)
+{
+
+	if (v < IP4F_BASE)
+		return (v);
+	v = f->l2[(size_t)(v - IP4F_BASE) * 256 + ((addr >> 8) & 0xff)];
+	if (v < IP4F_BASE)
+		return (v);
+	return ((f->l3[(size_t)(v - IP4F_BASE) * 8 + ((addr >> 5) & 7)] >>
+	    (addr & 31)) & 1);
+}
+
+/*
+ * Look up an address in a frozen set.
+ */
+int
+ip4s_frozen_lookup(const ip4s_frozen *f, uint32_t addr)
+{
+
+	return (ip4s_frozen_resolve(f, f->l1[addr >> 16], addr));
+}
+
+/*
+ * Look up a batch of addresses in a frozen set, storing the result for
+ * each in the corresponding element of res.  All first-level entries
+ * in a chunk of the batch are loaded before any of them are resolved,
+ * so the loads can overlap.  Returns the number of addresses found.
+ */
+size_t
+ip4s_frozen_lookupv(const ip4s_frozen *f, const uint32_t *addrs,
+    uint8_t *res, size_t n)
+{
+	uint32_t v[64];
+	size_t i, j, m, hits;
+
+	for (hits = i = 0; i < n; i += m) {
+		m = n - i < 64 ? n - i : 64;
+		for (j = 0; j < m; ++j)
+			v[j] = f->l1[addrs[i + j] >> 16];
+		for (j = 0; j < m; ++j)
+			hits += res[i + j] =
+			    ip4s_frozen_resolve(f, v[j], addrs[i + j]);
+	}
+	return (hits);
+}
+
+/*
+ * Return the number of addresses in a frozen set.
  */
 unsigned long
-ip4s_count(const ip4s_node *n)
+ip4s_frozen_count(const ip4s_frozen *f)
+{
+
+	return (f->count);
+}
+
+/*
+ * State for turning a frozen set back into ranges.
+ */
+struct ip4s_frozen_walk {
+	ip4s_range	*r;
+	size_t		 n, max;
+	uint32_t	 first, last;
+	int		 open;
+};
+
+static void
+ip4s_frozen_span(struct ip4s_frozen_walk *w, uint32_t first, uint32_t last,
+    int in)
 {
 
-	return (n->coverage);
+	if (in) {
+		if (!w->open)
+			w->first = first;
+		w->last = last;
+		w->open = 1;
+	} else if (w->open) {
+		if (w->n < w->max) {
+			w->r[w->n].first = w->first;
+			w->r[w->n].last = w->last;
+		}
+		w->n++;
+		w->open = 0;
+	}
+}
+
+/*
+ * Store the contents of a frozen set as sorted, disjoint, non-adjacent
+ * ranges in r, which has room for max of them.  Returns the number of
+ * ranges in the set, which may be more than max, in which case only
+ * the first max are stored.
+ */
+size_t
+ip4s_frozen_ranges(const ip4s_frozen *f, ip4s_range *r, size_t max)
+{
+	struct ip4s_frozen_walk w = { r, 0, max, 0, 0, 0 };
+	const uint32_t *l2, *l3;
+	uint32_t a, b, i, j, k;
+
+	for (i = 0; i < 1U << 16; ++i) {
+		a = i << 16;
+		if (f->l1[i] < IP4F_BASE) {
+			ip4s_frozen_span(&w, a, a | 0xffff, f->l1[i]);
+			continue;
+		}
+		l2 = f->l2 + (size_t)(f->l1[i] - IP4F_BASE) * 256;
+		for (j = 0; j < 256; ++j) {
+			b = a | j << 8;
+			if (l2[j] < IP4F_BASE) {
+				ip4s_frozen_span(&w, b, b | 0xff, l2[j]);
+				continue;
+			}
+			l3 = f->l3 + (size_t)(l2[j] - IP4F_BASE) * 8;
+			for (k = 0; k < 256; ++k)
+				ip4s_frozen_span(&w, b | k, b | k,
+				    (l3[k / 32] >> (k % 32)) & 1);
+		}
+	}
+	ip4s_frozen_span(&w, 0, 0, 0);
+	return (w.n);
 }
@@ -0,0 +1,170 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ip4.h>
+#include <ft/ipfix.h>
+#include <ft/logrec.h>
+
+/*
+ * Information elements in our template, in record order.  The flags
+ * of a log record go into tcpControlBits or icmpTypeCodeIPv4 depending
+ * on the protocol, and the other one is zero.
+ */
+static const uint16_t ft_ipfix_fields[][2] = {
+	{ 152, 8 },		/* flowStartMilliseconds */
+	{   8, 4 },		/* sourceIPv4Address */
+	{   7, 2 },		/* sourceTransportPort */
+	{  12, 4 },		/* destinationIPv4Address */
+	{  11, 2 },		/* destinationTransportPort */
+	{   4, 1 },		/* protocolIdentifier */
+	{   6, 2 },		/* tcpControlBits */
+	{  32, 2 },		/* icmpTypeCodeIPv4 */
+	{ 401, 8 },		/* transportOctetDeltaCount */
+};
+#define FT_IPFIX_NFIELDS (sizeof ft_ipfix_fields / sizeof *ft_ipfix_fields)
+
+/*
+ * Set up an encoder which builds messages in the given buffer, which
+ * must be at least FT_IPFIX_MINSIZE bytes long and should not exceed
+ * the path MTU.
+ */
+void
+ft_ipfix_init(ft_ipfix *fx, void *buf, size_t size, uint32_t domain)
+{
+
+	memset(fx, 0, sizeof *fx);
+	fx->buf = buf;
+	fx->size = size > 65535 ? 65535 : size;
+	fx->len = FT_IPFIX_HDRSIZE;
+	fx->domain = domain;
+}
+
+/*
+ * Close the data set in progress, if any.
+ */
+static void
+ft_ipfix_close_set(ft_ipfix *fx)
+{
+
+	if (fx->set == 0)
+		return;
+	be16enc(fx->buf + fx->set + 2, fx->len - fx->set);
+	fx->set = 0;
+}
+
+/*
+ * Append our template to the current message.  Returns -1 if there is
+ * no room for it.
+ */
+int
+ft_ipfix_template(ft_ipfix *fx)
+{
+	uint8_t *p;
+	unsigned int i;
+
+	if (fx->len + FT_IPFIX_TMPLSIZE > fx->size)
+		return (-1);
+	ft_ipfix_close_set(fx);
+	p = fx->buf + fx->len;
+	be16enc(p, 2);		/* template set */
+	be16enc(p + 2, FT_IPFIX_TMPLSIZE);
+	be16enc(p + 4, FT_IPFIX_TEMPLATE);
+	be16enc(p + 6, FT_IPFIX_NFIELDS);
+	for (p += 8, i = 0; i < FT_IPFIX_NFIELDS; ++i, p += 4) {
+		be16enc(p, ft_ipfix_fields[i][0]);
+		be16enc(p + 2, ft_ipfix_fields[i][1]);
+	}
+	fx->len += FT_IPFIX_TMPLSIZE;
+	return (0);
+}
+
+/*
+ * Append a log record to the current message, starting a data set if
+ * necessary.  Returns -1 if there is no room for it.
+ */
+int
+ft_ipfix_record(ft_ipfix *fx, const ft_logrec *lr)
+{
+	uint8_t *p;
+	size_t need;
+
+	need = FT_IPFIX_RECSIZE + (fx->set == 0 ? FT_IPFIX_SETSIZE : 0);
+	if (fx->len + need > fx->size)
+		return (-1);
+	if (fx->set == 0) {
+		fx->set = fx->len;
+		be16enc(fx->buf + fx->set, FT_IPFIX_TEMPLATE);
+		fx->len += FT_IPFIX_SETSIZE;
+	}
+	p = fx->buf + fx->len;
+	be64enc(p, lr->sec * 1000 + lr->usec / 1000);
+	memcpy(p + 8, &lr->sa, sizeof lr->sa);
+	be16enc(p + 12, lr->sp);
+	memcpy(p + 14, &lr->da, sizeof lr->da);
+	be16enc(p + 18, lr->dp);
+	p[20] = lr->proto;
+	be16enc(p + 21, lr->proto == ip_proto_tcp ? lr->flags : 0);
+	be16enc(p + 23, lr->proto == ip_proto_icmp ? lr->flags : 0);
+	be64enc(p + 25, lr->len);
+	fx->len += FT_IPFIX_RECSIZE;
+	fx->nrecs++;
+	return (0);
+}
+
+/*
+ * Finish the current message and start a new one.  Returns the length
+ * of the finished message, which is ready to send, or 0 if it was
+ * empty.
+ */
+size_t
+ft_ipfix_finish(ft_ipfix *fx, uint32_t now)
+{
+	size_t len;
+
+	if ((len = fx->len) == FT_IPFIX_HDRSIZE)
+		return (0);
+	ft_ipfix_close_set(fx);
+	be16enc(fx->buf, FT_IPFIX_VERSION);
+	be16enc(fx->buf + 2, len);
+	be32enc(fx->buf + 4, now);
+	be32enc(fx->buf + 8, fx->seq);
+	be32enc(fx->buf + 12, fx->domain);
+	fx->seq += fx->nrecs;
+	fx->nrecs = 0;
+	fx->len = FT_IPFIX_HDRSIZE;
+	return (len);
+}
@@ -37,15 +37,57 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #define FT_LOGV_REQUIRED
 #include <ft/log.h>
 #include <ft/strutil.h>
 
+/*
+ * Messages are formatted into a buffer and written out in one go,
+ * either to stderr or to syslog.  The syslog path is not buffered any
+ * further: syslog(3) takes exactly one message per call, so messages
+ * cannot be batched without merging them into a single record, and the
+ * rate limit already bounds how many calls a flood can cause.
+ *
+ * Each call site may log at most ft_log_ratelimit messages per second;
+ * the rest are counted, and once the second is over, a single line
+ * reports how many were suppressed.  Sites which have suppressed
+ * messages are kept on a list, so ft_log_flush() can report them even
+ * if they never log anything again.  Debug messages are never held
+ * back.
+ */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define FT_LOG_CLOCK	CLOCK_MONOTONIC_COARSE
+#else
+#define FT_LOG_CLOCK	CLOCK_MONOTONIC
+#endif
+
+#define FT_LOG_MSGMAX	1024
+
 static char ft_prog_name[16];
+static int ft_log_syslog;
+static ft_log_site *ft_log_sites;
 ft_log_level_t ft_log_level;
+unsigned int ft_log_ratelimit = 10;
+
+static const struct {
+	const char	*name;
+	int		 facility;
+} ft_log_facilities[] = {
+	{ "daemon",	LOG_DAEMON },
+	{ "local0",	LOG_LOCAL0 },
+	{ "local1",	LOG_LOCAL1 },
+	{ "local2",	LOG_LOCAL2 },
+	{ "local3",	LOG_LOCAL3 },
+	{ "local4",	LOG_LOCAL4 },
+	{ "local5",	LOG_LOCAL5 },
+	{ "local6",	LOG_LOCAL6 },
+	{ "local7",	LOG_LOCAL7 },
+	{ "user",	LOG_USER },
+	{ NULL,		0 }
+};
 
-#if 0
 static int
 ft_log_level_to_syslog(ft_log_level_t level)
 {
@@ -65,7 +107,6 @@ ft_log_level_to_syslog(ft_log_level_t level)
 		return (LOG_INFO);
 	}
 }
-#endif
 
 static const char *
 ft_log_level_to_string(ft_log_level_t level)
@@ -90,11 +131,23 @@ ft_log_level_to_string(ft_log_level_t level)
 void
 ft_logv(ft_log_level_t level, const char *fmt, va_list ap)
 {
+	char msg[FT_LOG_MSGMAX];
+	int len, n;
 
-	fprintf(stderr, "%s: %s: ", ft_prog_name,
+	if (ft_log_syslog) {
+		vsnprintf(msg, sizeof msg, fmt, ap);
+		syslog(ft_log_level_to_syslog(level), "%s", msg);
+		return;
+	}
+	len = snprintf(msg, sizeof msg, "%s: %s: ", ft_prog_name,
 	    ft_log_level_to_string(level));
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
+	if ((n = vsnprintf(msg + len, sizeof msg - len, fmt, ap)) < 0)
+		n = 0;
+	len += n;
+	if (len > (int)sizeof msg - 2)
+		len = sizeof msg - 2;
+	msg[len++] = '\n';
+	fwrite(msg, 1, len, stderr);
 }
 
 /*
@@ -115,6 +168,104 @@ ft_log(ft_log_level_t level, const char *fmt, ...)
 	errno = serrno;
 }
 
+static unsigned int
+ft_log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(FT_LOG_CLOCK, &ts);
+	return (ts.tv_sec);
+}
+
+/*
+ * Report the messages a site has suppressed, if any.
+ */
+static void
+ft_log_summary(ft_log_site *site)
+{
+	const char *file;
+	unsigned int n;
+
+	if ((n = __atomic_exchange_n(&site->suppressed, 0,
+	    __ATOMIC_RELAXED)) == 0)
+		return;
+	if ((file = strrchr(site->file, '/')) != NULL)
+		file++;
+	else
+		file = site->file;
+	ft_log(site->level, "%s:%u: %u similar message%s suppressed",
+	    file, site->line, n, n == 1 ? "" : "s");
+}
+
+/*
+ * Log a message from a call site, unless that site has already used up
+ * its allowance for the current second.
+ */
+void
+ft_log_at(ft_log_site *site, ft_log_level_t level, const char *fmt, ...)
+{
+	unsigned int now, window;
+	va_list ap;
+	int serrno;
+
+	serrno = errno;
+	if (ft_log_ratelimit > 0 && level > FT_LOG_LEVEL_DEBUG) {
+		now = ft_log_now();
+		window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+		if (window != now && __atomic_compare_exchange_n(&site->window,
+		    &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			/* new second, start over */
+			__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+			ft_log_summary(site);
+		}
+		if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) >
+		    ft_log_ratelimit) {
+			__atomic_add_fetch(&site->suppressed, 1,
+			    __ATOMIC_RELAXED);
+			if (!__atomic_exchange_n(&site->listed, 1,
+			    __ATOMIC_RELAXED)) {
+				site->next = __atomic_load_n(&ft_log_sites,
+				    __ATOMIC_RELAXED);
+				while (!__atomic_compare_exchange_n(
+				    &ft_log_sites, &site->next, site, 1,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+					/* nothing */ ;
+			}
+			errno = serrno;
+			return;
+		}
+	}
+	va_start(ap, fmt);
+	ft_logv(level, fmt, ap);
+	va_end(ap);
+	errno = serrno;
+}
+
+static void
+ft_log_report(int all)
+{
+	ft_log_site *site;
+	unsigned int now;
+
+	now = ft_log_now();
+	for (site = __atomic_load_n(&ft_log_sites, __ATOMIC_ACQUIRE);
+	    site != NULL; site = site->next)
+		if (all ||
+		    __atomic_load_n(&site->window, __ATOMIC_RELAXED) != now)
+			ft_log_summary(site);
+}
+
+/*
+ * Report suppressed messages from sites whose second is over.  Should
+ * be called periodically.
+ */
+void
+ft_log_flush(void)
+{
+
+	ft_log_report(0);
+}
+
 void
 ft_fatal(const char *fmt, ...)
 {
@@ -127,15 +278,39 @@ ft_fatal(const char *fmt, ...)
 }
 
 /*
- * Specify a destination for log messages.  Passing NULL or an empty
- * string resets the log destination to stderr.
+ * Specify a destination for log messages: "syslog" or "syslog:facility"
+ * for syslog, with the daemon facility by default.  Passing NULL or an
+ * empty string resets the log destination to stderr.
  */
 int
 ft_log_init(const char *ident, const char *logspec)
 {
+	const char *name;
+	unsigned int k;
 
 	strlcpy(ft_prog_name, ident, sizeof ft_prog_name);
-	(void)logspec;
+	if (ft_log_syslog) {
+		closelog();
+		ft_log_syslog = 0;
+	}
+	if (logspec == NULL || *logspec == '\0')
+		return (0);
+	if (strncmp(logspec, "syslog", 6) != 0 ||
+	    (logspec[6] != '\0' && logspec[6] != ':')) {
+		errno = EINVAL;
+		return (-1);
+	}
+	name = logspec[6] == ':' ? logspec + 7 : "daemon";
+	for (k = 0; ft_log_facilities[k].name != NULL; ++k)
+		if (strcmp(ft_log_facilities[k].name, name) == 0)
+			break;
+	if (ft_log_facilities[k].name == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	openlog(ft_prog_name, LOG_NDELAY | LOG_PID,
+	    ft_log_facilities[k].facility);
+	ft_log_syslog = 1;
 	return (0);
 }
 
@@ -146,5 +321,10 @@ int
 ft_log_exit(void)
 {
 
+	ft_log_report(1);
+	if (ft_log_syslog) {
+		closelog();
+		ft_log_syslog = 0;
+	}
 	return (0);
 }
@@ -0,0 +1,464 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ip4.h>
+#include <ft/logrec.h>
+
+/*
+ * Record layout:
+ *
+ *  0 magic  1 version  2 protocol  3 reserved
+ *  4 microseconds
+ *  8 seconds (64 bits)
+ * 16 source address
+ * 20 destination address
+ * 24 source port  26 destination port
+ * 28 flags  30 length
+ */
+
+/*
+ * Encode a log record into a buffer of FT_LOGREC_SIZE bytes.
+ */
+void
+ft_logrec_enc(void *buf, const ft_logrec *lr)
+{
+	uint8_t *p = buf;
+
+	p[0] = FT_LOGREC_MAGIC;
+	p[1] = FT_LOGREC_VERSION;
+	p[2] = lr->proto;
+	p[3] = 0;
+	be32enc(p + 4, lr->usec);
+	be64enc(p + 8, lr->sec);
+	memcpy(p + 16, &lr->sa, sizeof lr->sa);
+	memcpy(p + 20, &lr->da, sizeof lr->da);
+	be16enc(p + 24, lr->sp);
+	be16enc(p + 26, lr->dp);
+	be16enc(p + 28, lr->flags);
+	be16enc(p + 30, lr->len);
+}
+
+/*
+ * Decode a log record from a buffer of FT_LOGREC_SIZE bytes.  Returns
+ * -1 if the buffer does not contain a valid record.
+ */
+int
+ft_logrec_dec(ft_logrec *lr, const void *buf)
+{
+	const uint8_t *p = buf;
+
+	if (p[0] != FT_LOGREC_MAGIC || p[1] != FT_LOGREC_VERSION)
+		return (-1);
+	lr->proto = p[2];
+	lr->usec = be32dec(p + 4);
+	lr->sec = be64dec(p + 8);
+	memcpy(&lr->sa, p + 16, sizeof lr->sa);
+	memcpy(&lr->da, p + 20, sizeof lr->da);
+	lr->sp = be16dec(p + 24);
+	lr->dp = be16dec(p + 26);
+	lr->flags = be16dec(p + 28);
+	lr->len = be16dec(p + 30);
+	if (lr->usec >= 1000000)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Decimal representations of 0 through 255, with the number of digits
+ * in the last byte, for formatting dotted quads.
+ */
+static const char ft_logrec_dec8[256][4] = {
+	{ '0', 0, 0, 1 }, { '1', 0, 0, 1 }, { '2', 0, 0, 1 },
+	{ '3', 0, 0, 1 }, { '4', 0, 0, 1 }, { '5', 0, 0, 1 },
+	{ '6', 0, 0, 1 }, { '7', 0, 0, 1 }, { '8', 0, 0, 1 },
+	{ '9', 0, 0, 1 }, { '1', '0', 0, 2 }, { '1', '1', 0, 2 },
+	{ '1', '2', 0, 2 }, { '1', '3', 0, 2 }, { '1', '4', 0, 2 },
+	{ '1', '5', 0, 2 }, { '1', '6', 0, 2 }, { '1', '7', 0, 2 },
+	{ '1', '8', 0, 2 }, { '1', '9', 0, 2 }, { '2', '0', 0, 2 },
+	{ '2', '1', 0, 2 }, { '2', '2', 0, 2 }, { '2', '3', 0, 2 },
+	{ '2', '4', 0, 2 }, { '2', '5', 0, 2 }, { '2', '6', 0, 2 },
+	{ '2', '7', 0, 2 }, { '2', '8', 0, 2 }, { '2', '9', 0, 2 },
+	{ '3', '0', 0, 2 }, { '3', '1', 0, 2 }, { '3', '2', 0, 2 },
+	{ '3', '3', 0, 2 }, { '3', '4', 0, 2 }, { '3', '5', 0, 2 },
+	{ '3', '6', 0, 2 }, { '3', '7', 0, 2 }, { '3', '8', 0, 2 },
+	{ '3', '9', 0, 2 }, { '4', '0', 0, 2 }, { '4', '1', 0, 2 },
+	{ '4', '2', 0, 2 }, { '4', '3', 0, 2 }, { '4', '4', 0, 2 },
+	{ '4', '5', 0, 2 }, { '4', '6', 0, 2 }, { '4', '7', 0, 2 },
+	{ '4', '8', 0, 2 }, { '4', '9', 0, 2 }, { '5', '0', 0, 2 },
+	{ '5', '1', 0, 2 }, { '5', '2', 0, 2 }, { '5', '3', 0, 2 },
+	{ '5', '4', 0, 2 }, { '5', '5', 0, 2 }, { '5', '6', 0, 2 },
+	{ '5', '7', 0, 2 }, { '5', '8', 0, 2 }, { '5', '9', 0, 2 },
+	{ '6', '0', 0, 2 }, { '6', '1', 0, 2 }, { '6', '2', 0, 2 },
+	{ '6', '3', 0, 2 }, { '6', '4', 0, 2 }, { '6', '5', 0, 2 },
+	{ '6', '6', 0, 2 }, { '6', '7', 0, 2 }, { '6', '8', 0, 2 },
+	{ '6', '9', 0, 2 }, { '7', '0', 0, 2 }, { '7', '1', 0, 2 },
+	{ '7', '2', 0, 2 }, { '7', '3', 0, 2 }, { '7', '4', 0, 2 },
+	{ '7', '5', 0, 2 }, { '7', '6', 0, 2 }, { '7', '7', 0, 2 },
+	{ '7', '8', 0, 2 }, { '7', '9', 0, 2 }, { '8', '0', 0, 2 },
+	{ '8', '1', 0, 2 }, { '8', '2', 0, 2 }, { '8', '3', 0, 2 },
+	{ '8', '4', 0, 2 }, { '8', '5', 0, 2 }, { '8', '6', 0, 2 },
+	{ '8', '7', 0, 2 }, { '8', '8', 0, 2 }, { '8', '9', 0, 2 },
+	{ '9', '0', 0, 2 }, { '9', '1', 0, 2 }, { '9', '2', 0, 2 },
+	{ '9', '3', 0, 2 }, { '9', '4', 0, 2 }, { '9', '5', 0, 2 },
+	{ '9', '6', 0, 2 }, { '9', '7', 0, 2 }, { '9', '8', 0, 2 },
+	{ '9', '9', 0, 2 }, { '1', '0', '0', 3 }, { '1', '0', '1', 3 },
+	{ '1', '0', '2', 3 }, { '1', '0', '3', 3 }, { '1', '0', '4', 3 },
+	{ '1', '0', '5', 3 }, { '1', '0', '6', 3 }, { '1', '0', '7', 3 },
+	{ '1', '0', '8', 3 }, { '1', '0', '9', 3 }, { '1', '1', '0', 3 },
+	{ '1', '1', '1', 3 }, { '1', '1', '2', 3 }, { '1', '1', '3', 3 },
+	{ '1', '1', '4', 3 }, { '1', '1', '5', 3 }, { '1', '1', '6', 3 },
+	{ '1', '1', '7', 3 }, { '1', '1', '8', 3 }, { '1', '1', '9', 3 },
+	{ '1', '2', '0', 3 }, { '1', '2', '1', 3 }, { '1', '2', '2', 3 },
+	{ '1', '2', '3', 3 }, { '1', '2', '4', 3 }, { '1', '2', '5', 3 },
+	{ '1', '2', '6', 3 }, { '1', '2', '7', 3 }, { '1', '2', '8', 3 },
+	{ '1', '2', '9', 3 }, { '1', '3', '0', 3 }, { '1', '3', '1', 3 },
+	{ '1', '3', '2', 3 }, { '1', '3', '3', 3 }, { '1', '3', '4', 3 },
+	{ '1', '3', '5', 3 }, { '1', '3', '6', 3 }, { '1', '3', '7', 3 },
+	{ '1', '3', '8', 3 }, { '1', '3', '9', 3 }, { '1', '4', '0', 3 },
+	{ '1', '4', '1', 3 }, { '1', '4', '2', 3 }, { '1', '4', '3', 3 },
+	{ '1', '4', '4', 3 }, { '1', '4', '5', 3 }, { '1', '4', '6', 3 },
+	{ '1', '4', '7', 3 }, { '1', '4', '8', 3 }, { '1', '4', '9', 3 },
+	{ '1', '5', '0', 3 }, { '1', '5', '1', 3 }, { '1', '5', '2', 3 },
+	{ '1', '5', '3', 3 }, { '1', '5', '4', 3 }, { '1', '5', '5', 3 },
+	{ '1', '5', '6', 3 }, { '1', '5', '7', 3 }, { '1', '5', '8', 3 },
+	{ '1', '5', '9', 3 }, { '1', '6', '0', 3 }, { '1', '6', '1', 3 },
+	{ '1', '6', '2', 3 }, { '1', '6', '3', 3 }, { '1', '6', '4', 3 },
+	{ '1', '6', '5', 3 }, { '1', '6', '6', 3 }, { '1', '6', '7', 3 },
+	{ '1', '6', '8', 3 }, { '1', '6', '9', 3 }, { '1', '7', '0', 3 },
+	{ '1', '7', '1', 3 }, { '1', '7', '2', 3 }, { '1', '7', '3', 3 },
+	{ '1', '7', '4', 3 }, { '1', '7', '5', 3 }, { '1', '7', '6', 3 },
+	{ '1', '7', '7', 3 }, { '1', '7', '8', 3 }, { '1', '7', '9', 3 },
+	{ '1', '8', '0', 3 }, { '1', '8', '1', 3 }, { '1', '8', '2', 3 },
+	{ '1', '8', '3', 3 }, { '1', '8', '4', 3 }, { '1', '8', '5', 3 },
+	{ '1', '8', '6', 3 }, { '1', '8', '7', 3 }, { '1', '8', '8', 3 },
+	{ '1', '8', '9', 3 }, { '1', '9', '0', 3 }, { '1', '9', '1', 3 },
+	{ '1', '9', '2', 3 }, { '1', '9', '3', 3 }, { '1', '9', '4', 3 },
+	{ '1', '9', '5', 3 }, { '1', '9', '6', 3 }, { '1', '9', '7', 3 },
+	{ '1', '9', '8', 3 }, { '1', '9', '9', 3 }, { '2', '0', '0', 3 },
+	{ '2', '0', '1', 3 }, { '2', '0', '2', 3 }, { '2', '0', '3', 3 },
+	{ '2', '0', '4', 3 }, { '2', '0', '5', 3 }, { '2', '0', '6', 3 },
+	{ '2', '0', '7', 3 }, { '2', '0', '8', 3 }, { '2', '0', '9', 3 },
+	{ '2', '1', '0', 3 }, { '2', '1', '1', 3 }, { '2', '1', '2', 3 },
+	{ '2', '1', '3', 3 }, { '2', '1', '4', 3 }, { '2', '1', '5', 3 },
+	{ '2', '1', '6', 3 }, { '2', '1', '7', 3 }, { '2', '1', '8', 3 },
+	{ '2', '1', '9', 3 }, { '2', '2', '0', 3 }, { '2', '2', '1', 3 },
+	{ '2', '2', '2', 3 }, { '2', '2', '3', 3 }, { '2', '2', '4', 3 },
+	{ '2', '2', '5', 3 }, { '2', '2', '6', 3 }, { '2', '2', '7', 3 },
+	{ '2', '2', '8', 3 }, { '2', '2', '9', 3 }, { '2', '3', '0', 3 },
+	{ '2', '3', '1', 3 }, { '2', '3', '2', 3 }, { '2', '3', '3', 3 },
+	{ '2', '3', '4', 3 }, { '2', '3', '5', 3 }, { '2', '3', '6', 3 },
+	{ '2', '3', '7', 3 }, { '2', '3', '8', 3 }, { '2', '3', '9', 3 },
+	{ '2', '4', '0', 3 }, { '2', '4', '1', 3 }, { '2', '4', '2', 3 },
+	{ '2', '4', '3', 3 }, { '2', '4', '4', 3 }, { '2', '4', '5', 3 },
+	{ '2', '4', '6', 3 }, { '2', '4', '7', 3 }, { '2', '4', '8', 3 },
+	{ '2', '4', '9', 3 }, { '2', '5', '0', 3 }, { '2', '5', '1', 3 },
+	{ '2', '5', '2', 3 }, { '2', '5', '3', 3 }, { '2', '5', '4', 3 },
+	{ '2', '5', '5', 3 },
+};
+
+/*
+ * Pairs of decimal digits, for formatting larger numbers two digits at
+ * a time.
+ */
+static const char ft_logrec_dec2[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static inline char *
+ft_logrec_fmt_u64(char *p, uint64_t u)
+{
+	char tmp[20], *q;
+	size_t len;
+
+	q = tmp + sizeof tmp;
+	while (u >= 100) {
+		q -= 2;
+		memcpy(q, ft_logrec_dec2 + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		q -= 2;
+		memcpy(q, ft_logrec_dec2 + u * 2, 2);
+	} else {
+		*--q = '0' + u;
+	}
+	len = tmp + sizeof tmp - q;
+	memcpy(p, q, len);
+	return (p + len);
+}
+
+static inline char *
+ft_logrec_fmt_ip4(char *p, const ip4_addr *a)
+{
+	const char *d;
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i) {
+		d = ft_logrec_dec8[a->o[i]];
+		memcpy(p, d, 3);
+		p += d[3];
+		*p++ = i < 3 ? '.' : ',';
+	}
+	return (p);
+}
+
+/*
+ * Timestamp with a six-digit fraction, followed by a comma.
+ */
+static inline char *
+ft_logrec_fmt_time(char *p, uint64_t sec, uint32_t usec)
+{
+
+	p = ft_logrec_fmt_u64(p, sec);
+	*p++ = '.';
+	usec %= 1000000;
+	memcpy(p, ft_logrec_dec2 + (usec / 10000) * 2, 2);
+	memcpy(p + 2, ft_logrec_dec2 + (usec / 100 % 100) * 2, 2);
+	memcpy(p + 4, ft_logrec_dec2 + (usec % 100) * 2, 2);
+	p += 6;
+	*p++ = ',';
+	return (p);
+}
+
+/*
+ * Protocol-specific information, which ends the line: ICMP type and
+ * code, TCP flags, or nothing.
+ */
+static inline char *
+ft_logrec_fmt_info(char *p, uint8_t proto, uint16_t flags)
+{
+	static const char tcpfl[] = "NCEUAPRSF";
+	unsigned int bit, mask;
+
+	switch (proto) {
+	case ip_proto_icmp:
+		p = ft_logrec_fmt_u64(p, flags >> 8);
+		*p++ = '.';
+		p = ft_logrec_fmt_u64(p, flags & 0xff);
+		break;
+	case ip_proto_tcp:
+		for (bit = 0, mask = 0x100; mask > 0; ++bit, mask >>= 1)
+			*p++ = (flags & mask) ? tcpfl[bit] : '-';
+		break;
+	}
+	return (p);
+}
+
+static inline char *
+ft_logrec_fmt_proto(char *p, uint8_t proto)
+{
+
+	switch (proto) {
+	case ip_proto_icmp:
+		memcpy(p, "ICMP,", 5);
+		return (p + 5);
+	case ip_proto_tcp:
+		memcpy(p, "TCP,", 4);
+		return (p + 4);
+	case ip_proto_udp:
+		memcpy(p, "UDP,", 4);
+		return (p + 4);
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Copy the line from the scratch buffer if it was formatted there, and
+ * terminate it.
+ */
+static inline int
+ft_logrec_finish(char *buf, size_t size, const char *q, char *p)
+{
+	size_t len;
+
+	len = p - q;
+	if (q == buf) {
+		*p = '\0';
+	} else if (size > 0) {
+		if (len < size) {
+			memcpy(buf, q, len);
+			buf[len] = '\0';
+		} else {
+			memcpy(buf, q, size - 1);
+			buf[size - 1] = '\0';
+		}
+	}
+	return (len);
+}
+
+/*
+ * Format a log record as a line of text, without the trailing newline,
+ * exactly as flytrap writes it to a text log and ft2dshield expects to
+ * read it.  Returns the length of the line, or -1 if the protocol is
+ * unknown.  As with snprintf(3), the output is truncated and
+ * NUL-terminated if it does not fit in the buffer, but the return value
+ * is the full length.
+ *
+ * This is called for every logged packet, so it formats the line by
+ * hand rather than with snprintf(3).
+ */
+int
+ft_logrec_text(char *buf, size_t size, const ft_logrec *lr)
+{
+	char tmp[FT_LOGREC_TEXTMAX], *p, *q;
+
+	p = q = size >= sizeof tmp ? buf : tmp;
+
+	/* timestamp */
+	p = ft_logrec_fmt_time(p, lr->sec, lr->usec);
+
+	/* source and destination */
+	p = ft_logrec_fmt_ip4(p, &lr->sa);
+	p = ft_logrec_fmt_u64(p, lr->sp);
+	*p++ = ',';
+	p = ft_logrec_fmt_ip4(p, &lr->da);
+	p = ft_logrec_fmt_u64(p, lr->dp);
+	*p++ = ',';
+
+	/* protocol, length and protocol-specific information */
+	if ((p = ft_logrec_fmt_proto(p, lr->proto)) == NULL)
+		return (-1);
+	p = ft_logrec_fmt_u64(p, lr->len);
+	*p++ = ',';
+	p = ft_logrec_fmt_info(p, lr->proto, lr->flags);
+	return (ft_logrec_finish(buf, size, q, p));
+}
+
+/*
+ * Summary record layout:
+ *
+ *  0 magic  1 version  2 protocol  3 reserved
+ *  4 first microseconds
+ *  8 first seconds (64 bits)
+ * 16 last microseconds
+ * 20 source address
+ * 24 last seconds (64 bits)
+ * 32 first destination address
+ * 36 destination port  38 flags
+ * 40 count
+ * 44 estimated number of distinct destinations
+ */
+
+/*
+ * Encode a summary record into a buffer of FT_LOGSUM_SIZE bytes.
+ */
+void
+ft_logsum_enc(void *buf, const ft_logsum *ls)
+{
+	uint8_t *p = buf;
+
+	p[0] = FT_LOGSUM_MAGIC;
+	p[1] = FT_LOGSUM_VERSION;
+	p[2] = ls->proto;
+	p[3] = 0;
+	be32enc(p + 4, ls->fusec);
+	be64enc(p + 8, ls->fsec);
+	be32enc(p + 16, ls->lusec);
+	memcpy(p + 20, &ls->sa, sizeof ls->sa);
+	be64enc(p + 24, ls->lsec);
+	memcpy(p + 32, &ls->da, sizeof ls->da);
+	be16enc(p + 36, ls->dp);
+	be16enc(p + 38, ls->flags);
+	be32enc(p + 40, ls->count);
+	be32enc(p + 44, ls->ndst);
+}
+
+/*
+ * Decode a summary record from a buffer of FT_LOGSUM_SIZE bytes.
+ * Returns -1 if the buffer does not contain a valid record.
+ */
+int
+ft_logsum_dec(ft_logsum *ls, const void *buf)
+{
+	const uint8_t *p = buf;
+
+	if (p[0] != FT_LOGSUM_MAGIC || p[1] != FT_LOGSUM_VERSION)
+		return (-1);
+	ls->proto = p[2];
+	ls->fusec = be32dec(p + 4);
+	ls->fsec = be64dec(p + 8);
+	ls->lusec = be32dec(p + 16);
+	memcpy(&ls->sa, p + 20, sizeof ls->sa);
+	ls->lsec = be64dec(p + 24);
+	memcpy(&ls->da, p + 32, sizeof ls->da);
+	ls->dp = be16dec(p + 36);
+	ls->flags = be16dec(p + 38);
+	ls->count = be32dec(p + 40);
+	ls->ndst = be32dec(p + 44);
+	if (ls->fusec >= 1000000 || ls->lusec >= 1000000)
+		return (-1);
+	if (ls->lsec < ls->fsec ||
+	    (ls->lsec == ls->fsec && ls->lusec < ls->fusec))
+		return (-1);
+	if (ls->count == 0 || ls->ndst == 0 || ls->ndst > ls->count)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Format a summary record as a line of text, without the trailing
+ * newline:
+ *
+ *   +first,last,source,destination,port,protocol,count,ndst,info
+ *
+ * The return value and truncation are as for ft_logrec_text().
+ */
+int
+ft_logsum_text(char *buf, size_t size, const ft_logsum *ls)
+{
+	char tmp[FT_LOGSUM_TEXTMAX], *p, *q;
+
+	p = q = size >= sizeof tmp ? buf : tmp;
+	*p++ = FT_LOGSUM_PREFIX;
+	p = ft_logrec_fmt_time(p, ls->fsec, ls->fusec);
+	p = ft_logrec_fmt_time(p, ls->lsec, ls->lusec);
+	p = ft_logrec_fmt_ip4(p, &ls->sa);
+	p = ft_logrec_fmt_ip4(p, &ls->da);
+	p = ft_logrec_fmt_u64(p, ls->dp);
+	*p++ = ',';
+	if ((p = ft_logrec_fmt_proto(p, ls->proto)) == NULL)
+		return (-1);
+	p = ft_logrec_fmt_u64(p, ls->count);
+	*p++ = ',';
+	p = ft_logrec_fmt_u64(p, ls->ndst);
+	*p++ = ',';
+	p = ft_logrec_fmt_info(p, ls->proto, ls->flags);
+	return (ft_logrec_finish(buf, size, q, p));
+}
@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ft/shm.h>
+
+/*
+ * Size of a segment with room for the given number of interfaces,
+ * counters and ARP entries.
+ */
+size_t
+ft_shm_size(uint32_t niface, uint32_t ncounter, uint32_t maxarp)
+{
+
+	return (sizeof(ft_shm_hdr) + (size_t)niface * sizeof(ft_shm_iface) +
+	    (size_t)ncounter * sizeof(ft_shm_counter) +
+	    (size_t)maxarp * sizeof(ft_shm_arp));
+}
+
+/*
+ * Lay out an empty segment of the size given by ft_shm_size().
+ */
+void
+ft_shm_init(void *seg, uint32_t niface, uint32_t ncounter, uint32_t maxarp)
+{
+	ft_shm_hdr *h = seg;
+	size_t size;
+
+	size = ft_shm_size(niface, ncounter, maxarp);
+	memset(seg, 0, size);
+	h->magic = FT_SHM_MAGIC;
+	h->version = FT_SHM_VERSION;
+	h->hdrsize = sizeof *h;
+	h->size = size;
+	h->niface = niface;
+	h->ncounter = ncounter;
+	h->maxarp = maxarp;
+	h->iface_off = sizeof *h;
+	h->counter_off = h->iface_off + niface * sizeof(ft_shm_iface);
+	h->arp_off = h->counter_off + ncounter * sizeof(ft_shm_counter);
+}
+
+/*
+ * Start an update.  Readers will not use anything they copy until the
+ * matching ft_shm_end().
+ */
+void
+ft_shm_begin(ft_shm_hdr *h)
+{
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Finish an update.
+ */
+void
+ft_shm_end(ft_shm_hdr *h)
+{
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Check that a copy of a segment header is one we understand and that
+ * the tables it describes lie within the segment.  Returns the number
+ * of bytes in use, or 0 if the header is not valid.
+ */
+static size_t
+ft_shm_check(const ft_shm_hdr *h, size_t size)
+{
+	uint64_t end;
+
+	if (h->magic != FT_SHM_MAGIC || h->version != FT_SHM_VERSION ||
+	    h->hdrsize != sizeof *h || h->size > size || h->narp > h->maxarp)
+		return (0);
+	if (h->iface_off < sizeof *h ||
+	    h->iface_off + (uint64_t)h->niface * sizeof(ft_shm_iface) >
+	    h->counter_off ||
+	    h->counter_off + (uint64_t)h->ncounter * sizeof(ft_shm_counter) >
+	    h->arp_off ||
+	    h->arp_off + (uint64_t)h->maxarp * sizeof(ft_shm_arp) > h->size)
+		return (0);
+	end = h->arp_off + (uint64_t)h->narp * sizeof(ft_shm_arp);
+	return (end);
+}
+
+/*
+ * Copy a consistent view of a segment which is size bytes long into a
+ * buffer of the same size, giving up after the given number of tries
+ * if the writer keeps getting in the way.  Only the part of the
+ * segment which is in use is copied.  Returns 0 on success, or -1 with
+ * errno set to EAGAIN if we gave up, or EINVAL if the segment is not
+ * one we understand.
+ */
+int
+ft_shm_read(const void *seg, size_t size, void *buf, unsigned int tries)
+{
+	const ft_shm_hdr *h = seg;
+	uint64_t seq;
+	size_t used;
+
+	if (size < sizeof *h) {
+		errno = EINVAL;
+		return (-1);
+	}
+	while (tries-- > 0) {
+		seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(buf, seg, sizeof *h);
+		used = ft_shm_check(buf, size);
+		if (used > 0)
+			memcpy((char *)buf + sizeof *h,
+			    (const char *)seg + sizeof *h, used - sizeof *h);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (used == 0) {
+			errno = EINVAL;
+			return (-1);
+		}
+		return (0);
+	}
+	errno = EAGAIN;
+	return (-1);
+}
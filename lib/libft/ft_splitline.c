@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <ft/ctype.h>
+#include <ft/strutil.h>
+
+#define MIN_WORDV_SIZE	32
+
+/*
+ * Add a word to a vector.
+ */
+static int
+ft_wordv_add(ft_wordv *wv, char *str, size_t len)
+{
+	ft_word *tmp;
+	size_t size;
+
+	if (wv->nwords == wv->size) {
+		size = wv->size ? wv->size * 2 : MIN_WORDV_SIZE;
+		if ((tmp = realloc(wv->words, size * sizeof *tmp)) == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		wv->words = tmp;
+		wv->size = size;
+	}
+	wv->words[wv->nwords].str = str;
+	wv->words[wv->nwords].len = len;
+	wv->nwords++;
+	return (0);
+}
+
+/*
+ * Split the next line of a buffer into words, following the same
+ * quoting, comment and line continuation rules as ft_readlinev(), but
+ * without copying anything: quotes and escapes are removed in place, so
+ * the buffer must be writable, and the byte at end must be writable as
+ * well so the last word can be terminated.
+ *
+ * On return, *pp points past the line and wv holds its words.  Returns
+ * 1 if a line was read, even an empty one, 0 at the end of the buffer,
+ * or -1 with errno set to EINVAL if the buffer ends within a quoted
+ * string or right after an escape, or to ENOMEM.
+ */
+int
+ft_splitline(char **pp, char *end, int *lineno, ft_wordv *wv)
+{
+	char *p, *word, *out;
+	int ch, escape, quote, quoted;
+
+	p = *pp;
+	wv->nwords = 0;
+	for (;;) {
+		/* skip initial whitespace */
+		escape = 0;
+		for (;;) {
+			if (p == end)
+				goto eol;
+			ch = *p;
+			if (ch == '\n') {
+				/* either EOL or line continuation */
+				if (!escape)
+					goto eol;
+				if (lineno != NULL)
+					++*lineno;
+				escape = 0;
+			} else if (escape) {
+				/* escaped something else */
+				break;
+			} else if (ch == '#') {
+				/* comment: until EOL, no continuation */
+				while (p < end && *p != '\n')
+					++p;
+				goto eol;
+			} else if (ch == '\\') {
+				escape = 1;
+			} else if (!is_ws(ch)) {
+				break;
+			}
+			++p;
+		}
+
+		/* copy the word down over its quotes and escapes */
+		word = out = p;
+		quote = quoted = 0;
+		while (p < end && (!is_ws(*p) || quote || escape)) {
+			ch = *p++;
+			if (ch == '\\' && !escape && quote != '\'') {
+				/* escape next character */
+				escape = ch;
+			} else if ((ch == '\'' || ch == '"') &&
+			    !quote && !escape) {
+				/* begin quote */
+				quote = ch;
+				quoted = 1;
+			} else if (ch == quote && !escape) {
+				/* end quote */
+				quote = 0;
+			} else if (ch == '\n' && escape) {
+				/* line continuation */
+				escape = 0;
+			} else {
+				if (escape && quote && ch != '\\' &&
+				    ch != quote)
+					*out++ = '\\';
+				*out++ = ch;
+				escape = 0;
+			}
+			if (lineno != NULL && ch == '\n')
+				++*lineno;
+		}
+		if (p == end && (escape || quote)) {
+			/* missing escaped character or closing quote */
+			errno = EINVAL;
+			return (-1);
+		}
+		if ((out > word || quoted) &&
+		    ft_wordv_add(wv, word, out - word) != 0)
+			return (-1);
+		if (out < p || p == end) {
+			*out = '\0';
+			continue;
+		}
+		/* the terminator takes the place of the delimiter */
+		ch = *p;
+		*out = '\0';
+		++p;
+		if (ch == '\n') {
+			if (lineno != NULL)
+				++*lineno;
+			*pp = p;
+			return (1);
+		}
+	}
+eol:
+	if (p == end) {
+		*pp = p;
+		return (wv->nwords > 0);
+	}
+	/* *p == '\n' */
+	if (lineno != NULL)
+		++*lineno;
+	*pp = p + 1;
+	return (1);
+}
+
+/*
+ * Release the memory held by a word vector.
+ */
+void
+ft_wordv_free(ft_wordv *wv)
+{
+
+	free(wv->words);
+	wv->words = NULL;
+	wv->nwords = wv->size = 0;
+}
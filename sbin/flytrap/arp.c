@@ -32,12 +32,17 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <ft/arp.h>
 #include <ft/assert.h>
@@ -45,144 +50,863 @@
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
 #include <ft/log.h>
+#include <ft/shm.h>
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
 /*
- * A node in the tree.
+ * The tree has eight levels of interior nodes, each consuming four bits
+ * of the address, with leaves for individual addresses at the bottom.
+ * Interior nodes only store a bitmap of which of their sixteen children
+ * exist and the index of a segment in the child pool which holds the
+ * indices of those children in order.  Segments come in five sizes (1,
+ * 2, 4, 8 and 16 entries); a node which outgrows its segment moves to
+ * the next size up, and the old segment goes on a free list.
+ *
+ * Nodes and segments are allocated from arrays which grow as needed, so
+ * pointers into the tree are only valid until the next insertion.  The
+ * entire tree is released in one go by arp_destroy().
+ *
+ * Every leaf is also on exactly one list in a timing wheel, in the slot
+ * corresponding to the time at which it would expire if nothing
+ * happened to it in the meantime.  Leaves are not moved when they are
+ * refreshed; instead, arp_expire() rechecks each leaf when its slot
+ * comes up, and either expires it or moves it to the slot for its new
+ * deadline.  Deadlines beyond the end of the wheel are clamped, so a
+ * long-lived leaf makes one extra trip around the wheel per revolution.
  */
-struct arpn {
-	uint32_t	 addr;		/* network address */
-	uint8_t		 plen;		/* prefix length */
+#define ARP_NONE	UINT32_MAX
+#define ARP_DEPTH	8
+#define ARP_CLASSES	5
+
+#define ARP_WHEEL_SLOTS	1024		/* must be a power of two */
+#define ARP_WHEEL_TICK	1000		/* milliseconds per slot */
+#define ARP_EXPIRE_SLICE 64		/* max work per arp_expire() call */
+#define ARP_WHEAD	0x80000000U	/* wprev of the first leaf in a slot */
+
+#define ARP_EVICT_BATCH	16		/* leaves to evict at a time */
+#define ARP_EVICT_TRIES	4		/* batches per insertion */
+
+#define ARP_ANNOUNCE_BATCH 16		/* max frames per arp_announce() */
+#define ARP_ANNOUNCE_SCAN 1024		/* max leaves per arp_announce() */
+
+/*
+ * The snapshot file is a header followed by one fixed-size record per
+ * leaf, all in network byte order:
+ *
+ * header:  0 magic  4 version  6 record size  8 record count
+ *         12 reserved  16 time of writing (milliseconds)
+ * record:  0 address  4 ether address  10 flags  11 unanswered requests
+ *         12 last - first (milliseconds)  16 last seen (milliseconds)
+ *         24 VLAN key
+ *
+ * Version 1 records lack the VLAN key and are read as untagged.
+ */
+#define ARP_SNAP_MAGIC	 0x46544150U	/* "FTAP" */
+#define ARP_SNAP_VERSION 2
+#define ARP_SNAP_HDRSIZE 24
+#define ARP_SNAP_RECSIZE 28
+#define ARP_SNAP_V1_RECSIZE 24
+#define ARP_SNAP_CLAIMED 0x01
+#define ARP_SNAP_RESERVED 0x02
+
+unsigned int ft_arp_timeout = 600;	/* seconds */
+unsigned int ft_arp_claim_timeout = 3600; /* seconds */
+const char *ft_arp_file;		/* snapshot file */
+unsigned int ft_arp_interval = 60;	/* seconds between snapshots */
+unsigned int ft_arp_memory = 64;	/* megabytes per worker and interface */
+unsigned int ft_arp_announce;		/* seconds between announcements */
+
+struct arpi {
+	uint16_t	 map;		/* children present */
+	uint8_t		 cls;		/* size class of child segment */
+	uint32_t	 kids;		/* child segment */
+};
+
+struct arpl {
+	uint32_t	 addr;		/* address */
+	ether_addr	 ether;		/* last known owner */
 	uint8_t		 claimed:1;	/* claimed by us */
 	uint8_t		 reserved:1;	/* reserved address */
+	uint8_t		 used:1;	/* in the tree */
+	uint8_t		 ref:1;		/* touched since the hand went by */
+	unsigned int	 nreq;		/* unanswered requests */
+	uint32_t	 wnext;		/* next in wheel slot or free list */
+	uint32_t	 wprev;		/* previous in wheel slot */
 	uint64_t	 first;		/* first seen */
 	uint64_t	 last;		/* last seen */
-	union {
-		struct arpn *sub[16];	/* children */
-		struct {
-			ether_addr	 ether;
-			unsigned int	 nreq;
-		};
-	};
 };
 
-struct arpn arp_root;
+struct arp_table {
+	iface		*i;		/* owner */
+	uint32_t	 vlan;		/* VLAN key */
+	struct arp_table *next;		/* next VLAN on the interface */
+	struct arpi	*inner;		/* interior nodes, [0] is the root */
+	uint32_t	 ninner, maxinner;
+	struct arpl	*leaf;		/* leaf nodes */
+	uint32_t	 nleaf, maxleaf;
+	uint32_t	*kids;		/* child segments */
+	uint32_t	 nkids, maxkids;
+	uint32_t	 kfree[ARP_CLASSES]; /* free segments by size */
+	uint32_t	 ifree;		/* free interior nodes */
+	uint32_t	 lfree;		/* free leaves */
+	uint32_t	 nleaves;	/* leaves in use */
+	uint32_t	 nclaimed;	/* leaves claimed by us */
+	uint32_t	 hand;		/* eviction clock hand */
+
+	/* replies */
+	arp_pkt		 is_at;		/* template, see arp_template() */
+	ether_vlan	 tags;		/* tags of the last request answered */
+	int		 tagged;	/* tags is valid */
+	uint32_t	 apos;		/* announcement sweep position */
+	uint64_t	 anext;		/* next announcement sweep */
+
+	/* expiry */
+	uint32_t	 wheel[ARP_WHEEL_SLOTS];
+	uint64_t	 wheel_tick;	/* next tick to process */
+	unsigned long	 expired;	/* unclaimed leaves expired */
+	unsigned long	 released;	/* claimed leaves expired */
+	unsigned long	 conflicts;	/* claims lost to a real host */
+
+	/* snapshot */
+	uint8_t		*snap;		/* encoded leaves */
+	uint32_t	 nsnap, maxsnap;
+};
+
+static int arp_bulk;	/* loading a snapshot, don't log every insertion */
+
+static inline unsigned int
+arp_popcount(uint16_t map)
+{
+#if HAVE___BUILTIN_POPCOUNT
+	return (__builtin_popcount(map));
+#else
+	unsigned int n;
+
+	for (n = 0; map != 0; map &= map - 1)
+		++n;
+	return (n);
+#endif
+}
 
 /*
- * Print the leaf nodes of a tree in order.
+ * Grow one of the arrays in a table.
  */
-void
-arp_print_tree(FILE *f, struct arpn *n)
+static int
+arp_grow(void *pp, uint32_t *max, size_t size, uint32_t min)
 {
-	unsigned int i;
+	void *p;
+	uint32_t nmax;
 
-	if (n->plen == 32) {
-		fprintf(f, "%u.%u.%u.%u",
-		    (n->addr >> 24) & 0xff,
-		    (n->addr >> 16) & 0xff,
-		    (n->addr >> 8) & 0xff,
-		    n->addr & 0xff);
-		if (n->plen < 32)
-			fprintf(f, "/%u", n->plen);
-		fprintf(f, "\n");
-	} else {
-		for (i = 0; i < 16; ++i)
-			if (n->sub[i] != NULL)
-				arp_print_tree(f, n->sub[i]);
+	nmax = *max ? *max * 2 : min;
+	if (nmax <= *max) {
+		errno = ENOMEM;
+		return (-1);
 	}
+	if ((p = realloc(*(void **)pp, nmax * size)) == NULL)
+		return (-1);
+	*(void **)pp = p;
+	*max = nmax;
+	return (0);
 }
 
 /*
- * Delete all children of a given node in a tree.
+ * The memory each worker may use for the trees of each interface, in
+ * bytes, or 0 if there is no limit.  Only the trees and the arrays
+ * they are built from count, not the snapshot buffers.
  */
-void
-arp_delete(struct arpn *n)
+static size_t
+arp_budget(void)
+{
+
+	return ((size_t)ft_arp_memory << 20);
+}
+
+/*
+ * Grow one of the arrays in a tree, within the budget.  Close to the
+ * limit, the array only grows by as much as the budget allows; once
+ * there is no room left at all, fails with ENOSPC, and it is up to the
+ * caller to make room by evicting leaves.
+ */
+static int
+arp_table_grow(struct arp_table *t, void *pp, uint32_t *max, size_t size,
+    uint32_t min)
 {
-	unsigned int i;
+	iface *i = t->i;
+	uint32_t nmax;
+	size_t room;
+	void *p;
 
-	for (i = 0; i < 16; ++i) {
-		if (n->sub[i] != NULL) {
-			arp_delete(n->sub[i]);
-			free(n->sub[i]);
-			n->sub[i] = NULL;
+	nmax = *max ? *max * 2 : min;
+	if (nmax <= *max) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (arp_budget() > 0) {
+		room = i->arp_bytes < arp_budget() ?
+		    (arp_budget() - i->arp_bytes) / size : 0;
+		if (room < nmax - *max)
+			nmax = *max + room;
+		if (nmax == *max) {
+			errno = ENOSPC;
+			return (-1);
 		}
 	}
+	if ((p = realloc(*(void **)pp, (size_t)nmax * size)) == NULL)
+		return (-1);
+	*(void **)pp = p;
+	i->arp_bytes += (size_t)(nmax - *max) * size;
+	*max = nmax;
+	return (0);
 }
 
-#if 0
 /*
- * Expire
+ * Fill in the parts of an is-at reply which are the same for every
+ * reply from a given interface.
+ */
+static void
+arp_template(arp_pkt *ap, const iface *i)
+{
+
+	memset(ap, 0, sizeof *ap);
+	ap->htype = htobe16(arp_type_ether);
+	ap->ptype = htobe16(arp_type_ip4);
+	ap->hlen = 6;
+	ap->plen = 4;
+	ap->oper = htobe16(arp_oper_is_at);
+	memcpy(&ap->sha, &i->ether, sizeof(ether_addr));
+}
+
+/*
+ * Each interface has its own tree for every VLAN it sees traffic on.
+ * The trees are on a list, which other threads may walk to collect
+ * statistics, and in an index sorted by VLAN key, which only the owner
+ * uses.  In multi-worker mode, the fanout program steers all traffic
+ * for a given target address to the same worker, so each tree is a
+ * shard which only its worker ever touches.
+ */
+static struct arp_table *
+arp_table_find(const iface *i, uint32_t vlan, unsigned int *pos)
+{
+	unsigned int lo, hi, mid;
+
+	for (lo = 0, hi = i->arp_nindex; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (i->arp_index[mid]->vlan == vlan)
+			return (i->arp_index[mid]);
+		if (i->arp_index[mid]->vlan < vlan)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos != NULL)
+		*pos = lo;
+	return (NULL);
+}
+
+static struct arp_table *
+arp_table(iface *i, uint32_t vlan)
+{
+	struct arp_table *t;
+	unsigned int c, pos;
+
+	if ((t = arp_table_find(i, vlan, &pos)) != NULL)
+		return (t);
+	if (i->arp_nindex == i->arp_maxindex &&
+	    arp_grow(&i->arp_index, &i->arp_maxindex,
+	    sizeof *i->arp_index, 4) != 0)
+		return (NULL);
+	if (arp_budget() > 0 && i->arp_bytes + sizeof *t > arp_budget()) {
+		errno = ENOSPC;
+		return (NULL);
+	}
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (NULL);
+	t->i = i;
+	i->arp_bytes += sizeof *t;
+	if (arp_table_grow(t, &t->inner, &t->maxinner,
+	    sizeof *t->inner, 64) != 0) {
+		i->arp_bytes -= sizeof *t;
+		free(t);
+		return (NULL);
+	}
+	t->vlan = vlan;
+	arp_template(&t->is_at, i);
+	t->tagged = (vlan == 0);
+	t->inner[0].map = 0;
+	t->inner[0].cls = 0;
+	t->inner[0].kids = ARP_NONE;
+	t->ninner = 1;
+	for (c = 0; c < ARP_CLASSES; ++c)
+		t->kfree[c] = ARP_NONE;
+	t->ifree = t->lfree = ARP_NONE;
+	for (c = 0; c < ARP_WHEEL_SLOTS; ++c)
+		t->wheel[c] = ARP_NONE;
+	memmove(i->arp_index + pos + 1, i->arp_index + pos,
+	    (i->arp_nindex - pos) * sizeof *i->arp_index);
+	i->arp_index[pos] = t;
+	i->arp_nindex++;
+	t->next = i->arp;
+	__atomic_store_n(&i->arp, t, __ATOMIC_RELEASE);
+	if (vlan != 0 && !arp_bulk)
+		ft_verbose("%s: arp: new table for vlan %u", i->name, vlan);
+	return (t);
+}
+
+/*
+ * Fill in the ARP table gauges in a stats snapshot.  This may be called
+ * from a thread other than the one which owns the tables.
  */
 void
-arp_expire(struct arpn *n, uint64_t cutoff)
+arp_stats(iface *i, stats *st)
 {
-	unsigned int i;
+	struct arp_table *t;
 
-	if (n->last < cutoff) {
-		ft_verbose("expiring node %08x/%d", n->addr, n->plen);
-		arp_delete(n);
-	} else if (n->plen < 32) {
-		for (i = 0; i < 16; ++i)
-			if (n->sub[i] != NULL)
-				arp_expire(n->sub[i], cutoff);
+	st->arp_vlans = st->arp_entries = st->arp_claimed = st->arp_bytes = 0;
+	for (t = __atomic_load_n(&i->arp, __ATOMIC_ACQUIRE); t != NULL;
+	    t = t->next) {
+		st->arp_vlans++;
+		st->arp_entries +=
+		    __atomic_load_n(&t->nleaves, __ATOMIC_RELAXED);
+		st->arp_claimed +=
+		    __atomic_load_n(&t->nclaimed, __ATOMIC_RELAXED);
+		st->arp_bytes += sizeof *t +
+		    __atomic_load_n(&t->maxinner, __ATOMIC_RELAXED) *
+		    sizeof *t->inner +
+		    __atomic_load_n(&t->maxleaf, __ATOMIC_RELAXED) *
+		    sizeof *t->leaf +
+		    __atomic_load_n(&t->maxkids, __ATOMIC_RELAXED) *
+		    sizeof *t->kids;
 	}
 }
-#endif
 
 /*
- * Insert an address into a tree.
+ * Release an interface's trees.
  */
-static struct arpn *
-arp_insert(struct arpn *n, uint32_t addr, uint64_t when)
+void
+arp_destroy(iface *i)
 {
-	struct arpn *sn, *rn;
-	uint32_t sub;
-	uint8_t splen;
+	struct arp_table *t;
+	unsigned long leaves, expired, released, conflicts;
+	size_t bytes;
 
-	if (n == NULL)
-		n = &arp_root;
-	if (n->plen == 32) {
-		ft_assert(n->addr == addr);
-		return (n);
+	if (i->arp == NULL)
+		return;
+	leaves = expired = released = conflicts = 0;
+	bytes = 0;
+	while ((t = i->arp) != NULL) {
+		leaves += t->nleaves;
+		bytes += sizeof *t + t->maxinner * sizeof *t->inner +
+		    t->maxleaf * sizeof *t->leaf + t->maxkids * sizeof *t->kids;
+		expired += t->expired;
+		released += t->released;
+		conflicts += t->conflicts;
+		i->arp = t->next;
+		free(t->inner);
+		free(t->leaf);
+		free(t->kids);
+		free(t->snap);
+		free(t);
 	}
-	splen = n->plen + 4;
-	sub = (addr >> (32 - splen)) % 16;
-	if ((sn = n->sub[sub]) == NULL) {
-		if ((sn = calloc(1, sizeof *sn)) == NULL)
+	ft_verbose("%s: arp: %lu leaves in %u tables, %zu bytes, "
+	    "%lu expired, %lu released, %lu conflicts", i->name, leaves,
+	    i->arp_nindex, bytes, expired, released, conflicts);
+	free(i->arp_index);
+	i->arp_index = NULL;
+	i->arp_nindex = i->arp_maxindex = 0;
+	i->arp_bytes = 0;
+}
+
+/*
+ * Allocate a child segment of the given size class.
+ */
+static uint32_t
+arp_kids_alloc(struct arp_table *t, unsigned int cls)
+{
+	uint32_t k;
+
+	if ((k = t->kfree[cls]) != ARP_NONE) {
+		t->kfree[cls] = t->kids[k];
+		return (k);
+	}
+	while (t->nkids + (1U << cls) > t->maxkids)
+		if (arp_table_grow(t, &t->kids, &t->maxkids,
+		    sizeof *t->kids, 256) != 0)
+			return (ARP_NONE);
+	k = t->nkids;
+	t->nkids += 1U << cls;
+	return (k);
+}
+
+/*
+ * Make room for one more child in an interior node's segment.
+ */
+static int
+arp_kids_reserve(struct arp_table *t, uint32_t ni)
+{
+	unsigned int n;
+	uint32_t k;
+
+	n = arp_popcount(t->inner[ni].map);
+	if (n == 0 && t->inner[ni].kids == ARP_NONE) {
+		if ((k = arp_kids_alloc(t, 0)) == ARP_NONE)
+			return (-1);
+		t->inner[ni].kids = k;
+		t->inner[ni].cls = 0;
+	} else if (n == 1U << t->inner[ni].cls) {
+		if ((k = arp_kids_alloc(t, t->inner[ni].cls + 1)) == ARP_NONE)
+			return (-1);
+		memcpy(t->kids + k, t->kids + t->inner[ni].kids,
+		    n * sizeof *t->kids);
+		t->kids[t->inner[ni].kids] = t->kfree[t->inner[ni].cls];
+		t->kfree[t->inner[ni].cls] = t->inner[ni].kids;
+		t->inner[ni].kids = k;
+		t->inner[ni].cls++;
+	}
+	return (0);
+}
+
+/*
+ * Return a child segment to its free list.
+ */
+static void
+arp_kids_free(struct arp_table *t, uint32_t k, unsigned int cls)
+{
+
+	t->kids[k] = t->kfree[cls];
+	t->kfree[cls] = k;
+}
+
+/*
+ * Put a leaf on the wheel.  The slots are doubly linked so leaves can
+ * be evicted from anywhere; the first leaf in a slot points back at
+ * the slot instead of at another leaf.
+ */
+static void
+arp_wheel_insert(struct arp_table *t, uint32_t li, uint64_t deadline)
+{
+	uint64_t tick;
+	uint32_t slot;
+
+	ft_assert(li < ARP_WHEAD);
+	tick = deadline / ARP_WHEEL_TICK;
+	if (tick < t->wheel_tick)
+		tick = t->wheel_tick;
+	if (tick >= t->wheel_tick + ARP_WHEEL_SLOTS)
+		tick = t->wheel_tick + ARP_WHEEL_SLOTS - 1;
+	slot = tick % ARP_WHEEL_SLOTS;
+	t->leaf[li].wnext = t->wheel[slot];
+	t->leaf[li].wprev = ARP_WHEAD | slot;
+	if (t->wheel[slot] != ARP_NONE)
+		t->leaf[t->wheel[slot]].wprev = li;
+	t->wheel[slot] = li;
+}
+
+/*
+ * Take a leaf off the wheel.
+ */
+static void
+arp_wheel_remove(struct arp_table *t, uint32_t li)
+{
+	struct arpl *l = &t->leaf[li];
+
+	if (l->wprev & ARP_WHEAD)
+		t->wheel[l->wprev & ~ARP_WHEAD] = l->wnext;
+	else
+		t->leaf[l->wprev].wnext = l->wnext;
+	if (l->wnext != ARP_NONE)
+		t->leaf[l->wnext].wprev = l->wprev;
+}
+
+/*
+ * Compute the time at which a leaf will expire.
+ */
+static uint64_t
+arp_deadline(const struct arpl *l)
+{
+
+	if (l->reserved)
+		return (UINT64_MAX);
+	return (l->last + (l->claimed ?
+	    ft_arp_claim_timeout : ft_arp_timeout) * 1000ULL);
+}
+
+/*
+ * Remove a leaf from a tree, along with any interior nodes which become
+ * empty as a result.  The leaf must not be on the wheel.
+ */
+static void
+arp_remove(struct arp_table *t, uint32_t li)
+{
+	uint32_t path[ARP_DEPTH];
+	struct arpi *n;
+	unsigned int d, cnt, pos, bit;
+	uint32_t addr, ni;
+
+	addr = t->leaf[li].addr;
+	for (ni = 0, d = 0; d < ARP_DEPTH; ++d) {
+		path[d] = ni;
+		bit = 1U << ((addr >> (28 - 4 * d)) & 0xf);
+		ft_assert(t->inner[ni].map & bit);
+		ni = t->kids[t->inner[ni].kids +
+		    arp_popcount(t->inner[ni].map & (bit - 1))];
+	}
+	ft_assert(ni == li);
+	t->leaf[li].used = 0;
+	t->leaf[li].wnext = t->lfree;
+	t->lfree = li;
+	t->nleaves--;
+	for (d = ARP_DEPTH; d-- > 0; ) {
+		n = &t->inner[path[d]];
+		bit = 1U << ((addr >> (28 - 4 * d)) & 0xf);
+		pos = arp_popcount(n->map & (bit - 1));
+		cnt = arp_popcount(n->map);
+		memmove(t->kids + n->kids + pos, t->kids + n->kids + pos + 1,
+		    (cnt - pos - 1) * sizeof *t->kids);
+		n->map &= ~bit;
+		if (n->map != 0 || d == 0)
+			break;
+		/* now empty, release it and remove it from its parent */
+		arp_kids_free(t, n->kids, n->cls);
+		n->kids = t->ifree;
+		t->ifree = path[d];
+	}
+}
+
+/*
+ * Expire a bounded number of stale leaves from each tree.  Meant to be
+ * called between capture bursts, so that no single call holds up the
+ * capture loop.
+ */
+static void
+arp_expire_table(struct arp_table *t, uint64_t now)
+{
+	struct arpl *l;
+	uint64_t deadline, tick;
+	unsigned int budget;
+	uint32_t li, *head;
+
+	tick = now / ARP_WHEEL_TICK;
+	if (t->wheel_tick == 0)
+		t->wheel_tick = tick;
+	for (budget = ARP_EXPIRE_SLICE; budget > 0; --budget) {
+		head = &t->wheel[t->wheel_tick % ARP_WHEEL_SLOTS];
+		if (*head == ARP_NONE) {
+			/* nothing left in this slot, move on */
+			if (t->wheel_tick >= tick)
+				break;
+			t->wheel_tick++;
+			continue;
+		}
+		li = *head;
+		l = &t->leaf[li];
+		arp_wheel_remove(t, li);
+		if ((deadline = arp_deadline(l)) > now) {
+			/* refreshed since it was queued */
+			if (deadline / ARP_WHEEL_TICK <= t->wheel_tick)
+				deadline = (t->wheel_tick + 1) * ARP_WHEEL_TICK;
+			arp_wheel_insert(t, li, deadline);
+			continue;
+		}
+		ft_verbose("arp: %s %d.%d.%d.%d",
+		    l->claimed ? "releasing" : "expiring",
+		    (l->addr >> 24) & 0xff, (l->addr >> 16) & 0xff,
+		    (l->addr >> 8) & 0xff, l->addr & 0xff);
+		if (l->claimed) {
+			t->nclaimed--;
+			t->released++;
+		} else {
+			t->expired++;
+		}
+		arp_remove(t, li);
+	}
+}
+
+void
+arp_expire(iface *i, uint64_t now)
+{
+	struct arp_table *t;
+
+	for (t = i->arp; t != NULL; t = t->next)
+		arp_expire_table(t, now);
+}
+
+/*
+ * Broadcast gratuitous replies for the addresses we have claimed, so
+ * neighbouring routers keep them in their caches instead of asking for
+ * them over and over.  Each tree is swept once every ft_arp_announce
+ * seconds, a few frames at a time, so the transmit queue does not
+ * overflow and traffic is not held up.  Trees whose tags we have not
+ * seen yet, e.g. right after loading a snapshot, wait for the first
+ * request we answer.  Returns the number of frames queued.
+ */
+unsigned int
+arp_announce(iface *i, uint64_t now)
+{
+	static const ether_addr bcast =
+	    {{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }};
+	struct arp_table *t;
+	struct arpl *l;
+	unsigned int n, scan;
+	arp_pkt *ap;
+	txbuf tb;
+
+	if (ft_arp_announce == 0)
+		return (0);
+	n = 0;
+	scan = ARP_ANNOUNCE_SCAN;
+	for (t = i->arp; t != NULL && n < ARP_ANNOUNCE_BATCH && scan > 0;
+	    t = t->next) {
+		if (now < t->anext)
+			continue;
+		if (t->nclaimed == 0 || !t->tagged)
+			t->apos = t->nleaf;
+		for (; t->apos < t->nleaf && n < ARP_ANNOUNCE_BATCH &&
+		    scan > 0; ++t->apos, --scan) {
+			l = &t->leaf[t->apos];
+			if (!l->used || !l->claimed)
+				continue;
+			if (iface_txbuf(i, &tb) != 0 ||
+			    (ap = txbuf_append(&tb, sizeof *ap)) == NULL)
+				return (n);
+			memcpy(ap, &t->is_at, sizeof *ap);
+			ap->spa.q = ap->tpa.q = htobe32(l->addr);
+			memcpy(&ap->tha, &bcast, sizeof(ether_addr));
+			if (ethernet_send(&tb, &t->tags, ether_type_arp,
+			    &bcast) != 0)
+				return (n);
+			STATS_INC(i, arp_announced);
+			n++;
+		}
+		if (t->apos >= t->nleaf) {
+			/* done, start over later */
+			t->apos = 0;
+			t->anext = now + ft_arp_announce * 1000ULL;
+		}
+	}
+	return (n);
+}
+
+/*
+ * Look up an address in a tree.
+ */
+static struct arpl *
+arp_find(const struct arp_table *t, uint32_t addr)
+{
+	const struct arpi *n;
+	unsigned int d, bit;
+	uint32_t k;
+
+	if (t == NULL)
+		return (NULL);
+	n = &t->inner[0];
+	for (d = 0; d < ARP_DEPTH; ++d) {
+		bit = 1U << ((addr >> (28 - 4 * d)) & 0xf);
+		if (!(n->map & bit))
 			return (NULL);
-		sn->addr = n->addr | (sub << (32 - splen));
-		sn->plen = splen;
-		sn->first = sn->last = when;
-		ft_debug("added node %08x/%d", sn->addr, sn->plen);
-		if (sn->plen == 32) {
-			ft_verbose("arp: inserted %d.%d.%d.%d",
-			    (addr >> 24) & 0xff, (addr >> 16) & 0xff,
-			    (addr >> 8) & 0xff, addr & 0xff);
+		k = t->kids[n->kids + arp_popcount(n->map & (bit - 1))];
+		if (d == ARP_DEPTH - 1)
+			return (&t->leaf[k]);
+		n = &t->inner[k];
+	}
+	return (NULL);
+}
+
+/*
+ * Undo a partial insertion which ran out of room at the given depth:
+ * release the interior nodes it added, which are still empty or lead
+ * only to other nodes it added, and detach the topmost one from the
+ * node it hangs off, so that nothing is left behind which eviction
+ * could not reclaim.
+ */
+static void
+arp_unwind(struct arp_table *t, const uint32_t *path, uint32_t addr,
+    unsigned int d)
+{
+	struct arpi *n;
+	unsigned int cnt, pos, bit;
+
+	for (; d > 0; --d) {
+		n = &t->inner[path[d]];
+		if (n->map != 0)
+			break;
+		if (n->kids != ARP_NONE)
+			arp_kids_free(t, n->kids, n->cls);
+		n->kids = t->ifree;
+		t->ifree = path[d];
+		n = &t->inner[path[d - 1]];
+		bit = 1U << ((addr >> (28 - 4 * (d - 1))) & 0xf);
+		pos = arp_popcount(n->map & (bit - 1));
+		cnt = arp_popcount(n->map);
+		memmove(t->kids + n->kids + pos, t->kids + n->kids + pos + 1,
+		    (cnt - pos - 1) * sizeof *t->kids);
+		n->map &= ~bit;
+	}
+}
+
+/*
+ * Insert an address into a tree, or find it if it is already there.
+ * Fails with ENOSPC if the tree has used up its budget; either way, a
+ * failed insertion leaves the tree as it was.
+ */
+static struct arpl *
+arp_insert_leaf(struct arp_table *t, uint32_t addr, uint64_t when)
+{
+	uint32_t path[ARP_DEPTH];
+	struct arpl *l;
+	unsigned int d, n, pos, bit;
+	uint32_t ni, k;
+
+	for (ni = 0, d = 0; d < ARP_DEPTH; ++d, ni = k) {
+		path[d] = ni;
+		bit = 1U << ((addr >> (28 - 4 * d)) & 0xf);
+		pos = arp_popcount(t->inner[ni].map & (bit - 1));
+		if (t->inner[ni].map & bit) {
+			k = t->kids[t->inner[ni].kids + pos];
+			continue;
+		}
+		if (arp_kids_reserve(t, ni) != 0)
+			goto fail;
+		if (d == ARP_DEPTH - 1) {
+			if ((k = t->lfree) != ARP_NONE) {
+				t->lfree = t->leaf[k].wnext;
+			} else {
+				if (t->nleaf == t->maxleaf &&
+				    arp_table_grow(t, &t->leaf, &t->maxleaf,
+				    sizeof *t->leaf, 64) != 0)
+					goto fail;
+				k = t->nleaf++;
+			}
+			l = &t->leaf[k];
+			memset(l, 0, sizeof *l);
+			l->used = 1;
+			l->addr = addr;
+			l->first = l->last = when;
+			t->nleaves++;
+			if (t->wheel_tick == 0)
+				t->wheel_tick = when / ARP_WHEEL_TICK;
+			arp_wheel_insert(t, k, arp_deadline(l));
+			if (!arp_bulk)
+				ft_verbose("arp: inserted %d.%d.%d.%d",
+				    (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+				    (addr >> 8) & 0xff, addr & 0xff);
+		} else {
+			if ((k = t->ifree) != ARP_NONE) {
+				t->ifree = t->inner[k].kids;
+			} else {
+				if (t->ninner == t->maxinner &&
+				    arp_table_grow(t, &t->inner, &t->maxinner,
+				    sizeof *t->inner, 64) != 0)
+					goto fail;
+				k = t->ninner++;
+			}
+			t->inner[k].map = 0;
+			t->inner[k].cls = 0;
+			t->inner[k].kids = ARP_NONE;
+			ft_debug("added node %08x/%d",
+			    addr & ~(0xffffffffU >> (4 * d + 4)), 4 * d + 4);
+		}
+		n = arp_popcount(t->inner[ni].map);
+		memmove(t->kids + t->inner[ni].kids + pos + 1,
+		    t->kids + t->inner[ni].kids + pos,
+		    (n - pos) * sizeof *t->kids);
+		t->kids[t->inner[ni].kids + pos] = k;
+		t->inner[ni].map |= bit;
+	}
+	t->leaf[ni].ref = 1;
+	return (&t->leaf[ni]);
+fail:
+	arp_unwind(t, path, addr, d);
+	return (NULL);
+}
+
+/*
+ * Evict up to n leaves from a tree to make room for others, and return
+ * the number evicted.  Victims are chosen by the CLOCK algorithm: the
+ * hand sweeps the leaf pool, and a leaf which has been touched since
+ * the hand last went by gets a second chance.  Leaves with unanswered
+ * requests are also passed over on the first lap.  Claimed and
+ * reserved leaves are never evicted.
+ *
+ * Only the tree being inserted into is searched.  The budget covers
+ * all of an interface's trees, but the arrays never shrink, so a slot
+ * freed in one tree can only ever be reused by that tree; evicting
+ * from the others would lose entries without making any room.  Once
+ * the budget has been spent, each VLAN is therefore limited to the
+ * memory its tree already holds.
+ */
+static unsigned int
+arp_evict(struct arp_table *t, unsigned int n)
+{
+	struct arpl *l;
+	uint64_t steps;
+	unsigned int k;
+	uint32_t li;
+
+	for (k = 0, steps = 0; k < n && steps < 3ULL * t->nleaf; ++steps) {
+		li = t->hand;
+		if (++t->hand >= t->nleaf)
+			t->hand = 0;
+		l = &t->leaf[li];
+		if (!l->used || l->claimed || l->reserved)
+			continue;
+		if (l->ref) {
+			l->ref = 0;
+			continue;
 		}
-		n->sub[sub] = sn;
+		if (l->nreq > 0 && steps < t->nleaf)
+			continue;
+		ft_debug("arp: evicting %d.%d.%d.%d",
+		    (l->addr >> 24) & 0xff, (l->addr >> 16) & 0xff,
+		    (l->addr >> 8) & 0xff, l->addr & 0xff);
+		arp_wheel_remove(t, li);
+		arp_remove(t, li);
+		STATS_INC(t->i, arp_evicted);
+		k++;
 	}
-	if ((rn = arp_insert(sn, addr, when)) == NULL)
+	return (k);
+}
+
+/*
+ * Insert an address into a tree, evicting other leaves if the tree is
+ * over budget.  If no room can be made, the address is not inserted.
+ */
+static struct arpl *
+arp_insert(struct arp_table *t, uint32_t addr, uint64_t when)
+{
+	struct arpl *l;
+	unsigned int tries;
+
+	if (t == NULL)
 		return (NULL);
-#if 0
-	if (sn->last > n->last)
-		n->last = sn->last;
-#endif
-	return (rn);
+	for (tries = 0; tries < ARP_EVICT_TRIES; ++tries) {
+		if ((l = arp_insert_leaf(t, addr, when)) != NULL ||
+		    errno != ENOSPC)
+			return (l);
+		if (arp_evict(t, ARP_EVICT_BATCH) == 0)
+			break;
+	}
+	STATS_INC(t->i, arp_full);
+	errno = ENOSPC;
+	return (NULL);
 }
 
 /*
  * ARP registration
  */
 int
-arp_register(const ip4_addr *ip4, const ether_addr *ether, uint64_t when)
+arp_register(iface *i, uint32_t vlan, const ip4_addr *ip4,
+    const ether_addr *ether, uint64_t when)
 {
-	struct arpn *an;
+	struct arp_table *t;
+	struct arpl *an;
 
-	if ((an = arp_insert(NULL, be32toh(ip4->q), when)) == NULL)
+	t = arp_table(i, vlan);
+	if ((an = arp_insert(t, be32toh(ip4->q), when)) == NULL)
 		return (-1);
 	if (memcmp(&an->ether, ether, sizeof an->ether) != 0) {
 		/* warn if the ip4_addr moved from one ether_addr to another */
@@ -205,6 +929,15 @@ arp_register(const ip4_addr *ip4, const ether_addr *ether, uint64_t when)
 		}
 		memcpy(&an->ether, ether, sizeof an->ether);
 	}
+	if (an->claimed && memcmp(ether, &i->ether, sizeof *ether) != 0) {
+		/* a real host has shown up, back off */
+		ft_verbose("%d.%d.%d.%d: releasing claim",
+		    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3]);
+		an->claimed = 0;
+		t->nclaimed--;
+		t->conflicts++;
+	}
+	an->last = when;
 	an->nreq = 0;
 	return (0);
 }
@@ -213,21 +946,14 @@ arp_register(const ip4_addr *ip4, const ether_addr *ether, uint64_t when)
  * ARP lookup
  */
 int
-arp_lookup(const ip4_addr *ip4, ether_addr *ether)
-{
-	struct arpn *an;
-
-	ft_debug("ARP lookup %d.%d.%d.%d",
-	    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3]);
-	an = &arp_root;
-	if ((an = an->sub[ip4->o[0] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[0] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[1] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[1] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[2] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[2] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[3] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[3] % 16]) == NULL)
+arp_lookup(iface *i, uint32_t vlan, const ip4_addr *ip4, ether_addr *ether)
+{
+	struct arpl *an;
+
+	ft_debug("ARP lookup %d.%d.%d.%d vlan %u",
+	    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3], vlan);
+	if ((an = arp_find(arp_table_find(i, vlan, NULL),
+	    be32toh(ip4->q))) == NULL)
 		return (-1);
 	memcpy(ether, &an->ether, sizeof(ether_addr));
 	ft_debug("%d.%d.%d.%d is"
@@ -239,25 +965,32 @@ arp_lookup(const ip4_addr *ip4, ether_addr *ether)
 }
 
 /*
- * Claim an IP address
+ * Claim an IP address.  The reply is copied from the table's template,
+ * and only the addresses are filled in.  There may not be a table if
+ * the budget did not allow one for a new VLAN, see arp_table().
  */
 static int
-arp_reply(ether_flow *fl, const arp_pkt *iap, struct arpn *an)
-{
-	arp_pkt ap;
-
-	(void)an;
-
-	ap.htype = htobe16(arp_type_ether);
-	ap.ptype = htobe16(arp_type_ip4);
-	ap.hlen = 6;
-	ap.plen = 4;
-	ap.oper = htobe16(arp_oper_is_at);
-	memcpy(&ap.sha, &fl->p->i->ether, sizeof(ether_addr));
-	memcpy(&ap.spa, &iap->tpa, sizeof(ip4_addr));
-	memcpy(&ap.tha, &iap->sha, sizeof(ether_addr));
-	memcpy(&ap.tpa, &iap->spa, sizeof(ip4_addr));
-	if (ethernet_reply(fl, &ap, sizeof ap) != 0)
+arp_reply(ether_flow *fl, const arp_pkt *iap, struct arp_table *t)
+{
+	arp_pkt *ap, tmpl;
+	txbuf tb;
+
+	if (ft_rl_arp && !ratelimit_check(fl->p->i, &iap->spa, &fl->p->ts))
+		return (0);
+	if (t == NULL)
+		arp_template(&tmpl, fl->p->i);
+	else if (!t->tagged) {
+		t->tags = fl->vlan;
+		t->tagged = 1;
+	}
+	if (iface_txbuf(fl->p->i, &tb) != 0 ||
+	    (ap = txbuf_append(&tb, sizeof *ap)) == NULL)
+		return (-1);
+	memcpy(ap, t != NULL ? &t->is_at : &tmpl, sizeof *ap);
+	memcpy(&ap->spa, &iap->tpa, sizeof(ip4_addr));
+	memcpy(&ap->tha, &iap->sha, sizeof(ether_addr));
+	memcpy(&ap->tpa, &iap->spa, sizeof(ip4_addr));
+	if (ethernet_reply(fl, &tb) != 0)
 		return (-1);
 	return (0);
 }
@@ -266,13 +999,13 @@ arp_reply(ether_flow *fl, const arp_pkt *iap, struct arpn *an)
  * Register a reserved address
  */
 int
-arp_reserve(const ip4_addr *addr)
+arp_reserve(iface *i, uint32_t vlan, const ip4_addr *addr)
 {
-	struct arpn *an;
+	struct arpl *an;
 
-	ft_debug("arp: reserving %d.%d.%d.%d",
-	    addr->o[0], addr->o[1], addr->o[2], addr->o[3]);
-	if ((an = arp_insert(NULL, be32toh(addr->q), 0)) == NULL)
+	ft_debug("arp: reserving %d.%d.%d.%d vlan %u",
+	    addr->o[0], addr->o[1], addr->o[2], addr->o[3], vlan);
+	if ((an = arp_insert(arp_table(i, vlan), be32toh(addr->q), 0)) == NULL)
 		return (-1);
 	an->reserved = 1;
 	return (0);
@@ -280,18 +1013,28 @@ arp_reserve(const ip4_addr *addr)
 
 /*
  * Analyze a captured ARP packet
+ *
+ * We claim an address after three unanswered requests for it, except
+ * in the dark set, where requests are answered right away and without
+ * adding the address to the table.  Only exceptions, i.e. reserved
+ * addresses and addresses where a real host has been seen, have leaves
+ * there, and the usual rules apply to them.
  */
 int
 packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 {
+	const ip4s_frozen *set;
+	struct arp_table *t;
 	const arp_pkt *ap;
-	struct arpn *an;
+	struct arpl *an;
 	uint64_t when;
+	iface *i;
 
 	if (len < sizeof(arp_pkt)) {
 		ft_notice("%d.%03d short ARP packet (%zd < %zd)",
 		    fl->p->ts.tv_sec, fl->p->ts.tv_usec / 1000,
 		    len, sizeof(arp_pkt));
+		STATS_INC(fl->p->i, arp_short);
 		return (-1);
 	}
 	ap = (const arp_pkt *)data;
@@ -300,6 +1043,7 @@ packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 	if (be16toh(ap->htype) != arp_type_ether || ap->hlen != 6 ||
 	    be16toh(ap->ptype) != arp_type_ip4 || ap->plen != 4) {
 		ft_debug("\tARP packet ignored");
+		STATS_INC(fl->p->i, arp_ignored);
 		return (0);
 	}
 	switch (be16toh(ap->oper)) {
@@ -318,15 +1062,29 @@ packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 		return (0);
 	}
 	when = fl->p->ts.tv_sec * 1000 + fl->p->ts.tv_usec / 1000;
+	i = fl->p->i;
 	switch (be16toh(ap->oper)) {
 	case arp_oper_who_has:
 		/* ARP request */
-		if (dst_set && !ip4s_lookup(dst_set, be32toh(ap->tpa.q))) {
+		STATS_INC(i, arp_request);
+		if ((set = SET_LOAD(dst_set)) != NULL &&
+		    !ip4s_frozen_lookup(set, be32toh(ap->tpa.q))) {
 			ft_debug("\ttarget address is out of bounds");
 			break;
 		}
-		arp_register(&ap->spa, &ap->sha, when);
-		if ((an = arp_insert(NULL, be32toh(ap->tpa.q), when)) == NULL)
+		arp_register(i, fl->vkey, &ap->spa, &ap->sha, when);
+		t = arp_table(i, fl->vkey);
+		if ((set = SET_LOAD(dark_set)) != NULL &&
+		    ip4s_frozen_lookup(set, be32toh(ap->tpa.q)) &&
+		    arp_find(t, be32toh(ap->tpa.q)) == NULL) {
+			/* dark space, ours unless we know better */
+			ft_debug("\ttarget address is dark");
+			STATS_INC(i, arp_dark);
+			if (arp_reply(fl, ap, t) != 0)
+				return (-1);
+			break;
+		}
+		if ((an = arp_insert(t, be32toh(ap->tpa.q), when)) == NULL)
 			return (-1);
 		if (an->last != 0) {
 			ft_verbose("%d.%d.%d.%d: last seen %d.%03d",
@@ -343,7 +1101,7 @@ packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 			    ap->tpa.o[0], ap->tpa.o[1], ap->tpa.o[2], ap->tpa.o[3]);
 			an->nreq = 0;
 			an->last = when;
-			if (arp_reply(fl, ap, an) != 0)
+			if (arp_reply(fl, ap, t) != 0)
 				return (-1);
 		} else if (an->nreq == 0 || when - an->last >= 30000) {
 			/* new or stale, start over */
@@ -354,9 +1112,11 @@ packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 			ft_verbose("claiming %d.%d.%d.%d nreq = %d", ap->tpa.o[0],
 			    ap->tpa.o[1], ap->tpa.o[2], ap->tpa.o[3], an->nreq);
 			an->claimed = 1;
+			t->nclaimed++;
+			STATS_INC(i, arp_claims);
 			an->nreq = 0;
 			an->last = when;
-			if (arp_reply(fl, ap, an) != 0)
+			if (arp_reply(fl, ap, t) != 0)
 				return (-1);
 		} else {
 			an->nreq++;
@@ -365,9 +1125,264 @@ packet_analyze_arp(ether_flow *fl, const void *data, size_t len)
 		break;
 	case arp_oper_is_at:
 		/* ARP reply */
-		arp_register(&ap->spa, &ap->sha, when);
-		arp_register(&ap->tpa, &ap->tha, when);
+		STATS_INC(i, arp_reply);
+		arp_register(i, fl->vkey, &ap->spa, &ap->sha, when);
+		arp_register(i, fl->vkey, &ap->tpa, &ap->tha, when);
 		break;
 	}
 	return (0);
 }
+
+/*
+ * Encode the leaves below a node into the snapshot buffer, which has
+ * room for all of them.
+ */
+static void
+arp_snapshot_node(struct arp_table *t, uint32_t ni, unsigned int depth)
+{
+	const struct arpi *n = &t->inner[ni];
+	const struct arpl *l;
+	unsigned int k;
+	uint64_t span;
+	uint8_t *p;
+
+	for (k = 0; k < arp_popcount(n->map); ++k) {
+		if (depth < ARP_DEPTH - 1) {
+			arp_snapshot_node(t, t->kids[n->kids + k], depth + 1);
+			continue;
+		}
+		l = &t->leaf[t->kids[n->kids + k]];
+		p = t->snap + (size_t)t->nsnap++ * ARP_SNAP_RECSIZE;
+		be32enc(p, l->addr);
+		memcpy(p + 4, &l->ether, sizeof l->ether);
+		p[10] = (l->claimed ? ARP_SNAP_CLAIMED : 0) |
+		    (l->reserved ? ARP_SNAP_RESERVED : 0);
+		p[11] = l->nreq > 255 ? 255 : l->nreq;
+		span = l->last > l->first ? l->last - l->first : 0;
+		be32enc(p + 12, span > UINT32_MAX ? UINT32_MAX : span);
+		be64enc(p + 16, l->last);
+		be32enc(p + 24, t->vlan);
+	}
+}
+
+/*
+ * Take a snapshot of an interface's trees, for arp_save() to write out.
+ * Only the worker which owns the trees may call this, and arp_save()
+ * must not be running at the same time.
+ */
+int
+arp_snapshot(iface *i)
+{
+	struct arp_table *t;
+	uint8_t *p;
+
+	for (t = i->arp; t != NULL; t = t->next) {
+		if (t->nleaves > t->maxsnap) {
+			if ((p = realloc(t->snap,
+			    (size_t)t->nleaves * ARP_SNAP_RECSIZE)) == NULL)
+				return (-1);
+			t->snap = p;
+			t->maxsnap = t->nleaves;
+		}
+		t->nsnap = 0;
+		arp_snapshot_node(t, 0, 0);
+	}
+	return (0);
+}
+
+/*
+ * Write the latest snapshots of each interface's trees to a file.  The
+ * file is replaced atomically.
+ */
+int
+arp_save(const char *fn, iface **ifs, unsigned int n)
+{
+	uint8_t hdr[ARP_SNAP_HDRSIZE];
+	struct arp_table *t;
+	struct timeval now;
+	char tmpfn[1024];
+	unsigned int k;
+	uint32_t count;
+	FILE *f;
+	int serrno;
+
+	if ((size_t)snprintf(tmpfn, sizeof tmpfn, "%s.tmp", fn) >=
+	    sizeof tmpfn) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	for (count = 0, k = 0; k < n; ++k)
+		for (t = __atomic_load_n(&ifs[k]->arp, __ATOMIC_ACQUIRE);
+		    t != NULL; t = t->next)
+			count += t->nsnap;
+	gettimeofday(&now, NULL);
+	memset(hdr, 0, sizeof hdr);
+	be32enc(hdr, ARP_SNAP_MAGIC);
+	be16enc(hdr + 4, ARP_SNAP_VERSION);
+	be16enc(hdr + 6, ARP_SNAP_RECSIZE);
+	be32enc(hdr + 8, count);
+	be64enc(hdr + 16, now.tv_sec * 1000ULL + now.tv_usec / 1000);
+	if ((f = fopen(tmpfn, "w")) == NULL)
+		return (-1);
+	fwrite(hdr, sizeof hdr, 1, f);
+	for (k = 0; k < n; ++k)
+		for (t = __atomic_load_n(&ifs[k]->arp, __ATOMIC_ACQUIRE);
+		    t != NULL; t = t->next)
+			if (t->nsnap > 0)
+				fwrite(t->snap, ARP_SNAP_RECSIZE, t->nsnap, f);
+	if (ferror(f) || fclose(f) != 0) {
+		serrno = errno;
+		unlink(tmpfn);
+		errno = serrno;
+		return (-1);
+	}
+	if (rename(tmpfn, fn) != 0) {
+		serrno = errno;
+		unlink(tmpfn);
+		errno = serrno;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Decode the latest snapshots of an interface's trees into records for
+ * the shared memory segment, see shm_publish().  Fills in at most max
+ * records, and returns the number of entries in the snapshots, which
+ * may be more.  The same rules apply as for arp_save().
+ */
+uint32_t
+arp_publish(iface **ifs, unsigned int n, uint32_t index, ft_shm_arp *rec,
+    uint32_t max)
+{
+	struct arp_table *t;
+	const uint8_t *p;
+	unsigned int k;
+	uint32_t count, j, span;
+
+	for (count = 0, k = 0; k < n; ++k) {
+		for (t = __atomic_load_n(&ifs[k]->arp, __ATOMIC_ACQUIRE);
+		    t != NULL; t = t->next) {
+			for (j = 0; j < t->nsnap; ++j, ++count) {
+				if (count >= max)
+					continue;
+				p = t->snap + (size_t)j * ARP_SNAP_RECSIZE;
+				rec->addr = be32dec(p);
+				memcpy(rec->ether, p + 4, sizeof rec->ether);
+				rec->flags = 0;
+				if (p[10] & ARP_SNAP_CLAIMED)
+					rec->flags |= FT_SHM_CLAIMED;
+				if (p[10] & ARP_SNAP_RESERVED)
+					rec->flags |= FT_SHM_RESERVED;
+				rec->nreq = p[11];
+				span = be32dec(p + 12);
+				rec->last = be64dec(p + 16);
+				rec->first = rec->last - span;
+				rec->vlan = be32dec(p + 24);
+				rec->iface = index;
+				rec->reserved = 0;
+				rec++;
+			}
+		}
+	}
+	return (count);
+}
+
+/*
+ * Restore the trees from a snapshot file, giving each address to the
+ * worker the fanout program steers it to.  Entries which would have
+ * expired in the meantime are skipped, as are claims on addresses we
+ * are no longer allowed to claim.  Returns the number of entries
+ * restored, or -1 if the file could not be read.
+ */
+int
+arp_load(const char *fn, iface **ifs, unsigned int n)
+{
+	struct arp_table *t;
+	struct timeval tv;
+	struct stat st;
+	struct arpl *l;
+	uint8_t *base, *p;
+	uint64_t now, first, last, timeout;
+	uint32_t addr, count, span, vlan, k;
+	unsigned int version, recsize;
+	int fd, flags, ret, serrno;
+
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return (-1);
+	if (fstat(fd, &st) != 0) {
+		serrno = errno;
+		close(fd);
+		errno = serrno;
+		return (-1);
+	}
+	if (st.st_size < ARP_SNAP_HDRSIZE) {
+		close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	serrno = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		errno = serrno;
+		return (-1);
+	}
+	version = be16dec(base + 4);
+	recsize = be16dec(base + 6);
+	count = be32dec(base + 8);
+	if (be32dec(base) != ARP_SNAP_MAGIC ||
+	    ((version != 1 || recsize != ARP_SNAP_V1_RECSIZE) &&
+	    (version != ARP_SNAP_VERSION || recsize != ARP_SNAP_RECSIZE)) ||
+	    (uint64_t)st.st_size !=
+	    ARP_SNAP_HDRSIZE + (uint64_t)count * recsize) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return (-1);
+	}
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+	arp_bulk = 1;
+	p = base + ARP_SNAP_HDRSIZE;
+	for (ret = 0, k = 0; k < count; ++k, p += recsize) {
+		addr = be32dec(p);
+		vlan = version > 1 ? be32dec(p + 24) : 0;
+		flags = p[10];
+		span = be32dec(p + 12);
+		last = be64dec(p + 16);
+		first = last > span ? last - span : 0;
+		timeout = (flags & ARP_SNAP_CLAIMED) ?
+		    ft_arp_claim_timeout : ft_arp_timeout;
+		if (!(flags & ARP_SNAP_RESERVED) &&
+		    last + timeout * 1000 <= now)
+			continue;
+		if (dst_set != NULL && !ip4s_frozen_lookup(dst_set, addr))
+			flags &= ~ARP_SNAP_CLAIMED;
+		if ((t = arp_table(ifs[n > 1 ? addr % n : 0], vlan)) == NULL) {
+			ret = -1;
+			break;
+		}
+		if ((l = arp_find(t, addr)) != NULL && l->last >= last)
+			continue;
+		if ((l = arp_insert(t, addr, last)) == NULL) {
+			ret = -1;
+			break;
+		}
+		if (l->claimed)
+			t->nclaimed--;
+		memcpy(&l->ether, p + 4, sizeof l->ether);
+		l->claimed = !!(flags & ARP_SNAP_CLAIMED);
+		l->reserved = !!(flags & ARP_SNAP_RESERVED);
+		l->nreq = p[11];
+		l->first = first;
+		l->last = last;
+		if (l->claimed)
+			t->nclaimed++;
+		ret++;
+	}
+	arp_bulk = 0;
+	serrno = errno;
+	munmap(base, st.st_size);
+	errno = serrno;
+	return (ret);
+}
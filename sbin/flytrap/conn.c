@@ -0,0 +1,332 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ethernet.h>
+#include <ft/hash.h>
+#include <ft/hist.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/*
+ * Tarpitted TCP sessions
+ *
+ * The TCP code needs no state to keep a session going, see tcp4.c, but
+ * we track the ones which send us data or window probes after the
+ * handshake to find out how long we hold them and what they send us.
+ * Bare acknowledgements only keep an existing entry alive; otherwise
+ * the last ACK of a FIN exchange would bring back a session which has
+ * just been closed.  Each interface has a table of
+ * fixed size, allocated when the interface is opened, so the cost of
+ * tracking does not depend on what a scanner does to us.
+ *
+ * The table is an array of sets of CONN_WAYS entries, one cache line
+ * per set.  A session can only live in the set its 4-tuple hashes to,
+ * where it is identified by a second, independent 32-bit hash of the
+ * 4-tuple.  If it is not there, it takes over the least recently used
+ * entry in the set.
+ */
+#define CONN_WAYS	 3
+#define CONN_EXPIRE_SLICE 64		/* max sets per conn_expire() call */
+
+unsigned int ft_conn_table = 65536;	/* sessions per interface */
+unsigned int ft_conn_timeout = 900;	/* seconds of silence */
+
+struct conn_ent {
+	uint32_t	 tag;		/* 0 if unused */
+	uint32_t	 start;		/* first seen, in milliseconds */
+	uint32_t	 last;		/* last seen */
+	uint32_t	 bytes;		/* data offered to us */
+	uint32_t	 probes;	/* data segments and window probes */
+};
+
+struct conn_set {
+	struct conn_ent	 ent[CONN_WAYS];
+	uint32_t	 pad;
+} __attribute__((__aligned__(64)));
+
+struct conn_table {
+	struct conn_set	*sets;
+	uint32_t	 nsets;
+	uint64_t	 seed;
+	uint32_t	 sweep;		/* next set to check for expiry */
+	unsigned long	 active;	/* entries in use */
+	ft_hist		 held;		/* session durations, in ms */
+};
+
+/*
+ * Allocate an interface's session table.
+ */
+int
+conn_create(iface *i)
+{
+	struct conn_table *ct;
+
+	if ((ct = calloc(1, sizeof *ct)) == NULL)
+		return (-1);
+	ct->nsets = (ft_conn_table + CONN_WAYS - 1) / CONN_WAYS;
+	if (posix_memalign((void **)&ct->sets, sizeof *ct->sets,
+	    (size_t)ct->nsets * sizeof *ct->sets) != 0) {
+		free(ct);
+		return (-1);
+	}
+	memset(ct->sets, 0, (size_t)ct->nsets * sizeof *ct->sets);
+	ct->seed = ft_hash_u64(ft_hash_seed, (uintptr_t)ct);
+	i->conn = ct;
+	return (0);
+}
+
+static inline uint32_t
+conn_ms(const struct timeval *tv)
+{
+
+	return (tv->tv_sec * 1000U + tv->tv_usec / 1000);
+}
+
+/*
+ * Find a session's entry, or NULL if it is not being tracked.
+ */
+static struct conn_ent *
+conn_find(struct conn_table *ct, const ip4_flow *fl, const tcp4_hdr *th,
+    struct conn_set **setp, uint32_t *tagp)
+{
+	struct conn_set *set;
+	uint64_t h;
+	uint32_t tag;
+	unsigned int w;
+
+	h = ft_hash_ip4_flow64(ct->seed, fl->src.q, fl->dst.q,
+	    th->sp, th->dp);
+	set = &ct->sets[ft_hash_reduce(h >> 32, ct->nsets)];
+	if ((tag = (uint32_t)h) == 0)
+		tag = 1;
+	*setp = set;
+	*tagp = tag;
+	for (w = 0; w < CONN_WAYS; ++w)
+		if (set->ent[w].tag == tag)
+			return (&set->ent[w]);
+	return (NULL);
+}
+
+/*
+ * Stop tracking a session and record how long we held it.
+ */
+static void
+conn_end(iface *i, const ip4_flow *fl, const tcp4_hdr *th,
+    struct conn_ent *ce, const char *why)
+{
+	struct conn_table *ct = i->conn;
+	uint32_t held;
+
+	held = ce->last - ce->start;
+	ft_hist_add(&ct->held, held);
+	if (fl != NULL) {
+		ft_verbose("tcp4 session %u.%u.%u.%u:%hu to %u.%u.%u.%u:%hu "
+		    "%s after %u.%03u s, %u bytes in %u probes",
+		    fl->src.o[0], fl->src.o[1], fl->src.o[2], fl->src.o[3],
+		    (unsigned short)be16toh(th->sp),
+		    fl->dst.o[0], fl->dst.o[1], fl->dst.o[2], fl->dst.o[3],
+		    (unsigned short)be16toh(th->dp),
+		    why, held / 1000, held % 1000, ce->bytes, ce->probes);
+	}
+	ce->tag = 0;
+	__atomic_store_n(&ct->active, ct->active - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a segment which belongs to one of our sessions, starting to
+ * track the session if we weren't already.
+ */
+void
+conn_track(ip4_flow *fl, const tcp4_hdr *th, size_t len, int probe)
+{
+	iface *i = fl->eth->p->i;
+	struct conn_table *ct = i->conn;
+	struct conn_set *set;
+	struct conn_ent *ce;
+	uint32_t now, tag;
+	unsigned int w;
+
+	now = conn_ms(&fl->eth->p->ts);
+	if ((ce = conn_find(ct, fl, th, &set, &tag)) != NULL &&
+	    now - ce->last > ft_conn_timeout * 1000U) {
+		/* this is a new session on an old 4-tuple */
+		STATS_INC(i, tcp4_sessions_expired);
+		conn_end(i, NULL, NULL, ce, "expired");
+		ce = NULL;
+	}
+	if (ce == NULL) {
+		/* take over an unused entry or the least recently used */
+		for (ce = &set->ent[0], w = 1; w < CONN_WAYS && ce->tag != 0;
+		    ++w)
+			if (set->ent[w].tag == 0 ||
+			    now - set->ent[w].last > now - ce->last)
+				ce = &set->ent[w];
+		if (ce->tag != 0) {
+			if (now - ce->last > ft_conn_timeout * 1000U)
+				STATS_INC(i, tcp4_sessions_expired);
+			else
+				STATS_INC(i, tcp4_sessions_evicted);
+			conn_end(i, NULL, NULL, ce, "evicted");
+		}
+		ce->tag = tag;
+		ce->start = now;
+		ce->bytes = ce->probes = 0;
+		__atomic_store_n(&ct->active, ct->active + 1,
+		    __ATOMIC_RELAXED);
+		STATS_INC(i, tcp4_sessions);
+	}
+	ce->last = now;
+	ce->bytes += len;
+	ce->probes += probe;
+}
+
+/*
+ * Record a bare acknowledgement, which only counts if we are already
+ * tracking the session.
+ */
+void
+conn_touch(ip4_flow *fl, const tcp4_hdr *th)
+{
+	struct conn_set *set;
+	struct conn_ent *ce;
+	uint32_t tag;
+
+	if ((ce = conn_find(fl->eth->p->i->conn, fl, th, &set, &tag)) != NULL)
+		ce->last = conn_ms(&fl->eth->p->ts);
+}
+
+/*
+ * Forget sessions which have been idle for too long.  Otherwise this
+ * only happens when another session needs the entry, so the gauge
+ * would only ever go up on a quiet interface.  Each call checks a few
+ * sets, and a full sweep takes nsets / CONN_EXPIRE_SLICE calls.
+ */
+void
+conn_expire(iface *i, uint64_t now)
+{
+	struct conn_table *ct;
+	struct conn_set *set;
+	struct conn_ent *ce;
+	unsigned int n, w;
+	int32_t idle;
+
+	if ((ct = i->conn) == NULL)
+		return;
+	for (n = 0; n < CONN_EXPIRE_SLICE && n < ct->nsets; ++n) {
+		set = &ct->sets[ct->sweep];
+		if (++ct->sweep == ct->nsets)
+			ct->sweep = 0;
+		for (w = 0; w < CONN_WAYS; ++w) {
+			ce = &set->ent[w];
+			/* packet times may be slightly ahead of ours */
+			idle = (int32_t)((uint32_t)now - ce->last);
+			if (ce->tag != 0 &&
+			    idle > (int32_t)(ft_conn_timeout * 1000U)) {
+				STATS_INC(i, tcp4_sessions_expired);
+				conn_end(i, NULL, NULL, ce, "expired");
+			}
+		}
+	}
+}
+
+/*
+ * The peer has closed or reset a session.
+ */
+void
+conn_close(ip4_flow *fl, const tcp4_hdr *th)
+{
+	iface *i = fl->eth->p->i;
+	struct conn_set *set;
+	struct conn_ent *ce;
+	uint32_t tag;
+
+	if ((ce = conn_find(i->conn, fl, th, &set, &tag)) == NULL)
+		return;
+	ce->last = conn_ms(&fl->eth->p->ts);
+	STATS_INC(i, tcp4_sessions_closed);
+	conn_end(i, fl, th, ce, (th->fl & TCP4_RST) ? "reset" : "closed");
+}
+
+/*
+ * Fill in the session gauge.
+ */
+void
+conn_stats(iface *i, stats *st)
+{
+
+	st->tcp4_sessions_active = i->conn != NULL ?
+	    __atomic_load_n(&i->conn->active, __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * Return the distribution of session durations so far.
+ */
+const ft_hist *
+conn_held(const iface *i)
+{
+
+	return (i->conn != NULL ? &i->conn->held : NULL);
+}
+
+/*
+ * Release an interface's session table.
+ */
+void
+conn_destroy(iface *i)
+{
+	struct conn_table *ct;
+
+	if ((ct = i->conn) == NULL)
+		return;
+	ft_verbose("%s: sessions: %lu active, %lu ended, p50 %llu ms, "
+	    "max %llu ms", i->name, ct->active, ct->held.count,
+	    (unsigned long long)ft_hist_quantile(&ct->held, 0.5),
+	    (unsigned long long)ct->held.max);
+	free(ct->sets);
+	free(ct);
+	i->conn = NULL;
+}
@@ -45,6 +45,7 @@
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
@@ -53,84 +54,153 @@ packet_analyze_ethernet(packet *p, const void *data, size_t len)
 {
 	ether_flow fl;
 	const ether_hdr *eh;
+	const ether_tag *et;
 	int ret;
 
+	STATS_INC(p->i, rx_frames);
+	STATS_ADD(p->i, rx_bytes, len);
+	/*
+	 * With the FCS capture option, drop damaged frames right away.
+	 * A frame captured in part has lost its FCS, so let it through.
+	 */
+	if (ft_iface_fcs && p->len == p->wirelen) {
+		if (len < sizeof(ether_hdr) + sizeof(ether_ftr) ||
+		    ether_crc32(data, len) != ETHER_CRC32_RESIDUE) {
+			ft_debug("%d.%03d bad FCS, discarding %zd bytes",
+			    p->ts.tv_sec, p->ts.tv_usec / 1000, len);
+			STATS_INC(p->i, rx_fcs);
+			return (-1);
+		}
+		len -= sizeof(ether_ftr);
+	}
 	if (len < sizeof(ether_hdr)) {
 		ft_notice("%d.%03d short Ethernet packet (%zd < %zd)",
 		    p->ts.tv_sec, p->ts.tv_usec / 1000,
 		    len, sizeof(ether_hdr));
+		STATS_INC(p->i, ether_short);
 		return (-1);
 	}
 	eh = data;
 	data = eh + 1;
 	len -= sizeof *eh;
-	ft_debug("%d.%03d recv type %04x packet "
-	    "from %02x:%02x:%02x:%02x:%02x:%02x "
-	    "to %02x:%02x:%02x:%02x:%02x:%02x",
-	    p->ts.tv_sec, p->ts.tv_usec / 1000, be16toh(eh->type),
-	    eh->src.o[0], eh->src.o[1], eh->src.o[2],
-	    eh->src.o[3], eh->src.o[4], eh->src.o[5],
-	    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
-	    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5]);
 	fl.p = p;
 	fl.src = eh->src;
 	fl.dst = eh->dst;
 	fl.type = be16toh(eh->type);
+	/* a tag the kernel took off comes first, then any in the frame */
+	fl.vlan.n = 0;
+	if (p->vlan_tpid != 0)
+		fl.vlan.tag[fl.vlan.n++] =
+		    (uint32_t)p->vlan_tpid << 16 | p->vlan_tci;
+	while (fl.type == ether_type_vlan || fl.type == ether_type_qinq) {
+		if (fl.vlan.n == ETHER_VLAN_MAX || len < sizeof(ether_tag)) {
+			ft_debug("%d.%03d too many or truncated VLAN tags",
+			    p->ts.tv_sec, p->ts.tv_usec / 1000);
+			STATS_INC(p->i, ether_other);
+			return (-1);
+		}
+		et = data;
+		fl.vlan.tag[fl.vlan.n++] =
+		    (uint32_t)fl.type << 16 | be16toh(et->tci);
+		fl.type = be16toh(et->type);
+		data = et + 1;
+		len -= sizeof *et;
+	}
+	if (fl.vlan.n > 0)
+		STATS_INC(p->i, ether_vlan);
+	fl.vkey = ether_vlan_key(&fl.vlan);
 	fl.len = len;
+	ft_debug("%d.%03d recv type %04x packet "
+	    "from %02x:%02x:%02x:%02x:%02x:%02x "
+	    "to %02x:%02x:%02x:%02x:%02x:%02x vlan %u",
+	    p->ts.tv_sec, p->ts.tv_usec / 1000, fl.type,
+	    eh->src.o[0], eh->src.o[1], eh->src.o[2],
+	    eh->src.o[3], eh->src.o[4], eh->src.o[5],
+	    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
+	    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5], fl.vkey);
+	STATS_TIMER(t);
 	switch (fl.type) {
 	case ether_type_arp:
+		STATS_INC(p->i, ether_arp);
 		ret = packet_analyze_arp(&fl, data, len);
+		STATS_TIME(p->i, stage_arp, t);
 		break;
 	case ether_type_ip:
+		STATS_INC(p->i, ether_ip4);
 		ret = packet_analyze_ip4(&fl, data, len);
+		STATS_TIME(p->i, stage_ip4, t);
+		break;
+	case ether_type_ipv6:
+		STATS_INC(p->i, ether_ip6);
+		if (p->i->ndp == NULL) {
+			ret = -1;
+			break;
+		}
+		ret = packet_analyze_ip6(&fl, data, len);
+		STATS_TIME(p->i, stage_ip6, t);
 		break;
 	default:
+		STATS_INC(p->i, ether_other);
 		ret = -1;
 	}
 	return (ret);
 }
 
+/*
+ * Prepend an Ethernet header, along with any VLAN tags, to a frame
+ * under construction and queue it for transmission.
+ */
 int
-ethernet_send(iface *i, ether_type type, ether_addr *dst,
-    const void *data, size_t len)
+ethernet_send(txbuf *tb, const ether_vlan *vl, ether_type type,
+    const ether_addr *dst)
 {
-	packet p;
+	struct timeval tv;
 	ether_hdr *eh;
+	unsigned int k, n;
+	uint8_t *q;
 	int ret;
 
-	p.i = i;
-	p.len = sizeof *eh + len;
-	if ((eh = malloc(p.len)) == NULL)
+	n = vl != NULL ? vl->n : 0;
+	if ((eh = txbuf_prepend(tb,
+	    sizeof *eh + n * sizeof(ether_tag))) == NULL)
 		return (-1);
-	p.data = eh;
 	memcpy(&eh->dst, dst, sizeof eh->dst);
-	memcpy(&eh->src, &i->ether, sizeof eh->src);
-	eh->type = htobe16(type);
-	memcpy(eh + 1, data, len);
-	gettimeofday(&p.ts, NULL);
-	ft_debug("%d.%03d send type %04x packet "
-	    "from %02x:%02x:%02x:%02x:%02x:%02x "
-	    "to %02x:%02x:%02x:%02x:%02x:%02x",
-	    p.ts.tv_sec, p.ts.tv_usec / 1000, be16toh(eh->type),
-	    eh->src.o[0], eh->src.o[1], eh->src.o[2],
-	    eh->src.o[3], eh->src.o[4], eh->src.o[5],
-	    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
-	    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5]);
-	ret = iface_transmit(&p);
-	free(eh);
+	memcpy(&eh->src, &tb->i->ether, sizeof eh->src);
+	/* the tags go where the type would, and the type after them */
+	for (q = (uint8_t *)eh + 2 * sizeof(ether_addr), k = 0; k < n;
+	    ++k, q += sizeof(ether_tag)) {
+		be16enc(q, vl->tag[k] >> 16);
+		be16enc(q + 2, vl->tag[k] & 0xffff);
+	}
+	be16enc(q, type);
+	if (ft_log_level <= FT_LOG_LEVEL_DEBUG) {
+		/* not worth a system call per frame otherwise */
+		gettimeofday(&tv, NULL);
+		ft_debug("%d.%03d send type %04x packet "
+		    "from %02x:%02x:%02x:%02x:%02x:%02x "
+		    "to %02x:%02x:%02x:%02x:%02x:%02x vlan %u",
+		    tv.tv_sec, tv.tv_usec / 1000, type,
+		    eh->src.o[0], eh->src.o[1], eh->src.o[2],
+		    eh->src.o[3], eh->src.o[4], eh->src.o[5],
+		    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
+		    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5],
+		    vl != NULL ? ether_vlan_key(vl) : 0);
+	}
+	STATS_TIMER(t);
+	ret = iface_transmit(tb);
+	STATS_TIME(tb->i, stage_transmit, t);
 	if (ret != 0) {
 		ft_warning("failed to send type %04x packet "
 		    "to %02x:%02x:%02x:%02x:%02x:%02x",
-		    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
-		    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5]);
+		    type, dst->o[0], dst->o[1], dst->o[2],
+		    dst->o[3], dst->o[4], dst->o[5]);
 	}
 	return (ret);
 }
 
 int
-ethernet_reply(ether_flow *fl, const void *data, size_t len)
+ethernet_reply(ether_flow *fl, txbuf *tb)
 {
 
-	return (ethernet_send(fl->p->i, fl->type, &fl->src, data, len));
+	return (ethernet_send(tb, &fl->vlan, fl->type, &fl->src));
 }
-
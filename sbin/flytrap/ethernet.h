@@ -30,24 +30,62 @@
 #ifndef FLYTRAP_ETHERNET_H_INCLUDED
 #define FLYTRAP_ETHERNET_H_INCLUDED
 
+struct ft_hist;
+struct ft_shm_arp;
 struct iface;
 struct packet;
+struct stats;
+struct txbuf;
 
 #define FLYTRAP_ETHER_ADDR { 0x02, 0x00, 0x18, 0x11, 0x09, 0x02 }
 extern ether_addr flytrap_ether_addr;
 
-#define FLYTRAP_TCP4_SEQ 0x18110902U
+/*
+ * The 802.1Q tags a frame arrived with, outermost first, which any
+ * reply must carry as well.  Each tag is the TPID in the upper and the
+ * TCI in the lower sixteen bits.  The VLAN key combines the VLAN IDs
+ * into a single number, which is zero for untagged frames.
+ */
+#define ETHER_VLAN_MAX	 2
+
+typedef struct ether_vlan {
+	unsigned int	 n;
+	uint32_t	 tag[ETHER_VLAN_MAX];
+} ether_vlan;
+
+static inline uint32_t
+ether_vlan_key(const ether_vlan *vl)
+{
+	uint32_t key;
+	unsigned int k;
+
+	for (key = 0, k = 0; k < vl->n; ++k)
+		key = key << 12 | ETHER_VID(vl->tag[k]);
+	return (key);
+}
 
 typedef struct ether_flow {
 	struct packet	*p;
 	ether_addr	 src;
 	ether_addr	 dst;
+	ether_vlan	 vlan;
+	uint32_t	 vkey;		/* VLAN key */
 	uint16_t	 type;
 	uint16_t	 len;
 } ether_flow;
 
-extern ip4s_node *src_set;
-extern ip4s_node *dst_set;
+/*
+ * The address sets can be replaced at any time, see flytrap_reload(),
+ * so readers load each pointer once, with SET_LOAD(), and keep using
+ * that copy for the rest of the packet.  The old sets are not freed
+ * until every worker has gone back to its event queue.
+ */
+extern ip4s_frozen *src_set;
+extern ip4s_frozen *dst_set;
+extern ip4s_frozen *dark_set;
+extern unsigned int ft_set_files;
+#define SET_LOAD(set)	 __atomic_load_n(&(set), __ATOMIC_ACQUIRE)
+int set_build(ip4s_frozen **, ip4s_frozen **, ip4s_frozen **, int);
 
 typedef struct ip4_flow {
 	struct ether_flow	*eth;
@@ -64,16 +102,58 @@ typedef struct ip4_flow {
 	uint16_t	 sum;
 } ip4_flow;
 
-int	 arp_register(const ip4_addr *, const ether_addr *, uint64_t);
-int	 arp_lookup(const ip4_addr *, ether_addr *);
+typedef struct ip6_flow {
+	struct ether_flow	*eth;
+	ipv6_addr	 src;
+	ipv6_addr	 dst;
+	uint8_t		 nxt;
+	uint8_t		 hlim;
+	uint16_t	 len;		/* payload length */
+	uint16_t	 sum;		/* pseudo-header sum */
+} ip6_flow;
+
+int	 arp_register(struct iface *, uint32_t, const ip4_addr *,
+    const ether_addr *, uint64_t);
+int	 arp_lookup(struct iface *, uint32_t, const ip4_addr *, ether_addr *);
+int	 arp_reserve(struct iface *, uint32_t, const ip4_addr *);
+void	 arp_expire(struct iface *, uint64_t);
+unsigned int arp_announce(struct iface *, uint64_t);
+void	 arp_destroy(struct iface *);
+void	 arp_stats(struct iface *, struct stats *);
+int	 arp_snapshot(struct iface *);
+int	 arp_save(const char *, struct iface **, unsigned int);
+int	 arp_load(const char *, struct iface **, unsigned int);
+uint32_t arp_publish(struct iface **, unsigned int, uint32_t,
+    struct ft_shm_arp *, uint32_t);
+
+int	 ndp_create(struct iface *);
+void	 ndp_expire(struct iface *, uint64_t);
+void	 ndp_stats(struct iface *, struct stats *);
+void	 ndp_destroy(struct iface *);
+int	 ndp_solicit(ip6_flow *, const void *, size_t);
+int	 ndp_advert(ip6_flow *, const void *, size_t);
+
+int	 ratelimit_check(struct iface *, const ip4_addr *,
+    const struct timeval *);
+void	 ratelimit_destroy(struct iface *);
 
-uint32_t ether_crc32(const uint8_t *, size_t);
+int	 conn_create(struct iface *);
+void	 conn_track(ip4_flow *, const tcp4_hdr *, size_t, int);
+void	 conn_touch(ip4_flow *, const tcp4_hdr *);
+void	 conn_close(ip4_flow *, const tcp4_hdr *);
+void	 conn_expire(struct iface *, uint64_t);
+void	 conn_stats(struct iface *, struct stats *);
+const struct ft_hist *conn_held(const struct iface *);
+void	 conn_destroy(struct iface *);
 
-int	 ethernet_send(struct iface *, ether_type, ether_addr *,
-    const void *, size_t);
-int	 ethernet_reply(struct ether_flow *, const void *, size_t);
+int	 ethernet_send(struct txbuf *, const ether_vlan *, ether_type,
+    const ether_addr *);
+int	 ethernet_reply(struct ether_flow *, struct txbuf *);
 
-int	 ip4_reply(ip4_flow *, ip_proto, const void *, size_t);
+int	 ip4_reply(ip4_flow *, ip_proto, struct txbuf *);
+uint16_t ip6_pseudo_sum(const ipv6_addr *, const ipv6_addr *, uint32_t,
+    uint8_t);
+int	 ip6_reply(ip6_flow *, const ipv6_addr *, uint8_t, struct txbuf *);
 
 
 int	 packet_analyze_ethernet(struct packet *, const void *, size_t);
@@ -82,9 +162,11 @@ int	 packet_analyze_ip4(struct ether_flow *, const void *, size_t);
 int	 packet_analyze_icmp4(struct ip4_flow *, const void *, size_t);
 int	 packet_analyze_udp4(struct ip4_flow *, const void *, size_t);
 int	 packet_analyze_tcp4(struct ip4_flow *, const void *, size_t);
+int	 packet_analyze_ip6(struct ether_flow *, const void *, size_t);
+int	 packet_analyze_icmp6(struct ip6_flow *, const void *, size_t);
 
 int	 log_packet4(const struct timeval *,
     const ip4_addr *, int, const ip4_addr *, int,
-    const char *, size_t, const char *, ...);
+    ip_proto, size_t, unsigned int);
 
 #endif
@@ -27,23 +27,134 @@
  * SUCH DAMAGE.
  */
 
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <sys/types.h>
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_SIGNALFD_H && HAVE_SYS_TIMERFD_H
+#define FLYTRAP_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#elif HAVE_SYS_EVENT_H
+#define FLYTRAP_KQUEUE 1
+#include <sys/event.h>
+#endif
+#include <sys/resource.h>
+#include <sys/time.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#if !FLYTRAP_EPOLL && !FLYTRAP_KQUEUE
+#include <poll.h>
+#endif
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <ft/assert.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
 #include <ft/log.h>
 
 #include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+#include "pipeline.h"
 
 int ft_dryrun;
 const char *ft_logname;
+unsigned int ft_workers = 1;
+
+static volatile sig_atomic_t sighup;
+static volatile sig_atomic_t sigusr1;
+static volatile sig_atomic_t sigterm;
+static volatile int failed;
+static volatile int stopping;
+
+/*
+ * A worker thread serves one capture socket on each of the interfaces
+ * we were given.  It sleeps in an event queue until one of them has
+ * traffic, one of its timers is due, or it is told to stop, and reads
+ * from whichever sockets are ready without blocking.  Worker 0 also
+ * receives the signals.
+ *
+ * Each worker has a handful of periodic tasks, and keeps a single
+ * kernel timer set for the earliest of them: a timerfd with epoll, an
+ * EVFILT_TIMER with kqueue, and the poll() timeout as a last resort.
+ *
+ * In pipeline mode, the worker thread only captures frames and passes
+ * them on to an analysis thread, which queues replies for a transmit
+ * thread; see pipeline.c.  The analysis thread is the only one which
+ * touches the worker's ARP and neighbor tables, so it also looks after
+ * them.
+ */
+#define FLYTRAP_EVENTS	 64
+#define FLYTRAP_TICK	 1000		/* milliseconds */
+#define FLYTRAP_NEVER	 UINT64_MAX
+#define FLYTRAP_STALL	 10		/* milliseconds */
+
+/* event sources other than interfaces */
+#define FLYTRAP_EV_TIMER (UINT32_MAX - 2)
+#define FLYTRAP_EV_SIGNAL (UINT32_MAX - 1)
+#define FLYTRAP_EV_WAKE	 UINT32_MAX
+
+typedef enum flytrap_timer {
+	timer_tick,			/* idle housekeeping */
+	timer_stats,			/* rewrite the stats file */
+	timer_arp,			/* start an ARP snapshot */
+	timer_shm,			/* update the shared memory segment */
+	FLYTRAP_TIMERS
+} flytrap_timer;
 
-static sig_atomic_t sighup;
+struct worker {
+	unsigned int	 id;		/* worker number */
+	int		 eq;		/* event queue */
+	int		 tfd;		/* timer */
+	int		 sfd;		/* signals */
+	uint8_t		*ready;		/* interfaces with traffic */
+	uint64_t	 due[FLYTRAP_TIMERS]; /* monotonic milliseconds */
+	uint64_t	 armed;		/* the kernel timer is set for */
+	unsigned long	 qs;		/* odd while quiescent */
+#if !FLYTRAP_EPOLL && !FLYTRAP_KQUEUE
+	struct pollfd	*pfd;		/* interfaces, then the wake pipe */
+#endif
+
+	/* pipeline mode */
+	struct pipeline_ring *rx;	/* captured frames */
+	struct pipeline_ring *rtn;	/* analyzed frames */
+	struct pipeline_bell txbell;	/* wakes the transmit thread */
+	int		 stalled;	/* out of descriptors */
+	unsigned long	 aqs;		/* qs for the analysis thread */
+	pthread_t	 analyzer;
+	pthread_t	 transmitter;
+	int		 nstages;	/* stage threads running */
+};
+
+static struct iface **ifaces;	/* ft_workers per interface */
+static unsigned int nifaces;	/* number of interfaces */
+static struct worker *workers;	/* one per worker */
+static unsigned int arp_gen;	/* ARP snapshot generation */
+static int wakefd[2] = { -1, -1 }; /* wakes every worker up */
+static unsigned int set_gen;	/* address set generation */
+static pthread_t reload_thread;	/* address set reload */
+static int reload_started;	/* reload_thread must be joined */
+static int reload_busy;		/* reload_thread is running */
+static int draining;		/* pipeline stages done so far */
+
+static const int flytrap_signals[] = { SIGHUP, SIGUSR1, SIGINT, SIGTERM };
+#define FLYTRAP_NSIGNALS (sizeof flytrap_signals / sizeof *flytrap_signals)
+
+#define WORKER_IFACE(w, k) (ifaces[(k) * ft_workers + (w)->id])
 
 static void
 signal_handler(int sig)
@@ -53,42 +164,1179 @@ signal_handler(int sig)
 	case SIGHUP:
 		sighup++;
 		break;
+	case SIGUSR1:
+		sigusr1++;
+		break;
+	case SIGINT:
+	case SIGTERM:
+		sigterm++;
+		break;
 	}
 }
 
-int
-flytrap(const char *iname)
+static uint64_t
+flytrap_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Get every worker out of its event queue, to stop.
+ */
+static void
+flytrap_wake(void)
+{
+
+	if (wakefd[1] >= 0)
+		(void)!write(wakefd[1], "", 1);
+}
+
+#if FLYTRAP_EPOLL
+static int
+flytrap_ev_add(struct worker *w, int fd, uint32_t what)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.u32 = what;
+	return (epoll_ctl(w->eq, EPOLL_CTL_ADD, fd, &ev));
+}
+
+static int
+flytrap_ev_init(struct worker *w)
+{
+	sigset_t sigs;
+	unsigned int k;
+
+	if ((w->eq = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return (-1);
+	for (k = 0; k < nifaces; ++k)
+		if (flytrap_ev_add(w, iface_fd(WORKER_IFACE(w, k)), k) != 0)
+			return (-1);
+	if (flytrap_ev_add(w, wakefd[0], FLYTRAP_EV_WAKE) != 0)
+		return (-1);
+	if ((w->tfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+	    flytrap_ev_add(w, w->tfd, FLYTRAP_EV_TIMER) != 0)
+		return (-1);
+	if (w->id != 0)
+		return (0);
+	sigemptyset(&sigs);
+	for (k = 0; k < FLYTRAP_NSIGNALS; ++k)
+		sigaddset(&sigs, flytrap_signals[k]);
+	if ((w->sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+	    flytrap_ev_add(w, w->sfd, FLYTRAP_EV_SIGNAL) != 0)
+		return (-1);
+	return (0);
+}
+
+static int
+flytrap_ev_arm(struct worker *w, uint64_t due)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = due / 1000;
+	its.it_value.tv_nsec = due % 1000 * 1000000L;
+	return (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+static int
+flytrap_ev_wait(struct worker *w, int block)
+{
+	struct epoll_event evs[FLYTRAP_EVENTS];
+	struct signalfd_siginfo ssi;
+	uint64_t ticks;
+	int k, n;
+
+	if ((n = epoll_wait(w->eq, evs, FLYTRAP_EVENTS, block ? -1 : 0)) < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (k = 0; k < n; ++k) {
+		switch (evs[k].data.u32) {
+		case FLYTRAP_EV_TIMER:
+			(void)!read(w->tfd, &ticks, sizeof ticks);
+			break;
+		case FLYTRAP_EV_SIGNAL:
+			while (read(w->sfd, &ssi, sizeof ssi) == sizeof ssi)
+				signal_handler(ssi.ssi_signo);
+			break;
+		case FLYTRAP_EV_WAKE:
+			break;
+		default:
+			w->ready[evs[k].data.u32] = 1;
+		}
+	}
+	return (n);
+}
+#elif FLYTRAP_KQUEUE
+static int
+flytrap_ev_init(struct worker *w)
+{
+	struct kevent ev;
+	unsigned int k;
+
+	if ((w->eq = kqueue()) < 0)
+		return (-1);
+	for (k = 0; k < nifaces; ++k) {
+		EV_SET(&ev, iface_fd(WORKER_IFACE(w, k)), EVFILT_READ,
+		    EV_ADD, 0, 0, (void *)(uintptr_t)k);
+		if (kevent(w->eq, &ev, 1, NULL, 0, NULL) != 0)
+			return (-1);
+	}
+	EV_SET(&ev, wakefd[0], EVFILT_READ, EV_ADD, 0, 0,
+	    (void *)(uintptr_t)FLYTRAP_EV_WAKE);
+	if (kevent(w->eq, &ev, 1, NULL, 0, NULL) != 0)
+		return (-1);
+	for (k = 0; w->id == 0 && k < FLYTRAP_NSIGNALS; ++k) {
+		EV_SET(&ev, flytrap_signals[k], EVFILT_SIGNAL, EV_ADD, 0, 0,
+		    (void *)(uintptr_t)FLYTRAP_EV_SIGNAL);
+		if (kevent(w->eq, &ev, 1, NULL, 0, NULL) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+flytrap_ev_arm(struct worker *w, uint64_t due)
+{
+	struct kevent ev;
+	uint64_t now;
+
+	now = flytrap_clock();
+	EV_SET(&ev, 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+	    due > now ? due - now : 1, (void *)(uintptr_t)FLYTRAP_EV_TIMER);
+	return (kevent(w->eq, &ev, 1, NULL, 0, NULL));
+}
+
+static int
+flytrap_ev_wait(struct worker *w, int block)
+{
+	struct kevent evs[FLYTRAP_EVENTS];
+	struct timespec ts = { 0, 0 };
+	uintptr_t what;
+	int k, n;
+
+	if ((n = kevent(w->eq, NULL, 0, evs, FLYTRAP_EVENTS,
+	    block ? NULL : &ts)) < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (k = 0; k < n; ++k) {
+		what = (uintptr_t)evs[k].udata;
+		if (what == FLYTRAP_EV_SIGNAL)
+			signal_handler(evs[k].ident);
+		else if (what < nifaces)
+			w->ready[what] = 1;
+	}
+	return (n);
+}
+#else
+static int
+flytrap_ev_init(struct worker *w)
+{
+	unsigned int k;
+
+	if ((w->pfd = calloc(nifaces + 1, sizeof *w->pfd)) == NULL)
+		return (-1);
+	for (k = 0; k < nifaces; ++k)
+		w->pfd[k].fd = iface_fd(WORKER_IFACE(w, k));
+	w->pfd[nifaces].fd = wakefd[0];
+	for (k = 0; k <= nifaces; ++k)
+		w->pfd[k].events = POLLIN;
+	return (0);
+}
+
+static int
+flytrap_ev_arm(struct worker *w, uint64_t due)
+{
+
+	/* nothing to do, flytrap_ev_wait() computes the timeout */
+	(void)w;
+	(void)due;
+	return (0);
+}
+
+static int
+flytrap_ev_wait(struct worker *w, int block)
+{
+	uint64_t now;
+	unsigned int k;
+	int ms, n;
+
+	now = flytrap_clock();
+	ms = !block ? 0 : w->armed > now + INT32_MAX ? INT32_MAX :
+	    w->armed > now ? (int)(w->armed - now) : 0;
+	if ((n = poll(w->pfd, nifaces + 1, ms)) < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (k = 0; k < nifaces; ++k)
+		if (w->pfd[k].revents != 0)
+			w->ready[k] = 1;
+	return (n);
+}
+#endif
+
+/*
+ * Report our counters: to the log if logit is non-zero, which is when
+ * asked to with SIGUSR1, and to the stats file, if there is one, either
+ * way.  Only worker 0 does this, on behalf of all of them.
+ */
+static void
+flytrap_stats(int logit)
+{
+
+	if (logit)
+		stats_log(ifaces, nifaces * ft_workers);
+	if (ft_stats_file != NULL &&
+	    stats_write(ft_stats_file, ifaces, nifaces * ft_workers) != 0)
+		ft_warning("%s: %s", ft_stats_file, strerror(errno));
+}
+
+/*
+ * With more than one interface, each gets its own ARP file, named
+ * after it.
+ */
+static const char *
+flytrap_arp_file(unsigned int k, char *buf, size_t size)
+{
+
+	if (nifaces == 1)
+		return (ft_arp_file);
+	if ((size_t)snprintf(buf, size, "%s.%s", ft_arp_file,
+	    ifaces[k * ft_workers]->name) >= size) {
+		errno = ENAMETOOLONG;
+		return (NULL);
+	}
+	return (buf);
+}
+
+/*
+ * Write out the latest snapshots of every interface's ARP tables.
+ */
+static void
+flytrap_arp_save(void)
+{
+	char buf[1024];
+	const char *fn;
+	unsigned int k;
+
+	for (k = 0; k < nifaces; ++k) {
+		if ((fn = flytrap_arp_file(k, buf, sizeof buf)) == NULL ||
+		    arp_save(fn, &ifaces[k * ft_workers], ft_workers) != 0)
+			ft_warning("%s: %s", fn != NULL ? fn : ft_arp_file,
+			    strerror(errno));
+	}
+}
+
+/*
+ * Save the ARP tables.  Every arpinterval seconds, worker 0 starts a
+ * new generation; each worker notices the next time it wakes up and
+ * takes a snapshot of its own tables, and once they all have, worker 0
+ * writes them out.  No worker takes another snapshot until the files
+ * have been written.
+ *
+ * The shared memory segment is fed from the same snapshots: every
+ * shminterval seconds, worker 0 publishes the last complete generation,
+ * if there is a new one, and starts the next.
+ */
+static int arp_pending;		/* a generation is under way */
+static int arp_wanted;		/* write the files when it is done */
+static int arp_ready;		/* a generation is done, not published */
+
+static void
+flytrap_arp_start(void)
+{
+
+	if (!__atomic_load_n(&arp_pending, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&arp_pending, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&arp_gen, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+flytrap_arp(struct worker *w)
+{
+	struct iface *i;
+	unsigned int gen, k;
+
+	gen = __atomic_load_n(&arp_gen, __ATOMIC_ACQUIRE);
+	for (k = 0; k < nifaces; ++k) {
+		i = WORKER_IFACE(w, k);
+		if (i->arp_gen == gen)
+			continue;
+		if (arp_snapshot(i) != 0)
+			ft_warning("%s: arp snapshot: %s", i->name,
+			    strerror(errno));
+		__atomic_store_n(&i->arp_gen, gen, __ATOMIC_RELEASE);
+	}
+	if (w->id != 0 || !__atomic_load_n(&arp_pending, __ATOMIC_ACQUIRE))
+		return;
+	for (k = 0; k < nifaces * ft_workers; ++k)
+		if (__atomic_load_n(&ifaces[k]->arp_gen,
+		    __ATOMIC_ACQUIRE) != gen)
+			return;
+	if (__atomic_exchange_n(&arp_wanted, 0, __ATOMIC_ACQUIRE))
+		flytrap_arp_save();
+	__atomic_store_n(&arp_ready, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&arp_pending, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Update the shared memory segment.  Only worker 0 does this, and only
+ * it starts new ARP generations, so the snapshots cannot change under
+ * us while no generation is under way.
+ */
+static void
+flytrap_shm(void)
+{
+	int witharp;
+
+	witharp = !__atomic_load_n(&arp_pending, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&arp_ready, __ATOMIC_RELAXED);
+	shm_publish(ifaces, nifaces, witharp);
+	if (witharp)
+		__atomic_store_n(&arp_ready, 0, __ATOMIC_RELAXED);
+	flytrap_arp_start();
+}
+
+/*
+ * Run whichever periodic tasks are due, then set the kernel timer for
+ * the next one.  Deadlines advance by a whole interval each time, so
+ * tasks keep to their schedule regardless of how late they ran.
+ */
+static int
+flytrap_timers(struct worker *w, uint64_t now)
+{
+	static const uint64_t never = FLYTRAP_NEVER;
+	uint64_t ival[FLYTRAP_TIMERS], next;
+	unsigned int k;
+
+	ival[timer_tick] = FLYTRAP_TICK;
+	ival[timer_stats] = w->id == 0 && ft_stats_file != NULL &&
+	    ft_stats_interval > 0 ? ft_stats_interval * 1000ULL : never;
+	ival[timer_arp] = w->id == 0 && ft_arp_file != NULL &&
+	    ft_arp_interval > 0 ? ft_arp_interval * 1000ULL : never;
+	ival[timer_shm] = w->id == 0 && ft_shm_name != NULL ?
+	    ft_shm_interval * 1000ULL : never;
+	for (next = never, k = 0; k < FLYTRAP_TIMERS; ++k) {
+		if (ival[k] == never)
+			continue;
+		if (w->due[k] == 0) {
+			/* first run, the first interval starts now */
+			w->due[k] = now + ival[k];
+		} else if (w->due[k] <= now) {
+			switch ((flytrap_timer)k) {
+			case timer_tick:
+				if (w->id == 0)
+					ft_log_flush();
+				break;
+			case timer_stats:
+				flytrap_stats(0);
+				break;
+			case timer_arp:
+				__atomic_store_n(&arp_wanted, 1,
+				    __ATOMIC_RELEASE);
+				flytrap_arp_start();
+				break;
+			case timer_shm:
+				flytrap_shm();
+				break;
+			default:
+				break;
+			}
+			w->due[k] += ival[k];
+			if (w->due[k] <= now)
+				w->due[k] = now + ival[k];
+		}
+		if (w->due[k] < next)
+			next = w->due[k];
+	}
+	if (next != w->armed) {
+		w->armed = next;
+		if (flytrap_ev_arm(w, next) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * A worker is quiescent while it waits for events, and when it is not
+ * running at all: it holds no pointers to the address sets, so those
+ * which have been replaced can be freed; see flytrap_reload().  The
+ * counter is odd while the thread is quiescent and even while it is
+ * not, so each function only ever moves it one way.
+ */
+static void
+flytrap_offline(unsigned long *qs)
+{
+
+	if (!(*qs & 1))
+		__atomic_store_n(qs, *qs + 1, __ATOMIC_RELEASE);
+}
+
+static void
+flytrap_online(unsigned long *qs)
+{
+
+	if (*qs & 1) {
+		__atomic_store_n(qs, *qs + 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Wait until a thread has been quiescent since we started waiting.
+ */
+static void
+flytrap_quiesce(unsigned long *qsp)
+{
+	static const struct timespec pause = { 0, 1000000 };
+	unsigned long qs;
+
+	qs = __atomic_load_n(qsp, __ATOMIC_SEQ_CST);
+	while (!(qs & 1) && __atomic_load_n(qsp, __ATOMIC_SEQ_CST) == qs)
+		nanosleep(&pause, NULL);
+}
+
+/*
+ * Rebuild the address sets in the background, publish them, and free
+ * the old ones once every worker has been quiescent since.  Workers
+ * keep using whichever sets they find until then, and notice the new
+ * generation the next time they wake up, at which point they update
+ * their kernel filters.
+ */
+static void *
+flytrap_reload(void *arg)
+{
+	struct timespec t0, t1;
+	ip4s_frozen *src, *dst, *dark;
+	unsigned int k;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (set_build(&src, &dst, &dark, 1) != 0) {
+		ft_warning("failed to reload address sets, "
+		    "keeping the old ones");
+		goto done;
+	}
+	src = __atomic_exchange_n(&src_set, src, __ATOMIC_SEQ_CST);
+	dst = __atomic_exchange_n(&dst_set, dst, __ATOMIC_SEQ_CST);
+	dark = __atomic_exchange_n(&dark_set, dark, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&set_gen, 1, __ATOMIC_RELEASE);
+	for (k = 0; k < ft_workers; ++k) {
+		flytrap_quiesce(&workers[k].qs);
+		flytrap_quiesce(&workers[k].aqs);
+	}
+	if (src != NULL)
+		ip4s_frozen_destroy(src);
+	if (dst != NULL)
+		ip4s_frozen_destroy(dst);
+	if (dark != NULL)
+		ip4s_frozen_destroy(dark);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ft_notice("reloaded address sets in %.3f ms",
+	    (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+done:
+	__atomic_store_n(&reload_busy, 0, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/*
+ * Start reloading the address sets, unless we are already at it.
+ */
+static void
+flytrap_reload_start(void)
+{
+	sigset_t sigs, osigs;
+
+	if (__atomic_load_n(&reload_busy, __ATOMIC_ACQUIRE)) {
+		ft_notice("address set reload already in progress");
+		return;
+	}
+	if (reload_started)
+		pthread_join(reload_thread, NULL);
+	reload_started = 0;
+	__atomic_store_n(&reload_busy, 1, __ATOMIC_RELAXED);
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	if ((errno = pthread_create(&reload_thread, NULL,
+	    flytrap_reload, NULL)) != 0) {
+		ft_warning("failed to start address set reload: %s",
+		    strerror(errno));
+		reload_busy = 0;
+	} else {
+		reload_started = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+}
+
+/*
+ * Bring our kernel filters up to date with the address sets.
+ */
+static void
+flytrap_filters(struct worker *w)
 {
 	struct iface *i;
+	unsigned int gen, k;
+
+	gen = __atomic_load_n(&set_gen, __ATOMIC_ACQUIRE);
+	for (k = 0; k < nifaces; ++k) {
+		i = WORKER_IFACE(w, k);
+		if (i->set_gen != gen) {
+			i->set_gen = gen;
+			(void)iface_setfilter(i);
+		}
+	}
+}
+
+/*
+ * Act on the signals which have come in since the last time.
+ */
+static void
+flytrap_signal(void)
+{
+
+	if (sigterm && !stopping) {
+		ft_notice("shutting down");
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+		flytrap_wake();
+	}
+	if (sighup) {
+		sighup--;
+		log_reopen();
+		if (ft_set_files > 0)
+			flytrap_reload_start();
+	}
+	if (sigusr1) {
+		sigusr1--;
+		flytrap_stats(1);
+	}
+}
+
+/*
+ * Process whatever traffic an interface has for us.  Returns the number
+ * of frames processed, or -1 on error.
+ */
+static int
+flytrap_input(struct iface *i)
+{
+	struct packet *p;
+	int n;
+
+	if (ft_iface_batch > 0) {
+		/* burst mode */
+		if ((n = iface_dispatch(i, packet_analyze)) >= 0)
+			iface_flush(i);
+		return (n);
+	}
+	if ((p = iface_next(i)) == NULL)
+		return (errno == EAGAIN ? 0 : -1);
+	packet_analyze(p);
+	iface_release(p);
+	iface_flush(i);
+	return (1);
+}
+
+/*
+ * Age out ARP and neighbor entries and TCP sessions, announce claimed
+ * addresses and take ARP snapshots.  This is done by whichever thread
+ * analyzes the worker's traffic, since it is the one which fills the
+ * transmit queue.
+ */
+static void
+flytrap_housekeeping(struct worker *w)
+{
+	struct timeval now;
+	uint64_t ms;
+	unsigned int k;
+
+	gettimeofday(&now, NULL);
+	ms = now.tv_sec * 1000ULL + now.tv_usec / 1000;
+	for (k = 0; k < nifaces; ++k) {
+		arp_expire(WORKER_IFACE(w, k), ms);
+		ndp_expire(WORKER_IFACE(w, k), ms);
+		conn_expire(WORKER_IFACE(w, k), ms);
+		if (arp_announce(WORKER_IFACE(w, k), ms) > 0)
+			iface_flush(WORKER_IFACE(w, k));
+	}
+	if (ft_arp_file != NULL || ft_shm_name != NULL)
+		flytrap_arp(w);
+}
+
+/*
+ * Pipeline mode: return the descriptors which the analysis thread is
+ * done with to their pools.  Returns the number of descriptors.
+ */
+static unsigned int
+flytrap_reclaim(struct worker *w)
+{
+	struct packet *p;
+	unsigned int n;
+
+	for (n = 0; (p = pipeline_get(w->rtn)) != NULL; ++n)
+		iface_release(p);
+	if (n > 0) {
+		pipeline_consume(w->rtn);
+		w->stalled = 0;
+	}
+	return (n);
+}
+
+/*
+ * Pipeline mode: pass whatever traffic an interface has for us on to
+ * the analysis thread, up to a batch at a time.  Running out of
+ * descriptors is not an error; it means the analysis thread is behind,
+ * and the worker waits for it.  Returns the number of frames passed
+ * on, or -1 on error.
+ */
+static int
+flytrap_capture(struct worker *w, struct iface *i)
+{
 	struct packet *p;
+	unsigned int max;
+	int n, ret;
+
+	max = ft_iface_batch > 0 ? ft_iface_batch : 1;
+	for (n = 0; n < (int)max; ++n) {
+		if ((p = iface_next(i)) == NULL) {
+			if (errno == ENOBUFS)
+				w->stalled = 1;
+			else if (errno != EAGAIN)
+				return (-1);
+			break;
+		}
+		/* the ring has room for every descriptor */
+		ret = pipeline_put(w->rx, p);
+		ft_assert(ret == 0);
+	}
+	pipeline_publish(w->rx);
+	return (n);
+}
 
+/*
+ * Pipeline mode: analyze frames as they come in from the worker, then
+ * hand them back and get the transmit thread to send any replies.
+ * Runs until the worker has stopped and every frame it passed on has
+ * been analyzed.
+ */
+static void *
+flytrap_analyzer(void *arg)
+{
+	struct worker *w = arg;
+	struct packet *p;
+	unsigned int k, n;
+	int done, ret;
+
+	pipeline_pin(w->id * 3 + 1);
+	for (;;) {
+		done = __atomic_load_n(&draining, __ATOMIC_ACQUIRE) > 0;
+		flytrap_online(&w->aqs);
+		for (n = 0; n < IFACE_TXQ_SIZE &&
+		    (p = pipeline_get(w->rx)) != NULL; ++n) {
+			packet_analyze(p);
+			ret = pipeline_put(w->rtn, p);
+			ft_assert(ret == 0);
+		}
+		if (n > 0) {
+			pipeline_consume(w->rx);
+			pipeline_publish(w->rtn);
+			for (k = 0; k < nifaces; ++k)
+				iface_flush(WORKER_IFACE(w, k));
+		}
+		flytrap_housekeeping(w);
+		flytrap_offline(&w->aqs);
+		if (n == 0) {
+			if (done)
+				break;
+			pipeline_sleep(&w->rx->bell, FLYTRAP_TICK);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Pipeline mode: send whatever the analysis thread has queued.  Runs
+ * until the analysis thread has stopped and everything it queued has
+ * been sent.
+ */
+static void *
+flytrap_transmitter(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int k;
+	int done, idle;
+
+	pipeline_pin(w->id * 3 + 2);
+	for (;;) {
+		done = __atomic_load_n(&draining, __ATOMIC_ACQUIRE) > 1;
+		for (idle = 1, k = 0; k < nifaces; ++k)
+			if (iface_send(WORKER_IFACE(w, k)) != 0)
+				idle = 0;
+		if (!idle) {
+			/* the analysis thread may be waiting for room */
+			pipeline_kick(&w->rx->bell);
+			continue;
+		}
+		if (done)
+			break;
+		pipeline_sleep(&w->txbell, FLYTRAP_TICK);
+	}
+	return (NULL);
+}
+
+/*
+ * Capture and process packets until told to stop, something goes
+ * wrong, or another worker fails.
+ */
+static int
+flytrap_run(struct worker *w)
+{
+	struct iface *i;
+	unsigned int k;
+	int busy, n;
+
+	for (busy = 0; ; ) {
+		/* out of descriptors, wait for some to come back */
+		if (ft_pipeline && flytrap_reclaim(w) == 0 && w->stalled)
+			pipeline_sleep(&w->rtn->bell, FLYTRAP_STALL);
+		/* don't wait if an interface still had more for us */
+		flytrap_offline(&w->qs);
+		n = flytrap_ev_wait(w, !busy);
+		flytrap_online(&w->qs);
+		if (n < 0) {
+			ft_error("failed to wait for packets: %s",
+			    strerror(errno));
+			goto fail;
+		}
+		if (w->id == 0)
+			flytrap_signal();
+		if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+			return (-1);
+		if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+			return (0);
+		if (flytrap_timers(w, flytrap_clock()) != 0) {
+			ft_error("failed to set timer: %s", strerror(errno));
+			goto fail;
+		}
+		flytrap_filters(w);
+		for (busy = 0, k = 0; k < nifaces; ++k) {
+			if (!w->ready[k])
+				continue;
+			w->ready[k] = 0;
+			i = WORKER_IFACE(w, k);
+			if ((n = ft_pipeline ? flytrap_capture(w, i) :
+			    flytrap_input(i)) < 0)
+				goto fail;
+			if (w->stalled ||
+			    n >= (int)(ft_iface_batch > 0 ? ft_iface_batch : 1))
+				w->ready[k] = busy = 1;
+		}
+		if (!ft_pipeline)
+			flytrap_housekeeping(w);
+	}
+fail:
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	flytrap_wake();
+	return (-1);
+}
+
+static int
+flytrap_loop(struct worker *w)
+{
+	int ret;
+
+	pipeline_pin(ft_pipeline ? w->id * 3 : w->id);
+	ret = flytrap_run(w);
+	flytrap_offline(&w->qs);
+	return (ret);
+}
+
+static void *
+flytrap_worker(void *arg)
+{
+
+	flytrap_loop(arg);
+	return (NULL);
+}
+
+/*
+ * Pipeline mode: set up the rings between a worker's threads.  Each
+ * ring has room for every descriptor in every pool the worker draws
+ * from, so nothing is ever turned away.
+ */
+static int
+flytrap_pipeline_init(struct worker *w)
+{
+	unsigned int k;
+
+	if (pipeline_bell_init(&w->txbell) != 0)
+		return (-1);
+	if ((w->rx = pipeline_ring_new(nifaces * ft_pipeline_depth)) == NULL ||
+	    (w->rtn = pipeline_ring_new(nifaces * ft_pipeline_depth)) == NULL) {
+		pipeline_ring_destroy(w->rx);
+		w->rx = NULL;
+		pipeline_bell_destroy(&w->txbell);
+		return (-1);
+	}
+	for (k = 0; k < nifaces; ++k) {
+		WORKER_IFACE(w, k)->txq_bell = &w->txbell;
+		WORKER_IFACE(w, k)->txq_room = &w->rx->bell;
+	}
+	return (0);
+}
+
+/*
+ * Pipeline mode: once the workers have stopped, let the analysis and
+ * transmit threads finish what is left in their queues, in that order,
+ * then take back the last descriptors.
+ */
+static void
+flytrap_drain(void)
+{
+	struct worker *w;
+	unsigned int k;
+
+	__atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+	for (k = 0; k < ft_workers; ++k) {
+		w = &workers[k];
+		if (w->nstages > 0) {
+			pipeline_kick(&w->rx->bell);
+			pthread_join(w->analyzer, NULL);
+		}
+	}
+	__atomic_store_n(&draining, 2, __ATOMIC_RELEASE);
+	for (k = 0; k < ft_workers; ++k) {
+		w = &workers[k];
+		if (w->nstages > 1) {
+			pipeline_kick(&w->txbell);
+			pthread_join(w->transmitter, NULL);
+		}
+		w->nstages = 0;
+		if (w->rtn != NULL)
+			flytrap_reclaim(w);
+	}
+	for (k = 0; k < nifaces * ft_workers; ++k)
+		if (ifaces[k] != NULL)
+			ifaces[k]->txq_bell = ifaces[k]->txq_room = NULL;
+	draining = 0;
+}
+
+int
+flytrap(char **names, unsigned int n)
+{
+	struct timespec t0, t1;
+	struct iface *i;
+	struct worker *w;
+	pthread_t *threads;
+	sigset_t sigs, osigs, omask;
+	char buf[1024];
+	const char *fn;
+	unsigned int k, m, nthreads;
+	int nrest, ret;
+
+	for (k = 1; k < n; ++k) {
+		for (m = 0; m < k; ++m) {
+			if (strcmp(names[m], names[k]) == 0) {
+				ft_error("%s: interface listed twice",
+				    names[k]);
+				return (-1);
+			}
+		}
+	}
+	if (pipeline_init() != 0)
+		return (-1);
 	if (log_open(ft_logname) != 0) {
 		ft_error("failed to open log file: %s", strerror(errno));
+		pipeline_fini();
 		return (-1);
 	}
-	signal(SIGHUP, signal_handler); 
-	if ((i = iface_open(iname)) == NULL)
-		return (-1);
-	if (iface_activate(i) != 0)
+
+	/*
+	 * With an event queue, signals are received through it, so block
+	 * them everywhere; otherwise only the main thread takes them, and
+	 * they interrupt its poll().
+	 */
+	sigemptyset(&sigs);
+	for (k = 0; k < FLYTRAP_NSIGNALS; ++k) {
+#if FLYTRAP_EPOLL || FLYTRAP_KQUEUE
+		sigaddset(&sigs, flytrap_signals[k]);
+#endif
+#if FLYTRAP_KQUEUE
+		signal(flytrap_signals[k], SIG_IGN);
+#else
+		signal(flytrap_signals[k], signal_handler);
+#endif
+	}
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+
+	/* one socket, with its own state, per interface per worker */
+	ret = -1;
+	nifaces = n;
+	nthreads = 0;
+	threads = NULL;
+	if (pipe(wakefd) != 0 ||
+	    fcntl(wakefd[1], F_SETFL, O_NONBLOCK) != 0 ||
+	    (ifaces = calloc(n * ft_workers, sizeof *ifaces)) == NULL ||
+	    (workers = calloc(ft_workers, sizeof *workers)) == NULL ||
+	    (threads = calloc(ft_workers, sizeof *threads)) == NULL) {
+		ft_error("%s", strerror(errno));
 		goto fail;
-	for (;;) {
-		if (sighup) {
-			sighup--;
-			if (log_open(ft_logname) != 0) {
-				ft_warning("failed to reopen log file: %s",
-				    strerror(errno));
-			}
+	}
+	for (k = 0; k < ft_workers; ++k) {
+		workers[k].eq = workers[k].tfd = workers[k].sfd = -1;
+		workers[k].qs = workers[k].aqs = 1;
+	}
+	for (k = 0; k < n * ft_workers; ++k) {
+		if ((i = ifaces[k] = iface_open(names[k / ft_workers])) == NULL)
+			goto fail;
+		i->worker = k % ft_workers;
+		i->nonblock = 1;
+		if (ft_workers > 1 &&
+		    i->backend != iface_backend_tpacket) {
+			ft_error("multiple workers require the tpacket backend");
+			goto fail;
 		}
-		if ((p = iface_next(i)) == NULL) {
-			if (errno == EAGAIN)
-				continue;
+		if (ft_pipeline && i->backend != iface_backend_tpacket) {
+			ft_error("the pipeline requires the tpacket backend");
+			goto fail;
+		}
+		if (iface_activate(i) != 0)
+			goto fail;
+		if (iface_fd(i) < 0) {
+			ft_error("%s: capture handle cannot be waited for",
+			    i->name);
 			goto fail;
 		}
-		packet_analyze(p);
 	}
-	signal(SIGHUP, SIG_DFL);
-	return (0);
+	for (k = 0; k < ft_workers; ++k) {
+		w = &workers[k];
+		w->id = k;
+		if ((w->ready = calloc(n, 1)) == NULL ||
+		    flytrap_ev_init(w) != 0 ||
+		    flytrap_timers(w, flytrap_clock()) != 0) {
+			ft_error("failed to set up event queue: %s",
+			    strerror(errno));
+			goto fail;
+		}
+		/* look at every interface once before waiting */
+		memset(w->ready, 1, n);
+		if (ft_pipeline && flytrap_pipeline_init(w) != 0) {
+			ft_error("failed to set up pipeline: %s",
+			    strerror(errno));
+			goto fail;
+		}
+	}
+	if (n > 1)
+		ft_verbose("listening on %u interfaces", n);
+
+	/* pick up where we left off */
+	for (k = 0; ft_arp_file != NULL && k < n; ++k) {
+		if ((fn = flytrap_arp_file(k, buf, sizeof buf)) == NULL)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		nrest = arp_load(fn, &ifaces[k * ft_workers], ft_workers);
+		if (nrest >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ft_verbose("restored %d ARP entries from %s in %.3f ms",
+			    nrest, fn, (t1.tv_sec - t0.tv_sec) * 1e3 +
+			    (t1.tv_nsec - t0.tv_nsec) / 1e6);
+		} else if (errno != ENOENT) {
+			ft_warning("%s: %s", fn, strerror(errno));
+		}
+	}
+
+	/* publish our state for other processes to read */
+	if (ft_shm_name != NULL && shm_create(ifaces, n) != 0) {
+		ft_error("%s: %s", ft_shm_name, strerror(errno));
+		goto fail;
+	}
+
+	/* start the pipeline and the other workers with signals blocked */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &omask);
+	for (k = 0; ft_pipeline && k < ft_workers; ++k) {
+		w = &workers[k];
+		if ((errno = pthread_create(&w->analyzer, NULL,
+		    flytrap_analyzer, w)) == 0) {
+			w->nstages++;
+			if ((errno = pthread_create(&w->transmitter, NULL,
+			    flytrap_transmitter, w)) == 0)
+				w->nstages++;
+		}
+		if (w->nstages < 2) {
+			ft_error("failed to start pipeline: %s",
+			    strerror(errno));
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			flytrap_wake();
+			break;
+		}
+	}
+	for (nthreads = 1; nthreads < ft_workers; ++nthreads) {
+		if ((errno = pthread_create(&threads[nthreads], NULL,
+		    flytrap_worker, &workers[nthreads])) != 0) {
+			ft_error("failed to start worker: %s", strerror(errno));
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			flytrap_wake();
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	if (ft_workers > 1)
+		ft_verbose("started %u workers", nthreads);
+	if (ft_pipeline)
+		ft_verbose("pipelined %u workers over %u threads", ft_workers,
+		    ft_workers * 3);
+
+	/* the main thread is worker 0 */
+	if (!failed)
+		flytrap_loop(&workers[0]);
+	for (k = 1; k < nthreads; ++k)
+		pthread_join(threads[k], NULL);
+	if (ft_pipeline)
+		flytrap_drain();
+	if (reload_started)
+		pthread_join(reload_thread, NULL);
+	reload_started = 0;
+	if (!failed)
+		ret = 0;
+	if (ft_arp_file != NULL) {
+		for (k = 0; k < n * ft_workers; ++k)
+			if (arp_snapshot(ifaces[k]) != 0)
+				break;
+		if (k < n * ft_workers)
+			ft_warning("%s: %s", ft_arp_file, strerror(errno));
+		else
+			flytrap_arp_save();
+	}
+	if (ft_stats_file != NULL &&
+	    stats_write(ft_stats_file, ifaces, n * ft_workers) != 0)
+		ft_warning("%s: %s", ft_stats_file, strerror(errno));
 fail:
-	iface_close(i);
-	return (-1);
+	for (k = 0; k < FLYTRAP_NSIGNALS; ++k)
+		signal(flytrap_signals[k], SIG_DFL);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (ft_pipeline && workers != NULL && ifaces != NULL)
+		flytrap_drain();
+	for (k = 0; workers != NULL && k < ft_workers; ++k) {
+		if (workers[k].eq >= 0)
+			close(workers[k].eq);
+		if (workers[k].tfd >= 0)
+			close(workers[k].tfd);
+		if (workers[k].sfd >= 0)
+			close(workers[k].sfd);
+		free(workers[k].ready);
+#if !FLYTRAP_EPOLL && !FLYTRAP_KQUEUE
+		free(workers[k].pfd);
+#endif
+		if (workers[k].rx != NULL) {
+			pipeline_ring_destroy(workers[k].rx);
+			pipeline_ring_destroy(workers[k].rtn);
+			pipeline_bell_destroy(&workers[k].txbell);
+		}
+	}
+	free(workers);
+	workers = NULL;
+	for (k = 0; ifaces != NULL && k < n * ft_workers; ++k)
+		if (ifaces[k] != NULL)
+			iface_close(ifaces[k]);
+	shm_destroy();
+	free(ifaces);
+	ifaces = NULL;
+	free(threads);
+	for (k = 0; k < 2; ++k) {
+		if (wakefd[k] >= 0)
+			close(wakefd[k]);
+		wakefd[k] = -1;
+	}
+	log_close();
+	pipeline_fini();
+	return (ret);
+}
+
+/*
+ * Timestamp of the last frame replayed, which stands in for the current
+ * time when expiring ARP entries.
+ */
+static struct timeval replay_ts;
+
+static int
+flytrap_replay_one(struct packet *p)
+{
+
+	replay_ts = p->ts;
+	if (packet_steer(p, ft_workers) != p->i->worker)
+		return (0);
+	return (packet_analyze(p));
+}
+
+/*
+ * Push every frame in a capture file through the analyzer as fast as
+ * possible, then report how long it took.  Replies are built but not
+ * sent, and the log goes to /dev/null unless told otherwise.  With more
+ * than one worker, each worker reads the whole file in turn but only
+ * analyzes the frames the fanout program would have given it, so each
+ * worker's tables are filled as they would be live.
+ */
+int
+flytrap_replay(const char *fn)
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	struct iface **ifs;
+	unsigned long frames, replies, dropped;
+	unsigned int k;
+	uint64_t now;
+	double secs;
+	int pcr;
+
+	ft_dryrun = 1;
+	if ((ifs = calloc(ft_workers, sizeof *ifs)) == NULL) {
+		ft_error("%s", strerror(errno));
+		return (-1);
+	}
+	if (log_open(ft_logname != NULL ? ft_logname : "/dev/null") != 0) {
+		ft_error("failed to open log file: %s", strerror(errno));
+		free(ifs);
+		return (-1);
+	}
+	for (k = 0; k < ft_workers; ++k) {
+		if ((ifs[k] = iface_open_offline(fn)) == NULL) {
+			while (k-- > 0)
+				iface_close(ifs[k]);
+			log_close();
+			free(ifs);
+			return (-1);
+		}
+		ifs[k]->worker = k;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (pcr = 0, k = 0; k < ft_workers && pcr >= 0; ++k) {
+		while ((pcr = iface_dispatch(ifs[k], flytrap_replay_one)) > 0) {
+			now = replay_ts.tv_sec * 1000ULL +
+			    replay_ts.tv_usec / 1000;
+			arp_expire(ifs[k], now);
+			ndp_expire(ifs[k], now);
+			conn_expire(ifs[k], now);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	for (frames = replies = 0, k = 0; k < ft_workers; ++k) {
+		frames += ifs[k]->stats.rx_frames;
+		replies += ifs[k]->stats.tx_replies;
+	}
+	if (ft_stats_file != NULL &&
+	    stats_write(ft_stats_file, ifs, ft_workers) != 0)
+		ft_warning("%s: %s", ft_stats_file, strerror(errno));
+	for (k = 0; k < ft_workers; ++k)
+		iface_close(ifs[k]);
+	free(ifs);
+	dropped = log_dropped();
+	log_close();
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%lu frames in %.3f s, %.0f frames/s, %lu replies, "
+	    "%lu log records dropped, peak RSS %ld kB\n", frames, secs,
+	    secs > 0 ? frames / secs : 0.0, replies, dropped, ru.ru_maxrss);
+	return (pcr < 0 ? -1 : 0);
 }
@@ -32,19 +32,122 @@
 
 extern int ft_dryrun;
 extern const char *ft_logname;
+extern unsigned int ft_workers;
+
+/* capture tunables */
+extern unsigned int ft_iface_batch;
+extern unsigned int ft_iface_bufsize;
+extern unsigned int ft_iface_snaplen;
+extern int ft_iface_immediate;
+extern int ft_iface_fcs;
+extern const char *ft_iface_backend;
+extern unsigned int ft_iface_blocksize;
+
+/* ARP tunables */
+extern unsigned int ft_arp_timeout;
+extern unsigned int ft_arp_claim_timeout;
+extern const char *ft_arp_file;
+extern unsigned int ft_arp_interval;
+extern unsigned int ft_arp_memory;
+extern unsigned int ft_arp_announce;
+
+/* neighbor discovery tunables */
+extern unsigned int ft_ndp_table;
+
+/* rate limiting tunables */
+extern unsigned int ft_rl_src_rate;
+extern unsigned int ft_rl_src_burst;
+extern unsigned int ft_rl_net_rate;
+extern unsigned int ft_rl_net_burst;
+extern unsigned int ft_rl_max_rate;
+extern unsigned int ft_rl_table;
+extern int ft_rl_arp;
+
+/* session table tunables */
+extern unsigned int ft_conn_table;
+extern unsigned int ft_conn_timeout;
+
+/* pipeline tunables */
+extern int ft_pipeline;
+extern unsigned int ft_pipeline_depth;
+extern int ft_hugepages;
+extern const char *ft_cpus;
+
+/* stats tunables */
+extern const char *ft_stats_file;
+extern unsigned int ft_stats_interval;
+
+/* log tunables */
+extern const char *ft_log_format;
+extern const char *ft_log_compress;
+extern const char *ft_log_full;
+extern unsigned int ft_log_bufsize;
+extern unsigned int ft_log_interval;
+extern unsigned int ft_log_ring;
+extern unsigned int ft_log_summary;
+extern unsigned int ft_log_sumtable;
+
+/* IPFIX tunables */
+extern const char *ft_ipfix_collector;
+extern unsigned int ft_ipfix_domain;
+extern unsigned int ft_ipfix_interval;
+extern unsigned int ft_ipfix_mtu;
+extern unsigned int ft_ipfix_refresh;
+
+/* shared memory tunables */
+extern const char *ft_shm_name;
+extern unsigned int ft_shm_entries;
+extern unsigned int ft_shm_interval;
 
 /* main loop */
-int		 flytrap(const char *);
+int		 flytrap(char **, unsigned int);
+int		 flytrap_replay(const char *);
 
 /* log subsystem */
 int		 log_open(const char *);
+void		 log_reopen(void);
+void		 log_close(void);
+unsigned long	 log_dropped(void);
+
+/* IPFIX export, driven by the log writer */
+struct ft_logrec;
+int		 ipfix_open(void);
+void		 ipfix_export(const struct ft_logrec *, uint64_t);
+void		 ipfix_tick(uint64_t);
+void		 ipfix_close(uint64_t);
 
 /* interfaces and packets */
+struct txbuf;
 struct iface	*iface_open(const char *);
+struct iface	*iface_open_offline(const char *);
 int		 iface_activate(struct iface *);
+int		 iface_fd(struct iface *);
+int		 iface_setfilter(struct iface *);
+void		 iface_kstats(struct iface *);
 void		 iface_close(struct iface *);
 struct packet	*iface_next(struct iface *);
-int		 iface_transmit(struct packet *);
+void		 iface_release(struct packet *);
+int		 iface_dispatch(struct iface *, int (*)(struct packet *));
+int		 iface_txbuf(struct iface *, struct txbuf *);
+int		 iface_transmit(struct txbuf *);
+int		 iface_send(struct iface *);
+int		 iface_flush(struct iface *);
 int		 packet_analyze(struct packet *);
+unsigned int	 packet_steer(const struct packet *, unsigned int);
+
+/* stats subsystem */
+struct ft_shm_counter;
+struct stats;
+void		 stats_snapshot(struct iface *, struct stats *);
+int		 stats_write(const char *, struct iface **, unsigned int);
+void		 stats_log(struct iface **, unsigned int);
+unsigned int	 stats_count(void);
+void		 stats_publish(struct iface **, unsigned int, uint32_t,
+    struct ft_shm_counter *);
+
+/* shared memory segment, updated by worker 0 */
+int		 shm_create(struct iface **, unsigned int);
+void		 shm_publish(struct iface **, unsigned int, int);
+void		 shm_destroy(void);
 
 #endif
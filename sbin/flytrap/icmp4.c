@@ -49,34 +49,40 @@
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
 /*
- * Reply to an echo request
+ * Reply to an echo request.  If we only have part of the request, we
+ * echo what we have, with a checksum of our own.
  */
 static int
-icmp4_reply(ip4_flow *fl, uint16_t id, uint16_t seq,
-    const void *payload, size_t payloadlen)
+icmp4_reply(ip4_flow *fl, const icmp_hdr *req, size_t len)
 {
 	icmp_hdr *ih;
-	size_t len;
-	int ret;
+	txbuf tb;
 
-	len = sizeof(icmp_hdr) + payloadlen;
-	if ((ih = calloc(1, len)) == NULL)
+	if (!ratelimit_check(fl->eth->p->i, &fl->src, &fl->eth->p->ts))
+		return (0);
+	if (iface_txbuf(fl->eth->p->i, &tb) != 0 ||
+	    (ih = txbuf_append(&tb, len)) == NULL)
 		return (-1);
-	ih->type = htobe16(icmp_type_echo_reply);
-	ih->code = htobe16(0);
-	ih->hdata = htobe32(id << 16 | seq);
-	memcpy(ih->data, payload, payloadlen);
-	ih->sum = htobe16(~ip4_cksum(0, ih, len));
+	memcpy(ih, req, len);
+	ih->type = icmp_type_echo_reply;
+	ih->code = 0;
+	if (len < be16toh(fl->len)) {
+		ih->sum = 0;
+		ih->sum = htobe16(~ip4_cksum(0, ih, len));
+	} else {
+		/* only the first word changed (RFC 1624) */
+		ih->sum = htobe16(~ip4_cksum_adjust(~be16toh(req->sum),
+		    req->type << 8 | req->code, ih->type << 8 | ih->code));
+	}
 	ft_verbose("echo reply to %d.%d.%d.%d id 0x%04x seq 0x%04x",
 	    fl->src.o[0], fl->src.o[1], fl->src.o[2], fl->src.o[3],
-	    id, seq);
-	ret = ip4_reply(fl, ip_proto_icmp, ih, len);
-	free(ih);
-	return (ret);
+	    be32toh(ih->hdata) >> 16, be32toh(ih->hdata) & 0xffff);
+	return (ip4_reply(fl, ip_proto_icmp, &tb));
 }
 
 /*
@@ -94,12 +100,16 @@ packet_analyze_icmp4(ip4_flow *fl, const void *data, size_t len)
 		ft_notice("%d.%03d short ICMP packet (%zd < %zd)",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    len, sizeof *ih);
+		STATS_INC(fl->eth->p->i, icmp4_invalid);
 		return (-1);
 	}
-	if ((sum = ~ip4_cksum(0, data, len)) != 0) {
+	/* we capture ICMP whole, but the frame may be longer than that */
+	if (len == be16toh(fl->len) &&
+	    (sum = ~ip4_cksum(0, data, len)) != 0) {
 		ft_notice("%d.%03d invalid ICMP checksum 0x%04hx",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    sum);
+		STATS_INC(fl->eth->p->i, icmp4_invalid);
 		return (-1);
 	}
 	data = ih + 1;
@@ -111,13 +121,15 @@ packet_analyze_icmp4(ip4_flow *fl, const void *data, size_t len)
 		ft_verbose("echo request from %d.%d.%d.%d id 0x%04x seq 0x%04x",
 		    fl->src.o[0], fl->src.o[1], fl->src.o[2], fl->src.o[3],
 		    id, seq);
-		ret = icmp4_reply(fl, id, seq,
-		    (const uint16_t *)ih->data, len);
+		ret = icmp4_reply(fl, ih, sizeof *ih + len);
 		break;
 	default:
 		ret = 0;
 	}
+	STATS_TIMER(t);
 	log_packet4(&fl->eth->p->ts, &fl->src, 0, &fl->dst, 0,
-	    "ICMP", len, "%u.%u", ih->type, ih->code);
+	    ip_proto_icmp, be16toh(fl->len) - sizeof *ih,
+	    ih->type << 8 | ih->code);
+	STATS_TIME(fl->eth->p->i, stage_log, t);
 	return (ret);
 }
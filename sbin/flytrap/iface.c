@@ -35,6 +35,7 @@
 #include <sys/time.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,25 +48,96 @@
 #error pcap library required
 #endif
 
+#include <ft/assert.h>
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
 #include <ft/log.h>
-#include <ft/sbuf.h>
 #include <ft/strutil.h>
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
+#include "pipeline.h"
 
 ether_addr	 flytrap_ether_addr = { FLYTRAP_ETHER_ADDR };
 
+unsigned int	 ft_iface_batch = 64;	/* max frames per wakeup, 0 = one */
+unsigned int	 ft_iface_bufsize;	/* kernel buffer size, 0 = default */
+unsigned int	 ft_iface_snaplen = IFACE_SNAPLEN; /* except ICMP and ND */
+int		 ft_iface_immediate;	/* deliver frames without delay */
+int		 ft_iface_fcs;		/* frames carry an FCS, check it */
+const char	*ft_iface_backend = "auto"; /* auto, pcap or tpacket */
+
+/*
+ * Free an interface's buffers and the interface itself.
+ */
+static void
+iface_free(iface *i)
+{
+
+	pipeline_free(i->txq, IFACE_TXQ_SIZE * IFACE_SNAPLEN);
+	pipeline_free(i->pool, i->pool_size * sizeof *i->pool);
+	free(i);
+}
+
+/*
+ * Allocate an interface along with its packet descriptors, transmit
+ * queue, session table and neighbor table.
+ */
+static iface *
+iface_new(const char *name)
+{
+	iface *i;
+	unsigned int n;
+
+	if ((i = calloc(1, sizeof *i)) == NULL)
+		return (NULL);
+	if (strlcpy(i->name, name, sizeof i->name) >= sizeof i->name) {
+		free(i);
+		errno = ENAMETOOLONG;
+		return (NULL);
+	}
+	memcpy(&i->ether, &flytrap_ether_addr, sizeof(ether_addr));
+	i->fd = -1;
+
+	/*
+	 * Preallocate packet descriptors.  In pipeline mode, they also
+	 * cover the frames in transit between threads.
+	 */
+	i->pool_size = ft_pipeline ? ft_pipeline_depth : IFACE_POOL_SIZE;
+	if ((i->pool = pipeline_alloc(i->pool_size * sizeof *i->pool)) == NULL)
+		goto fail;
+	for (n = 0; n < i->pool_size; ++n) {
+		i->pool[n].i = i;
+		i->pool[n].next = i->pool_free;
+		i->pool_free = &i->pool[n];
+	}
+
+	/* preallocate transmit queue */
+	if ((i->txq = pipeline_alloc(IFACE_TXQ_SIZE * IFACE_SNAPLEN)) == NULL)
+		goto fail;
+
+	/* preallocate session table */
+	if (conn_create(i) != 0)
+		goto fail;
+
+	/* preallocate neighbor table */
+	if (ndp_create(i) != 0)
+		goto fail;
+	return (i);
+fail:
+	conn_destroy(i);
+	ndp_destroy(i);
+	iface_free(i);
+	return (NULL);
+}
+
 /*
  * Prepare to use the named interface, but do not start capturing yet.
- * Annoyingly, there is no way to tell at this point whether the interface
- * exists and whether we are permitted to use it.
- *
- * TODO: pcap_findalldevs()
+ * With the pcap backend, there is no way to tell at this point whether
+ * the interface exists and whether we are permitted to use it.
  */
 iface *
 iface_open(const char *name)
@@ -74,38 +146,104 @@ iface_open(const char *name)
 	iface *i;
 
 	*pceb = '\0';
-	if ((i = calloc(1, sizeof *i)) == NULL)
+	if ((i = iface_new(name)) == NULL)
 		return (NULL);
-	if (strlcpy(i->name, name, sizeof i->name) >= sizeof i->name)
+
+	/* try the native backend first unless told otherwise */
+	if (strcmp(ft_iface_backend, "auto") == 0 ||
+	    strcmp(ft_iface_backend, "tpacket") == 0) {
+		if (tpacket_open(i) == 0) {
+			i->backend = iface_backend_tpacket;
+			ft_verbose("%s: interface opened (tpacket)", i->name);
+			return (i);
+		}
+		if (strcmp(ft_iface_backend, "tpacket") == 0) {
+			ft_error("failed to open %s: TPACKET_V3 unavailable",
+			    i->name);
+			goto fail;
+		}
+	} else if (strcmp(ft_iface_backend, "pcap") != 0) {
+		ft_error("unknown capture backend: %s", ft_iface_backend);
 		goto fail;
-	memcpy(&i->ether, &flytrap_ether_addr, sizeof(ether_addr));
+	}
+	i->backend = iface_backend_pcap;
+
 #if HAVE_PCAP_PCAP_H
 	if ((i->pch = pcap_create(i->name, pceb)) == NULL ||
 	    pcap_set_promisc(i->pch, 1) != 0 ||
-	    pcap_set_snaplen(i->pch, 2048) != 0 ||
-	    pcap_set_timeout(i->pch, 100) != 0)
+	    pcap_set_snaplen(i->pch, IFACE_SNAPLEN) != 0 ||
+	    pcap_set_timeout(i->pch, IFACE_TIMEOUT) != 0)
 		goto fail;
+#if HAVE_PCAP_SET_BUFFER_SIZE
+	if (ft_iface_bufsize > 0 &&
+	    pcap_set_buffer_size(i->pch, ft_iface_bufsize) != 0)
+		goto fail;
+#endif
+#if HAVE_PCAP_SET_IMMEDIATE_MODE
+	if (ft_iface_immediate &&
+	    pcap_set_immediate_mode(i->pch, 1) != 0)
+		goto fail;
+#endif
 #else
-	if ((i->pch = pcap_open_live(i->name, 2048, 1, 100, pceb)) == NULL)
+	if ((i->pch = pcap_open_live(i->name, IFACE_SNAPLEN, 1, IFACE_TIMEOUT,
+	    pceb)) == NULL)
 		goto fail;
 #endif
-	ft_verbose("%s: interface opened", i->name);
+	ft_verbose("%s: interface opened (pcap)", i->name);
 	return (i);
 fail:
 	if (*pceb)
 		ft_error("failed to open %s: %s", i->name, pceb);
 	if (i->pch != NULL)
 		pcap_close(i->pch);
-	free(i);
+	tpacket_close(i);
+	conn_destroy(i);
+	ndp_destroy(i);
+	iface_free(i);
+	return (NULL);
+}
+
+/*
+ * Open a capture file for replay.  The result can be used like a
+ * live interface, except that there is nothing to activate, and
+ * anything sent to it is discarded.
+ */
+iface *
+iface_open_offline(const char *fn)
+{
+	char pceb[PCAP_ERRBUF_SIZE];
+	iface *i;
+
+	*pceb = '\0';
+	if ((i = iface_new(fn)) == NULL)
+		return (NULL);
+	i->backend = iface_backend_pcap;
+	if ((i->pch = pcap_open_offline(fn, pceb)) == NULL) {
+		ft_error("failed to open %s: %s", fn, pceb);
+		goto fail;
+	}
+	if (pcap_datalink(i->pch) != DLT_EN10MB) {
+		ft_error("%s: not an Ethernet capture", fn);
+		goto fail;
+	}
+	ft_verbose("%s: capture file opened", i->name);
+	return (i);
+fail:
+	if (i->pch != NULL)
+		pcap_close(i->pch);
+	conn_destroy(i);
+	ndp_destroy(i);
+	iface_free(i);
 	return (NULL);
 }
 
 int
 iface_activate(iface *i)
 {
-	char fsz[1024];
-	struct sbuf fsb;
-	struct bpf_program fprog;
+	char pceb[PCAP_ERRBUF_SIZE];
+
+	if (i->backend == iface_backend_tpacket)
+		return (iface_setfilter(i) != 0 ? -1 : tpacket_activate(i));
 
 	/* activate interface */
 #if HAVE_PCAP_PCAP_H
@@ -120,6 +258,11 @@ iface_activate(iface *i)
 		    i->name, pcap_geterr(i->pch));
 		return (-1);
 	}
+	if (i->nonblock && pcap_setnonblock(i->pch, 1, pceb) != 0) {
+		ft_error("%s: failed to set non-blocking mode: %s",
+		    i->name, pceb);
+		return (-1);
+	}
 	ft_verbose("%s: interface activated", i->name);
 
 	/* we only understand Ethernet */
@@ -128,41 +271,116 @@ iface_activate(iface *i)
 		return (-1);
 	}
 
-	/* compose and compile filter program */
-	sbuf_new(&fsb, fsz, sizeof fsz, 0);
-	sbuf_printf(&fsb,
-	    "arp"
-	    " or ether dst %02x:%02x:%02x:%02x:%02x:%02x"
-	    " or ether dst ff:ff:ff:ff:ff:ff",
-	    i->ether.o[0], i->ether.o[1], i->ether.o[2],
-	    i->ether.o[3], i->ether.o[4], i->ether.o[5]);
-	sbuf_finish(&fsb);
-	if (pcap_compile(i->pch, &fprog, fsz, 1, 0xffffffffU) != 0) {
-		ft_error("%s: failed to compile filter: %s",
-		    i->name, pcap_geterr(i->pch));
-		return (-1);
-	}
-
 	/* install filter program */
-	if (pcap_setfilter(i->pch, &fprog) != 0) {
-		ft_error("%s: failed to install filter: %s",
-		    i->name, pcap_geterr(i->pch));
-		pcap_freecode(&fprog);
+	if (iface_setfilter(i) != 0)
 		return (-1);
-	}
-	pcap_freecode(&fprog);
-	ft_verbose("%s: filter installed: \"%s\"", i->name, fsz);
 
 	/* done */
 	return (0);
 }
 
+/*
+ * Return a descriptor which polls readable when the interface has
+ * traffic for us, or -1 if there is none.
+ */
+int
+iface_fd(iface *i)
+{
+	int fd;
+
+	if (i->backend == iface_backend_tpacket)
+		return (i->fd);
+	if ((fd = pcap_get_selectable_fd(i->pch)) < 0)
+		errno = EOPNOTSUPP;
+	return (fd);
+}
+
+/*
+ * Update our copy of the kernel's capture counters.  Only one thread
+ * may do this for any given interface.
+ */
+void
+iface_kstats(iface *i)
+{
+	struct pcap_stat ps;
+	unsigned long received, dropped;
+
+	if (i->backend == iface_backend_tpacket) {
+		if (tpacket_stats(i, &received, &dropped) == 0) {
+			i->kern_received += received;
+			i->kern_dropped += dropped;
+		}
+	} else if (i->pch != NULL && pcap_stats(i->pch, &ps) == 0) {
+		i->kern_received = ps.ps_recv;
+		i->kern_dropped = ps.ps_drop + ps.ps_ifdrop;
+	}
+}
+
 void
 iface_close(iface *i)
 {
 
-	pcap_close(i->pch);
-	free(i);
+	iface_flush(i);
+	iface_kstats(i);
+	ft_verbose("%s: kernel: %lu frames received, %lu dropped",
+	    i->name, i->kern_received, i->kern_dropped);
+	ft_verbose("%s: transmit queue: %lu frames in %lu flushes, "
+	    "peak %u, errors %lu", i->name, i->txq_frames, i->txq_flushes,
+	    i->txq_peak, i->txq_errors);
+	ft_verbose("%s: %lu frames captured in part, %lu discarded with "
+	    "bad FCS", i->name, i->stats.rx_truncated, i->stats.rx_fcs);
+	ft_verbose("%s: packet pool: %u of %u in use, peak %u, exhausted %lu",
+	    i->name, i->pool_inuse, i->pool_size, i->pool_peak,
+	    i->pool_exhausted);
+	if (i->backend == iface_backend_tpacket) {
+		ft_verbose("%s: %lu frames in %lu blocks over %lu wakeups",
+		    i->name, i->tp_frames, i->tp_blocks, i->tp_wakeups);
+		tpacket_close(i);
+	} else {
+		pcap_close(i->pch);
+	}
+	arp_destroy(i);
+	ratelimit_destroy(i);
+	conn_destroy(i);
+	ndp_destroy(i);
+	iface_free(i);
+}
+
+/*
+ * Take a descriptor from the interface's pool.
+ */
+static packet *
+iface_alloc(iface *i)
+{
+	packet *p;
+
+	if ((p = i->pool_free) == NULL) {
+		i->pool_exhausted++;
+		return (NULL);
+	}
+	i->pool_free = p->next;
+	p->next = NULL;
+	if (++i->pool_inuse > i->pool_peak)
+		i->pool_peak = i->pool_inuse;
+	return (p);
+}
+
+/*
+ * Return a descriptor to its interface's pool once the caller is done
+ * with it.
+ */
+void
+iface_release(packet *p)
+{
+	iface *i = p->i;
+
+	if (i->backend == iface_backend_tpacket && p->data != NULL)
+		tpacket_unref(i, p->blk);
+	p->data = NULL;
+	p->len = p->wirelen = 0;
+	p->next = i->pool_free;
+	i->pool_free = p;
+	i->pool_inuse--;
 }
 
 packet *
@@ -173,34 +391,283 @@ iface_next(iface *i)
 	packet *p;
 	int pcr;
 
+	if ((p = iface_alloc(i)) == NULL) {
+		errno = ENOBUFS;
+		return (NULL);
+	}
+	if (i->backend == iface_backend_tpacket) {
+		if (tpacket_next(i, p, !i->nonblock) != 0) {
+			iface_release(p);
+			return (NULL);
+		}
+		return (p);
+	}
 	if ((pcr = pcap_next_ex(i->pch, &ph, &pd)) < 0) {
 		ft_error("%s: failed to read packet: %s",
 		    i->name, pcap_geterr(i->pch));
+		iface_release(p);
 		errno = EIO; /* XXX */
 		return (NULL);
 	} else if (pcr == 0) {
+		iface_release(p);
 		errno = EAGAIN;
 		return (NULL);
-	} else if (ph->len > ph->caplen) {
-		errno = ENOSPC;
-		return (NULL);
 	}
-	if ((p = calloc(1, sizeof *p)) == NULL) {
-		errno = ENOMEM;
-		return (NULL);
-	}
-	p->i = i;
+	if (ph->len > ph->caplen)
+		STATS_INC(i, rx_truncated);
 	p->ts = ph->ts;
 	p->data = pd;
 	p->len = ph->caplen;
+	p->wirelen = ph->len;
+	p->vlan_tpid = p->vlan_tci = 0;
 	return (p);
 }
 
+/*
+ * Called by pcap_dispatch() for each frame in a burst.
+ */
+static void
+iface_dispatch_one(u_char *arg, const struct pcap_pkthdr *ph,
+    const u_char *pd)
+{
+	iface *i = (iface *)arg;
+	packet *p;
+
+	if (ph->len > ph->caplen)
+		STATS_INC(i, rx_truncated);
+	if ((p = iface_alloc(i)) == NULL)
+		return;
+	p->ts = ph->ts;
+	p->data = pd;
+	p->len = ph->caplen;
+	p->wirelen = ph->len;
+	p->vlan_tpid = p->vlan_tci = 0;
+	i->handler(p);
+	iface_release(p);
+}
+
+/*
+ * Wait for traffic, unless the interface is in non-blocking mode, then
+ * pass up to ft_iface_batch frames to the handler.  Returns the number
+ * of frames processed, which may be zero if the read timed out, or -1
+ * on error.
+ */
+int
+iface_dispatch(iface *i, int (*handler)(packet *))
+{
+	packet *p;
+	int pcr;
+
+	if (i->backend == iface_backend_tpacket) {
+		for (pcr = 0; pcr < (int)ft_iface_batch; ++pcr) {
+			if ((p = iface_alloc(i)) == NULL)
+				break;
+			if (tpacket_next(i, p,
+			    pcr == 0 && !i->nonblock) != 0) {
+				iface_release(p);
+				if (errno != EAGAIN)
+					return (-1);
+				break;
+			}
+			handler(p);
+			iface_release(p);
+		}
+		return (pcr);
+	}
+	i->handler = handler;
+	pcr = pcap_dispatch(i->pch, ft_iface_batch, iface_dispatch_one,
+	    (u_char *)i);
+	if (pcr == -1) {
+		ft_error("%s: failed to read packets: %s",
+		    i->name, pcap_geterr(i->pch));
+		errno = EIO; /* XXX */
+		return (-1);
+	}
+	return (pcr < 0 ? 0 : pcr);
+}
+
+static inline int
+iface_txq_full(iface *i)
+{
+
+	return (i->txq_head -
+	    __atomic_load_n(&i->txq_tail, __ATOMIC_ACQUIRE) == IFACE_TXQ_SIZE);
+}
+
+/*
+ * Make room in a full transmit queue: flush it ourselves or, in
+ * pipeline mode, wait up to the read timeout for the transmit thread
+ * to catch up.
+ */
+static int
+iface_txq_wait(iface *i)
+{
+	unsigned int ms;
+
+	if (i->txq_bell == NULL) {
+		/* sending empties the queue, even if some frames fail */
+		iface_flush(i);
+		return (0);
+	}
+	for (ms = 0; ms < IFACE_TIMEOUT; ++ms) {
+		pipeline_kick(i->txq_bell);
+		pipeline_sleep(i->txq_room, 1);
+		if (!iface_txq_full(i))
+			return (0);
+	}
+	return (-1);
+}
+
+/*
+ * Set up a transmit buffer in the next free slot of the transmit queue,
+ * flushing the queue first if it is full.  The buffer starts out empty,
+ * with IFACE_TXQ_HEADROOM bytes in front of it for headers.  The slot
+ * is not claimed until the frame is passed to iface_transmit(), so an
+ * abandoned buffer needs no cleanup, but there can only be one buffer
+ * under construction per interface at any time.
+ */
 int
-iface_transmit(packet *p)
+iface_txbuf(iface *i, txbuf *tb)
 {
 
-	if (!ft_dryrun && pcap_inject(p->i->pch, p->data, p->len) != (int)p->len)
+	if (iface_txq_full(i) && iface_txq_wait(i) != 0) {
+		STATS_INC(i, tx_failed);
+		errno = ENOBUFS;
 		return (-1);
+	}
+	tb->i = i;
+	tb->slot = i->txq_head % IFACE_TXQ_SIZE;
+	tb->data = IFACE_TXQ_SLOT(i, tb->slot) + IFACE_TXQ_HEADROOM;
+	tb->len = 0;
+	return (0);
+}
+
+/*
+ * Extend a transmit buffer at the end and return a pointer to the new
+ * space, or NULL if the slot is full.
+ */
+void *
+txbuf_append(txbuf *tb, size_t len)
+{
+	uint8_t *end, *lim;
+
+	end = tb->data + tb->len;
+	lim = IFACE_TXQ_SLOT(tb->i, tb->slot) + IFACE_SNAPLEN;
+	if (len > (size_t)(lim - end)) {
+		STATS_INC(tb->i, tx_failed);
+		errno = EMSGSIZE;
+		return (NULL);
+	}
+	tb->len += len;
+	return (end);
+}
+
+/*
+ * Extend a transmit buffer at the front and return a pointer to the new
+ * start of the frame, or NULL if the headroom is exhausted.
+ */
+void *
+txbuf_prepend(txbuf *tb, size_t len)
+{
+	uint8_t *lim;
+
+	lim = IFACE_TXQ_SLOT(tb->i, tb->slot);
+	if (len > (size_t)(tb->data - lim)) {
+		STATS_INC(tb->i, tx_failed);
+		errno = EMSGSIZE;
+		return (NULL);
+	}
+	tb->data -= len;
+	tb->len += len;
+	return (tb->data);
+}
+
+/*
+ * Queue a frame built with iface_txbuf() for transmission.  Queued
+ * frames are sent when the queue fills up or iface_flush() is called,
+ * whichever comes first.
+ */
+int
+iface_transmit(txbuf *tb)
+{
+	iface *i = tb->i;
+	unsigned int depth;
+
+	STATS_INC(i, tx_replies);
+	if (ft_dryrun)
+		return (0);
+	ft_assert(tb->slot == i->txq_head % IFACE_TXQ_SIZE);
+	i->txq_off[tb->slot] = tb->data - IFACE_TXQ_SLOT(i, tb->slot);
+	i->txq_len[tb->slot] = tb->len;
+	__atomic_store_n(&i->txq_head, i->txq_head + 1, __ATOMIC_RELEASE);
+	depth = i->txq_head - __atomic_load_n(&i->txq_tail, __ATOMIC_RELAXED);
+	if (depth > i->txq_peak)
+		i->txq_peak = depth;
 	return (0);
 }
+
+/*
+ * Pass n frames from consecutive slots in the transmit queue to the
+ * kernel.  Returns the number of frames sent.
+ */
+static unsigned int
+iface_inject(iface *i, unsigned int first, unsigned int n)
+{
+	unsigned int k;
+	int ret;
+
+	if (i->backend == iface_backend_tpacket)
+		return ((ret = tpacket_transmit(i, first, n)) < 0 ? 0 : ret);
+	for (k = 0; k < n; ++k)
+		if (pcap_inject(i->pch,
+		    IFACE_TXQ_SLOT(i, first + k) + i->txq_off[first + k],
+		    i->txq_len[first + k]) != (int)i->txq_len[first + k])
+			break;
+	return (k);
+}
+
+/*
+ * Send all queued frames.  Frames which could not be sent are counted
+ * and discarded.  Returns the number of frames taken off the queue, or
+ * -1 if any of them could not be sent.  In pipeline mode, only the
+ * transmit thread calls this.
+ */
+int
+iface_send(iface *i)
+{
+	unsigned int depth, first, head, n, sent;
+
+	head = __atomic_load_n(&i->txq_head, __ATOMIC_ACQUIRE);
+	if ((depth = head - i->txq_tail) == 0)
+		return (0);
+	STATS_TIMER(t);
+	i->txq_flushes++;
+	first = i->txq_tail % IFACE_TXQ_SIZE;
+	n = depth < IFACE_TXQ_SIZE - first ? depth : IFACE_TXQ_SIZE - first;
+	if ((sent = iface_inject(i, first, n)) == n && n < depth)
+		sent += iface_inject(i, 0, depth - n);
+	i->txq_frames += sent;
+	if (sent < depth) {
+		ft_warning("%s: failed to send %u of %u queued frames",
+		    i->name, depth - sent, depth);
+		i->txq_errors += depth - sent;
+	}
+	__atomic_store_n(&i->txq_tail, head, __ATOMIC_RELEASE);
+	STATS_TIME(i, stage_flush, t);
+	return (sent < depth ? -1 : (int)depth);
+}
+
+/*
+ * Send all queued frames, or in pipeline mode, get the transmit thread
+ * to.  Returns 0 if everything was sent and -1 otherwise.
+ */
+int
+iface_flush(iface *i)
+{
+
+	if (i->txq_bell != NULL) {
+		pipeline_kick(i->txq_bell);
+		return (0);
+	}
+	return (iface_send(i) < 0 ? -1 : 0);
+}
@@ -30,12 +30,145 @@
 #ifndef FLYTRAP_IFACE_H_INCLUDED
 #define FLYTRAP_IFACE_H_INCLUDED
 
+struct arp_table;
+struct bpf_program;
+struct conn_table;
+struct ndp_table;
 struct pcap;
+struct ratelimit;
+struct packet;
+struct pipeline_bell;
+
+/*
+ * Number of packet descriptors preallocated per interface.
+ */
+#define IFACE_POOL_SIZE	 64
+
+/*
+ * Capture parameters shared by all backends.
+ */
+#define IFACE_SNAPLEN	 2048		/* bytes */
+#define IFACE_TIMEOUT	 100		/* milliseconds */
+
+/*
+ * Longest filter program we generate.  This is the Linux limit; BSD
+ * defaults to 512, but a program which is too long is simply rejected
+ * and we fall back to a shorter one, see iface_filter.c.
+ */
+#define IFACE_FILTER_MAX 4096
+
+/*
+ * Default TPACKET_V3 ring geometry, see iface_tpacket.c.
+ */
+#define IFACE_RING_SIZE	 (8U << 20)
+#define IFACE_BLOCK_SIZE (256U << 10)
+
+/*
+ * Number of outgoing frames which can be queued before a flush is
+ * forced.  Each slot holds up to IFACE_SNAPLEN bytes.  Replies are
+ * built directly in a slot, starting IFACE_TXQ_HEADROOM bytes in so
+ * each layer can prepend its header in place.  The queue is a ring,
+ * so in pipeline mode one thread can fill it while another drains it;
+ * the size must be a power of two.
+ */
+#define IFACE_TXQ_SIZE	 64
+#define IFACE_TXQ_HEADROOM 64
+#define IFACE_TXQ_SLOT(i, n) ((i)->txq + (n) * IFACE_SNAPLEN)
+
+typedef enum iface_backend {
+	iface_backend_pcap,
+	iface_backend_tpacket,
+} iface_backend;
 
 typedef struct iface {
 	char		 name[64];
+	iface_backend	 backend;
 	struct pcap	*pch;
 	ether_addr	 ether;
+	unsigned int	 worker;	/* worker number */
+	struct arp_table *arp;		/* ARP table shards, one per VLAN */
+	struct arp_table **arp_index;	/* the same, sorted by VLAN */
+	unsigned int	 arp_nindex, arp_maxindex;
+	size_t		 arp_bytes;	/* ARP table memory, see arp.c */
+	struct ratelimit *rl;		/* reply rate limits */
+	struct conn_table *conn;	/* tarpitted TCP sessions */
+	struct ndp_table *ndp;		/* IPv6 neighbors */
+	unsigned int	 arp_gen;	/* last ARP snapshot taken */
+	unsigned int	 set_gen;	/* address sets in the filter */
+	int		 nonblock;	/* never wait for traffic */
+
+	/* packet descriptor pool */
+	struct packet	*pool;		/* all descriptors */
+	struct packet	*pool_free;	/* free list */
+	unsigned int	 pool_size;	/* number of descriptors */
+	unsigned int	 pool_inuse;	/* descriptors currently in use */
+	unsigned int	 pool_peak;	/* high-water mark */
+	unsigned long	 pool_exhausted; /* allocation failures */
+
+	/* burst receive */
+	int		(*handler)(struct packet *);
+
+	/* counters, see stats.h */
+	struct stats	 stats;
+	unsigned long	 kern_received;	/* kernel counters so far */
+	unsigned long	 kern_dropped;
+#if WITH_TIMING
+	ft_hist		 timing[STATS_STAGES];
+#endif
+
+	/* TPACKET_V3 ring */
+	int		 fd;		/* packet socket */
+	int		 ifindex;
+	uint8_t		*ring;		/* mapped ring */
+	unsigned int	 blk_size;	/* bytes per block */
+	unsigned int	 blk_nr;	/* number of blocks */
+	unsigned int	*blk_refs;	/* references per block */
+	unsigned int	 blk_cur;	/* block being consumed */
+	int		 blk_busy;	/* we hold blk_cur */
+	int		 tp_idle;	/* the ring was empty */
+	unsigned int	 blk_left;	/* frames left in blk_cur */
+	uint8_t		*frame;		/* next frame in blk_cur */
+	unsigned long	 tp_wakeups;	/* traffic after an empty ring */
+	unsigned long	 tp_blocks;	/* blocks consumed */
+	unsigned long	 tp_frames;	/* frames consumed */
+
+	/* transmit queue */
+	uint8_t		*txq;		/* IFACE_TXQ_SIZE frame slots */
+	size_t		 txq_off[IFACE_TXQ_SIZE]; /* offset into slot */
+	size_t		 txq_len[IFACE_TXQ_SIZE];
+	unsigned int	 txq_head;	/* frames queued so far */
+	unsigned int	 txq_peak;	/* high-water mark */
+	struct pipeline_bell *txq_bell;	/* wakes the transmit thread */
+	struct pipeline_bell *txq_room;	/* rung when frames are sent */
+	unsigned int	 txq_tail	/* frames sent or discarded */
+	    __attribute__((__aligned__(64)));
+	unsigned long	 txq_frames;	/* frames sent */
+	unsigned long	 txq_flushes;	/* flushes with frames queued */
+	unsigned long	 txq_errors;	/* frames which could not be sent */
 } iface;
 
+/*
+ * A frame under construction in a transmit queue slot, see
+ * iface_txbuf().
+ */
+typedef struct txbuf {
+	struct iface	*i;
+	unsigned int	 slot;
+	uint8_t		*data;		/* start of frame so far */
+	size_t		 len;
+} txbuf;
+
+void	*txbuf_append(txbuf *, size_t);
+void	*txbuf_prepend(txbuf *, size_t);
+
+/* TPACKET_V3 backend */
+int	 tpacket_open(iface *);
+int	 tpacket_setfilter(iface *, const struct bpf_program *);
+int	 tpacket_activate(iface *);
+void	 tpacket_close(iface *);
+int	 tpacket_next(iface *, struct packet *, int);
+void	 tpacket_unref(iface *, unsigned int);
+int	 tpacket_transmit(iface *, unsigned int, unsigned int);
+int	 tpacket_stats(iface *, unsigned long *, unsigned long *);
+
 #endif
@@ -0,0 +1,470 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel packet filter
+ *
+ * Rather than passing a filter expression to pcap_compile(), we
+ * generate the BPF program ourselves, which lets us fold the address
+ * sets into it so out-of-range traffic is dropped before it is copied
+ * to userspace.  The program accepts:
+ *
+ *  - ARP requests for addresses in the destination set, and all other
+ *    ARP packets;
+ *  - IPv4 packets sent to us or to the broadcast address, with their
+ *    source and destination addresses in the source and destination
+ *    sets;
+ *  - IPv6 neighbor solicitations and advertisements, unless neighbor
+ *    discovery is disabled.
+ *
+ * ICMP packets are captured whole, since we may have to echo them,
+ * while other IPv4 packets are cut short at ft_iface_snaplen: all we
+ * need from those is their headers.
+ *
+ * Frames may be untagged or carry up to two 802.1Q tags, although on
+ * Linux the kernel usually strips the outer tag before the filter runs.
+ *
+ * Each set becomes a sorted sequence of range comparisons.  Classic
+ * BPF only allows forward jumps, and conditional jumps can reach at
+ * most 255 instructions ahead, so the comparisons are emitted in
+ * groups, each followed by its own exits.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#else
+#error pcap library required
+#endif
+
+#include <ft/arp.h>
+#include <ft/assert.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/ip6.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/* ranges per group of comparisons, see above */
+#define FILTER_GROUP	 100
+
+/* pseudo-labels */
+#define FA_NEXT		 0U		/* the next instruction */
+#define FA_ACCEPT	 1U		/* accept the packet */
+#define FA_REJECT	 2U		/* reject the packet */
+#define FA_LABELS	 (IFACE_FILTER_MAX + 16)
+#define FA_UNPLACED	 (~0U)
+
+/*
+ * A tiny assembler.  Jump targets are given as labels, which are
+ * resolved once the whole program has been emitted.
+ */
+struct filter_asm {
+	struct bpf_insn	 insn[IFACE_FILTER_MAX];
+	unsigned int	 jt[IFACE_FILTER_MAX];
+	unsigned int	 jf[IFACE_FILTER_MAX];
+	unsigned int	 n;
+	unsigned int	 label[FA_LABELS];
+	unsigned int	 nlabels;
+	int		 overflow;
+};
+
+static unsigned int
+fa_label(struct filter_asm *fa)
+{
+
+	if (fa->nlabels == FA_LABELS) {
+		fa->overflow = 1;
+		return (FA_NEXT);
+	}
+	fa->label[fa->nlabels] = FA_UNPLACED;
+	return (fa->nlabels++);
+}
+
+static void
+fa_place(struct filter_asm *fa, unsigned int l)
+{
+
+	if (l > FA_REJECT)
+		fa->label[l] = fa->n;
+}
+
+static void
+fa_emit(struct filter_asm *fa, uint16_t code, uint32_t k,
+    unsigned int jt, unsigned int jf)
+{
+
+	if (fa->n == IFACE_FILTER_MAX) {
+		fa->overflow = 1;
+		return;
+	}
+	fa->insn[fa->n].code = code;
+	fa->insn[fa->n].jt = fa->insn[fa->n].jf = 0;
+	fa->insn[fa->n].k = k;
+	fa->jt[fa->n] = jt;
+	fa->jf[fa->n] = jf;
+	fa->n++;
+}
+
+#define fa_stmt(fa, code, k)						\
+	fa_emit((fa), (code), (k), FA_NEXT, FA_NEXT)
+#define fa_jump(fa, code, k, jt, jf)					\
+	fa_emit((fa), BPF_JMP | (code) | BPF_K, (k), (jt), (jf))
+
+/*
+ * Transfer control to a label, which may be one of the pseudo-labels
+ * FA_ACCEPT or FA_REJECT, in which case we just return.
+ */
+static void
+fa_goto(struct filter_asm *fa, unsigned int l)
+{
+
+	if (l == FA_ACCEPT)
+		fa_stmt(fa, BPF_RET | BPF_K, IFACE_SNAPLEN);
+	else if (l == FA_REJECT)
+		fa_stmt(fa, BPF_RET | BPF_K, 0);
+	else
+		fa_emit(fa, BPF_JMP | BPF_JA, 0, l, FA_NEXT);
+}
+
+static unsigned int
+fa_offset(const struct filter_asm *fa, unsigned int pc, unsigned int l)
+{
+
+	if (l == FA_NEXT)
+		return (0);
+	ft_assert(l > FA_REJECT && fa->label[l] != FA_UNPLACED);
+	ft_assert(fa->label[l] > pc);
+	return (fa->label[l] - pc - 1);
+}
+
+static void
+fa_resolve(struct filter_asm *fa)
+{
+	struct bpf_insn *insn;
+	unsigned int jt, jf, pc;
+
+	for (pc = 0; pc < fa->n; ++pc) {
+		insn = &fa->insn[pc];
+		if (BPF_CLASS(insn->code) != BPF_JMP)
+			continue;
+		jt = fa_offset(fa, pc, fa->jt[pc]);
+		if (BPF_OP(insn->code) == BPF_JA) {
+			insn->k = jt;
+			continue;
+		}
+		jf = fa_offset(fa, pc, fa->jf[pc]);
+		ft_assert(jt <= 255 && jf <= 255);
+		insn->jt = jt;
+		insn->jf = jf;
+	}
+}
+
+/*
+ * Emit code which jumps to yes if the accumulator is within one of the
+ * ranges and to no otherwise.  The ranges must be sorted and disjoint.
+ */
+static void
+filter_ranges(struct filter_asm *fa, const ip4s_range *r, size_t n,
+    unsigned int yes, unsigned int no)
+{
+	unsigned int gyes, gno, gnext;
+	size_t i, j;
+
+	if (n == 0)
+		fa_goto(fa, no);
+	for (i = 0; i < n; i += FILTER_GROUP) {
+		gyes = fa_label(fa);
+		gno = fa_label(fa);
+		gnext = fa_label(fa);
+		for (j = i; j < n && j < i + FILTER_GROUP; ++j) {
+			/* below this range means below all the others */
+			if (r[j].first > 0)
+				fa_jump(fa, BPF_JGE, r[j].first, FA_NEXT, gno);
+			fa_jump(fa, BPF_JGT, r[j].last, FA_NEXT, gyes);
+		}
+		/* above every range in the group */
+		if (j < n)
+			fa_goto(fa, gnext);
+		fa_place(fa, gno);
+		fa_goto(fa, no);
+		fa_place(fa, gyes);
+		fa_goto(fa, yes);
+		fa_place(fa, gnext);
+	}
+}
+
+/*
+ * Retrieve the contents of a set, which may be NULL, as ranges.
+ * Returns the number of ranges, or -1 if the set is too large for the
+ * filter, in which case *rp is NULL.
+ */
+static ssize_t
+filter_set_ranges(const ip4s_frozen *set, ip4s_range **rp)
+{
+	size_t n;
+
+	*rp = NULL;
+	if (set == NULL)
+		return (0);
+	n = ip4s_frozen_ranges(set, NULL, 0);
+	if (n > IFACE_FILTER_MAX / 2) {
+		errno = E2BIG;
+		return (-1);
+	}
+	if (n > 0 && (*rp = malloc(n * sizeof **rp)) == NULL)
+		return (-1);
+	ip4s_frozen_ranges(set, *rp, n);
+	return (n);
+}
+
+/*
+ * Compile a filter program for an interface, including the given source
+ * and destination address sets, either of which may be NULL.  On
+ * success, the caller must free prog->bf_insns.
+ */
+static int
+iface_filter_compile(const iface *i, const ip4s_frozen *sset,
+    const ip4s_frozen *dset, struct bpf_program *prog)
+{
+	struct filter_asm *fa;
+	ip4s_range *sr, *dr;
+	ssize_t nsr, ndr;
+	unsigned int arp, arpok, ip, dst, ipdst, ipok, ipacc, hi, bhi;
+	unsigned int icmp, ip6, nd, notnd, type, tagged, k;
+	int serrno;
+
+	sr = dr = NULL;
+	nsr = ndr = 0;
+	if ((nsr = filter_set_ranges(sset, &sr)) < 0 ||
+	    (ndr = filter_set_ranges(dset, &dr)) < 0) {
+		free(sr);
+		return (-1);
+	}
+	if ((fa = calloc(1, sizeof *fa)) == NULL) {
+		free(sr);
+		free(dr);
+		return (-1);
+	}
+	fa->nlabels = FA_REJECT + 1;
+	arp = fa_label(fa);
+	arpok = fa_label(fa);
+	ip = fa_label(fa);
+	dst = fa_label(fa);
+	ipdst = fa_label(fa);
+	ipok = fa_label(fa);
+	ipacc = fa_label(fa);
+	icmp = fa_label(fa);
+	hi = fa_label(fa);
+	bhi = fa_label(fa);
+	ip6 = fa_label(fa);
+	nd = fa_label(fa);
+	notnd = fa_label(fa);
+	type = fa_label(fa);
+
+	/*
+	 * Ethernet type, after up to ETHER_VLAN_MAX tags: X holds their
+	 * length, and everything past them is loaded relative to it
+	 */
+	fa_stmt(fa, BPF_LDX | BPF_W | BPF_IMM, 0);
+	fa_stmt(fa, BPF_LD | BPF_H | BPF_ABS, 12);
+	for (k = 1; k <= ETHER_VLAN_MAX; ++k) {
+		tagged = fa_label(fa);
+		fa_jump(fa, BPF_JEQ, ether_type_vlan, tagged, FA_NEXT);
+		fa_jump(fa, BPF_JEQ, ether_type_qinq, tagged, type);
+		fa_place(fa, tagged);
+		fa_stmt(fa, BPF_LDX | BPF_W | BPF_IMM,
+		    k * sizeof(ether_tag));
+		fa_stmt(fa, BPF_LD | BPF_H | BPF_ABS,
+		    12 + k * sizeof(ether_tag));
+	}
+	fa_place(fa, type);
+	fa_jump(fa, BPF_JEQ, ether_type_arp, arp, FA_NEXT);
+	fa_jump(fa, BPF_JEQ, ether_type_ip, ip, FA_NEXT);
+	if (ft_ndp_table > 0)
+		fa_jump(fa, BPF_JEQ, ether_type_ipv6, ip6, FA_NEXT);
+	fa_goto(fa, FA_REJECT);
+
+	/* IPv6: neighbor discovery only, right after the fixed header */
+	if (ft_ndp_table > 0) {
+		fa_place(fa, ip6);
+		fa_stmt(fa, BPF_LD | BPF_B | BPF_IND, 20);
+		fa_jump(fa, BPF_JEQ, ip6_proto_icmp6, FA_NEXT, notnd);
+		fa_stmt(fa, BPF_LD | BPF_B | BPF_IND, 54);
+		fa_jump(fa, BPF_JEQ, icmp6_type_nd_solicit, nd, FA_NEXT);
+		fa_jump(fa, BPF_JEQ, icmp6_type_nd_advert, nd, notnd);
+		fa_place(fa, notnd);
+		fa_goto(fa, FA_REJECT);
+		fa_place(fa, nd);
+		fa_goto(fa, FA_ACCEPT);
+	}
+
+	/* ARP: check the target address of requests */
+	fa_place(fa, arp);
+	if (dset != NULL) {
+		fa_stmt(fa, BPF_LD | BPF_H | BPF_IND, 20);
+		fa_jump(fa, BPF_JEQ, arp_oper_who_has, FA_NEXT, arpok);
+		fa_stmt(fa, BPF_LD | BPF_W | BPF_IND, 38);
+		fa_goto(fa, dst);
+	}
+	fa_place(fa, arpok);
+	fa_goto(fa, FA_ACCEPT);
+
+	/* IPv4: must be sent to us or to the broadcast address */
+	fa_place(fa, ip);
+	fa_stmt(fa, BPF_LD | BPF_W | BPF_ABS, 2);
+	fa_jump(fa, BPF_JEQ, (uint32_t)i->ether.o[2] << 24 |
+	    i->ether.o[3] << 16 | i->ether.o[4] << 8 | i->ether.o[5],
+	    hi, FA_NEXT);
+	fa_jump(fa, BPF_JEQ, 0xffffffffU, bhi, FA_NEXT);
+	fa_goto(fa, FA_REJECT);
+	fa_place(fa, hi);
+	fa_stmt(fa, BPF_LD | BPF_H | BPF_ABS, 0);
+	fa_jump(fa, BPF_JEQ, i->ether.o[0] << 8 | i->ether.o[1],
+	    ipok, FA_NEXT);
+	fa_goto(fa, FA_REJECT);
+	fa_place(fa, bhi);
+	fa_stmt(fa, BPF_LD | BPF_H | BPF_ABS, 0);
+	fa_jump(fa, BPF_JEQ, 0xffff, ipok, FA_NEXT);
+	fa_goto(fa, FA_REJECT);
+	fa_place(fa, ipok);
+	if (sset != NULL) {
+		fa_stmt(fa, BPF_LD | BPF_W | BPF_IND, 26);
+		filter_ranges(fa, sr, nsr, ipdst, FA_REJECT);
+	}
+	fa_place(fa, ipdst);
+	if (dset != NULL) {
+		fa_stmt(fa, BPF_LD | BPF_W | BPF_IND, 30);
+		fa_place(fa, dst);
+		filter_ranges(fa, dr, ndr, ipacc, FA_REJECT);
+	}
+
+	/*
+	 * IPv4 accepted: trim anything but ICMP.  ARP requests for the
+	 * destination set end up here as well, but they are shorter than
+	 * the shortest snaplen.
+	 */
+	fa_place(fa, ipacc);
+	if (ft_iface_snaplen < IFACE_SNAPLEN) {
+		fa_stmt(fa, BPF_LD | BPF_B | BPF_IND, 23);
+		fa_jump(fa, BPF_JEQ, ip_proto_icmp, icmp, FA_NEXT);
+		fa_stmt(fa, BPF_RET | BPF_K, ft_iface_snaplen);
+		fa_place(fa, icmp);
+		fa_goto(fa, FA_ACCEPT);
+	} else {
+		fa_goto(fa, FA_ACCEPT);
+	}
+	free(sr);
+	free(dr);
+
+	if (fa->overflow) {
+		free(fa);
+		errno = E2BIG;
+		return (-1);
+	}
+	fa_resolve(fa);
+	prog->bf_len = fa->n;
+	if ((prog->bf_insns = malloc(fa->n * sizeof *fa->insn)) == NULL) {
+		serrno = errno;
+		free(fa);
+		errno = serrno;
+		return (-1);
+	}
+	memcpy(prog->bf_insns, fa->insn, fa->n * sizeof *fa->insn);
+	free(fa);
+	return (0);
+}
+
+/*
+ * Install a filter program on an interface.  Installing a new program
+ * replaces the old one atomically, so this can be called again at any
+ * time to bring the filter up to date after the address sets change.
+ * If the sets make the program too large, or the kernel rejects it, we
+ * fall back to a program without them and rely on the checks in the
+ * protocol code.
+ */
+int
+iface_setfilter(iface *i)
+{
+	const ip4s_frozen *src, *dst;
+	struct bpf_program prog;
+	int ret, sets;
+
+	src = SET_LOAD(src_set);
+	dst = SET_LOAD(dst_set);
+	for (sets = 1; sets >= 0; --sets) {
+		if (iface_filter_compile(i, sets ? src : NULL,
+		    sets ? dst : NULL, &prog) != 0) {
+			if (sets && errno == E2BIG)
+				continue;
+			ft_error("%s: failed to compile filter: %s",
+			    i->name, strerror(errno));
+			return (-1);
+		}
+		if (i->backend == iface_backend_tpacket) {
+			ret = tpacket_setfilter(i, &prog);
+		} else if ((ret = pcap_setfilter(i->pch, &prog)) != 0) {
+			ft_verbose("%s: %s", i->name, pcap_geterr(i->pch));
+			errno = EINVAL;
+		}
+		free(prog.bf_insns);
+		if (ret == 0) {
+			if (sets || (src == NULL && dst == NULL))
+				ft_verbose("%s: filter installed: "
+				    "%u instructions", i->name, prog.bf_len);
+			else
+				ft_notice("%s: address sets too large for "
+				    "the kernel filter, filter installed: "
+				    "%u instructions", i->name, prog.bf_len);
+			return (0);
+		}
+		if (!sets)
+			ft_error("%s: failed to install filter: %s",
+			    i->name, strerror(errno));
+	}
+	return (-1);
+}
@@ -0,0 +1,571 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_LINUX_IF_PACKET_H
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#ifndef BPF_MOD
+#define BPF_MOD 0x90
+#endif
+#endif
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#else
+#error pcap library required
+#endif
+
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+#include <ft/strutil.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/*
+ * Linux AF_PACKET capture using a TPACKET_V3 memory-mapped ring.
+ *
+ * The kernel fills fixed-size blocks with variable-length frames and
+ * hands each block over in its entirety once it is full or the read
+ * timeout expires.  Packet descriptors point straight into the ring, so
+ * a block cannot be returned to the kernel until every descriptor which
+ * refers to it has been released.  Each block therefore carries a
+ * reference count, with one extra reference held while we are still
+ * reading frames from it.
+ */
+
+#if HAVE_LINUX_IF_PACKET_H && defined(TPACKET3_HDRLEN)
+
+unsigned int	 ft_iface_blocksize = IFACE_BLOCK_SIZE;
+
+static inline struct tpacket_block_desc *
+tpacket_block(iface *i, unsigned int n)
+{
+
+	return ((struct tpacket_block_desc *)(i->ring + (size_t)n * i->blk_size));
+}
+
+/*
+ * Create a packet socket for the interface and map its receive ring.
+ * Nothing is captured until tpacket_activate() binds the socket.
+ */
+int
+tpacket_open(iface *i)
+{
+	struct tpacket_req3 req;
+	struct ifreq ifr;
+	unsigned int ring_size;
+	int ver;
+
+	if ((i->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+		ft_verbose("%s: packet socket: %s", i->name, strerror(errno));
+		return (-1);
+	}
+
+	/* look up the interface and make sure it is Ethernet */
+	memset(&ifr, 0, sizeof ifr);
+	strlcpy(ifr.ifr_name, i->name, sizeof ifr.ifr_name);
+	if (ioctl(i->fd, SIOCGIFINDEX, &ifr) != 0) {
+		ft_verbose("%s: %s", i->name, strerror(errno));
+		goto fail;
+	}
+	i->ifindex = ifr.ifr_ifindex;
+	if (ioctl(i->fd, SIOCGIFHWADDR, &ifr) != 0) {
+		ft_verbose("%s: %s", i->name, strerror(errno));
+		goto fail;
+	}
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		ft_verbose("%s: not an Ethernet interface", i->name);
+		goto fail;
+	}
+
+	/* set up the ring */
+	ver = TPACKET_V3;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_VERSION,
+	    &ver, sizeof ver) != 0) {
+		ft_verbose("%s: TPACKET_V3: %s", i->name, strerror(errno));
+		goto fail;
+	}
+	ring_size = ft_iface_bufsize ? ft_iface_bufsize : IFACE_RING_SIZE;
+	i->blk_size = ft_iface_blocksize;
+	if (i->blk_size < IFACE_SNAPLEN ||
+	    i->blk_size % (unsigned int)getpagesize() != 0) {
+		ft_error("%s: invalid ring block size %u",
+		    i->name, i->blk_size);
+		goto fail;
+	}
+	if ((i->blk_nr = ring_size / i->blk_size) < 2)
+		i->blk_nr = 2;
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = i->blk_size;
+	req.tp_block_nr = i->blk_nr;
+	req.tp_frame_size = IFACE_SNAPLEN;
+	req.tp_frame_nr = i->blk_size / IFACE_SNAPLEN * i->blk_nr;
+	req.tp_retire_blk_tov = IFACE_TIMEOUT;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_RX_RING,
+	    &req, sizeof req) != 0) {
+		ft_verbose("%s: PACKET_RX_RING: %s", i->name, strerror(errno));
+		goto fail;
+	}
+	i->ring = mmap(NULL, (size_t)i->blk_size * i->blk_nr,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, i->fd, 0);
+	if (i->ring == MAP_FAILED) {
+		i->ring = NULL;
+		ft_verbose("%s: mmap: %s", i->name, strerror(errno));
+		goto fail;
+	}
+	if ((i->blk_refs = calloc(i->blk_nr, sizeof *i->blk_refs)) == NULL)
+		goto fail;
+	ft_verbose("%s: mapped %u blocks of %u bytes", i->name,
+	    i->blk_nr, i->blk_size);
+	return (0);
+fail:
+	tpacket_close(i);
+	return (-1);
+}
+
+/*
+ * Join the interface's fanout group.  The kernel runs the steering
+ * program on every frame and delivers it to the worker whose number it
+ * returns.  Frames are hashed on the IPv4 destination address, the
+ * target address of an ARP request, the sender address of an ARP reply
+ * or the low word of the neighbor discovery target address (the only
+ * IPv6 frames the filter lets through), so every question about a given
+ * address, every answer from it, and every packet sent to it once it
+ * has been claimed, ends up with the same worker and the same ARP or
+ * neighbor table.  A live host therefore releases a claim on its
+ * address as soon as it replies.  packet_steer() makes the same choice
+ * when replaying a capture.
+ *
+ * The program runs before the frame is handed to us, when the data
+ * starts at the network header and the kernel has already taken off
+ * the outer VLAN tag, so the type is read from the socket buffer and
+ * offsets are relative to the network header.  If a QinQ frame still
+ * has its inner tag, the type is read from that and the offsets are
+ * moved past it.
+ */
+static int
+tpacket_fanout(iface *i)
+{
+#if defined(PACKET_FANOUT_CBPF) && defined(PACKET_FANOUT_DATA)
+	struct sock_filter steer[] = {
+		BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+		    SKF_AD_OFF + SKF_AD_PROTOCOL),		/* type */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x8100, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x88a8, 0, 2),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 4),		/* tagged */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0806, 0, 6),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, 6),		/* arp oper */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_IND, 14),		/* arp spa */
+		BPF_JUMP(BPF_JMP | BPF_JA, 7, 0, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_IND, 24),		/* arp tpa */
+		BPF_JUMP(BPF_JMP | BPF_JA, 5, 0, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_IND, 16),		/* ip dst */
+		BPF_JUMP(BPF_JMP | BPF_JA, 2, 0, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x86dd, 0, 3),
+		BPF_STMT(BPF_LD | BPF_W | BPF_IND, 60),		/* nd target */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, ft_workers),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog sfp;
+	int arg;
+
+	/* one group per interface */
+	arg = ((getpid() + i->ifindex) & 0xffff) |
+	    (PACKET_FANOUT_CBPF << 16);
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_FANOUT,
+	    &arg, sizeof arg) != 0) {
+		ft_error("%s: failed to join fanout group: %s",
+		    i->name, strerror(errno));
+		return (-1);
+	}
+	sfp.len = sizeof steer / sizeof steer[0];
+	sfp.filter = steer;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_FANOUT_DATA,
+	    &sfp, sizeof sfp) != 0) {
+		ft_error("%s: failed to install fanout program: %s",
+		    i->name, strerror(errno));
+		return (-1);
+	}
+	ft_verbose("%s: worker %u joined fanout group", i->name, i->worker);
+	return (0);
+#else
+	ft_error("%s: fanout not supported on this platform", i->name);
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Attach a filter program to the socket, replacing any previous one.
+ */
+int
+tpacket_setfilter(iface *i, const struct bpf_program *prog)
+{
+	struct sock_fprog sfp;
+
+	sfp.len = prog->bf_len;
+	sfp.filter = (struct sock_filter *)prog->bf_insns;
+	return (setsockopt(i->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	    &sfp, sizeof sfp));
+}
+
+/*
+ * Enter promiscuous mode and start capturing.  The filter program must
+ * already be attached.
+ */
+int
+tpacket_activate(iface *i)
+{
+	struct packet_mreq mr;
+	struct sockaddr_ll sll;
+
+	memset(&mr, 0, sizeof mr);
+	mr.mr_ifindex = i->ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+	    &mr, sizeof mr) != 0) {
+		ft_error("%s: failed to enter promiscuous mode: %s",
+		    i->name, strerror(errno));
+		return (-1);
+	}
+
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = i->ifindex;
+	if (bind(i->fd, (struct sockaddr *)&sll, sizeof sll) != 0) {
+		ft_error("%s: failed to activate: %s",
+		    i->name, strerror(errno));
+		return (-1);
+	}
+	ft_verbose("%s: interface activated", i->name);
+
+	if (ft_workers > 1 && tpacket_fanout(i) != 0)
+		return (-1);
+	return (0);
+}
+
+void
+tpacket_close(iface *i)
+{
+
+	if (i->ring != NULL)
+		munmap(i->ring, (size_t)i->blk_size * i->blk_nr);
+	i->ring = NULL;
+	free(i->blk_refs);
+	i->blk_refs = NULL;
+	if (i->fd >= 0)
+		close(i->fd);
+	i->fd = -1;
+}
+
+/*
+ * Retrieve the number of frames the kernel has seen and dropped since
+ * the last call.  The kernel clears its counters when they are read.
+ */
+int
+tpacket_stats(iface *i, unsigned long *received, unsigned long *dropped)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len;
+
+	len = sizeof st;
+	if (i->fd < 0 ||
+	    getsockopt(i->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0)
+		return (-1);
+	*received = st.tp_packets;
+	*dropped = st.tp_drops;
+	return (0);
+}
+
+/*
+ * Drop a reference to a block and hand it back to the kernel once
+ * nobody is looking at it any more.
+ */
+void
+tpacket_unref(iface *i, unsigned int n)
+{
+
+	if (--i->blk_refs[n] == 0)
+		__atomic_store_n(&tpacket_block(i, n)->hdr.bh1.block_status,
+		    TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/*
+ * Check whether the kernel has handed us the current block.  A block we
+ * have seen before may still be referenced by descriptors from the
+ * previous lap around the ring.
+ */
+static int
+tpacket_ready(iface *i)
+{
+	struct tpacket_block_desc *bd;
+
+	bd = tpacket_block(i, i->blk_cur);
+	return (i->blk_refs[i->blk_cur] == 0 &&
+	    (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+	    TP_STATUS_USER));
+}
+
+/*
+ * Fill in a descriptor for the next frame in the ring, waiting up to
+ * the read timeout for the kernel to hand us a block if wait is
+ * non-zero.  Returns 0 on success and -1 with errno set to EAGAIN if no
+ * frame is available or EIO on error.
+ */
+int
+tpacket_next(iface *i, packet *p, int wait)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *th;
+	struct pollfd pfd;
+
+	while (i->blk_left == 0) {
+		/* done with the current block, move on */
+		if (i->blk_busy) {
+			i->blk_busy = 0;
+			tpacket_unref(i, i->blk_cur);
+			i->blk_cur = (i->blk_cur + 1) % i->blk_nr;
+		}
+		if (!tpacket_ready(i)) {
+			if (!wait) {
+				i->tp_idle = 1;
+				errno = EAGAIN;
+				return (-1);
+			}
+			pfd.fd = i->fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, IFACE_TIMEOUT) < 0 &&
+			    errno != EINTR) {
+				ft_error("%s: failed to read packets: %s",
+				    i->name, strerror(errno));
+				errno = EIO;
+				return (-1);
+			}
+			wait = 0;
+			if (!tpacket_ready(i)) {
+				errno = EAGAIN;
+				return (-1);
+			}
+			i->tp_idle = 1;
+		}
+		if (i->tp_idle) {
+			i->tp_idle = 0;
+			i->tp_wakeups++;
+		}
+		bd = tpacket_block(i, i->blk_cur);
+		i->blk_refs[i->blk_cur]++;
+		i->blk_busy = 1;
+		i->blk_left = bd->hdr.bh1.num_pkts;
+		i->frame = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+		i->tp_blocks++;
+	}
+	th = (struct tpacket3_hdr *)i->frame;
+	i->frame += th->tp_next_offset;
+	i->blk_left--;
+	i->tp_frames++;
+	if (th->tp_len > th->tp_snaplen)
+		STATS_INC(i, rx_truncated);
+	p->ts.tv_sec = th->tp_sec;
+	p->ts.tv_usec = th->tp_nsec / 1000;
+	p->data = (uint8_t *)th + th->tp_mac;
+	p->len = th->tp_snaplen;
+	p->wirelen = th->tp_len;
+	p->vlan_tpid = p->vlan_tci = 0;
+	if (th->tp_status & TP_STATUS_VLAN_VALID) {
+		/* the kernel took the outer tag off, put it back later */
+		p->vlan_tci = th->hv1.tp_vlan_tci;
+		p->vlan_tpid = ether_type_vlan;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+		if (th->tp_status & TP_STATUS_VLAN_TPID_VALID)
+			p->vlan_tpid = th->hv1.tp_vlan_tpid;
+#endif
+	}
+	p->blk = i->blk_cur;
+	i->blk_refs[i->blk_cur]++;
+	return (0);
+}
+
+/*
+ * Send n frames from consecutive slots in the transmit queue, starting
+ * with the given one, with a single system call if possible.  Returns
+ * the number of frames sent, or -1 if none could be.
+ */
+int
+tpacket_transmit(iface *i, unsigned int first, unsigned int n)
+{
+#if HAVE_SENDMMSG
+	struct mmsghdr msg[IFACE_TXQ_SIZE];
+	struct iovec iov[IFACE_TXQ_SIZE];
+	unsigned int k;
+	int ret;
+
+	memset(msg, 0, n * sizeof *msg);
+	for (k = 0; k < n; ++k) {
+		iov[k].iov_base = IFACE_TXQ_SLOT(i, first + k) +
+		    i->txq_off[first + k];
+		iov[k].iov_len = i->txq_len[first + k];
+		msg[k].msg_hdr.msg_iov = &iov[k];
+		msg[k].msg_hdr.msg_iovlen = 1;
+	}
+	for (k = 0; k < n; k += ret)
+		if ((ret = sendmmsg(i->fd, msg + k, n - k, 0)) <= 0)
+			break;
+	return (k > 0 ? (int)k : -1);
+#else
+	unsigned int k;
+
+	for (k = 0; k < n; ++k)
+		if (send(i->fd, IFACE_TXQ_SLOT(i, first + k) +
+		    i->txq_off[first + k], i->txq_len[first + k], 0) !=
+		    (ssize_t)i->txq_len[first + k])
+			break;
+	return (k > 0 ? (int)k : -1);
+#endif
+}
+
+#else
+
+unsigned int	 ft_iface_blocksize = IFACE_BLOCK_SIZE;
+
+int
+tpacket_open(iface *i)
+{
+
+	ft_verbose("%s: TPACKET_V3 not supported on this platform", i->name);
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+int
+tpacket_setfilter(iface *i, const struct bpf_program *prog)
+{
+
+	(void)i;
+	(void)prog;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+int
+tpacket_activate(iface *i)
+{
+
+	(void)i;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+void
+tpacket_close(iface *i)
+{
+
+	(void)i;
+}
+
+int
+tpacket_stats(iface *i, unsigned long *received, unsigned long *dropped)
+{
+
+	(void)i;
+	(void)received;
+	(void)dropped;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+int
+tpacket_next(iface *i, packet *p, int wait)
+{
+
+	(void)i;
+	(void)p;
+	(void)wait;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+void
+tpacket_unref(iface *i, unsigned int n)
+{
+
+	(void)i;
+	(void)n;
+}
+
+int
+tpacket_transmit(iface *i, unsigned int first, unsigned int n)
+{
+
+	(void)i;
+	(void)first;
+	(void)n;
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+#endif
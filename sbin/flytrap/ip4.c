@@ -50,6 +50,7 @@
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
@@ -59,41 +60,61 @@
 int
 packet_analyze_ip4(ether_flow *ethfl, const void *data, size_t len)
 {
+	const ip4s_frozen *set;
 	ip4_flow fl;
 	const ip4_hdr *ih;
-	size_t ihl;
-	int ret;
+	iface *i;
+	size_t caplen, ihl;
+	int partial, ret;
 
+	i = ethfl->p->i;
 	if (len < sizeof(ip4_hdr)) {
 		ft_notice("%d.%03d short IP packet (%zd < %zd)",
 		    ethfl->p->ts.tv_sec, ethfl->p->ts.tv_usec / 1000,
 		    len, sizeof(ip4_hdr));
+		STATS_INC(i, ip4_short);
 		return (-1);
 	}
 	ih = data;
 	ihl = ip4_hdr_ihl(ih) * 4;
-	if (ihl < 20 || len < ihl || len < be16toh(ih->len)) {
+	partial = ethfl->p->len < ethfl->p->wirelen;
+	if (ihl < 20 || len < ihl || be16toh(ih->len) < ihl ||
+	    (len < be16toh(ih->len) && !partial)) {
 		ft_notice("%d.%03d malformed IP header (plen %zd len %zd ihl %zd)",
 		    ethfl->p->ts.tv_sec, ethfl->p->ts.tv_usec / 1000,
 		    len, be16toh(ih->len), ihl);
+		STATS_INC(i, ip4_malformed);
 		return (-1);
 	}
+	/*
+	 * If the frame was cut short, we only have part of the payload;
+	 * the protocol code can tell by comparing what it gets to fl.len,
+	 * and will not be able to verify the checksum.
+	 */
+	caplen = len < be16toh(ih->len) ? len : be16toh(ih->len);
 	len = be16toh(ih->len);
 	ft_debug("\tIP version %d proto %d len %zu"
 	    " from %d.%d.%d.%d to %d.%d.%d.%d",
 	    ip4_hdr_ver(ih), ih->proto, len,
 	    ih->srcip.o[0], ih->srcip.o[1], ih->srcip.o[2], ih->srcip.o[3],
 	    ih->dstip.o[0], ih->dstip.o[1], ih->dstip.o[2], ih->dstip.o[3]);
-	if (src_set != NULL && !ip4s_lookup(src_set, be32toh(ih->srcip.q))) {
+	if ((set = SET_LOAD(src_set)) != NULL &&
+	    !ip4s_frozen_lookup(set, be32toh(ih->srcip.q))) {
 		ft_debug("\tsource address is out of bounds");
+		STATS_INC(i, ip4_filtered);
 		return (0);
 	}
-	if (dst_set != NULL && !ip4s_lookup(dst_set, be32toh(ih->dstip.q))) {
+	if ((set = SET_LOAD(dst_set)) != NULL &&
+	    !ip4s_frozen_lookup(set, be32toh(ih->dstip.q))) {
 		ft_debug("\tdestination address is out of bounds");
+		STATS_INC(i, ip4_filtered);
 		return (0);
 	}
 	data = (const uint8_t *)data + ihl;
+	caplen -= ihl;
 	len -= ihl;
+	if (caplen < len)
+		STATS_INC(i, ip4_partial);
 	fl.eth = ethfl;
 	fl.src = ih->srcip;
 	fl.dst = ih->dstip;
@@ -105,48 +126,54 @@ packet_analyze_ip4(ether_flow *ethfl, const void *data, size_t len)
 	    fl.pseudo[4], fl.pseudo[5], fl.pseudo[6], fl.pseudo[7],
 	    fl.pseudo[8], fl.pseudo[9], fl.pseudo[10], fl.pseudo[11]);
 	fl.sum = ip4_cksum(0, &fl.pseudo, sizeof fl.pseudo);
+	STATS_TIMER(t);
 	switch (ih->proto) {
 	case ip_proto_icmp:
-		ret = packet_analyze_icmp4(&fl, data, len);
+		STATS_INC(i, icmp4_packets);
+		ret = packet_analyze_icmp4(&fl, data, caplen);
+		STATS_TIME(i, stage_icmp4, t);
 		break;
 	case ip_proto_tcp:
-		ret = packet_analyze_tcp4(&fl, data, len);
+		STATS_INC(i, tcp4_packets);
+		ret = packet_analyze_tcp4(&fl, data, caplen);
+		STATS_TIME(i, stage_tcp4, t);
 		break;
 	case ip_proto_udp:
-		ret = packet_analyze_udp4(&fl, data, len);
+		STATS_INC(i, udp4_packets);
+		ret = packet_analyze_udp4(&fl, data, caplen);
+		STATS_TIME(i, stage_udp4, t);
 		break;
 	default:
+		STATS_INC(i, ip4_other);
 		ret = -1;
 	}
 	return (ret);
 }
 
+/*
+ * Prepend an IPv4 header to a reply under construction and pass it on
+ * to the Ethernet layer.
+ */
 int
-ip4_reply(ip4_flow *fl, ip_proto proto,
-    const void *data, size_t len)
+ip4_reply(ip4_flow *fl, ip_proto proto, txbuf *tb)
 {
 	ip4_hdr *ih;
-	size_t iplen;
-	int ret;
 
 	ft_debug("ip4 proto %d to %02x:%02x:%02x:%02x:%02x:%02x", proto,
 	    fl->eth->dst.o[0], fl->eth->dst.o[1], fl->eth->dst.o[2],
 	    fl->eth->dst.o[3], fl->eth->dst.o[4], fl->eth->dst.o[5]);
-	iplen = sizeof *ih + len;
-	if ((ih = calloc(1, iplen)) == NULL)
+	if ((ih = txbuf_prepend(tb, sizeof *ih)) == NULL)
 		return (-1);
 	ih->ver_ihl = 0x45;
 	ih->dscp_ecn = 0x00;
-	ih->len = htobe16(iplen);
+	ih->len = htobe16(tb->len);
 	ih->id = 0x0000;
 	ih->fl_off = 0x0000;
 	ih->ttl = 0x40;
 	ih->proto = proto;
+	ih->sum = 0x0000;
 	ih->srcip = fl->dst;
 	ih->dstip = fl->src;
 	ih->sum = htobe16(~ip4_cksum(0, ih, sizeof *ih));
-	memcpy(ih + 1, data, len);
-	ret = ethernet_reply(fl->eth, ih, iplen);
-	free(ih);
-	return (ret);
+	return (ethernet_reply(fl->eth, tb));
 }
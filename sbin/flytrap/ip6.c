@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/ip6.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/*
+ * Sum of the IPv6 pseudo-header (RFC 8200 section 8.1), to be passed to
+ * ip4_cksum() as the initial value when checksumming the upper-layer
+ * packet.
+ */
+uint16_t
+ip6_pseudo_sum(const ipv6_addr *src, const ipv6_addr *dst, uint32_t len,
+    uint8_t nxt)
+{
+	uint8_t tail[8];
+	uint16_t sum;
+
+	be32enc(tail, len);
+	be32enc(tail + 4, nxt);
+	sum = ip4_cksum(0, src, sizeof *src);
+	sum = ip4_cksum(sum, dst, sizeof *dst);
+	return (ip4_cksum(sum, tail, sizeof tail));
+}
+
+/*
+ * Analyze a captured IPv6 packet.  Only neighbor discovery is of any
+ * interest to us, so anything but ICMPv6 directly after the fixed
+ * header is counted and dropped.
+ */
+int
+packet_analyze_ip6(ether_flow *ethfl, const void *data, size_t len)
+{
+	ip6_flow fl;
+	const ip6_hdr *ih;
+	iface *i;
+	int ret;
+
+	i = ethfl->p->i;
+	if (len < sizeof(ip6_hdr)) {
+		ft_notice("%d.%03d short IPv6 packet (%zd < %zd)",
+		    ethfl->p->ts.tv_sec, ethfl->p->ts.tv_usec / 1000,
+		    len, sizeof(ip6_hdr));
+		STATS_INC(i, ip6_short);
+		return (-1);
+	}
+	ih = data;
+	if (ip6_hdr_ver(ih) != 6 ||
+	    len - sizeof *ih < be16toh(ih->len)) {
+		ft_notice("%d.%03d malformed IPv6 header (ver %u len %zd "
+		    "plen %u)", ethfl->p->ts.tv_sec,
+		    ethfl->p->ts.tv_usec / 1000, ip6_hdr_ver(ih),
+		    len, be16toh(ih->len));
+		STATS_INC(i, ip6_malformed);
+		return (-1);
+	}
+	data = ih + 1;
+	len = be16toh(ih->len);
+	fl.eth = ethfl;
+	fl.src = ih->srcip;
+	fl.dst = ih->dstip;
+	fl.nxt = ih->nxt;
+	fl.hlim = ih->hlim;
+	fl.len = len;
+	ft_debug("\tIPv6 next header %u len %zu hop limit %u",
+	    fl.nxt, len, fl.hlim);
+	switch (fl.nxt) {
+	case ip6_proto_icmp6:
+		STATS_INC(i, icmp6_packets);
+		fl.sum = ip6_pseudo_sum(&fl.src, &fl.dst, len, fl.nxt);
+		ret = packet_analyze_icmp6(&fl, data, len);
+		break;
+	default:
+		STATS_INC(i, ip6_other);
+		ret = -1;
+	}
+	return (ret);
+}
+
+/*
+ * Analyze a captured ICMPv6 packet
+ */
+int
+packet_analyze_icmp6(ip6_flow *fl, const void *data, size_t len)
+{
+	const icmp6_hdr *ih;
+	uint16_t sum;
+
+	ih = data;
+	if (len < sizeof *ih) {
+		ft_notice("%d.%03d short ICMPv6 packet (%zd < %zd)",
+		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
+		    len, sizeof *ih);
+		STATS_INC(fl->eth->p->i, icmp6_invalid);
+		return (-1);
+	}
+	if ((sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
+		ft_notice("%d.%03d invalid ICMPv6 checksum 0x%04hx",
+		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
+		    sum);
+		STATS_INC(fl->eth->p->i, icmp6_invalid);
+		return (-1);
+	}
+	switch (ih->type) {
+	case icmp6_type_nd_solicit:
+		STATS_INC(fl->eth->p->i, ndp_solicit);
+		return (ndp_solicit(fl, data, len));
+	case icmp6_type_nd_advert:
+		STATS_INC(fl->eth->p->i, ndp_advert);
+		return (ndp_advert(fl, data, len));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Prepend an IPv6 header to a reply under construction and pass it on
+ * to the Ethernet layer.  Neighbor discovery requires the maximum hop
+ * limit, and we send nothing else.
+ */
+int
+ip6_reply(ip6_flow *fl, const ipv6_addr *src, uint8_t nxt, txbuf *tb)
+{
+	ip6_hdr *ih;
+	size_t len;
+
+	len = tb->len;
+	if ((ih = txbuf_prepend(tb, sizeof *ih)) == NULL)
+		return (-1);
+	ih->ver_tc_fl = htobe32(6U << 28);
+	ih->len = htobe16(len);
+	ih->nxt = nxt;
+	ih->hlim = ND_HOP_LIMIT;
+	ih->srcip = *src;
+	ih->dstip = fl->src;
+	return (ethernet_reply(fl->eth, tb));
+}
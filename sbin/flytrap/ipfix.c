@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * IPFIX export
+ *
+ * If a collector is configured, the log writer thread also passes every
+ * log record it drains to ipfix_export(), which encodes it straight
+ * into a preallocated message buffer.  The message is sent as a single
+ * UDP datagram once the next record would not fit, or once the oldest
+ * record in it has waited ft_ipfix_interval milliseconds.  The template
+ * goes out with the first message and again every ft_ipfix_refresh
+ * seconds, as RFC 7011 requires when exporting over UDP.
+ *
+ * Nothing is ever retried: a message the collector does not get is
+ * lost, and the gap shows up in the sequence numbers.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/ip4.h>
+#include <ft/ipfix.h>
+#include <ft/log.h>
+#include <ft/logrec.h>
+
+#include "flytrap.h"
+
+#define IPFIX_PORT	"4739"
+
+const char *ft_ipfix_collector;		/* host[:port] */
+unsigned int ft_ipfix_domain;		/* observation domain ID */
+unsigned int ft_ipfix_interval = 1000;	/* milliseconds */
+unsigned int ft_ipfix_mtu = 1400;	/* bytes per message */
+unsigned int ft_ipfix_refresh = 600;	/* seconds */
+
+static int ipfix_fd = -1;
+static uint8_t *ipfix_buf;
+static ft_ipfix ipfix;
+static uint64_t ipfix_first;		/* oldest record in the message */
+static uint64_t ipfix_tmpl_last;	/* last time the template was due */
+static int ipfix_tmpl_due;
+static int ipfix_failing;
+static unsigned long ipfix_msgs, ipfix_recs, ipfix_errors;
+
+/*
+ * Resolve the collector and connect a socket to it.
+ */
+static int
+ipfix_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd, gerr;
+
+	if ((host = strdup(ft_ipfix_collector)) == NULL)
+		return (-1);
+	port = NULL;
+	if (*host == '[' && (port = strchr(host, ']')) != NULL) {
+		/* [address]:port, for IPv6 literals */
+		*port++ = '\0';
+		memmove(host, host + 1, strlen(host + 1) + 1);
+		port = *port == ':' ? port + 1 : NULL;
+	} else if ((port = strchr(host, ':')) != NULL &&
+	    strchr(port + 1, ':') == NULL) {
+		*port++ = '\0';
+	} else {
+		port = NULL;
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((gerr = getaddrinfo(host, port != NULL && *port != '\0' ?
+	    port : IPFIX_PORT, &hints, &res)) != 0) {
+		ft_error("%s: %s", ft_ipfix_collector,
+		    gai_strerror(gerr));
+		free(host);
+		errno = EINVAL;
+		return (-1);
+	}
+	free(host);
+	for (fd = -1, ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		ft_error("%s: %s", ft_ipfix_collector, strerror(errno));
+	return (fd);
+}
+
+/*
+ * Set up the exporter.  Does nothing unless a collector is configured.
+ */
+int
+ipfix_open(void)
+{
+
+	if (ft_ipfix_collector == NULL)
+		return (0);
+	if ((ipfix_buf = malloc(ft_ipfix_mtu)) == NULL)
+		return (-1);
+	if ((ipfix_fd = ipfix_connect()) < 0) {
+		free(ipfix_buf);
+		ipfix_buf = NULL;
+		return (-1);
+	}
+	ft_ipfix_init(&ipfix, ipfix_buf, ft_ipfix_mtu, ft_ipfix_domain);
+	ipfix_first = ipfix_tmpl_last = 0;
+	ipfix_tmpl_due = 1;
+	ipfix_failing = 0;
+	ipfix_msgs = ipfix_recs = ipfix_errors = 0;
+	ft_verbose("exporting IPFIX to %s, domain %u",
+	    ft_ipfix_collector, ft_ipfix_domain);
+	return (0);
+}
+
+/*
+ * Send the current message, if there is one, and start a new one.
+ */
+static void
+ipfix_send(uint64_t now)
+{
+	uint32_t nrecs;
+	size_t len;
+
+	nrecs = ipfix.nrecs;
+	if ((len = ft_ipfix_finish(&ipfix, now / 1000)) == 0)
+		return;
+	ipfix_first = 0;
+	if (send(ipfix_fd, ipfix_buf, len, MSG_DONTWAIT) != (ssize_t)len) {
+		if (!ipfix_failing)
+			ft_warning("%s: IPFIX export failed: %s",
+			    ft_ipfix_collector, strerror(errno));
+		ipfix_failing = 1;
+		ipfix_errors++;
+		return;
+	}
+	if (ipfix_failing)
+		ft_notice("%s: IPFIX export resumed", ft_ipfix_collector);
+	ipfix_failing = 0;
+	ipfix_msgs++;
+	ipfix_recs += nrecs;
+}
+
+/*
+ * Add the template to the current message if it is due, then the
+ * record.  Returns -1 if the record did not fit.
+ */
+static int
+ipfix_add(const ft_logrec *lr)
+{
+
+	if (ipfix_tmpl_due && ft_ipfix_template(&ipfix) == 0)
+		ipfix_tmpl_due = 0;
+	return (ft_ipfix_record(&ipfix, lr));
+}
+
+/*
+ * Export a log record.  Called by the writer thread.
+ */
+void
+ipfix_export(const ft_logrec *lr, uint64_t now)
+{
+
+	if (ipfix_fd < 0)
+		return;
+	if (ipfix_add(lr) != 0) {
+		/* a template and a record always fit in an empty message */
+		ipfix_send(now);
+		(void)ipfix_add(lr);
+	}
+	if (ipfix_first == 0)
+		ipfix_first = now;
+}
+
+/*
+ * Send the current message if it has waited long enough, and see if
+ * the template is due.  Called by the writer thread on every pass.
+ */
+void
+ipfix_tick(uint64_t now)
+{
+
+	if (ipfix_fd < 0)
+		return;
+	if (ipfix_first != 0 && now - ipfix_first >= ft_ipfix_interval)
+		ipfix_send(now);
+	if (ipfix_tmpl_last == 0) {
+		ipfix_tmpl_last = now;
+	} else if (now - ipfix_tmpl_last >= ft_ipfix_refresh * 1000ULL) {
+		ipfix_tmpl_last = now;
+		ipfix_tmpl_due = 1;
+	}
+}
+
+/*
+ * Send whatever is left and shut the exporter down.
+ */
+void
+ipfix_close(uint64_t now)
+{
+
+	if (ipfix_fd < 0)
+		return;
+	ipfix_send(now);
+	ft_verbose("IPFIX: %lu records in %lu messages, %lu failed",
+	    ipfix_recs, ipfix_msgs, ipfix_errors);
+	close(ipfix_fd);
+	ipfix_fd = -1;
+	free(ipfix_buf);
+	ipfix_buf = NULL;
+}
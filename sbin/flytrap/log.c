@@ -33,53 +33,725 @@
 
 #include <sys/time.h>
 
-#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include <ft/ethernet.h>
+#include <ft/hash.h>
 #include <ft/ip4.h>
+#include <ft/log.h>
+#include <ft/logrec.h>
 
 #include "flytrap.h"
 #include "ethernet.h"
 
+/*
+ * Log records are not written by the threads that produce them.  Each
+ * thread which logs anything gets its own single-producer,
+ * single-consumer ring of records, and a dedicated writer thread drains
+ * all the rings, formats the records and writes them out in large
+ * chunks.  A slow disk or a stalled log rotation can therefore only
+ * fill up the rings; what happens then is decided by ft_log_full.
+ *
+ * If the log is compressed, each chunk is passed through deflate and
+ * followed by a sync flush, so everything written so far can always be
+ * decompressed.  The gzip member is finished when the file is closed
+ * or reopened, and a new one is started on the next write; gzip(1)
+ * reads the concatenated members as a single stream.
+ *
+ * If summaries are enabled, the writer folds records with the same
+ * source address, destination port, protocol and flags into a fixed-size
+ * table instead of writing them out, and writes one summary record per
+ * entry every ft_log_summary seconds, or when the entry is evicted to
+ * make room for another.  The number of distinct destinations in each
+ * entry is estimated with a small HyperLogLog sketch, so an entry has
+ * the same size whether it covers one address or a whole network.
+ *
+ * If an IPFIX collector is configured, the writer also exports every
+ * record it drains, summarized or not; see ipfix.c.
+ */
+#define LOG_MAXRINGS	128
+#define LOG_IDLE_MS	10
+#define LOG_REPORT_MS	10000
+#define LOG_ZBUFSIZE	65536
+#define LOG_SUM_WAYS	4
+#define LOG_SUM_REGS	64
+
+const char *ft_log_format = "text"; /* text or binary */
+const char *ft_log_compress = "none"; /* none or gzip */
+const char *ft_log_full = "drop"; /* drop or block */
+unsigned int ft_log_bufsize = 64 * 1024;
+unsigned int ft_log_interval = 1000;
+unsigned int ft_log_ring = 8192;
+unsigned int ft_log_summary = 0; /* seconds, 0 to log every packet */
+unsigned int ft_log_sumtable = 16384;
+
+struct log_ring {
+	ft_logrec	*recs;
+	unsigned int	 mask;
+	/* written by the producer */
+	unsigned int	 head __attribute__((__aligned__(64)));
+	unsigned long	 dropped;
+	/* written by the consumer */
+	unsigned int	 tail __attribute__((__aligned__(64)));
+};
+
+static struct log_ring *rings[LOG_MAXRINGS];
+static unsigned int nrings;
+static pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cv = PTHREAD_COND_INITIALIZER;
+static int kicked;
+static __thread struct log_ring *ring;
+
+static const char *logname;
 static FILE *logfile;
+static int logbinary;
+static int logblock;
+static int logz;
+#if WITH_ZLIB
+static z_stream logzs;
+static int logzopen;		/* gzip member in progress */
+static unsigned char *logzbuf;
+#endif
+
+struct log_sum {
+	ft_logsum	 ls;		/* count is 0 if unused */
+	uint8_t		 reg[LOG_SUM_REGS];
+};
+
+static struct log_sum *sums;
+static uint32_t nsumsets;
+
+static pthread_t writer;
+static int running;
+static int stopping;
+static int reopen;
+
+/*
+ * Return the current time in milliseconds.
+ */
+static uint64_t
+log_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec * 1000ULL + now.tv_usec / 1000);
+}
+
+/*
+ * Sleep for a few milliseconds.
+ */
+static void
+log_sleep(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Wake the writer thread up.
+ */
+static void
+log_kick(void)
+{
+
+	pthread_mutex_lock(&log_mtx);
+	kicked = 1;
+	pthread_cond_signal(&log_cv);
+	pthread_mutex_unlock(&log_mtx);
+}
+
+/*
+ * Writer: wait until kicked or until LOG_IDLE_MS have passed.
+ */
+static void
+log_idle(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += LOG_IDLE_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&log_mtx);
+	if (!kicked)
+		pthread_cond_timedwait(&log_cv, &log_mtx, &ts);
+	kicked = 0;
+	pthread_mutex_unlock(&log_mtx);
+}
 
+/*
+ * Allocate and register a ring for the calling thread.
+ */
+static struct log_ring *
+log_ring_new(void)
+{
+	struct log_ring *r;
+	unsigned int size;
+
+	for (size = 1; size < ft_log_ring; size *= 2)
+		/* nothing */ ;
+	if ((r = calloc(1, sizeof *r)) == NULL)
+		return (NULL);
+	if ((r->recs = calloc(size, sizeof *r->recs)) == NULL) {
+		free(r);
+		return (NULL);
+	}
+	r->mask = size - 1;
+	pthread_mutex_lock(&log_mtx);
+	if (nrings == LOG_MAXRINGS) {
+		pthread_mutex_unlock(&log_mtx);
+		free(r->recs);
+		free(r);
+		errno = ENOSPC;
+		return (NULL);
+	}
+	rings[nrings] = r;
+	__atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_mtx);
+	return (r);
+}
+
+/*
+ * Queue a log record.  Only ever called by the thread which owns the
+ * ring.
+ */
 int
 log_packet4(const struct timeval *tv,
     const ip4_addr *sa, int sp,
     const ip4_addr *da, int dp,
-    const char *proto, size_t len, const char *fmt, ...)
-{
-	va_list ap;
-
-	fprintf(logfile,
-	    "%llu.%06lu,%d.%d.%d.%d,%d,%d.%d.%d.%d,%d,%s,%zu,",
-	    (unsigned long long)tv->tv_sec, (unsigned long)tv->tv_usec,
-	    sa->o[0], sa->o[1], sa->o[2], sa->o[3], sp,
-	    da->o[0], da->o[1], da->o[2], da->o[3], dp,
-	    proto, len);
-	va_start(ap, fmt);
-	vfprintf(logfile ? logfile : stdout, fmt, ap);
-	va_end(ap);
-	fprintf(logfile ? logfile : stdout, "\n");
-	fflush(logfile);
+    ip_proto proto, size_t len, unsigned int flags)
+{
+	ft_logrec *lr;
+	unsigned int head;
+
+	if (ring == NULL && (ring = log_ring_new()) == NULL)
+		return (-1);
+	head = ring->head;
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >
+	    ring->mask) {
+		if (!logblock) {
+			__atomic_store_n(&ring->dropped, ring->dropped + 1,
+			    __ATOMIC_RELAXED);
+			errno = ENOBUFS;
+			return (-1);
+		}
+		log_kick();
+		log_sleep(1);
+	}
+	lr = &ring->recs[head & ring->mask];
+	lr->sec = tv->tv_sec;
+	lr->usec = tv->tv_usec;
+	lr->sa = *sa;
+	lr->sp = sp;
+	lr->da = *da;
+	lr->dp = dp;
+	lr->proto = proto;
+	lr->flags = flags;
+	lr->len = len > UINT16_MAX ? UINT16_MAX : len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+#if WITH_ZLIB
+/*
+ * Writer: compress a chunk and write it out, starting a new gzip member
+ * if necessary.
+ */
+static int
+log_deflate(char *buf, size_t len, int flush)
+{
+	size_t n;
+
+	if (!logzopen) {
+		memset(&logzs, 0, sizeof logzs);
+		if (deflateInit2(&logzs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		logzopen = 1;
+	}
+	logzs.next_in = (unsigned char *)buf;
+	logzs.avail_in = len;
+	do {
+		logzs.next_out = logzbuf;
+		logzs.avail_out = LOG_ZBUFSIZE;
+		deflate(&logzs, flush);
+		n = LOG_ZBUFSIZE - logzs.avail_out;
+		if (n > 0 && fwrite(logzbuf, 1, n, logfile) != n)
+			return (-1);
+	} while (logzs.avail_out == 0);
+	if (flush == Z_FINISH) {
+		deflateEnd(&logzs);
+		logzopen = 0;
+	}
 	return (0);
 }
+#endif
 
+/*
+ * Writer: write out and empty the buffer.
+ */
+static void
+log_write(char *buf, size_t *len)
+{
+	int ret;
+
+	if (*len == 0)
+		return;
+#if WITH_ZLIB
+	if (logz)
+		ret = log_deflate(buf, *len, Z_SYNC_FLUSH);
+	else
+#endif
+		ret = fwrite(buf, 1, *len, logfile) != *len ? -1 : 0;
+	if (ret != 0 || fflush(logfile) != 0) {
+		ft_warning("failed to write log file: %s", strerror(errno));
+		clearerr(logfile);
+	}
+	*len = 0;
+}
+
+/*
+ * Writer: finish the current gzip member, if there is one.
+ */
+static void
+log_finish(void)
+{
+
+#if WITH_ZLIB
+	if (!logzopen)
+		return;
+	if (log_deflate(NULL, 0, Z_FINISH) != 0 || fflush(logfile) != 0) {
+		ft_warning("failed to write log file: %s", strerror(errno));
+		clearerr(logfile);
+	}
+#endif
+}
+
+/*
+ * Writer: reopen the log file, keeping the old one if that fails.
+ */
+static void
+log_reopen_file(void)
+{
+	FILE *f;
+
+	if (logname == NULL)
+		return;
+	if ((f = fopen(logname, "a")) == NULL) {
+		ft_warning("failed to reopen log file: %s", strerror(errno));
+		return;
+	}
+	if (logfile != stdout)
+		fclose(logfile);
+	logfile = f;
+}
+
+/*
+ * Return the number of records dropped so far, across all rings.
+ */
+unsigned long
+log_dropped(void)
+{
+	unsigned long dropped;
+	unsigned int i, n;
+
+	n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+	for (dropped = 0, i = 0; i < n; ++i)
+		dropped += __atomic_load_n(&rings[i]->dropped,
+		    __ATOMIC_RELAXED);
+	return (dropped);
+}
+
+/*
+ * Writer: report records dropped since the last report.
+ */
+static void
+log_report(unsigned long *reported)
+{
+	unsigned long dropped;
+
+	dropped = log_dropped();
+	if (dropped > *reported) {
+		ft_warning("%lu log records dropped", dropped - *reported);
+		*reported = dropped;
+	}
+}
+
+/*
+ * Writer: append a formatted record to the buffer, writing the buffer
+ * out first if there is not enough room left.
+ */
+static void
+log_append(char *buf, size_t *len, uint64_t *first, const char *line,
+    size_t l)
+{
+
+	if (*len + l > ft_log_bufsize)
+		log_write(buf, len);
+	if (*len == 0)
+		*first = log_now();
+	memcpy(buf + *len, line, l);
+	*len += l;
+}
+
+/*
+ * Writer: estimate the number of distinct destinations in a summary,
+ * using linear counting while some registers are still empty.
+ */
+static uint32_t
+log_sum_ndst(const struct log_sum *s)
+{
+	double e, sum;
+	unsigned int i, zeros;
+
+	for (sum = 0.0, zeros = 0, i = 0; i < LOG_SUM_REGS; ++i) {
+		sum += 1.0 / (1ULL << s->reg[i]);
+		if (s->reg[i] == 0)
+			zeros++;
+	}
+	e = 0.709 * LOG_SUM_REGS * LOG_SUM_REGS / sum;
+	if (e <= 2.5 * LOG_SUM_REGS && zeros > 0)
+		e = LOG_SUM_REGS * log((double)LOG_SUM_REGS / zeros);
+	if (e < 1.0)
+		return (1);
+	if (e >= s->ls.count)
+		return (s->ls.count);
+	return ((uint32_t)(e + 0.5));
+}
+
+/*
+ * Writer: write out a summary and free its entry.
+ */
+static void
+log_sum_emit(char *buf, size_t *len, uint64_t *first, struct log_sum *s)
+{
+	char line[FT_LOGSUM_TEXTMAX];
+	int l;
+
+	s->ls.ndst = log_sum_ndst(s);
+	if (logbinary) {
+		ft_logsum_enc(line, &s->ls);
+		l = FT_LOGSUM_SIZE;
+	} else {
+		l = ft_logsum_text(line, sizeof line - 1, &s->ls);
+		if (l >= 0 && l < (int)sizeof line - 1)
+			line[l++] = '\n';
+		else
+			l = 0;
+	}
+	if (l > 0)
+		log_append(buf, len, first, line, l);
+	s->ls.count = 0;
+}
+
+/*
+ * Writer: write out all summaries.
+ */
+static void
+log_sum_flush(char *buf, size_t *len, uint64_t *first)
+{
+	uint32_t i;
+
+	for (i = 0; i < nsumsets * LOG_SUM_WAYS; ++i)
+		if (sums[i].ls.count > 0)
+			log_sum_emit(buf, len, first, &sums[i]);
+}
+
+/*
+ * Writer: fold a record into the summary table.  If its set is full,
+ * the entry which was started first is written out to make room.
+ */
+static void
+log_sum_add(char *buf, size_t *len, uint64_t *first, const ft_logrec *lr)
+{
+	struct log_sum *set, *s, *victim;
+	uint64_t h;
+	unsigned int i, rank;
+
+	h = ft_hash_u64(ft_hash_seed ^ lr->proto, (uint64_t)lr->sa.q << 32 |
+	    (uint32_t)lr->dp << 16 | lr->flags);
+	set = sums + ft_hash_reduce(h >> 32, nsumsets) * LOG_SUM_WAYS;
+	for (victim = NULL, i = 0; i < LOG_SUM_WAYS; ++i) {
+		s = &set[i];
+		if (s->ls.count == 0) {
+			if (victim == NULL || victim->ls.count > 0)
+				victim = s;
+			continue;
+		}
+		if (s->ls.sa.q == lr->sa.q && s->ls.dp == lr->dp &&
+		    s->ls.proto == lr->proto && s->ls.flags == lr->flags)
+			break;
+		if (victim == NULL || (victim->ls.count > 0 &&
+		    (s->ls.fsec < victim->ls.fsec ||
+		    (s->ls.fsec == victim->ls.fsec &&
+		    s->ls.fusec < victim->ls.fusec))))
+			victim = s;
+	}
+	if (i == LOG_SUM_WAYS) {
+		s = victim;
+		if (s->ls.count > 0)
+			log_sum_emit(buf, len, first, s);
+		s->ls.fsec = lr->sec;
+		s->ls.fusec = lr->usec;
+		s->ls.sa = lr->sa;
+		s->ls.da = lr->da;
+		s->ls.dp = lr->dp;
+		s->ls.proto = lr->proto;
+		s->ls.flags = lr->flags;
+		memset(s->reg, 0, sizeof s->reg);
+	}
+	if (s->ls.count < UINT32_MAX)
+		s->ls.count++;
+	s->ls.lsec = lr->sec;
+	s->ls.lusec = lr->usec;
+
+	/* low bits pick a register, the rest give the rank */
+	h = ft_hash_u64(ft_hash_seed, lr->da.q);
+	i = h % LOG_SUM_REGS;
+	h /= LOG_SUM_REGS;
+	rank = h == 0 ? 59 : __builtin_clzll(h) - 5;
+	if (rank > s->reg[i])
+		s->reg[i] = rank;
+}
+
+/*
+ * Writer thread: drain the rings until told to stop.
+ */
+static void *
+log_writer(void *arg)
+{
+	char line[FT_LOGREC_TEXTMAX], *buf;
+	struct log_ring *r;
+	unsigned long reported;
+	uint64_t now, first, last, sumlast;
+	unsigned int head, tail, i, n;
+	size_t len, count;
+	int l;
+
+	buf = arg;
+	len = 0;
+	reported = 0;
+	first = last = sumlast = now = log_now();
+	for (;;) {
+		if (__atomic_exchange_n(&reopen, 0, __ATOMIC_ACQ_REL)) {
+			log_write(buf, &len);
+			log_finish();
+			log_reopen_file();
+		}
+		count = 0;
+		n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; ++i) {
+			r = rings[i];
+			tail = r->tail;
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			for (; tail != head; ++tail, ++count) {
+				ipfix_export(&r->recs[tail & r->mask], now);
+				if (sums != NULL) {
+					log_sum_add(buf, &len, &first,
+					    &r->recs[tail & r->mask]);
+					continue;
+				}
+				if (logbinary) {
+					ft_logrec_enc(line,
+					    &r->recs[tail & r->mask]);
+					l = FT_LOGREC_SIZE;
+				} else {
+					l = ft_logrec_text(line,
+					    sizeof line - 1,
+					    &r->recs[tail & r->mask]);
+					if (l < 0 || l >= (int)sizeof line - 1)
+						continue;
+					line[l++] = '\n';
+				}
+				log_append(buf, &len, &first, line, l);
+			}
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+		now = log_now();
+		ipfix_tick(now);
+		if (sums != NULL && now - sumlast >= ft_log_summary * 1000ULL) {
+			log_sum_flush(buf, &len, &first);
+			sumlast = now;
+		}
+		if (len > 0 && now - first >= ft_log_interval)
+			log_write(buf, &len);
+		if (now - last >= LOG_REPORT_MS) {
+			log_report(&reported);
+			last = now;
+		}
+		if (count == 0) {
+			if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+				break;
+			log_idle();
+		}
+	}
+	if (sums != NULL)
+		log_sum_flush(buf, &len, &first);
+	log_write(buf, &len);
+	log_finish();
+	log_report(&reported);
+	ipfix_close(log_now());
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Open the log file and start the writer thread.  This is done
+ * synchronously so the caller finds out right away if it fails.
+ */
 int
 log_open(const char *logfn)
 {
-	FILE *nf, *of;
+	sigset_t sigs, osigs;
+	char *buf;
 
-	if (logfn == NULL)
-		nf = stdout;
-	else if ((nf = fopen(logfn, "a")) == NULL)
+	if (running) {
+		errno = EBUSY;
+		return (-1);
+	}
+	if (strcmp(ft_log_format, "text") == 0) {
+		logbinary = 0;
+	} else if (strcmp(ft_log_format, "binary") == 0) {
+		logbinary = 1;
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (strcmp(ft_log_compress, "none") == 0) {
+		logz = 0;
+	} else if (strcmp(ft_log_compress, "gzip") == 0) {
+#if WITH_ZLIB
+		logz = 1;
+#else
+		errno = EOPNOTSUPP;
+		return (-1);
+#endif
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (strcmp(ft_log_full, "drop") == 0) {
+		logblock = 0;
+	} else if (strcmp(ft_log_full, "block") == 0) {
+		logblock = 1;
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((buf = malloc(ft_log_bufsize)) == NULL)
 		return (-1);
-	of = logfile;
-	logfile = nf;
-	if (of != NULL && of != stdout)
-		fclose(of);
+#if WITH_ZLIB
+	if (logz && logzbuf == NULL &&
+	    (logzbuf = malloc(LOG_ZBUFSIZE)) == NULL) {
+		free(buf);
+		return (-1);
+	}
+#endif
+	if (ipfix_open() != 0) {
+		free(buf);
+		return (-1);
+	}
+	if (ft_log_summary > 0) {
+		nsumsets = (ft_log_sumtable + LOG_SUM_WAYS - 1) / LOG_SUM_WAYS;
+		if ((sums = calloc(nsumsets * LOG_SUM_WAYS,
+		    sizeof *sums)) == NULL) {
+			ipfix_close(0);
+			free(buf);
+			return (-1);
+		}
+		ft_verbose("summarizing log records every %u s, %u entries",
+		    ft_log_summary, nsumsets * LOG_SUM_WAYS);
+	}
+	if (logfn == NULL) {
+		logfile = stdout;
+	} else if ((logfile = fopen(logfn, "a")) == NULL) {
+		free(sums);
+		sums = NULL;
+		ipfix_close(0);
+		free(buf);
+		return (-1);
+	}
+	logname = logfn;
+	stopping = reopen = 0;
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	errno = pthread_create(&writer, NULL, log_writer, buf);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (errno != 0) {
+		if (logfile != stdout)
+			fclose(logfile);
+		logfile = NULL;
+		free(sums);
+		sums = NULL;
+		ipfix_close(0);
+		free(buf);
+		return (-1);
+	}
+	running = 1;
 	return (0);
 }
+
+/*
+ * Ask the writer thread to reopen the log file.
+ */
+void
+log_reopen(void)
+{
+
+	__atomic_store_n(&reopen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Stop the writer thread once it has written out everything that was
+ * queued, and close the log file.  Must not be called while any other
+ * thread may still be logging.
+ */
+void
+log_close(void)
+{
+	unsigned int i;
+
+	if (!running)
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	log_kick();
+	pthread_join(writer, NULL);
+	running = 0;
+	if (logfile != stdout)
+		fclose(logfile);
+	logfile = NULL;
+	for (i = 0; i < nrings; ++i) {
+		free(rings[i]->recs);
+		free(rings[i]);
+		rings[i] = NULL;
+	}
+	nrings = 0;
+	ring = NULL;
+	free(sums);
+	sums = NULL;
+#if WITH_ZLIB
+	free(logzbuf);
+	logzbuf = NULL;
+#endif
+}
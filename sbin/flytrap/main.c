@@ -32,14 +32,17 @@
 #endif
 
 #include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <ft/ctype.h>
 #include <ft/endian.h>
 #include <ft/ethernet.h>
+#include <ft/hash.h>
 #include <ft/ip4.h>
 #include <ft/log.h>
 #include <ft/pidfile.h>
@@ -50,19 +53,206 @@
 static const char *ft_pidfile = "/var/run/flytrap.pid";
 static int ft_foreground = 0;
 
-ip4s_node *src_set;
-ip4s_node *dst_set;
+/*
+ * The address sets are built as trees from the command line, then
+ * frozen for fast lookups.  The arguments are kept so the sets can be
+ * rebuilt later, when the files they refer to may have changed.
+ */
+struct set_arg {
+	int		 opt;
+	const char	*arg;
+};
+static struct set_arg *set_args;
+static unsigned int nset_args;
+static int set_reload;		/* log errors instead of printing them */
+unsigned int ft_set_files;
+ip4s_frozen *src_set;
+ip4s_frozen *dst_set;
+ip4s_frozen *dark_set;
+
+/*
+ * Tunables which can be set with -o name=value
+ */
+typedef enum { opt_bool, opt_uint, opt_str } opt_type;
+static const struct option {
+	const char	*name;
+	opt_type	 type;
+	void		*value;
+	unsigned int	 min, max;
+} options[] = {
+	{ "arpannounce", opt_uint,	&ft_arp_announce,	0, 86400 },
+	{ "arpfile",	opt_str,	&ft_arp_file,		0, 0 },
+	{ "arpinterval", opt_uint,	&ft_arp_interval,	0, 86400 },
+	{ "arplimit",	opt_bool,	&ft_rl_arp,		0, 1 },
+	{ "arpmemory",	opt_uint,	&ft_arp_memory,		0, 65536 },
+	{ "arptimeout",	opt_uint,	&ft_arp_timeout,	1, 1U << 24 },
+	{ "backend",	opt_str,	&ft_iface_backend,	0, 0 },
+	{ "batch",	opt_uint,	&ft_iface_batch,	0, 65536 },
+	{ "blocksize",	opt_uint,	&ft_iface_blocksize,	4096, 1U << 30 },
+	{ "bufsize",	opt_uint,	&ft_iface_bufsize,	0, 1U << 30 },
+	{ "claimtimeout", opt_uint,	&ft_arp_claim_timeout,	1, 1U << 24 },
+	{ "conntable",	opt_uint,	&ft_conn_table,		64, 1U << 24 },
+	{ "conntimeout", opt_uint,	&ft_conn_timeout,	1, 1U << 20 },
+	{ "cpus",	opt_str,	&ft_cpus,		0, 0 },
+	{ "fcs",	opt_bool,	&ft_iface_fcs,		0, 1 },
+	{ "hugepages",	opt_bool,	&ft_hugepages,		0, 1 },
+	{ "immediate",	opt_bool,	&ft_iface_immediate,	0, 1 },
+	{ "ipfix",	opt_str,	&ft_ipfix_collector,	0, 0 },
+	{ "ipfixdomain", opt_uint,	&ft_ipfix_domain,	0, ~0U },
+	{ "ipfixinterval", opt_uint,	&ft_ipfix_interval,	1, 3600000 },
+	{ "ipfixmtu",	opt_uint,	&ft_ipfix_mtu,		512, 65535 },
+	{ "ipfixtemplate", opt_uint,	&ft_ipfix_refresh,	1, 86400 },
+	{ "logbufsize",	opt_uint,	&ft_log_bufsize,	512, 1U << 26 },
+	{ "logcompress", opt_str,	&ft_log_compress,	0, 0 },
+	{ "logformat",	opt_str,	&ft_log_format,		0, 0 },
+	{ "logfull",	opt_str,	&ft_log_full,		0, 0 },
+	{ "loginterval", opt_uint,	&ft_log_interval,	0, 3600000 },
+	{ "logring",	opt_uint,	&ft_log_ring,		16, 1U << 24 },
+	{ "logsummary",	opt_uint,	&ft_log_summary,	0, 86400 },
+	{ "logsumtable", opt_uint,	&ft_log_sumtable,	64, 1U << 24 },
+	{ "maxrate",	opt_uint,	&ft_rl_max_rate,	0, 1000000 },
+	{ "msgrate",	opt_uint,	&ft_log_ratelimit,	0, 1000000 },
+	{ "ndptable",	opt_uint,	&ft_ndp_table,		0, 1U << 24 },
+	{ "netburst",	opt_uint,	&ft_rl_net_burst,	1, 1U << 20 },
+	{ "netrate",	opt_uint,	&ft_rl_net_rate,	0, 1000000 },
+	{ "pipeline",	opt_bool,	&ft_pipeline,		0, 1 },
+	{ "pipelinedepth", opt_uint,	&ft_pipeline_depth,	64, 65536 },
+	{ "ratetable",	opt_uint,	&ft_rl_table,		64, 1U << 24 },
+	{ "shm",	opt_str,	&ft_shm_name,		0, 0 },
+	{ "shmentries",	opt_uint,	&ft_shm_entries,	0, 1U << 24 },
+	{ "shminterval", opt_uint,	&ft_shm_interval,	1, 86400 },
+	{ "snaplen",	opt_uint,	&ft_iface_snaplen,	128, 2048 },
+	{ "srcburst",	opt_uint,	&ft_rl_src_burst,	1, 1U << 20 },
+	{ "srcrate",	opt_uint,	&ft_rl_src_rate,	0, 1000000 },
+	{ "statsfile",	opt_str,	&ft_stats_file,		0, 0 },
+	{ "statsinterval", opt_uint,	&ft_stats_interval,	0, 86400 },
+	{ "workers",	opt_uint,	&ft_workers,		1, 64 },
+	{ NULL,		opt_bool,	NULL,			0, 0 }
+};
+
+static int
+set_option(const char *arg)
+{
+	const struct option *o;
+	const char *v;
+	unsigned long ul;
+	size_t len;
+	char *e;
+
+	if ((v = strchr(arg, '=')) != NULL)
+		len = v++ - arg;
+	else
+		len = strlen(arg);
+	for (o = options; o->name != NULL; ++o)
+		if (strlen(o->name) == len && strncmp(o->name, arg, len) == 0)
+			break;
+	if (o->name == NULL) {
+		fprintf(stderr, "unknown option: %.*s\n", (int)len, arg);
+		return (-1);
+	}
+	switch (o->type) {
+	case opt_bool:
+		if (v == NULL || strcmp(v, "1") == 0 ||
+		    strcmp(v, "yes") == 0 || strcmp(v, "on") == 0)
+			*(int *)o->value = 1;
+		else if (strcmp(v, "0") == 0 ||
+		    strcmp(v, "no") == 0 || strcmp(v, "off") == 0)
+			*(int *)o->value = 0;
+		else
+			goto invalid;
+		break;
+	case opt_uint:
+		if (v == NULL || !is_digit(*v))
+			goto invalid;
+		ul = strtoul(v, &e, 10);
+		if (*e != '\0' || ul < o->min || ul > o->max)
+			goto invalid;
+		*(unsigned int *)o->value = ul;
+		break;
+	case opt_str:
+		if (v == NULL || *v == '\0')
+			goto invalid;
+		*(const char **)o->value = v;
+		break;
+	}
+	return (0);
+invalid:
+	fprintf(stderr, "invalid value for option %s\n", o->name);
+	return (-1);
+}
+
+/*
+ * Report a problem with the address sets: on stderr while parsing the
+ * command line, to the log when reloading.
+ */
+static void
+set_error(const char *fmt, ...)
+{
+	char msg[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+	if (set_reload)
+		ft_warning("%s", msg);
+	else
+		fprintf(stderr, "%s\n", msg);
+}
+
+/*
+ * Read a list of ranges from a file, for -i @file and friends.
+ */
+static ip4s_range *
+read_ranges(const char *fn, size_t *np)
+{
+	ip4s_range *r;
+	FILE *f;
+	int lineno;
+
+	if ((f = fopen(fn, "r")) == NULL) {
+		set_error("%s: %s", fn, strerror(errno));
+		return (NULL);
+	}
+	lineno = 1;
+	if ((r = ip4s_range_read(f, np, &lineno)) == NULL) {
+		if (errno == EINVAL)
+			set_error("%s:%d: invalid address or range",
+			    fn, lineno);
+		else
+			set_error("%s: %s", fn, strerror(errno));
+	}
+	fclose(f);
+	return (r);
+}
 
 static int
-include_range(ip4s_node **set, const char *range)
+include_range(ip4s_node **set, const char *range, const char *what)
 {
 	ip4_addr first, last;
+	ip4s_range *r;
+	size_t n;
+	int ret;
+
+	if (*range == '@') {
+		if ((r = read_ranges(range + 1, &n)) == NULL)
+			return (-1);
+		if (!set_reload)
+			fprintf(stderr, "%s %zu ranges from %s\n", what, n,
+			    range + 1);
+		ret = -1;
+		if (*set != NULL || (*set = ip4s_new()) != NULL)
+			ret = ip4s_insertv(*set, r, n);
+		free(r);
+		return (ret);
+	}
 
 	if (ip4_parse_range(range, &first, &last) == NULL)
 		return (-1);
-	fprintf(stderr, "include %u.%u.%u.%u - %u.%u.%u.%u\n",
-	    first.o[0], first.o[1], first.o[2], first.o[3],
-	    last.o[0], last.o[1], last.o[2], last.o[3]);
+	if (!set_reload)
+		fprintf(stderr, "%s %u.%u.%u.%u - %u.%u.%u.%u\n", what,
+		    first.o[0], first.o[1], first.o[2], first.o[3],
+		    last.o[0], last.o[1], last.o[2], last.o[3]);
 	if (*set == NULL)
 		if ((*set = ip4s_new()) == NULL)
 			return (-1);
@@ -75,12 +265,33 @@ static int
 exclude_range(ip4s_node **set, const char *range)
 {
 	ip4_addr first, last;
+	ip4s_range *r;
+	size_t n;
+	int ret;
+
+	if (*range == '@') {
+		if ((r = read_ranges(range + 1, &n)) == NULL)
+			return (-1);
+		if (!set_reload)
+			fprintf(stderr, "exclude %zu ranges from %s\n", n,
+			    range + 1);
+		ret = -1;
+		if (*set == NULL)
+			if ((*set = ip4s_new()) == NULL ||
+			    ip4s_insert(*set, 0U, ~0U) != 0)
+				goto done;
+		ret = ip4s_removev(*set, r, n);
+done:
+		free(r);
+		return (ret);
+	}
 
 	if (ip4_parse_range(range, &first, &last) == NULL)
 		return (-1);
-	fprintf(stderr, "exclude %u.%u.%u.%u - %u.%u.%u.%u\n",
-	    first.o[0], first.o[1], first.o[2], first.o[3],
-	    last.o[0], last.o[1], last.o[2], last.o[3]);
+	if (!set_reload)
+		fprintf(stderr, "exclude %u.%u.%u.%u - %u.%u.%u.%u\n",
+		    first.o[0], first.o[1], first.o[2], first.o[3],
+		    last.o[0], last.o[1], last.o[2], last.o[3]);
 	if (*set == NULL)
 		if ((*set = ip4s_new()) == NULL ||
 		    ip4s_insert(*set, 0U, ~0U) != 0)
@@ -90,6 +301,107 @@ exclude_range(ip4s_node **set, const char *range)
 	return (0);
 }
 
+/*
+ * Remember an address set argument for set_build().  Literal ranges
+ * are checked right away, files when they are read.
+ */
+static int
+set_add(int opt, const char *arg)
+{
+	ip4_addr first, last;
+	struct set_arg *sa;
+
+	if (*arg == '@')
+		ft_set_files++;
+	else if (ip4_parse_range(arg, &first, &last) == NULL)
+		return (-1);
+	if ((sa = realloc(set_args, (nset_args + 1) * sizeof *sa)) == NULL)
+		return (-1);
+	set_args = sa;
+	set_args[nset_args].opt = opt;
+	set_args[nset_args].arg = arg;
+	nset_args++;
+	return (0);
+}
+
+/*
+ * Build the address sets from the command line, rereading any files
+ * it refers to.  The source and destination sets may come out NULL,
+ * meaning there is no restriction, and the dark set, meaning there is
+ * no dark space.  Returns 0 on success and -1 on failure, leaving the
+ * old sets untouched.
+ */
+int
+set_build(ip4s_frozen **srcp, ip4s_frozen **dstp, ip4s_frozen **darkp,
+    int reload)
+{
+	ip4s_node *src_tree, *dst_tree, *dark_tree, *tree;
+	ip4s_frozen *src, *dst, *dark;
+	unsigned int k;
+	int ret;
+
+	set_reload = reload;
+	src_tree = dst_tree = dark_tree = NULL;
+	src = dst = dark = NULL;
+	for (ret = 0, k = 0; ret == 0 && k < nset_args; ++k) {
+		switch (set_args[k].opt) {
+		case 'D':
+			ret = include_range(&dark_tree, set_args[k].arg, "dark");
+			break;
+		case 'I':
+			ret = include_range(&src_tree, set_args[k].arg,
+			    "include");
+			break;
+		case 'i':
+			ret = include_range(&dst_tree, set_args[k].arg,
+			    "include");
+			break;
+		case 'X':
+			ret = exclude_range(&src_tree, set_args[k].arg);
+			break;
+		case 'x':
+			ret = exclude_range(&dst_tree, set_args[k].arg);
+			break;
+		}
+	}
+	/* dark space outside the destination set is never answered */
+	if (ret == 0 && dark_tree != NULL && dst_tree != NULL) {
+		if ((tree = ip4s_intersect(dark_tree, dst_tree)) == NULL) {
+			set_error("failed to prepare address sets: %s",
+			    strerror(errno));
+			ret = -1;
+		} else {
+			ip4s_destroy(dark_tree);
+			dark_tree = tree;
+		}
+	}
+	if (ret == 0 &&
+	    ((src_tree != NULL && (src = ip4s_freeze(src_tree)) == NULL) ||
+	    (dst_tree != NULL && (dst = ip4s_freeze(dst_tree)) == NULL) ||
+	    (dark_tree != NULL && (dark = ip4s_freeze(dark_tree)) == NULL))) {
+		set_error("failed to prepare address sets: %s",
+		    strerror(errno));
+		ret = -1;
+	}
+	if (src_tree != NULL)
+		ip4s_destroy(src_tree);
+	if (dst_tree != NULL)
+		ip4s_destroy(dst_tree);
+	if (dark_tree != NULL)
+		ip4s_destroy(dark_tree);
+	if (ret != 0) {
+		if (src != NULL)
+			ip4s_frozen_destroy(src);
+		if (dst != NULL)
+			ip4s_frozen_destroy(dst);
+		return (-1);
+	}
+	*srcp = src;
+	*dstp = dst;
+	*darkp = dark;
+	return (0);
+}
+
 static void
 daemonize(void)
 {
@@ -115,20 +427,27 @@ usage(void)
 {
 
 	fprintf(stderr, "usage: "
-	    "flytrap [-dfnv] [-p pidfile] [-Ii addr] [-Xx addr] interface\n");
+	    "flytrap [-dfnv] [-o option=value] [-p pidfile] "
+	    "[-D addr] [-Ii addr] [-Xx addr] interface ...\n"
+	    "       flytrap [-dv] [-l logfile] [-o option=value] "
+	    "[-D addr] [-Ii addr] [-Xx addr] -r file\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	const char *ifname;
+	const char *replay;
 	int opt, ret;
 
-	ifname = NULL;
+	replay = NULL;
 	ft_log_level = FT_LOG_LEVEL_NOTICE;
-	while ((opt = getopt(argc, argv, "dfhI:i:l:nvX:x:")) != -1) {
+	while ((opt = getopt(argc, argv, "D:dfhI:i:l:no:p:r:vX:x:")) != -1) {
 		switch (opt) {
+		case 'D':
+			if (set_add(opt, optarg) != 0)
+				usage();
+			break;
 		case 'd':
 			if (ft_log_level > FT_LOG_LEVEL_DEBUG)
 				ft_log_level = FT_LOG_LEVEL_DEBUG;
@@ -137,11 +456,11 @@ main(int argc, char *argv[])
 			ft_foreground = 1;
 			break;
 		case 'I':
-			if (include_range(&src_set, optarg) != 0)
+			if (set_add(opt, optarg) != 0)
 				usage();
 			break;
 		case 'i':
-			if (include_range(&dst_set, optarg) != 0)
+			if (set_add(opt, optarg) != 0)
 				usage();
 			break;
 		case 'l':
@@ -150,19 +469,26 @@ main(int argc, char *argv[])
 		case 'n':
 			ft_dryrun = 1;
 			break;
+		case 'o':
+			if (set_option(optarg) != 0)
+				usage();
+			break;
 		case 'p':
 			ft_pidfile = optarg;
 			break;
+		case 'r':
+			replay = optarg;
+			break;
 		case 'v':
 			if (ft_log_level > FT_LOG_LEVEL_VERBOSE)
 				ft_log_level = FT_LOG_LEVEL_VERBOSE;
 			break;
 		case 'X':
-			if (exclude_range(&src_set, optarg) != 0)
+			if (set_add(opt, optarg) != 0)
 				usage();
 			break;
 		case 'x':
-			if (exclude_range(&dst_set, optarg) != 0)
+			if (set_add(opt, optarg) != 0)
 				usage();
 			break;
 		default:
@@ -173,15 +499,27 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
-		usage();
-	ifname = *argv;
+	if (replay != NULL) {
+		if (argc != 0)
+			usage();
+		ft_foreground = 1;
+	} else {
+		if (argc < 1)
+			usage();
+	}
+
+	if (set_build(&src_set, &dst_set, &dark_set, 0) != 0)
+		exit(1);
 
 	if (!ft_foreground)
 		daemonize();
 
-	ft_log_init("flytrap", NULL);
-	ret = flytrap(ifname);
+	ft_log_init("flytrap", ft_foreground ? NULL : "syslog");
+	ft_hash_randomize();
+	if (replay != NULL)
+		ret = flytrap_replay(replay);
+	else
+		ret = flytrap(argv, argc);
 	ft_log_exit();
 
 	exit(ret == 0 ? 0 : 1);
@@ -0,0 +1,515 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <ft/endian.h>
+#include <ft/ethernet.h>
+#include <ft/hash.h>
+#include <ft/ip4.h>
+#include <ft/ip6.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/*
+ * IPv6 neighbor table
+ *
+ * Neighbor discovery is IPv6's answer to ARP, and we claim addresses
+ * the same way, see packet_analyze_arp(), but the address space is far
+ * too large for a tree like the ARP table's: a scanner sweeping a
+ * single /64 would have us allocate memory until we ran out.  Instead,
+ * each interface has a table of fixed size, allocated when the
+ * interface is opened, laid out like the session table in conn.c: an
+ * array of sets of NDP_WAYS entries, where an address can only live in
+ * the set it hashes to.  When the set is full, a new address takes over
+ * an expired entry if there is one, then the least recently seen entry
+ * which is not claimed, and only then a claimed one.
+ *
+ * Expired entries are found by ndp_expire(), which looks at a bounded
+ * number of sets per call, and by lookups, which ignore them.
+ */
+#define NDP_WAYS	 4
+#define NDP_EXPIRE_SLICE 64		/* sets per ndp_expire() call */
+
+#define NDP_USED	 0x01
+#define NDP_CLAIMED	 0x02
+
+unsigned int ft_ndp_table = 16384;	/* addresses per interface */
+
+struct ndp_ent {
+	ipv6_addr	 addr;
+	uint32_t	 vlan;		/* VLAN key */
+	ether_addr	 ether;		/* last known owner */
+	uint8_t		 flags;
+	uint8_t		 nreq;		/* unanswered solicitations */
+	uint64_t	 first;		/* first seen */
+	uint64_t	 last;		/* last seen */
+};
+
+struct ndp_set {
+	struct ndp_ent	 ent[NDP_WAYS];
+} __attribute__((__aligned__(64)));
+
+struct ndp_table {
+	struct ndp_set	*sets;
+	uint32_t	 nsets;
+	uint32_t	 sweep;		/* next set for ndp_expire() */
+	uint64_t	 seed;
+	unsigned long	 entries;	/* entries in use */
+	unsigned long	 claimed;	/* entries claimed by us */
+	unsigned long	 expired;	/* unclaimed entries expired */
+	unsigned long	 released;	/* claimed entries expired */
+	unsigned long	 conflicts;	/* claims lost to a real host */
+};
+
+/*
+ * Allocate an interface's neighbor table, unless neighbor discovery is
+ * disabled.
+ */
+int
+ndp_create(iface *i)
+{
+	struct ndp_table *nt;
+
+	if (ft_ndp_table == 0)
+		return (0);
+	if ((nt = calloc(1, sizeof *nt)) == NULL)
+		return (-1);
+	nt->nsets = (ft_ndp_table + NDP_WAYS - 1) / NDP_WAYS;
+	if (posix_memalign((void **)&nt->sets, 64,
+	    (size_t)nt->nsets * sizeof *nt->sets) != 0) {
+		free(nt);
+		return (-1);
+	}
+	memset(nt->sets, 0, (size_t)nt->nsets * sizeof *nt->sets);
+	nt->seed = ft_hash_u64(ft_hash_seed, (uintptr_t)nt);
+	i->ndp = nt;
+	return (0);
+}
+
+static const char *
+ndp_ntop(const ipv6_addr *addr, char *buf)
+{
+
+	return (inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN));
+}
+
+static inline int
+ndp_unspecified(const ipv6_addr *addr)
+{
+	static const ipv6_addr any;
+
+	return (memcmp(addr, &any, sizeof any) == 0);
+}
+
+static inline uint64_t
+ndp_deadline(const struct ndp_ent *ne)
+{
+
+	return (ne->last + ((ne->flags & NDP_CLAIMED) ?
+	    ft_arp_claim_timeout : ft_arp_timeout) * 1000ULL);
+}
+
+/*
+ * Release an entry.
+ */
+static void
+ndp_drop(struct ndp_table *nt, struct ndp_ent *ne, int expired)
+{
+
+	if (ne->flags & NDP_CLAIMED) {
+		__atomic_store_n(&nt->claimed, nt->claimed - 1,
+		    __ATOMIC_RELAXED);
+		if (expired)
+			nt->released++;
+	} else if (expired) {
+		nt->expired++;
+	}
+	ne->flags = 0;
+	__atomic_store_n(&nt->entries, nt->entries - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the set an address belongs in.
+ */
+static struct ndp_set *
+ndp_set(const struct ndp_table *nt, uint32_t vlan, const ipv6_addr *addr)
+{
+
+	return (&nt->sets[ft_hash_reduce(ft_hash32(nt->seed ^ vlan,
+	    addr, sizeof *addr), nt->nsets)]);
+}
+
+/*
+ * Look up an address, disregarding entries which have expired.
+ */
+static struct ndp_ent *
+ndp_find(struct ndp_table *nt, uint32_t vlan, const ipv6_addr *addr,
+    uint64_t now)
+{
+	struct ndp_set *set;
+	struct ndp_ent *ne;
+	unsigned int w;
+
+	set = ndp_set(nt, vlan, addr);
+	for (w = 0; w < NDP_WAYS; ++w) {
+		ne = &set->ent[w];
+		if ((ne->flags & NDP_USED) && ne->vlan == vlan &&
+		    memcmp(&ne->addr, addr, sizeof *addr) == 0) {
+			if (ndp_deadline(ne) > now)
+				return (ne);
+			ndp_drop(nt, ne, 1);
+			return (NULL);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Look up an address, inserting it if it is not already there.
+ */
+static struct ndp_ent *
+ndp_insert(iface *i, uint32_t vlan, const ipv6_addr *addr, uint64_t now)
+{
+	struct ndp_table *nt = i->ndp;
+	struct ndp_set *set;
+	struct ndp_ent *ne, *victim;
+	unsigned int w;
+
+	if ((ne = ndp_find(nt, vlan, addr, now)) != NULL)
+		return (ne);
+	set = ndp_set(nt, vlan, addr);
+	for (victim = NULL, w = 0; w < NDP_WAYS; ++w) {
+		ne = &set->ent[w];
+		if (!(ne->flags & NDP_USED)) {
+			victim = ne;
+			break;
+		}
+		if (ndp_deadline(ne) <= now) {
+			ndp_drop(nt, ne, 1);
+			victim = ne;
+			break;
+		}
+		/* prefer unclaimed entries, then the least recently seen */
+		if (victim == NULL ||
+		    ((victim->flags ^ ne->flags) & NDP_CLAIMED ?
+		    !(ne->flags & NDP_CLAIMED) : ne->last < victim->last))
+			victim = ne;
+	}
+	ne = victim;
+	if (ne->flags & NDP_USED) {
+		STATS_INC(i, ndp_evicted);
+		ndp_drop(nt, ne, 0);
+	}
+	memset(ne, 0, sizeof *ne);
+	ne->addr = *addr;
+	ne->vlan = vlan;
+	ne->flags = NDP_USED;
+	ne->first = ne->last = now;
+	__atomic_store_n(&nt->entries, nt->entries + 1, __ATOMIC_RELAXED);
+	return (ne);
+}
+
+/*
+ * Expire stale entries from a bounded number of sets.  Meant to be
+ * called between capture bursts, like arp_expire().
+ */
+void
+ndp_expire(iface *i, uint64_t now)
+{
+	struct ndp_table *nt;
+	struct ndp_ent *ne;
+	unsigned int k, w;
+
+	if ((nt = i->ndp) == NULL)
+		return;
+	for (k = 0; k < NDP_EXPIRE_SLICE && k < nt->nsets; ++k) {
+		for (w = 0; w < NDP_WAYS; ++w) {
+			ne = &nt->sets[nt->sweep].ent[w];
+			if ((ne->flags & NDP_USED) && ndp_deadline(ne) <= now)
+				ndp_drop(nt, ne, 1);
+		}
+		if (++nt->sweep == nt->nsets)
+			nt->sweep = 0;
+	}
+}
+
+/*
+ * Record the link-layer address of a neighbor, and back off if it is
+ * an address we had claimed.
+ */
+static void
+ndp_register(iface *i, uint32_t vlan, const ipv6_addr *addr,
+    const ether_addr *ether, uint64_t when)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct ndp_ent *ne;
+
+	if ((ne = ndp_insert(i, vlan, addr, when)) == NULL)
+		return;
+	if (memcmp(&ne->ether, ether, sizeof ne->ether) != 0) {
+		ft_verbose("%s registered at %02x:%02x:%02x:%02x:%02x:%02x",
+		    ndp_ntop(addr, buf), ether->o[0], ether->o[1],
+		    ether->o[2], ether->o[3], ether->o[4], ether->o[5]);
+		ne->ether = *ether;
+	}
+	if ((ne->flags & NDP_CLAIMED) &&
+	    memcmp(ether, &i->ether, sizeof *ether) != 0) {
+		/* a real host has shown up, back off */
+		ft_verbose("%s: releasing claim", ndp_ntop(addr, buf));
+		ne->flags &= ~NDP_CLAIMED;
+		__atomic_store_n(&i->ndp->claimed, i->ndp->claimed - 1,
+		    __ATOMIC_RELAXED);
+		i->ndp->conflicts++;
+	}
+	ne->last = when;
+	ne->nreq = 0;
+}
+
+/*
+ * Check the fixed part of a solicitation or advertisement and find the
+ * link-layer address option of the given type, if present.  Returns -1
+ * if the packet is invalid (RFC 4861 sections 7.1.1 and 7.1.2).
+ */
+static int
+ndp_validate(ip6_flow *fl, const nd_pkt *np, size_t len, nd_opt_type type,
+    const ether_addr **lla)
+{
+	const uint8_t *opt;
+	size_t olen;
+
+	*lla = NULL;
+	if (fl->hlim != ND_HOP_LIMIT || len < sizeof *np ||
+	    np->hdr.code != 0 || np->target.o[0] == 0xff)
+		return (-1);
+	for (opt = np->opt, len -= sizeof *np; len > 0;
+	    opt += olen, len -= olen) {
+		if (len < 2 || opt[1] == 0 || (olen = opt[1] * 8U) > len)
+			return (-1);
+		if (opt[0] == type && olen >= sizeof(nd_opt_lla))
+			*lla = &((const nd_opt_lla *)opt)->lla;
+	}
+	return (0);
+}
+
+/*
+ * Advertise a claimed address in response to a solicitation.  If ARP
+ * replies are rate limited, so are advertisements: each address counts
+ * as its own source and each /64 as a network.
+ */
+static int
+ndp_reply(ip6_flow *fl, const nd_pkt *ns)
+{
+	iface *i = fl->eth->p->i;
+	ip4_addr key;
+	nd_opt_lla *ol;
+	nd_pkt *np;
+	txbuf tb;
+
+	if (ft_rl_arp) {
+		key.q = htobe32((ft_hash32(0, &fl->src, 8) & 0xffffff00U) |
+		    (ft_hash32(0, &fl->src, sizeof fl->src) & 0xff));
+		if (!ratelimit_check(i, &key, &fl->eth->p->ts))
+			return (0);
+	}
+	if (iface_txbuf(i, &tb) != 0 ||
+	    (np = txbuf_append(&tb, sizeof *np + sizeof *ol)) == NULL)
+		return (-1);
+	np->hdr.type = icmp6_type_nd_advert;
+	np->hdr.code = 0;
+	np->hdr.sum = 0;
+	np->flags = htobe32(ND_ADVERT_SOLICITED | ND_ADVERT_OVERRIDE);
+	np->target = ns->target;
+	ol = (nd_opt_lla *)np->opt;
+	ol->type = nd_opt_target_lla;
+	ol->len = 1;
+	ol->lla = i->ether;
+	np->hdr.sum = htobe16(~ip4_cksum(ip6_pseudo_sum(&ns->target,
+	    &fl->src, tb.len, ip6_proto_icmp6), np, tb.len));
+	return (ip6_reply(fl, &ns->target, ip6_proto_icmp6, &tb));
+}
+
+/*
+ * Analyze a neighbor solicitation
+ *
+ * We claim an address after three unanswered solicitations for it,
+ * exactly as we do with ARP.  A solicitation from the unspecified
+ * address is a host performing duplicate address detection before it
+ * starts using the target address, so we never answer those, and give
+ * up any claim we had on the address.
+ */
+int
+ndp_solicit(ip6_flow *fl, const void *data, size_t len)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const ether_addr *lla;
+	const nd_pkt *np;
+	struct ndp_ent *ne;
+	uint64_t when;
+	iface *i;
+
+	i = fl->eth->p->i;
+	np = data;
+	if (ndp_validate(fl, np, len, nd_opt_source_lla, &lla) != 0 ||
+	    (ndp_unspecified(&fl->src) && lla != NULL)) {
+		ft_notice("%d.%03d invalid neighbor solicitation",
+		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000);
+		STATS_INC(i, ndp_invalid);
+		return (-1);
+	}
+	ft_debug("\tsolicit %s vlan %u",
+	    ndp_ntop(&np->target, buf), fl->eth->vkey);
+	when = fl->eth->p->ts.tv_sec * 1000ULL + fl->eth->p->ts.tv_usec / 1000;
+	if (ndp_unspecified(&fl->src)) {
+		STATS_INC(i, ndp_dad);
+		if ((ne = ndp_find(i->ndp, fl->eth->vkey, &np->target,
+		    when)) != NULL && (ne->flags & NDP_CLAIMED)) {
+			ft_verbose("%s: duplicate address detection, "
+			    "releasing claim", ndp_ntop(&np->target, buf));
+			ne->flags &= ~NDP_CLAIMED;
+			__atomic_store_n(&i->ndp->claimed,
+			    i->ndp->claimed - 1, __ATOMIC_RELAXED);
+			i->ndp->conflicts++;
+		}
+		if (ne != NULL) {
+			ne->nreq = 0;
+			ne->last = when;
+		}
+		return (0);
+	}
+	ndp_register(i, fl->eth->vkey, &fl->src,
+	    lla != NULL ? lla : &fl->eth->src, when);
+	if ((ne = ndp_insert(i, fl->eth->vkey, &np->target, when)) == NULL)
+		return (-1);
+	if (ne->flags & NDP_CLAIMED) {
+		/* already ours, refresh */
+		ne->nreq = 0;
+		ne->last = when;
+		return (ndp_reply(fl, np));
+	} else if (ne->nreq == 0 || when - ne->last >= 30000) {
+		/* new or stale, start over */
+		ne->nreq = 1;
+		ne->first = ne->last = when;
+	} else if (ne->nreq >= 3 && when - ne->first >= 3000) {
+		/* claim new address */
+		ft_verbose("claiming %s nreq = %d",
+		    ndp_ntop(&np->target, buf), ne->nreq);
+		ne->flags |= NDP_CLAIMED;
+		__atomic_store_n(&i->ndp->claimed, i->ndp->claimed + 1,
+		    __ATOMIC_RELAXED);
+		STATS_INC(i, ndp_claims);
+		ne->nreq = 0;
+		ne->last = when;
+		return (ndp_reply(fl, np));
+	} else {
+		if (ne->nreq < UINT8_MAX)
+			ne->nreq++;
+		ne->last = when;
+	}
+	return (0);
+}
+
+/*
+ * Analyze a neighbor advertisement
+ */
+int
+ndp_advert(ip6_flow *fl, const void *data, size_t len)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const ether_addr *lla;
+	const nd_pkt *np;
+	uint64_t when;
+
+	np = data;
+	if (ndp_validate(fl, np, len, nd_opt_target_lla, &lla) != 0) {
+		ft_notice("%d.%03d invalid neighbor advertisement",
+		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000);
+		STATS_INC(fl->eth->p->i, ndp_invalid);
+		return (-1);
+	}
+	ft_debug("\tadvert %s vlan %u",
+	    ndp_ntop(&np->target, buf), fl->eth->vkey);
+	when = fl->eth->p->ts.tv_sec * 1000ULL + fl->eth->p->ts.tv_usec / 1000;
+	ndp_register(fl->eth->p->i, fl->eth->vkey, &np->target,
+	    lla != NULL ? lla : &fl->eth->src, when);
+	return (0);
+}
+
+/*
+ * Fill in the neighbor table gauges in a stats snapshot.  This may be
+ * called from a thread other than the one which owns the table.
+ */
+void
+ndp_stats(iface *i, stats *st)
+{
+	struct ndp_table *nt;
+
+	if ((nt = i->ndp) == NULL) {
+		st->ndp_entries = st->ndp_claimed = st->ndp_bytes = 0;
+		return;
+	}
+	st->ndp_entries = __atomic_load_n(&nt->entries, __ATOMIC_RELAXED);
+	st->ndp_claimed = __atomic_load_n(&nt->claimed, __ATOMIC_RELAXED);
+	st->ndp_bytes = sizeof *nt + (size_t)nt->nsets * sizeof *nt->sets;
+}
+
+/*
+ * Release an interface's neighbor table.
+ */
+void
+ndp_destroy(iface *i)
+{
+	struct ndp_table *nt;
+
+	if ((nt = i->ndp) == NULL)
+		return;
+	ft_verbose("%s: ndp: %lu entries, %lu claimed, %lu expired, "
+	    "%lu released, %lu conflicts", i->name, nt->entries, nt->claimed,
+	    nt->expired, nt->released, nt->conflicts);
+	free(nt->sets);
+	free(nt);
+	i->ndp = NULL;
+}
@@ -36,11 +36,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <ft/arp.h>
+#include <ft/endian.h>
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
 #include "packet.h"
 
 int
@@ -48,6 +52,63 @@ packet_analyze(packet *p)
 {
 	int ret;
 
+	STATS_TIME_SINCE(p->i, stage_capture, &p->ts);
+	STATS_TIMER(t);
 	ret = packet_analyze_ethernet(p, p->data, p->len);
+	STATS_TIME(p->i, stage_ether, t);
 	return (ret);
 }
+
+/*
+ * Pick the worker out of n which the fanout program in iface_tpacket.c
+ * would deliver a frame to, for use when replaying a capture, where any
+ * VLAN tags are still in the frame.  Frames the program cannot make
+ * sense of go to the first worker.  The two must be kept in step.
+ */
+unsigned int
+packet_steer(const packet *p, unsigned int n)
+{
+	const uint8_t *d = p->data;
+	uint32_t key;
+	uint16_t type;
+	size_t off;
+
+	if (n < 2 || p->len < 14)
+		return (0);
+	type = be16dec(d + 12);
+	off = 14;
+	/* the kernel takes the outer tag off before the program runs */
+	if (type == ether_type_vlan || type == ether_type_qinq) {
+		if (p->len < off + 4)
+			return (0);
+		type = be16dec(d + off + 2);
+		off += 4;
+	}
+	if (type == ether_type_vlan || type == ether_type_qinq) {
+		if (p->len < off + 4)
+			return (0);
+		type = be16dec(d + off + 2);
+		off += 4;
+	}
+	switch (type) {
+	case ether_type_arp:
+		if (p->len < off + 28)
+			return (0);
+		key = be16dec(d + off + 6) == arp_oper_is_at ?
+		    be32dec(d + off + 14) : be32dec(d + off + 24);
+		break;
+	case ether_type_ip:
+		if (p->len < off + 20)
+			return (0);
+		key = be32dec(d + off + 16);
+		break;
+	case ether_type_ipv6:
+		if (p->len < off + 64)
+			return (0);
+		key = be32dec(d + off + 60);
+		break;
+	default:
+		return (0);
+	}
+	return (key % n);
+}
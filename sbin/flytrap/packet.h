@@ -36,7 +36,12 @@ typedef struct packet {
 	struct iface	*i;
 	struct timeval	 ts;
 	const void	*data;
-	size_t		 len;
+	size_t		 len;		/* bytes captured */
+	size_t		 wirelen;	/* bytes on the wire */
+	struct packet	*next;		/* descriptor pool free list */
+	unsigned int	 blk;		/* ring block holding data */
+	uint16_t	 vlan_tpid;	/* tag removed by the kernel, if any */
+	uint16_t	 vlan_tci;
 } packet;
 
 #endif
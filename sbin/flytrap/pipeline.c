@@ -0,0 +1,385 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ft/ctype.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "pipeline.h"
+
+/*
+ * Pipeline support
+ *
+ * In pipeline mode, each worker is split into three threads: one which
+ * captures frames, one which analyzes them, and one which transmits the
+ * replies, while the log writer thread already takes care of logging.
+ * Captured frames travel from the first to the second in a ring of
+ * packet descriptors and come back in another once analyzed, and
+ * replies travel from the second to the third in the interface's
+ * transmit queue.  Each stage thus keeps its own working set in its
+ * own cache, and a slow transmit or log write can only hold up the
+ * capture thread once the descriptors run out.
+ *
+ * This file has the rings and the doorbells the threads sleep on, as
+ * well as CPU pinning and huge page allocation, which also apply
+ * outside pipeline mode; see flytrap.c for the threads themselves.
+ */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	 MAP_ANON
+#endif
+
+#if HAVE_PTHREAD_SETAFFINITY_NP && defined(CPU_SETSIZE)
+#define PIPELINE_AFFINITY 1
+#else
+#define PIPELINE_AFFINITY 0
+#endif
+
+/* the default huge page size on the platforms which have them */
+#define PIPELINE_HUGEPAGE (2UL << 20)
+
+int ft_pipeline;
+unsigned int ft_pipeline_depth = 1024;
+int ft_hugepages;
+const char *ft_cpus;
+
+#if PIPELINE_AFFINITY
+static cpu_set_t *cpus;
+static unsigned int ncpus;
+
+/*
+ * Parse a CPU number or range, or a comma-separated list of them, as
+ * found in sysfs.
+ */
+static int
+pipeline_cpulist(const char *s, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *e;
+
+	CPU_ZERO(set);
+	for (;;) {
+		if (!is_digit(*s))
+			return (-1);
+		first = last = strtoul(s, &e, 10);
+		if (*e == '-') {
+			s = e + 1;
+			if (!is_digit(*s))
+				return (-1);
+			last = strtoul(s, &e, 10);
+		}
+		if (last < first || last >= CPU_SETSIZE)
+			return (-1);
+		while (first <= last)
+			CPU_SET(first++, set);
+		if (*e != ',')
+			break;
+		s = e + 1;
+	}
+	return (*e == '\0' || *e == '\n' ? 0 : -1);
+}
+
+/*
+ * Look up the CPUs on a NUMA node.
+ */
+static int
+pipeline_node(const char *s, cpu_set_t *set)
+{
+	char fn[64], buf[1024];
+	FILE *f;
+	int ret;
+
+	if (!is_digit(*s) || strlen(s) > 8)
+		return (-1);
+	snprintf(fn, sizeof fn, "/sys/devices/system/node/node%s/cpulist", s);
+	if ((f = fopen(fn, "r")) == NULL)
+		return (-1);
+	ret = -1;
+	if (fgets(buf, sizeof buf, f) != NULL)
+		ret = pipeline_cpulist(buf, set);
+	fclose(f);
+	return (ret);
+}
+#endif
+
+/*
+ * Parse the CPU list and check that everything we were asked for is
+ * supported.
+ */
+int
+pipeline_init(void)
+{
+#if PIPELINE_AFFINITY
+	char *list, *tok, *last;
+	const char *p;
+	unsigned int n;
+	int ret;
+#endif
+
+#ifndef MAP_HUGETLB
+	if (ft_hugepages)
+		ft_warning("huge pages are not supported on this platform");
+#endif
+	if (ft_cpus == NULL)
+		return (0);
+#if PIPELINE_AFFINITY
+	for (n = 1, p = ft_cpus; *p != '\0'; ++p)
+		if (*p == ',')
+			n++;
+	if ((cpus = calloc(n, sizeof *cpus)) == NULL ||
+	    (list = strdup(ft_cpus)) == NULL) {
+		ft_error("%s", strerror(errno));
+		pipeline_fini();
+		return (-1);
+	}
+	ret = 0;
+	for (tok = strtok_r(list, ",", &last); tok != NULL;
+	     tok = strtok_r(NULL, ",", &last)) {
+		if (strncmp(tok, "node", 4) == 0)
+			ret = pipeline_node(tok + 4, &cpus[ncpus]);
+		else
+			ret = pipeline_cpulist(tok, &cpus[ncpus]);
+		if (ret != 0) {
+			ft_error("invalid CPU or NUMA node: %s", tok);
+			break;
+		}
+		ncpus++;
+	}
+	free(list);
+	if (ret != 0 || ncpus == 0) {
+		if (ncpus == 0 && ret == 0)
+			ft_error("empty CPU list");
+		pipeline_fini();
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+#else
+	ft_error("CPU pinning is not supported on this platform");
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+void
+pipeline_fini(void)
+{
+
+#if PIPELINE_AFFINITY
+	free(cpus);
+	cpus = NULL;
+	ncpus = 0;
+#endif
+}
+
+/*
+ * Pin the calling thread to the nth entry in the CPU list, wrapping
+ * around if there are fewer entries than threads.  Threads are numbered
+ * by worker, and in pipeline mode by stage within each worker.
+ */
+void
+pipeline_pin(unsigned int n)
+{
+
+#if PIPELINE_AFFINITY
+	if (ncpus == 0)
+		return;
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof *cpus,
+	    &cpus[n % ncpus])) != 0)
+		ft_warning("failed to set CPU affinity: %s", strerror(errno));
+#else
+	(void)n;
+#endif
+}
+
+/*
+ * Allocate zeroed memory for a ring or buffer pool, from huge pages if
+ * so configured, falling back to normal pages if there are none to be
+ * had.  The size is rounded up to a whole huge page.
+ */
+void *
+pipeline_alloc(size_t size)
+{
+	static int warned;
+	void *p;
+
+	if (!ft_hugepages)
+		return (calloc(1, size));
+	size = (size + PIPELINE_HUGEPAGE - 1) & ~(PIPELINE_HUGEPAGE - 1);
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return (p);
+	if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+		ft_warning("huge pages unavailable, using normal pages: %s",
+		    strerror(errno));
+#else
+	(void)warned;
+#endif
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+void
+pipeline_free(void *p, size_t size)
+{
+
+	if (p == NULL)
+		return;
+	if (!ft_hugepages) {
+		free(p);
+		return;
+	}
+	size = (size + PIPELINE_HUGEPAGE - 1) & ~(PIPELINE_HUGEPAGE - 1);
+	munmap(p, size);
+}
+
+int
+pipeline_bell_init(struct pipeline_bell *b)
+{
+
+	memset(b, 0, sizeof *b);
+	if ((errno = pthread_mutex_init(&b->mtx, NULL)) != 0)
+		return (-1);
+	if ((errno = pthread_cond_init(&b->cv, NULL)) != 0) {
+		pthread_mutex_destroy(&b->mtx);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+pipeline_bell_destroy(struct pipeline_bell *b)
+{
+
+	pthread_cond_destroy(&b->cv);
+	pthread_mutex_destroy(&b->mtx);
+}
+
+/*
+ * Wake up whoever is sleeping on a bell, or make sure their next
+ * attempt to sleep returns right away.  This pairs with the sequence in
+ * pipeline_sleep(): either the sleeper sees rung, or we see sleeping.
+ */
+void
+pipeline_kick(struct pipeline_bell *b)
+{
+
+	__atomic_store_n(&b->rung, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&b->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&b->mtx);
+		pthread_cond_signal(&b->cv);
+		pthread_mutex_unlock(&b->mtx);
+	}
+}
+
+/*
+ * Sleep until kicked or until ms milliseconds have passed.  The caller
+ * must check for work after deciding to sleep and before calling this,
+ * and again afterwards, since wakeups can be spurious.
+ */
+void
+pipeline_sleep(struct pipeline_bell *b, unsigned int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&b->mtx);
+	__atomic_store_n(&b->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&b->rung, __ATOMIC_SEQ_CST))
+		pthread_cond_timedwait(&b->cv, &b->mtx, &ts);
+	__atomic_store_n(&b->sleeping, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->rung, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&b->mtx);
+}
+
+/*
+ * Create a ring with room for at least min items.
+ */
+struct pipeline_ring *
+pipeline_ring_new(unsigned int min)
+{
+	struct pipeline_ring *r;
+	void *p;
+	unsigned int size;
+
+	for (size = 1; size < min; size *= 2)
+		/* nothing */ ;
+	if ((errno = posix_memalign(&p, 64, sizeof *r)) != 0)
+		return (NULL);
+	r = p;
+	memset(r, 0, sizeof *r);
+	r->mask = size - 1;
+	if ((r->slot = pipeline_alloc(size * sizeof *r->slot)) == NULL) {
+		free(r);
+		return (NULL);
+	}
+	if (pipeline_bell_init(&r->bell) != 0) {
+		pipeline_free(r->slot, size * sizeof *r->slot);
+		free(r);
+		return (NULL);
+	}
+	return (r);
+}
+
+void
+pipeline_ring_destroy(struct pipeline_ring *r)
+{
+
+	if (r == NULL)
+		return;
+	pipeline_bell_destroy(&r->bell);
+	pipeline_free(r->slot, (r->mask + 1) * sizeof *r->slot);
+	free(r);
+}
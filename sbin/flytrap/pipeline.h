@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FLYTRAP_PIPELINE_H_INCLUDED
+#define FLYTRAP_PIPELINE_H_INCLUDED
+
+/*
+ * A doorbell which a thread can sleep on until another kicks it.  The
+ * kicker only takes the lock if the sleeper is actually asleep, so
+ * kicking a busy thread costs two atomic operations.
+ */
+struct pipeline_bell {
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cv;
+	int		 rung;		/* kicked since the last sleep */
+	int		 sleeping;
+};
+
+/*
+ * A single-producer, single-consumer ring of pointers.  Each side works
+ * on a private copy of its index and publishes it once per batch, so
+ * the shared indices only change hands once per batch rather than once
+ * per item.  The consumer can sleep on the ring's bell, which the
+ * producer kicks when it publishes.
+ */
+struct pipeline_ring {
+	void		**slot;
+	unsigned int	 mask;
+	/* written by the producer */
+	unsigned int	 head __attribute__((__aligned__(64)));
+	unsigned int	 phead;		/* next slot to fill */
+	unsigned int	 ptail;		/* last tail seen */
+	/* written by the consumer */
+	unsigned int	 tail __attribute__((__aligned__(64)));
+	unsigned int	 ctail;		/* next slot to empty */
+	unsigned int	 chead;		/* last head seen */
+	struct pipeline_bell bell __attribute__((__aligned__(64)));
+};
+
+int	 pipeline_init(void);
+void	 pipeline_fini(void);
+void	 pipeline_pin(unsigned int);
+void	*pipeline_alloc(size_t);
+void	 pipeline_free(void *, size_t);
+int	 pipeline_bell_init(struct pipeline_bell *);
+void	 pipeline_bell_destroy(struct pipeline_bell *);
+void	 pipeline_kick(struct pipeline_bell *);
+void	 pipeline_sleep(struct pipeline_bell *, unsigned int);
+struct pipeline_ring *pipeline_ring_new(unsigned int);
+void	 pipeline_ring_destroy(struct pipeline_ring *);
+
+/*
+ * Producer: add an item to the ring.  Returns -1 if the ring is full.
+ * The item is not visible to the consumer until published.
+ */
+static inline int
+pipeline_put(struct pipeline_ring *r, void *p)
+{
+
+	if (r->phead - r->ptail > r->mask) {
+		r->ptail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->phead - r->ptail > r->mask)
+			return (-1);
+	}
+	r->slot[r->phead++ & r->mask] = p;
+	return (0);
+}
+
+/*
+ * Producer: make everything added so far visible and wake the consumer.
+ */
+static inline void
+pipeline_publish(struct pipeline_ring *r)
+{
+
+	if (r->phead != r->head) {
+		__atomic_store_n(&r->head, r->phead, __ATOMIC_RELEASE);
+		pipeline_kick(&r->bell);
+	}
+}
+
+/*
+ * Consumer: take the next item off the ring, or return NULL if it is
+ * empty.  The slot is not handed back to the producer until consumed.
+ */
+static inline void *
+pipeline_get(struct pipeline_ring *r)
+{
+
+	if (r->ctail == r->chead) {
+		r->chead = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (r->ctail == r->chead)
+			return (NULL);
+	}
+	return (r->slot[r->ctail++ & r->mask]);
+}
+
+/*
+ * Consumer: hand every slot emptied so far back to the producer.
+ */
+static inline void
+pipeline_consume(struct pipeline_ring *r)
+{
+
+	__atomic_store_n(&r->tail, r->ctail, __ATOMIC_RELEASE);
+}
+
+#endif
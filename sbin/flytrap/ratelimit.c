@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ethernet.h>
+#include <ft/hash.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+#include "packet.h"
+
+/*
+ * Reply rate limiting
+ *
+ * Before we reply to a packet, its source must have a token in its own
+ * bucket, in the bucket for its /24, and in a global bucket.  Buckets
+ * refill continuously at a fixed rate, up to a maximum burst size.
+ *
+ * Address and /24 buckets live in two fixed-size hash tables per
+ * interface.  Each table is an array of sets of RL_WAYS buckets, one
+ * cache line per set.  A key can only live in the set it hashes to; if
+ * it is not there, it takes over the least recently used bucket in the
+ * set, starting out full.  Memory use is therefore fixed, and a flood
+ * from spoofed sources can only evict other buckets, while the global
+ * bucket bounds the number of replies it can get out of us.
+ *
+ * In multi-worker mode, each worker has its own tables, so a source
+ * whose packets are spread across workers gets a share of each.
+ */
+#define RL_WAYS		 4
+#define RL_EMPTY	 0xffffffffU	/* key of an unused bucket */
+#define RL_TOKEN	 1000		/* tokens are kept in thousandths */
+
+unsigned int ft_rl_src_rate = 10;	/* replies per second per address */
+unsigned int ft_rl_src_burst = 20;
+unsigned int ft_rl_net_rate = 100;	/* replies per second per /24 */
+unsigned int ft_rl_net_burst = 200;
+unsigned int ft_rl_max_rate = 10000;	/* replies per second in total */
+unsigned int ft_rl_table = 16384;	/* buckets per table */
+int ft_rl_arp;				/* also limit ARP replies */
+
+struct rl_bucket {
+	uint32_t	 key;
+	uint32_t	 stamp;		/* last refill, in milliseconds */
+	uint32_t	 tokens;
+	uint32_t	 pad;
+};
+
+struct rl_table {
+	struct rl_bucket *b;
+	uint32_t	 nsets;
+	uint64_t	 seed;
+	unsigned int	 rate, burst;
+	unsigned long	 evicted;	/* buckets taken over */
+	unsigned long	 limited;	/* replies suppressed */
+};
+
+struct ratelimit {
+	struct rl_table	 src;
+	struct rl_table	 net;
+	struct rl_bucket global;
+	unsigned long	 global_limited;
+	unsigned long	 allowed;
+};
+
+static int
+rl_table_init(struct rl_table *t, unsigned int rate, unsigned int burst)
+{
+	size_t size;
+
+	t->rate = rate;
+	t->burst = burst;
+	/* a different seed for every table */
+	t->seed = ft_hash_u64(ft_hash_seed, (uintptr_t)t);
+	if (rate == 0)
+		return (0);
+	t->nsets = (ft_rl_table + RL_WAYS - 1) / RL_WAYS;
+	size = (size_t)t->nsets * RL_WAYS * sizeof *t->b;
+	if (posix_memalign((void **)&t->b, 64, size) != 0)
+		return (-1);
+	memset(t->b, 0xff, size);
+	return (0);
+}
+
+/*
+ * Refill a bucket and return its balance.
+ */
+static uint32_t
+rl_refill(struct rl_bucket *b, unsigned int rate, unsigned int burst,
+    uint32_t now)
+{
+	uint64_t tokens;
+	int32_t elapsed;
+
+	/* rate per second is also thousandths of a token per ms */
+	elapsed = (int32_t)(now - b->stamp);
+	tokens = b->tokens;
+	if (elapsed > 0)
+		tokens += (uint64_t)elapsed * rate;
+	if (tokens > (uint64_t)burst * RL_TOKEN)
+		tokens = (uint64_t)burst * RL_TOKEN;
+	b->stamp = now;
+	return (b->tokens = tokens);
+}
+
+/*
+ * Find the bucket for a key, taking over the least recently used one
+ * in its set if it is not there.
+ */
+static struct rl_bucket *
+rl_find(struct rl_table *t, uint32_t key, uint32_t now)
+{
+	struct rl_bucket *set, *b;
+	uint32_t h;
+	unsigned int w;
+
+	h = ft_hash_ip4(t->seed, key);
+	set = t->b + (size_t)ft_hash_reduce(h, t->nsets) * RL_WAYS;
+	for (w = 0; w < RL_WAYS; ++w)
+		if (set[w].key == key)
+			return (&set[w]);
+	for (b = set, w = 1; w < RL_WAYS && b->key != RL_EMPTY; ++w)
+		if (set[w].key == RL_EMPTY ||
+		    now - set[w].stamp > now - b->stamp)
+			b = &set[w];
+	if (b->key != RL_EMPTY)
+		t->evicted++;
+	b->key = key;
+	b->stamp = now;
+	b->tokens = t->burst * RL_TOKEN;
+	return (b);
+}
+
+static struct ratelimit *
+ratelimit_table(iface *i)
+{
+	struct ratelimit *rl;
+
+	if ((rl = i->rl) != NULL)
+		return (rl);
+	if ((rl = calloc(1, sizeof *rl)) == NULL)
+		return (NULL);
+	if (rl_table_init(&rl->src, ft_rl_src_rate, ft_rl_src_burst) != 0 ||
+	    rl_table_init(&rl->net, ft_rl_net_rate, ft_rl_net_burst) != 0) {
+		free(rl->src.b);
+		free(rl);
+		return (NULL);
+	}
+	rl->global.tokens = ft_rl_max_rate * RL_TOKEN;
+	return (i->rl = rl);
+}
+
+/*
+ * Decide whether we may reply to a packet from the given source at the
+ * given time.  Returns non-zero if we may, in which case the source is
+ * charged for the reply.
+ */
+int
+ratelimit_check(iface *i, const ip4_addr *src, const struct timeval *tv)
+{
+	struct ratelimit *rl;
+	struct rl_bucket *sb, *nb;
+	uint32_t addr, now;
+
+	if (ft_rl_src_rate == 0 && ft_rl_net_rate == 0 && ft_rl_max_rate == 0)
+		return (1);
+	if ((rl = ratelimit_table(i)) == NULL)
+		return (0);
+	addr = be32toh(src->q);
+	now = tv->tv_sec * 1000U + tv->tv_usec / 1000;
+	sb = nb = NULL;
+	if (rl->src.rate > 0) {
+		sb = rl_find(&rl->src, addr, now);
+		if (rl_refill(sb, rl->src.rate, rl->src.burst, now) <
+		    RL_TOKEN) {
+			rl->src.limited++;
+			STATS_INC(i, tx_limited);
+			return (0);
+		}
+	}
+	if (rl->net.rate > 0) {
+		nb = rl_find(&rl->net, addr >> 8, now);
+		if (rl_refill(nb, rl->net.rate, rl->net.burst, now) <
+		    RL_TOKEN) {
+			rl->net.limited++;
+			STATS_INC(i, tx_limited);
+			return (0);
+		}
+	}
+	if (ft_rl_max_rate > 0) {
+		if (rl_refill(&rl->global, ft_rl_max_rate, ft_rl_max_rate,
+		    now) < RL_TOKEN) {
+			rl->global_limited++;
+			STATS_INC(i, tx_limited);
+			return (0);
+		}
+		rl->global.tokens -= RL_TOKEN;
+	}
+	if (sb != NULL)
+		sb->tokens -= RL_TOKEN;
+	if (nb != NULL)
+		nb->tokens -= RL_TOKEN;
+	rl->allowed++;
+	return (1);
+}
+
+/*
+ * Release an interface's rate limiting tables.
+ */
+void
+ratelimit_destroy(iface *i)
+{
+	struct ratelimit *rl;
+
+	if ((rl = i->rl) == NULL)
+		return;
+	ft_verbose("%s: rate limit: %lu replies allowed, suppressed %lu "
+	    "by address, %lu by /24 and %lu in total, %lu + %lu evictions",
+	    i->name, rl->allowed, rl->src.limited, rl->net.limited,
+	    rl->global_limited, rl->src.evicted, rl->net.evicted);
+	free(rl->src.b);
+	free(rl->net.b);
+	free(rl);
+	i->rl = NULL;
+}
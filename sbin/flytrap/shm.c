@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory segment
+ *
+ * If a name is configured, worker 0 publishes the counters of every
+ * interface and the contents of the ARP tables in a POSIX shared memory
+ * segment every ft_shm_interval seconds, for ftstate(1) and other tools
+ * to read.  The ARP entries come from the same snapshots as the ARP
+ * file, so the tables are never walked on behalf of a reader; the
+ * segment is laid out and locked as described in <ft/shm.h>, so
+ * readers never block or slow down the workers.
+ *
+ * The segment has a fixed size, with room for ft_shm_entries ARP
+ * entries; any beyond that are left out and counted.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+#include <ft/shm.h>
+#include <ft/strutil.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+
+const char *ft_shm_name;		/* segment name */
+unsigned int ft_shm_entries = 65536;	/* room for this many ARP entries */
+unsigned int ft_shm_interval = 5;	/* seconds between updates */
+
+static ft_shm_hdr *shm_hdr;
+static size_t shm_size;
+
+/*
+ * Create the segment, replacing any left over from an earlier run.
+ * Readers which still have the old one mapped keep it until they let
+ * go.  The interfaces are given as they are by flytrap(), with
+ * ft_workers for each.
+ */
+int
+shm_create(iface **ifs, unsigned int n)
+{
+	ft_shm_iface *fi;
+	unsigned int k;
+	void *seg;
+	int fd, serrno;
+
+	if (ft_shm_name[0] != '/' || strchr(ft_shm_name + 1, '/') != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	shm_size = ft_shm_size(n, n * stats_count() + 1, ft_shm_entries);
+	(void)shm_unlink(ft_shm_name);
+	if ((fd = shm_open(ft_shm_name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+		return (-1);
+	if (ftruncate(fd, shm_size) != 0 ||
+	    (seg = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0)) == MAP_FAILED) {
+		serrno = errno;
+		close(fd);
+		shm_unlink(ft_shm_name);
+		errno = serrno;
+		return (-1);
+	}
+	close(fd);
+	ft_shm_init(seg, n, n * stats_count() + 1, ft_shm_entries);
+	shm_hdr = seg;
+	shm_hdr->pid = getpid();
+	fi = (ft_shm_iface *)(void *)((char *)seg + shm_hdr->iface_off);
+	for (k = 0; k < n; ++k)
+		strlcpy(fi[k].name, ifs[k * ft_workers]->name,
+		    sizeof fi[k].name);
+	ft_verbose("%s: %zu bytes of shared memory", ft_shm_name, shm_size);
+	return (0);
+}
+
+/*
+ * Update the segment.  The counters are always brought up to date; the
+ * ARP entries only if a new snapshot has been taken since last time,
+ * otherwise the previous ones stay.
+ */
+void
+shm_publish(iface **ifs, unsigned int n, int witharp)
+{
+	ft_shm_counter *c;
+	ft_shm_arp *a;
+	struct timeval now;
+	unsigned int k;
+	uint32_t m, narp, ndropped, room;
+	uint64_t ms;
+
+	if (shm_hdr == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	ms = now.tv_sec * 1000ULL + now.tv_usec / 1000;
+	c = (ft_shm_counter *)(void *)((char *)shm_hdr + shm_hdr->counter_off);
+	ft_shm_begin(shm_hdr);
+	for (k = 0; k < n; ++k, c += stats_count())
+		stats_publish(&ifs[k * ft_workers], ft_workers, k, c);
+	strlcpy(c->name, "log_dropped", sizeof c->name);
+	c->iface = FT_SHM_NOIFACE;
+	c->gauge = 0;
+	c->value = log_dropped();
+	if (witharp) {
+		a = (ft_shm_arp *)(void *)((char *)shm_hdr + shm_hdr->arp_off);
+		for (narp = ndropped = 0, k = 0; k < n; ++k) {
+			room = shm_hdr->maxarp - narp;
+			m = arp_publish(&ifs[k * ft_workers], ft_workers, k,
+			    a + narp, room);
+			if (m > room) {
+				ndropped += m - room;
+				m = room;
+			}
+			narp += m;
+		}
+		shm_hdr->narp = narp;
+		shm_hdr->arp_dropped = ndropped;
+		shm_hdr->arp_updated = ms;
+	}
+	shm_hdr->updated = ms;
+	ft_shm_end(shm_hdr);
+}
+
+/*
+ * Remove the segment.
+ */
+void
+shm_destroy(void)
+{
+
+	if (shm_hdr == NULL)
+		return;
+	munmap(shm_hdr, shm_size);
+	shm_unlink(ft_shm_name);
+	shm_hdr = NULL;
+}
@@ -0,0 +1,453 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/ethernet.h>
+#include <ft/hist.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+#include <ft/shm.h>
+#include <ft/strutil.h>
+
+#include "flytrap.h"
+#include "ethernet.h"
+#include "stats.h"
+#include "iface.h"
+
+const char *ft_stats_file;
+unsigned int ft_stats_interval = 10;	/* seconds */
+
+static const struct stats_desc {
+	const char	*name;
+	size_t		 off;
+	int		 gauge;
+} stats_desc[] = {
+#define COUNTER(n)	{ #n, offsetof(stats, n), 0 }
+#define GAUGE(n)	{ #n, offsetof(stats, n), 1 }
+	COUNTER(rx_frames),
+	COUNTER(rx_bytes),
+	COUNTER(rx_truncated),
+	COUNTER(rx_fcs),
+	COUNTER(ether_short),
+	COUNTER(ether_arp),
+	COUNTER(ether_ip4),
+	COUNTER(ether_ip6),
+	COUNTER(ether_other),
+	COUNTER(ether_vlan),
+	COUNTER(arp_short),
+	COUNTER(arp_ignored),
+	COUNTER(arp_request),
+	COUNTER(arp_reply),
+	COUNTER(arp_claims),
+	COUNTER(arp_dark),
+	COUNTER(arp_evicted),
+	COUNTER(arp_full),
+	COUNTER(arp_announced),
+	COUNTER(ip4_short),
+	COUNTER(ip4_malformed),
+	COUNTER(ip4_partial),
+	COUNTER(ip4_filtered),
+	COUNTER(ip4_other),
+	COUNTER(icmp4_packets),
+	COUNTER(icmp4_invalid),
+	COUNTER(udp4_packets),
+	COUNTER(udp4_invalid),
+	COUNTER(tcp4_packets),
+	COUNTER(tcp4_invalid),
+	COUNTER(tcp4_stray),
+	COUNTER(tcp4_sessions),
+	COUNTER(tcp4_sessions_closed),
+	COUNTER(tcp4_sessions_expired),
+	COUNTER(tcp4_sessions_evicted),
+	COUNTER(ip6_short),
+	COUNTER(ip6_malformed),
+	COUNTER(ip6_other),
+	COUNTER(icmp6_packets),
+	COUNTER(icmp6_invalid),
+	COUNTER(ndp_invalid),
+	COUNTER(ndp_solicit),
+	COUNTER(ndp_advert),
+	COUNTER(ndp_dad),
+	COUNTER(ndp_claims),
+	COUNTER(ndp_evicted),
+	COUNTER(tx_replies),
+	COUNTER(tx_limited),
+	COUNTER(tx_failed),
+	COUNTER(kern_received),
+	COUNTER(kern_dropped),
+	COUNTER(txq_frames),
+	COUNTER(txq_errors),
+	COUNTER(pool_exhausted),
+	GAUGE(arp_entries),
+	GAUGE(arp_claimed),
+	GAUGE(arp_bytes),
+	GAUGE(arp_vlans),
+	GAUGE(ndp_entries),
+	GAUGE(ndp_claimed),
+	GAUGE(ndp_bytes),
+	GAUGE(tcp4_sessions_active),
+#undef COUNTER
+#undef GAUGE
+};
+#define STATS_NDESC (sizeof stats_desc / sizeof stats_desc[0])
+
+#if WITH_TIMING
+static const char *stats_stage_name[STATS_STAGES] = {
+	[stage_capture]		 = "capture",
+	[stage_ether]		 = "ether",
+	[stage_arp]		 = "arp",
+	[stage_ip4]		 = "ip4",
+	[stage_icmp4]		 = "icmp4",
+	[stage_ip6]		 = "ip6",
+	[stage_tcp4]		 = "tcp4",
+	[stage_udp4]		 = "udp4",
+	[stage_log]		 = "log",
+	[stage_transmit]	 = "transmit",
+	[stage_flush]		 = "flush",
+};
+#endif
+
+static const struct stats_quantile {
+	const char	*name;
+	double		 q;
+} stats_quantile[] = {
+	{ "0.5",	0.5 },
+	{ "0.99",	0.99 },
+	{ "0.999",	0.999 },
+};
+#define STATS_NQUANTILE (sizeof stats_quantile / sizeof stats_quantile[0])
+
+#define STATS_VALUE(st, d) (*(const unsigned long *)(const void *) \
+	((const char *)(st) + (d)->off))
+
+/*
+ * Take a snapshot of an interface's counters.  The counters are owned
+ * by the interface's worker, so they are read one word at a time; the
+ * snapshot as a whole is not atomic, but each value in it is exact.
+ * Must only be called by one thread at a time for any given interface,
+ * see iface_kstats().
+ */
+void
+stats_snapshot(iface *i, stats *st)
+{
+	const unsigned long *src;
+	unsigned long *dst;
+	unsigned int k;
+
+	src = (const unsigned long *)(const void *)&i->stats;
+	dst = (unsigned long *)(void *)st;
+	for (k = 0; k < sizeof *st / sizeof *dst; ++k)
+		dst[k] = __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+	iface_kstats(i);
+	st->kern_received = i->kern_received;
+	st->kern_dropped = i->kern_dropped;
+	st->txq_frames = __atomic_load_n(&i->txq_frames, __ATOMIC_RELAXED);
+	st->txq_errors = __atomic_load_n(&i->txq_errors, __ATOMIC_RELAXED);
+	st->pool_exhausted =
+	    __atomic_load_n(&i->pool_exhausted, __ATOMIC_RELAXED);
+	arp_stats(i, st);
+	conn_stats(i, st);
+	ndp_stats(i, st);
+}
+
+/*
+ * Write out the quantiles of the durations of the TCP sessions we have
+ * held, per interface.
+ */
+static int
+stats_write_sessions(FILE *f, iface **ifs, unsigned int n)
+{
+	const ft_hist *ch;
+	ft_hist *h;
+	unsigned int j, k;
+
+	if ((h = malloc(sizeof *h)) == NULL)
+		return (-1);
+	fprintf(f, "# TYPE flytrap_tcp4_session_seconds summary\n");
+	for (k = 0; k < n; ++k) {
+		if ((ch = conn_held(ifs[k])) == NULL)
+			continue;
+		memset(h, 0, sizeof *h);
+		ft_hist_merge(h, ch);
+		for (j = 0; j < STATS_NQUANTILE; ++j) {
+			fprintf(f, "flytrap_tcp4_session_seconds{iface=\"%s\","
+			    "worker=\"%u\",quantile=\"%s\"} %.3f\n",
+			    ifs[k]->name, ifs[k]->worker,
+			    stats_quantile[j].name,
+			    ft_hist_quantile(h, stats_quantile[j].q) / 1e3);
+		}
+		fprintf(f, "flytrap_tcp4_session_seconds_count{iface=\"%s\","
+		    "worker=\"%u\"} %lu\n", ifs[k]->name, ifs[k]->worker,
+		    h->count);
+	}
+	free(h);
+	return (0);
+}
+
+#if WITH_TIMING
+/*
+ * Write out the latency quantiles for each stage and interface.
+ */
+static int
+stats_write_timing(FILE *f, iface **ifs, unsigned int n)
+{
+	ft_hist *h;
+	unsigned int j, k, s;
+
+	if ((h = malloc(sizeof *h)) == NULL)
+		return (-1);
+	fprintf(f, "# TYPE flytrap_latency_ns summary\n");
+	for (s = 0; s < STATS_STAGES; ++s) {
+		for (k = 0; k < n; ++k) {
+			memset(h, 0, sizeof *h);
+			ft_hist_merge(h, &ifs[k]->timing[s]);
+			for (j = 0; j < STATS_NQUANTILE; ++j) {
+				fprintf(f, "flytrap_latency_ns{iface=\"%s\","
+				    "worker=\"%u\",stage=\"%s\","
+				    "quantile=\"%s\"} %llu\n",
+				    ifs[k]->name, ifs[k]->worker,
+				    stats_stage_name[s], stats_quantile[j].name,
+				    (unsigned long long)
+				    ft_hist_quantile(h, stats_quantile[j].q));
+			}
+			fprintf(f, "flytrap_latency_ns_count{iface=\"%s\","
+			    "worker=\"%u\",stage=\"%s\"} %lu\n",
+			    ifs[k]->name, ifs[k]->worker,
+			    stats_stage_name[s], h->count);
+		}
+	}
+	free(h);
+	return (0);
+}
+
+/*
+ * Log the latency quantiles for each stage, over all interfaces.
+ */
+static void
+stats_log_timing(iface **ifs, unsigned int n)
+{
+	ft_hist *h;
+	unsigned int k, s;
+
+	if ((h = malloc(sizeof *h)) == NULL)
+		return;
+	for (s = 0; s < STATS_STAGES; ++s) {
+		memset(h, 0, sizeof *h);
+		for (k = 0; k < n; ++k)
+			ft_hist_merge(h, &ifs[k]->timing[s]);
+		if (h->count == 0)
+			continue;
+		ft_notice("stats: %s latency p50 %llu p99 %llu p99.9 %llu ns"
+		    " over %lu packets", stats_stage_name[s],
+		    (unsigned long long)ft_hist_quantile(h, 0.5),
+		    (unsigned long long)ft_hist_quantile(h, 0.99),
+		    (unsigned long long)ft_hist_quantile(h, 0.999),
+		    h->count);
+	}
+	free(h);
+}
+#endif
+
+/*
+ * Log the quantiles of the session durations, over all interfaces.
+ */
+static void
+stats_log_sessions(iface **ifs, unsigned int n)
+{
+	const ft_hist *ch;
+	ft_hist *h;
+	unsigned int k;
+
+	if ((h = calloc(1, sizeof *h)) == NULL)
+		return;
+	for (k = 0; k < n; ++k)
+		if ((ch = conn_held(ifs[k])) != NULL)
+			ft_hist_merge(h, ch);
+	if (h->count > 0) {
+		ft_notice("stats: tcp4 sessions held p50 %.3f p99 %.3f "
+		    "max %.3f s over %lu sessions",
+		    ft_hist_quantile(h, 0.5) / 1e3,
+		    ft_hist_quantile(h, 0.99) / 1e3, h->max / 1e3, h->count);
+	}
+	free(h);
+}
+
+/*
+ * Write the counters for all interfaces to a file, in the Prometheus
+ * text exposition format so it can be picked up by a textfile collector
+ * or served as is.  The file is written under a temporary name and
+ * renamed into place, so readers never see a partial file.
+ */
+int
+stats_write(const char *fn, iface **ifs, unsigned int n)
+{
+	const struct stats_desc *d;
+	char tmpfn[1024];
+	stats *st;
+	FILE *f;
+	unsigned int k;
+	int ret, serrno;
+
+	if ((size_t)snprintf(tmpfn, sizeof tmpfn, "%s.tmp", fn) >=
+	    sizeof tmpfn) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if ((st = calloc(n, sizeof *st)) == NULL)
+		return (-1);
+	for (k = 0; k < n; ++k)
+		stats_snapshot(ifs[k], &st[k]);
+	if ((f = fopen(tmpfn, "w")) == NULL) {
+		serrno = errno;
+		free(st);
+		errno = serrno;
+		return (-1);
+	}
+	for (d = stats_desc; d < stats_desc + STATS_NDESC; ++d) {
+		fprintf(f, "# TYPE flytrap_%s %s\n", d->name,
+		    d->gauge ? "gauge" : "counter");
+		for (k = 0; k < n; ++k) {
+			fprintf(f,
+			    "flytrap_%s{iface=\"%s\",worker=\"%u\"} %lu\n",
+			    d->name, ifs[k]->name, ifs[k]->worker,
+			    STATS_VALUE(&st[k], d));
+		}
+	}
+	fprintf(f, "# TYPE flytrap_log_dropped counter\n");
+	fprintf(f, "flytrap_log_dropped %lu\n", log_dropped());
+	free(st);
+	ret = stats_write_sessions(f, ifs, n);
+#if WITH_TIMING
+	if (ret == 0)
+		ret = stats_write_timing(f, ifs, n);
+#endif
+	if (ret != 0) {
+		serrno = errno;
+		fclose(f);
+		unlink(tmpfn);
+		errno = serrno;
+		return (-1);
+	}
+	if (ferror(f) || fclose(f) != 0) {
+		serrno = errno;
+		unlink(tmpfn);
+		errno = serrno;
+		return (-1);
+	}
+	if (rename(tmpfn, fn) != 0) {
+		serrno = errno;
+		unlink(tmpfn);
+		errno = serrno;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Log the non-zero counters, summed over all interfaces.
+ */
+void
+stats_log(iface **ifs, unsigned int n)
+{
+	const struct stats_desc *d;
+	stats st, sum;
+	unsigned long *src, *dst;
+	unsigned int j, k;
+
+	memset(&sum, 0, sizeof sum);
+	src = (unsigned long *)(void *)&st;
+	dst = (unsigned long *)(void *)&sum;
+	for (k = 0; k < n; ++k) {
+		stats_snapshot(ifs[k], &st);
+		for (j = 0; j < sizeof st / sizeof *src; ++j)
+			dst[j] += src[j];
+	}
+	for (d = stats_desc; d < stats_desc + STATS_NDESC; ++d)
+		if (STATS_VALUE(&sum, d) != 0)
+			ft_notice("stats: %s %lu", d->name,
+			    STATS_VALUE(&sum, d));
+	ft_notice("stats: log_dropped %lu", log_dropped());
+	stats_log_sessions(ifs, n);
+#if WITH_TIMING
+	stats_log_timing(ifs, n);
+#endif
+}
+
+/*
+ * Number of records stats_publish() fills in.
+ */
+unsigned int
+stats_count(void)
+{
+
+	return (STATS_NDESC);
+}
+
+/*
+ * Sum the counters of an interface's workers into records for the
+ * shared memory segment, see shm_publish().
+ */
+void
+stats_publish(iface **ifs, unsigned int n, uint32_t index,
+    ft_shm_counter *c)
+{
+	const struct stats_desc *d;
+	stats st, sum;
+	unsigned long *src, *dst;
+	unsigned int j, k;
+
+	memset(&sum, 0, sizeof sum);
+	src = (unsigned long *)(void *)&st;
+	dst = (unsigned long *)(void *)&sum;
+	for (k = 0; k < n; ++k) {
+		stats_snapshot(ifs[k], &st);
+		for (j = 0; j < sizeof st / sizeof *src; ++j)
+			dst[j] += src[j];
+	}
+	for (d = stats_desc; d < stats_desc + STATS_NDESC; ++d, ++c) {
+		strlcpy(c->name, d->name, sizeof c->name);
+		c->iface = index;
+		c->gauge = d->gauge;
+		c->value = STATS_VALUE(&sum, d);
+	}
+}
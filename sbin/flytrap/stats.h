@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FLYTRAP_STATS_H_INCLUDED
+#define FLYTRAP_STATS_H_INCLUDED
+
+/*
+ * Per-worker counters.  Each worker has its own set, embedded in its
+ * interface, and is the only one to update it, so a plain increment
+ * will do.  The counters are only read by another thread when they are
+ * reported, which can live with a slightly stale view.
+ *
+ * Everything is an unsigned long, so that a snapshot can be taken one
+ * word at a time.  The fields at the end are not counted on the fly but
+ * filled in when a snapshot is taken, see stats_snapshot().
+ */
+typedef struct stats {
+	/* capture */
+	unsigned long	 rx_frames;	/* frames analyzed */
+	unsigned long	 rx_bytes;
+	unsigned long	 rx_truncated;	/* frames captured in part */
+	unsigned long	 rx_fcs;	/* frames with a bad FCS */
+
+	/* link layer */
+	unsigned long	 ether_short;
+	unsigned long	 ether_arp;
+	unsigned long	 ether_ip4;
+	unsigned long	 ether_ip6;
+	unsigned long	 ether_other;	/* unsupported ethertype */
+	unsigned long	 ether_vlan;	/* 802.1Q tagged */
+
+	/* ARP */
+	unsigned long	 arp_short;
+	unsigned long	 arp_ignored;	/* not Ethernet / IPv4 */
+	unsigned long	 arp_request;
+	unsigned long	 arp_reply;
+	unsigned long	 arp_claims;	/* addresses claimed */
+	unsigned long	 arp_dark;	/* answered from the dark set */
+	unsigned long	 arp_evicted;	/* forgotten to make room */
+	unsigned long	 arp_full;	/* not inserted, no room */
+	unsigned long	 arp_announced;	/* gratuitous replies sent */
+
+	/* IPv4 */
+	unsigned long	 ip4_short;
+	unsigned long	 ip4_malformed;
+	unsigned long	 ip4_partial;	/* checksum not verified */
+	unsigned long	 ip4_filtered;	/* outside the address sets */
+	unsigned long	 ip4_other;	/* unsupported protocol */
+	unsigned long	 icmp4_packets;
+	unsigned long	 icmp4_invalid;	/* short or bad checksum */
+	unsigned long	 udp4_packets;
+	unsigned long	 udp4_invalid;
+	unsigned long	 tcp4_packets;
+	unsigned long	 tcp4_invalid;
+	unsigned long	 tcp4_stray;	/* not part of a session of ours */
+	unsigned long	 tcp4_sessions;	/* sessions tracked */
+	unsigned long	 tcp4_sessions_closed; /* by FIN or RST */
+	unsigned long	 tcp4_sessions_expired; /* idle for too long */
+	unsigned long	 tcp4_sessions_evicted; /* to make room */
+
+	/* IPv6 and neighbor discovery */
+	unsigned long	 ip6_short;
+	unsigned long	 ip6_malformed;
+	unsigned long	 ip6_other;	/* not ICMPv6 */
+	unsigned long	 icmp6_packets;
+	unsigned long	 icmp6_invalid;	/* short or bad checksum */
+	unsigned long	 ndp_invalid;	/* malformed solicitation etc. */
+	unsigned long	 ndp_solicit;
+	unsigned long	 ndp_advert;
+	unsigned long	 ndp_dad;	/* duplicate address detection */
+	unsigned long	 ndp_claims;	/* addresses claimed */
+	unsigned long	 ndp_evicted;	/* live entries taken over */
+
+	/* replies */
+	unsigned long	 tx_replies;	/* queued for transmission */
+	unsigned long	 tx_limited;	/* suppressed by rate limits */
+	unsigned long	 tx_failed;	/* could not be queued */
+
+	/* gauges and outside counters, filled in by stats_snapshot() */
+	unsigned long	 kern_received;	/* seen by the kernel */
+	unsigned long	 kern_dropped;	/* dropped by the kernel */
+	unsigned long	 txq_frames;	/* frames passed to the kernel */
+	unsigned long	 txq_errors;	/* frames the kernel refused */
+	unsigned long	 pool_exhausted;
+	unsigned long	 arp_entries;	/* addresses in the ARP table */
+	unsigned long	 arp_claimed;	/* addresses currently claimed */
+	unsigned long	 arp_bytes;	/* ARP table memory */
+	unsigned long	 arp_vlans;	/* VLANs with an ARP table */
+	unsigned long	 ndp_entries;	/* addresses in the neighbor table */
+	unsigned long	 ndp_claimed;	/* addresses currently claimed */
+	unsigned long	 ndp_bytes;	/* neighbor table memory */
+	unsigned long	 tcp4_sessions_active;
+} stats;
+
+#define STATS_INC(i, c)		((void)((i)->stats.c++))
+#define STATS_ADD(i, c, n)	((void)((i)->stats.c += (n)))
+
+/*
+ * Per-stage latency histograms, only collected when built with
+ * --enable-timing.  Stages are timed inclusively, so the IP stage also
+ * covers the transport layer, and so on.  The capture stage runs from
+ * the kernel's timestamp to the start of analysis.
+ */
+typedef enum stats_stage {
+	stage_capture,
+	stage_ether,
+	stage_arp,
+	stage_ip4,
+	stage_icmp4,
+	stage_ip6,
+	stage_tcp4,
+	stage_udp4,
+	stage_log,
+	stage_transmit,
+	stage_flush,
+	STATS_STAGES
+} stats_stage;
+
+#if WITH_TIMING
+#include <time.h>
+
+#include <ft/hist.h>
+
+static inline uint64_t
+stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static inline void
+stats_time_since(ft_hist *h, const struct timeval *tv)
+{
+	struct timespec ts;
+	int64_t d;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	d = (int64_t)(ts.tv_sec - tv->tv_sec) * 1000000000 +
+	    ts.tv_nsec - tv->tv_usec * 1000;
+	if (d >= 0)
+		ft_hist_add(h, d);
+}
+
+#define STATS_TIMER(t)		uint64_t t = stats_clock()
+#define STATS_TIME(i, s, t)	\
+	ft_hist_add(&(i)->timing[s], stats_clock() - (t))
+#define STATS_TIME_SINCE(i, s, tv) stats_time_since(&(i)->timing[s], (tv))
+#else
+#define STATS_TIMER(t)		do { } while (0)
+#define STATS_TIME(i, s, t)	do { } while (0)
+#define STATS_TIME_SINCE(i, s, tv) do { } while (0)
+#endif
+
+#endif
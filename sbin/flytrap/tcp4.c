@@ -33,6 +33,7 @@
 
 #include <sys/time.h>
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -40,159 +41,202 @@
 
 #include <ft/endian.h>
 #include <ft/ethernet.h>
+#include <ft/hash.h>
 #include <ft/ip4.h>
 #include <ft/log.h>
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
 /*
- * Reply to a TCP packet with an RST.
+ * All our replies are a bare TCP header, and most of its fields never
+ * change.  The template has those fields filled in, and we precompute
+ * their partial checksum, so a reply only needs a handful of fields
+ * patched in and a short sum finished off.  The template is set up on
+ * first use.
  */
-static int
-tcp4_go_away(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+static tcp4_hdr tcp4_tmpl;
+static uint16_t tcp4_tmpl_sum;	/* constant part of header sum */
+static pthread_once_t tcp4_tmpl_once = PTHREAD_ONCE_INIT;
+
+/*
+ * We keep no per-connection state.  Instead, like a SYN cookie, our
+ * initial sequence number is a keyed hash of the 4-tuple plus the
+ * peer's initial sequence number.  A later segment is part of one of
+ * our sessions if subtracting the hash from the acknowledgement number
+ * it carries gives back an initial sequence number which matches its
+ * own sequence number.  Since we never accept any data, that is all we
+ * need to know to answer it.
+ */
+static uint64_t tcp4_secret;
+
+static void
+tcp4_tmpl_init(void)
 {
-	tcp4_hdr oth;
-	uint16_t olen, sum;
-	int ret;
+	tcp4_hdr *t = &tcp4_tmpl;
+	uint16_t plen;
 
-	(void)ilen;
+	tcp4_secret = ft_hash_u64(ft_hash_seed, ip_proto_tcp);
+	memset(t, 0, sizeof *t);
+	t->off_ns = (sizeof *t / 4U) << 4;
+	t->win = htobe16(0);
+	/* header, plus the pseudo-header's protocol and length fields */
+	plen = htobe16(sizeof *t);
+	tcp4_tmpl_sum = ip4_cksum(0, t, sizeof *t);
+	tcp4_tmpl_sum = ip4_cksum(tcp4_tmpl_sum, &plen, sizeof plen);
+	tcp4_tmpl_sum = ip4_cksum_adjust(tcp4_tmpl_sum, 0, ip_proto_tcp);
+}
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_RST;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+static inline uint16_t
+tcp4_fold(uint32_t sum)
+{
 
-	/* compute pseudo-header checksum, then packet checksum */
-	sum = ip4_cksum(0, &fl->dst, sizeof fl->dst);
-	sum = ip4_cksum(sum, &fl->src, sizeof fl->src);
-	sum = ip4_cksum(sum, &fl->proto, sizeof fl->proto);
-	olen = htobe16(sizeof oth);
-	sum = ip4_cksum(sum, &olen, sizeof olen);
-	oth.sum = htobe16(~ip4_cksum(sum, &oth, sizeof oth));
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ((sum & 0xffff) + (sum >> 16));
+}
 
-	/* send packet */
-	ret = ip4_reply(fl, ip_proto_tcp, &oth, sizeof oth);
-	return (ret);
+static inline uint32_t
+tcp4_cookie(const ip4_flow *fl, const tcp4_hdr *ith)
+{
+
+	return (ft_hash_ip4_flow(tcp4_secret, fl->src.q, fl->dst.q,
+	    ith->sp, ith->dp));
 }
 
 /*
- * Reply to a SYN packet with a SYN/ACK with a very small window size.
+ * Send a reply with the specified sequence and acknowledgement numbers
+ * and flags.
  */
 static int
-tcp4_hello(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_reply(ip4_flow *fl, const tcp4_hdr *ith, uint32_t seq, uint32_t ack,
+    uint8_t flags)
 {
-	tcp4_hdr oth;
-	uint32_t ack;
-	uint16_t olen, sum;
-	int ret;
+	tcp4_hdr *th;
+	txbuf tb;
+	uint32_t sum;
+	uint16_t asum;
 
-	(void)ilen;
+	if (!ratelimit_check(fl->eth->p->i, &fl->src, &fl->eth->p->ts))
+		return (0);
+	if (iface_txbuf(fl->eth->p->i, &tb) != 0 ||
+	    (th = txbuf_append(&tb, sizeof *th)) == NULL)
+		return (-1);
+	*th = tcp4_tmpl;
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	ack = be32toh(ith->seq) + 1;
-	oth.ack = htobe32(ack);
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_SYN | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+	/*
+	 * The received pseudo-header sum covers both addresses, which
+	 * we reuse for ours, plus the protocol and the length, which we
+	 * take back out (RFC 1624).
+	 */
+	asum = ip4_cksum_adjust(fl->sum, be16toh(fl->proto), 0);
+	asum = ip4_cksum_adjust(asum, be16toh(fl->len), 0);
 
-	/* compute pseudo-header checksum, then packet checksum */
-	sum = ip4_cksum(0, &fl->dst, sizeof fl->dst);
-	sum = ip4_cksum(sum, &fl->src, sizeof fl->src);
-	sum = ip4_cksum(sum, &fl->proto, sizeof fl->proto);
-	olen = htobe16(sizeof oth);
-	sum = ip4_cksum(sum, &olen, sizeof olen);
-	oth.sum = htobe16(~ip4_cksum(sum, &oth, sizeof oth));
+	th->sp = ith->dp;
+	th->dp = ith->sp;
+	th->seq = htobe32(seq);
+	th->ack = htobe32(ack);
+	th->fl = flags;
+	sum = (uint32_t)tcp4_tmpl_sum + asum + flags +
+	    be16toh(th->sp) + be16toh(th->dp) + (seq >> 16) + (seq & 0xffff) +
+	    (ack >> 16) + (ack & 0xffff);
+	th->sum = htobe16(~tcp4_fold(sum));
 
-	/* send packet */
-	ret = ip4_reply(fl, ip_proto_tcp, &oth, sizeof oth);
-	return (ret);
+	return (ip4_reply(fl, ip_proto_tcp, &tb));
 }
 
 /*
- * Reply to a TCP packet with another which acknowledges receipt but
- * informs the peer that we don't have any free buffer space.
+ * Reply to a TCP packet with an RST.
  */
 static int
-tcp4_please_hold(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_go_away(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
 {
-	tcp4_hdr oth;
-	uint16_t olen, sum;
-	int ret;
 
 	(void)ilen;
+	return (tcp4_reply(fl, ith, be32toh(ith->ack), be32toh(ith->seq),
+	    TCP4_RST));
+}
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = (ith->fl & TCP4_SYN) | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+/*
+ * Reply to a SYN packet with a SYN/ACK with a zero window and our
+ * cookie as the initial sequence number.
+ */
+static int
+tcp4_hello(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+{
+	uint32_t seq;
 
-	/* compute pseudo-header checksum, then packet checksum */
-	sum = ip4_cksum(0, &fl->dst, sizeof fl->dst);
-	sum = ip4_cksum(sum, &fl->src, sizeof fl->src);
-	sum = ip4_cksum(sum, &fl->proto, sizeof fl->proto);
-	olen = htobe16(sizeof oth);
-	sum = ip4_cksum(sum, &olen, sizeof olen);
-	oth.sum = htobe16(~ip4_cksum(sum, &oth, sizeof oth));
+	(void)ilen;
+	seq = be32toh(ith->seq);
+	return (tcp4_reply(fl, ith, tcp4_cookie(fl, ith) + seq, seq + 1,
+	    TCP4_SYN | TCP4_ACK));
+}
 
-	/* send packet */
-	ret = ip4_reply(fl, ip_proto_tcp, &oth, sizeof oth);
-	return (ret);
+/*
+ * Reply to data or a window probe with an acknowledgement which
+ * accepts none of it and informs the peer that we still don't have
+ * any free buffer space.  The peer will keep probing, in the hope
+ * that the window opens, for as long as we keep answering.
+ */
+static int
+tcp4_please_hold(ip4_flow *fl, const tcp4_hdr *ith, uint32_t rcv_nxt)
+{
+
+	return (tcp4_reply(fl, ith, be32toh(ith->ack), rcv_nxt, TCP4_ACK));
 }
 
 /*
  * Reply to a FIN packet with a FIN/ACK.
  */
 static int
-tcp4_goodbye(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_goodbye(ip4_flow *fl, const tcp4_hdr *ith)
 {
-	tcp4_hdr oth;
-	uint16_t olen, sum;
-	int ret;
 
-	(void)ilen;
-
-	/* fill in packet */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_FIN | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+	return (tcp4_reply(fl, ith, be32toh(ith->ack), be32toh(ith->seq) + 1,
+	    TCP4_FIN | TCP4_ACK));
+}
 
-	/* compute pseudo-header checksum, then packet checksum */
-	sum = ip4_cksum(0, &fl->dst, sizeof fl->dst);
-	sum = ip4_cksum(sum, &fl->src, sizeof fl->src);
-	sum = ip4_cksum(sum, &fl->proto, sizeof fl->proto);
-	olen = htobe16(sizeof oth);
-	sum = ip4_cksum(sum, &olen, sizeof olen);
-	oth.sum = htobe16(~ip4_cksum(sum, &oth, sizeof oth));
+/*
+ * Handle a segment which is neither a SYN nor an RST.  If it belongs
+ * to one of our sessions, its acknowledgement number is our initial
+ * sequence number plus one, so we can recover the peer's initial
+ * sequence number, irs, from the cookie.  Since we never accept any
+ * data, the peer sends everything at irs + 1, except for Linux window
+ * probes, which are sent one below that.  After an exchange of FINs,
+ * both numbers have advanced by one, which works out the same.
+ */
+static int
+tcp4_continue(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+{
+	uint32_t irs, seq;
 
-	/* send packet */
-	ret = ip4_reply(fl, ip_proto_tcp, &oth, sizeof oth);
-	return (ret);
+	if (!(ith->fl & TCP4_ACK)) {
+		STATS_INC(fl->eth->p->i, tcp4_stray);
+		return (0);
+	}
+	seq = be32toh(ith->seq);
+	irs = be32toh(ith->ack) - 1 - tcp4_cookie(fl, ith);
+	if (seq == irs && ilen == 0) {
+		/* window probe */
+		conn_track(fl, ith, 0, 1);
+		return (tcp4_please_hold(fl, ith, seq + 1));
+	} else if (seq != irs + 1) {
+		STATS_INC(fl->eth->p->i, tcp4_stray);
+		return (0);
+	} else if (ilen > 0) {
+		/* data, possibly with a FIN we can't accept yet */
+		conn_track(fl, ith, ilen, 1);
+		return (tcp4_please_hold(fl, ith, seq));
+	} else if (ith->fl & TCP4_FIN) {
+		/* closing connection */
+		conn_close(fl, ith);
+		return (tcp4_goodbye(fl, ith));
+	}
+	/* bare acknowledgement, nothing to say */
+	conn_touch(fl, ith);
+	return (0);
 }
 
 /*
@@ -201,10 +245,8 @@ tcp4_goodbye(ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
 int
 packet_analyze_tcp4(ip4_flow *fl, const void *data, size_t len)
 {
-	char flags[] = "NCEUAPRSF";
 	const tcp4_hdr *th;
 	size_t thlen;
-	unsigned int bit, mask;
 	uint16_t sum;
 	int ret;
 
@@ -214,50 +256,40 @@ packet_analyze_tcp4(ip4_flow *fl, const void *data, size_t len)
 		ft_notice("%d.%03d short TCP packet (%zd < %zd)",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    len, thlen);
+		STATS_INC(fl->eth->p->i, tcp4_invalid);
 		return (-1);
 	}
-	if ((sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
+	/* can't verify the checksum if we only have the headers */
+	if (len == be16toh(fl->len) &&
+	    (sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
 		ft_notice("%d.%03d invalid TCP checksum 0x%04hx",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    sum);
+		STATS_INC(fl->eth->p->i, tcp4_invalid);
 		return (-1);
 	}
-	data = (const uint8_t *)data + thlen;
-	len -= thlen;
+	len = be16toh(fl->len) - thlen;
 	ft_verbose("tcp4 port %hu to %hu seq %lu ack %lu win %hu len %zu",
 	    (unsigned short)be16toh(th->sp), (unsigned short)be16toh(th->dp),
 	    (unsigned long)be32toh(th->seq), (unsigned long)be32toh(th->ack),
 	    (unsigned short)be16toh(th->win), len);
-	if (!tcp4_hdr_ns(th))
-		flags[0] = '-';
-	for (bit = 1, mask = 0x80; mask > 0; ++bit, mask >>= 1)
-		if (!(th->fl & mask))
-			flags[bit] = '-';
+	STATS_TIMER(t);
 	log_packet4(&fl->eth->p->ts, &fl->src, be16toh(th->sp),
-	    &fl->dst, be16toh(th->dp), "TCP", len, flags);
+	    &fl->dst, be16toh(th->dp), ip_proto_tcp, len,
+	    (tcp4_hdr_ns(th) ? 0x100 : 0) | th->fl);
+	STATS_TIME(fl->eth->p->i, stage_log, t);
+	pthread_once(&tcp4_tmpl_once, tcp4_tmpl_init);
 	if (th->fl & TCP4_SYN) {
 		if (th->fl & TCP4_ACK)
 			ret = tcp4_go_away(fl, th, len);
 		else
 			ret = tcp4_hello(fl, th, len);
-	} else if (th->fl & TCP4_FIN) {
-		/* closing connection */
-		/*
-		 * This is disabled for now, as I haven't found a way to
-		 * handle FIN correctly without keeping connection state.
-		 * We may consider doing so in the future if we find a
-		 * clever way to represent state with a minimal amount of
-		 * resources and without exposing ourselves to a DoS.
-		 */
-		ret = 0 && tcp4_goodbye(fl, th, len);
 	} else if (th->fl & TCP4_RST) {
-		/* ignore packet */
+		/* forget the session, if we were tracking it */
+		conn_close(fl, th);
 		ret = 0;
-	} else if (len > 0) {
-		ret = tcp4_please_hold(fl, th, len);
 	} else {
-		/* ignore packet */
-		ret = 0;
+		ret = tcp4_continue(fl, th, len);
 	}
 	return (ret);
 }
@@ -43,6 +43,7 @@
 
 #include "flytrap.h"
 #include "ethernet.h"
+#include "stats.h"
 #include "iface.h"
 #include "packet.h"
 
@@ -60,18 +61,22 @@ packet_analyze_udp4(ip4_flow *fl, const void *data, size_t len)
 		ft_notice("%d.%03d short UDP packet (%zd < %zd)",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    len, sizeof *uh);
+		STATS_INC(fl->eth->p->i, udp4_invalid);
 		return (-1);
 	}
-	if (uh->sum != 0 &&
+	/* can't verify the checksum if we only have the header */
+	if (uh->sum != 0 && len == be16toh(fl->len) &&
 	    (sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
 		ft_notice("%d.%03d invalid UDP checksum 0x%04hx",
 		    fl->eth->p->ts.tv_sec, fl->eth->p->ts.tv_usec / 1000,
 		    sum);
+		STATS_INC(fl->eth->p->i, udp4_invalid);
 		return (-1);
 	}
-	data = uh + 1;
-	len -= sizeof *uh;
+	len = be16toh(fl->len) - sizeof *uh;
+	STATS_TIMER(t);
 	log_packet4(&fl->eth->p->ts, &fl->src, be16toh(uh->sp),
-	    &fl->dst, be16toh(uh->dp), "UDP", len, "");
+	    &fl->dst, be16toh(uh->dp), ip_proto_udp, len, 0);
+	STATS_TIME(fl->eth->p->i, stage_log, t);
 	return (0);
 }
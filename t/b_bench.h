@@ -0,0 +1,80 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef B_BENCH_H_INCLUDED
+#define B_BENCH_H_INCLUDED
+
+/*
+ * Benchmark results are printed one per line, in the format used by
+ * Go's testing package:
+ *
+ *   Benchmark<name>	<iterations>	<t> ns/op	[<r> MB/s]
+ *
+ * so that runs can be compared with benchstat(1), or simply diffed.
+ * Names use / to separate parameters, e.g. BenchmarkIP4Cksum/1500.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+/* results go here so the compiler can't optimize the work away */
+static volatile unsigned long b_sink;
+
+static inline uint64_t
+b_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Report n iterations which took ns nanoseconds in total and processed
+ * a combined total of bytes bytes, or 0 if throughput is meaningless.
+ */
+static inline void
+b_report(unsigned long n, uint64_t ns, uint64_t bytes,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("Benchmark");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\t%lu\t%.2f ns/op", n, n > 0 ? (double)ns / n : 0.0);
+	if (bytes > 0 && ns > 0)
+		printf("\t%.2f MB/s", bytes * 1000.0 / ns);
+	printf("\n");
+	fflush(stdout);
+}
+
+#endif
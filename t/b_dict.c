@@ -0,0 +1,104 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure dictionary insertions, lookups, iteration and removals at a
+ * range of sizes.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ft/dict.h>
+
+#include "b_bench.h"
+
+#define KEYLEN	16
+
+static const unsigned int sizes[] = { 1000, 10000, 100000, 1000000 };
+
+static void
+bench(unsigned int n)
+{
+	const struct ft_dict_ent *e;
+	struct ft_dict *d;
+	unsigned long sum;
+	unsigned int i;
+	uint64_t t0;
+	char *keys;
+
+	if ((keys = malloc((size_t)n * KEYLEN)) == NULL ||
+	    (d = ft_dict_create()) == NULL)
+		exit(1);
+	for (i = 0; i < n; ++i)
+		snprintf(keys + (size_t)i * KEYLEN, KEYLEN, "key%08lx",
+		    (unsigned long)random());
+
+	t0 = b_now();
+	for (i = 0; i < n; ++i)
+		ft_dict_insert(d, keys + (size_t)i * KEYLEN, NULL);
+	b_report(n, b_now() - t0, 0, "DictInsert/%u", n);
+
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < n; ++i)
+		if (ft_dict_find(d, keys + (size_t)i * KEYLEN) != NULL)
+			sum++;
+	b_report(n, b_now() - t0, 0, "DictLookup/%u", n);
+
+	t0 = b_now();
+	for (e = ft_dict_first(d); e != NULL; e = ft_dict_next(d, e))
+		sum++;
+	b_report(n, b_now() - t0, 0, "DictIterate/%u", n);
+
+	t0 = b_now();
+	for (i = 0; i < n; ++i)
+		ft_dict_remove(d, keys + (size_t)i * KEYLEN);
+	b_report(n, b_now() - t0, 0, "DictRemove/%u", n);
+
+	ft_dict_destroy(d);
+	free(keys);
+	b_sink = sum;
+}
+
+int
+main(void)
+{
+	unsigned int i;
+
+	srandom(1024);
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+		bench(sizes[i]);
+	exit(0);
+}
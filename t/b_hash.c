@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the cost of the string and buffer hash functions on keys of
+ * typical lengths, and of the fixed-width address and flow hashes.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ft/hash.h>
+
+#include "b_bench.h"
+
+#define NHASHES	(1U << 24)
+
+static const size_t sizes[] = { 4, 8, 16, 64, 256 };
+
+static char buf[1024];
+
+static void
+bench_hash(size_t len)
+{
+	unsigned long sum;
+	unsigned int i;
+	uint64_t t0;
+
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_hash(buf + (i & 255), len);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * len,
+	    "Hash/%zu", len);
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_hash64(ft_hash_seed, buf + (i & 255), len);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * len,
+	    "Hash64/%zu", len);
+	b_sink = sum;
+}
+
+static void
+bench_strhash(size_t len)
+{
+	static char keys[256][256 + 1];
+	unsigned long sum;
+	unsigned int i, j;
+	uint64_t t0;
+
+	for (i = 0; i < 256; ++i) {
+		for (j = 0; j < len; ++j)
+			keys[i][j] = 'a' + random() % 26;
+		keys[i][len] = '\0';
+	}
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_strhash(keys[i & 255]);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * len,
+	    "StrHash/%zu", len);
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_strhash64(keys[i & 255]);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * len,
+	    "StrHash64/%zu", len);
+	b_sink = sum;
+}
+
+static void
+bench_fixed(void)
+{
+	unsigned long sum;
+	unsigned int i;
+	uint64_t t0;
+
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_hash_ip4(ft_hash_seed, i);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * 4, "HashIP4");
+	t0 = b_now();
+	for (i = 0; i < NHASHES; ++i)
+		sum += ft_hash_ip4_flow(ft_hash_seed, i, ~i, i >> 16, 80);
+	b_report(NHASHES, b_now() - t0, (uint64_t)NHASHES * 12,
+	    "HashIP4Flow");
+	b_sink = sum;
+}
+
+int
+main(void)
+{
+	unsigned int i;
+
+	srandom(1990);
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = 'a' + random() % 26;
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+		bench_hash(sizes[i]);
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+		bench_strhash(sizes[i]);
+	bench_fixed();
+	exit(0);
+}
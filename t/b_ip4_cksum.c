@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the throughput of each ip4_cksum() implementation the CPU
+ * supports, from bare IP headers up to full-sized packets.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ft/ip4.h>
+
+#include "b_bench.h"
+
+#define NBYTES	(256U << 20)	/* per implementation and size */
+
+static const char *impls[] = { "generic", "sse2", "avx2", "neon" };
+static const size_t sizes[] = { 20, 40, 64, 576, 1500 };
+
+static uint8_t buf[1500];
+
+static void
+bench(const char *name, size_t len)
+{
+	unsigned int i, n;
+	uint64_t t0;
+	uint16_t sum;
+
+	n = NBYTES / len;
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < n; ++i)
+		sum = ip4_cksum(sum, buf, len);
+	b_report(n, b_now() - t0, (uint64_t)n * len,
+	    "IP4Cksum/%s/%zu", name, len);
+	b_sink = sum;
+}
+
+int
+main(void)
+{
+	unsigned int i, j;
+
+	srandom(791);
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = random();
+	for (i = 0; i < sizeof impls / sizeof impls[0]; ++i) {
+		if (ip4_cksum_select(impls[i]) != 0)
+			continue;
+		for (j = 0; j < sizeof sizes / sizeof sizes[0]; ++j)
+			bench(impls[i], sizes[j]);
+	}
+	exit(0);
+}
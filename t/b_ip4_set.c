@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure insertion into, removal from and lookups in address sets,
+ * using range lists shaped like real block lists: mostly small
+ * prefixes scattered over the address space.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ft/ip4.h>
+
+#include "b_bench.h"
+
+#define NADDRS		4096
+#define NLOOKUPS	(1U << 22)
+
+static const unsigned int sizes[] = { 100, 1000, 10000, 100000 };
+
+static uint32_t addrs[NADDRS];
+
+static ip4s_range *
+mkranges(unsigned int n)
+{
+	ip4s_range *r;
+	unsigned int k, plen;
+	uint32_t mask;
+
+	if ((r = malloc(n * sizeof *r)) == NULL)
+		return (NULL);
+	for (k = 0; k < n; ++k) {
+		plen = 20 + random() % 13;
+		mask = plen == 32 ? ~0U : ~(~0U >> plen);
+		r[k].first = ((uint32_t)random() << 1 ^ random()) & mask;
+		r[k].last = r[k].first | ~mask;
+	}
+	return (r);
+}
+
+static void
+bench(unsigned int n)
+{
+	uint8_t res[NADDRS];
+	ip4s_range *r;
+	ip4s_node *s;
+	ip4s_frozen *f;
+	unsigned long hits;
+	unsigned int i, k;
+	uint64_t t0;
+
+	if ((r = mkranges(n)) == NULL || (s = ip4s_new()) == NULL)
+		exit(1);
+
+	t0 = b_now();
+	for (k = 0; k < n; ++k)
+		ip4s_insert(s, r[k].first, r[k].last);
+	b_report(n, b_now() - t0, 0, "IP4sInsert/%u", n);
+
+	hits = 0;
+	t0 = b_now();
+	for (i = 0; i < NLOOKUPS; ++i)
+		hits += ip4s_lookup(s, addrs[i % NADDRS]);
+	b_report(NLOOKUPS, b_now() - t0, 0, "IP4sLookup/%u", n);
+
+	if ((f = ip4s_freeze(s)) == NULL)
+		exit(1);
+	t0 = b_now();
+	for (i = 0; i < NLOOKUPS; ++i)
+		hits += ip4s_frozen_lookup(f, addrs[i % NADDRS]);
+	b_report(NLOOKUPS, b_now() - t0, 0, "IP4sFrozenLookup/%u", n);
+
+	t0 = b_now();
+	for (i = 0; i < NLOOKUPS; i += NADDRS)
+		hits += ip4s_frozen_lookupv(f, addrs, res, NADDRS);
+	b_report(NLOOKUPS, b_now() - t0, 0, "IP4sFrozenLookupv/%u", n);
+	ip4s_frozen_destroy(f);
+
+	t0 = b_now();
+	for (k = 0; k < n; ++k)
+		ip4s_remove(s, r[k].first, r[k].last);
+	b_report(n, b_now() - t0, 0, "IP4sRemove/%u", n);
+
+	t0 = b_now();
+	ip4s_destroy(s);
+	if ((s = ip4s_build(r, n)) == NULL)
+		exit(1);
+	b_report(n, b_now() - t0, 0, "IP4sBuild/%u", n);
+	ip4s_destroy(s);
+	free(r);
+	b_sink = hits;
+}
+
+int
+main(void)
+{
+	unsigned int i;
+
+	srandom(1477555200);
+	for (i = 0; i < NADDRS; ++i)
+		addrs[i] = (uint32_t)random() << 1 ^ random();
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+		bench(sizes[i]);
+	exit(0);
+}
@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compare the cost of formatting text log lines with ft_logrec_text()
+ * and with snprintf(3), which is what flytrap used to do.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/ip4.h>
+#include <ft/logrec.h>
+
+#include "b_bench.h"
+
+#define NRECS	1024
+#define NLOOPS	2000
+
+static ft_logrec recs[NRECS];
+
+static int
+snprintf_text(char *buf, size_t size, const ft_logrec *lr)
+{
+	char tcpfl[] = "NCEUAPRSF", info[sizeof tcpfl];
+	const char *proto;
+	unsigned int bit, mask;
+
+	switch (lr->proto) {
+	case ip_proto_icmp:
+		proto = "ICMP";
+		snprintf(info, sizeof info, "%u.%u",
+		    lr->flags >> 8, lr->flags & 0xff);
+		break;
+	case ip_proto_tcp:
+		proto = "TCP";
+		for (bit = 0, mask = 0x100; mask > 0; ++bit, mask >>= 1)
+			if (!(lr->flags & mask))
+				tcpfl[bit] = '-';
+		memcpy(info, tcpfl, sizeof info);
+		break;
+	case ip_proto_udp:
+		proto = "UDP";
+		*info = '\0';
+		break;
+	default:
+		return (-1);
+	}
+	return (snprintf(buf, size,
+	    "%llu.%06lu,%d.%d.%d.%d,%d,%d.%d.%d.%d,%d,%s,%u,%s",
+	    (unsigned long long)lr->sec, (unsigned long)lr->usec,
+	    lr->sa.o[0], lr->sa.o[1], lr->sa.o[2], lr->sa.o[3], lr->sp,
+	    lr->da.o[0], lr->da.o[1], lr->da.o[2], lr->da.o[3], lr->dp,
+	    proto, (unsigned int)lr->len, info));
+}
+
+static void
+bench(const char *name, int (*fmt)(char *, size_t, const ft_logrec *))
+{
+	char line[FT_LOGREC_TEXTMAX];
+	unsigned long sum;
+	unsigned int i, j;
+	uint64_t t0;
+
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NLOOPS; ++i)
+		for (j = 0; j < NRECS; ++j)
+			sum += fmt(line, sizeof line, &recs[j]);
+	b_report(NLOOPS * NRECS, b_now() - t0, sum, "%s", name);
+	b_sink = sum;
+}
+
+int
+main(void)
+{
+	static const ip_proto protos[] =
+	    { ip_proto_tcp, ip_proto_tcp, ip_proto_udp, ip_proto_icmp };
+	unsigned int i;
+
+	srandom(1477555200);
+	for (i = 0; i < NRECS; ++i) {
+		recs[i].sec = 1477555200 + i;
+		recs[i].usec = random() % 1000000;
+		recs[i].sa.q = random();
+		recs[i].sp = random();
+		recs[i].da.q = random();
+		recs[i].dp = random() % 1024;
+		recs[i].proto = protos[i % 4];
+		recs[i].flags = 0x002;
+		recs[i].len = random() % 1500;
+	}
+	bench("LogrecText", ft_logrec_text);
+	bench("LogrecSnprintf", snprintf_text);
+	exit(0);
+}
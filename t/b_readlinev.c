@@ -0,0 +1,106 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the cost of reading and splitting lines with ft_readlinev(),
+ * and with ft_readall() and ft_splitline(), on a file shaped like a
+ * configuration or address list file.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ft/strutil.h>
+
+#include "b_bench.h"
+
+#define NLINES	100000
+#define NLOOPS	10
+
+int
+main(void)
+{
+	ft_wordv wv = { NULL, 0, 0 };
+	char **wordv, *buf, *p;
+	unsigned long lines, words;
+	unsigned int i;
+	uint64_t t0;
+	size_t blen;
+	long size;
+	FILE *f;
+	int len;
+
+	if ((f = tmpfile()) == NULL)
+		exit(1);
+	srandom(1337);
+	for (i = 0; i < NLINES; ++i) {
+		fprintf(f, "%u.%u.%u.%u/%u include \"sensor %u\" # %lx\n",
+		    (unsigned int)random() & 0xff,
+		    (unsigned int)random() & 0xff,
+		    (unsigned int)random() & 0xff, 0, 24, i,
+		    (unsigned long)random());
+	}
+	size = ftell(f);
+	lines = words = 0;
+	t0 = b_now();
+	for (i = 0; i < NLOOPS; ++i) {
+		rewind(f);
+		while ((wordv = ft_readlinev(f, NULL, &len)) != NULL) {
+			words += len;
+			while (len--)
+				free(wordv[len]);
+			free(wordv);
+			lines++;
+		}
+	}
+	b_report(lines, b_now() - t0, (uint64_t)size * NLOOPS, "Readlinev");
+	lines = 0;
+	t0 = b_now();
+	for (i = 0; i < NLOOPS; ++i) {
+		rewind(f);
+		if ((buf = ft_readall(f, &blen)) == NULL)
+			exit(1);
+		p = buf;
+		while (ft_splitline(&p, buf + blen, NULL, &wv) > 0) {
+			words += wv.nwords;
+			lines++;
+		}
+		free(buf);
+	}
+	b_report(lines, b_now() - t0, (uint64_t)size * NLOOPS, "Splitline");
+	ft_wordv_free(&wv);
+	fclose(f);
+	b_sink = words;
+	exit(0);
+}
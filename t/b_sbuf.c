@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the cost of formatting a typical log line into an sbuf, both
+ * self-extending and fixed-length.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ft/sbuf.h>
+
+#include "b_bench.h"
+
+#define NLINES	(1U << 21)
+
+static void
+format(struct sbuf *sb, unsigned int i)
+{
+
+	sbuf_clear(sb);
+	sbuf_printf(sb, "%u.%06u,%u.%u.%u.%u,%u,%u.%u.%u.%u,%u,%s,%u,%s",
+	    1477555200 + i, i % 1000000,
+	    192, 0, 2, i & 0xff, 1024 + (i & 0x7fff),
+	    198, 51, 100, (i >> 8) & 0xff, 22,
+	    "TCP", 0, "-------S-");
+	sbuf_finish(sb);
+}
+
+int
+main(void)
+{
+	char buf[128];
+	struct sbuf fixed, *sb;
+	unsigned long sum;
+	unsigned int i;
+	uint64_t t0;
+
+	if ((sb = sbuf_new_auto()) == NULL)
+		exit(1);
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NLINES; ++i) {
+		format(sb, i);
+		sum += sbuf_len(sb);
+	}
+	b_report(NLINES, b_now() - t0, sum, "SbufPrintf/auto");
+	sbuf_delete(sb);
+
+	if ((sb = sbuf_new(&fixed, buf, sizeof buf, SBUF_FIXEDLEN)) == NULL)
+		exit(1);
+	sum = 0;
+	t0 = b_now();
+	for (i = 0; i < NLINES; ++i) {
+		format(sb, i);
+		sum += sbuf_len(sb);
+	}
+	b_report(NLINES, b_now() - t0, sum, "SbufPrintf/fixed");
+	sbuf_delete(sb);
+	b_sink = sum;
+	exit(0);
+}
@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/dict.h>
+
+#include <cryb/test.h>
+
+#define T_DICT_KEYS	100000
+#define T_DICT_KEYLEN	16
+
+static int
+t_dict_basic(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	const struct ft_dict_ent *e;
+	struct ft_dict *d;
+	int one = 1, two = 2;
+	int ret;
+
+	if ((d = ft_dict_create()) == NULL)
+		return (0);
+	ret = t_is_null(ft_dict_first(d));
+	errno = 0;
+	ret &= t_is_null(ft_dict_lookup(d, "one"));
+	ret &= t_compare_i(ENOENT, errno);
+	ret &= t_compare_i(0, ft_dict_insert(d, "one", &one));
+	ret &= t_compare_i(0, ft_dict_insert(d, "two", &two));
+	errno = 0;
+	ret &= t_compare_i(-1, ft_dict_insert(d, "one", &two));
+	ret &= t_compare_i(EEXIST, errno);
+	ret &= t_compare_ptr(&one, ft_dict_lookup(d, "one"));
+	ret &= t_compare_ptr(&two, ft_dict_lookup(d, "two"));
+	if ((e = ft_dict_find(d, "two")) != NULL) {
+		ret &= t_compare_str("two", ft_dict_key(e));
+		ret &= t_compare_ptr(&two, ft_dict_value(e));
+	} else {
+		ret = 0;
+	}
+	ret &= t_compare_i(0, ft_dict_remove(d, "one"));
+	errno = 0;
+	ret &= t_compare_i(-1, ft_dict_remove(d, "one"));
+	ret &= t_compare_i(ENOENT, errno);
+	ret &= t_is_null(ft_dict_lookup(d, "one"));
+	ret &= t_compare_ptr(&two, ft_dict_lookup(d, "two"));
+	ft_dict_destroy(d);
+	return (ret);
+}
+
+/*
+ * Count the entries in a dictionary, checking that the value of each
+ * entry is its index and that every index is seen exactly once.
+ */
+static unsigned int
+t_dict_count(const struct ft_dict *d, const char *keys, uint8_t *seen)
+{
+	const struct ft_dict_ent *e;
+	const char *key;
+	uintptr_t i;
+	unsigned int n;
+
+	memset(seen, 0, T_DICT_KEYS);
+	for (n = 0, e = ft_dict_first(d); e != NULL; e = ft_dict_next(d, e)) {
+		key = ft_dict_key(e);
+		i = (uintptr_t)ft_dict_value(e);
+		if (i >= T_DICT_KEYS || seen[i]++ ||
+		    key != keys + i * T_DICT_KEYLEN)
+			return (UINT32_MAX);
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * Insert enough keys to make the table grow many times over, remove
+ * half of them, and check that lookups and iteration agree throughout.
+ */
+static int
+t_dict_many(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct ft_dict *d;
+	uint8_t *seen;
+	char *keys, *key;
+	uintptr_t i;
+	int ret;
+
+	keys = malloc(T_DICT_KEYS * T_DICT_KEYLEN);
+	seen = malloc(T_DICT_KEYS);
+	d = ft_dict_create();
+	if (keys == NULL || seen == NULL || d == NULL) {
+		ret = 0;
+		goto done;
+	}
+	for (i = 0; i < T_DICT_KEYS; ++i)
+		snprintf(keys + i * T_DICT_KEYLEN, T_DICT_KEYLEN, "key%lu",
+		    (unsigned long)i);
+	ret = 1;
+	for (i = 0; i < T_DICT_KEYS && ret; ++i)
+		ret &= t_compare_i(0,
+		    ft_dict_insert(d, keys + i * T_DICT_KEYLEN, (void *)i));
+	ret &= t_compare_u(T_DICT_KEYS, t_dict_count(d, keys, seen));
+	for (i = 0; i < T_DICT_KEYS && ret; i += 2)
+		ret &= t_compare_i(0,
+		    ft_dict_remove(d, keys + i * T_DICT_KEYLEN));
+	ret &= t_compare_u(T_DICT_KEYS / 2, t_dict_count(d, keys, seen));
+	for (i = 0; i < T_DICT_KEYS && ret; ++i) {
+		key = keys + i * T_DICT_KEYLEN;
+		errno = 0;
+		if (i % 2 == 0) {
+			ret &= t_is_null(ft_dict_find(d, key));
+			ret &= t_compare_i(ENOENT, errno);
+		} else {
+			ret &= t_compare_ptr((void *)i,
+			    ft_dict_lookup(d, key));
+		}
+	}
+	for (i = 1; i < T_DICT_KEYS && ret; i += 2)
+		ret &= t_compare_i(0,
+		    ft_dict_remove(d, keys + i * T_DICT_KEYLEN));
+	ret &= t_is_null(ft_dict_first(d));
+done:
+	if (d != NULL)
+		ft_dict_destroy(d);
+	free(seen);
+	free(keys);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	t_add_test(t_dict_basic, NULL, "basic");
+	t_add_test(t_dict_many, NULL, "many");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
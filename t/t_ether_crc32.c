@@ -0,0 +1,157 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/ethernet.h>
+
+#include <cryb/test.h>
+
+/* implementations to test, if the CPU supports them */
+static char *t_impls[] = { "bytewise", "slice8", "pclmul", "armv8" };
+
+/*
+ * Reference implementation: one bit at a time.
+ */
+static uint32_t
+t_crc32_ref(const uint8_t *p, size_t len)
+{
+	uint32_t crc;
+	int i;
+
+	for (crc = 0xffffffffU; len > 0; --len) {
+		crc ^= *p++;
+		for (i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320U : 0);
+	}
+	return (crc);
+}
+
+/*
+ * The standard check value, the complement of which is 0xcbf43926.
+ */
+static int
+t_crc32_check(char **desc CRYB_UNUSED, void *arg)
+{
+	static const char data[] = "123456789";
+
+	if (!t_compare_i(0, ether_crc32_select(arg)))
+		return (0);
+	return (t_compare_x32(0x340bc6d9, ether_crc32(data, 9)));
+}
+
+/*
+ * Compare with the reference implementation for all lengths up to a
+ * full-sized frame, at every alignment, with random data.
+ */
+static int
+t_crc32_random(char **desc CRYB_UNUSED, void *arg)
+{
+	uint8_t buf[1600 + 8];
+	size_t len, off;
+	int ret;
+
+	if (!t_compare_i(0, ether_crc32_select(arg)))
+		return (0);
+	srandom(8023);
+	for (off = 0; off < sizeof buf; ++off)
+		buf[off] = random();
+	ret = 1;
+	for (len = 0; len <= 1600 && ret; ++len)
+		for (off = 0; off < 8 && ret; ++off)
+			ret &= t_compare_x32(t_crc32_ref(buf + off, len),
+			    ether_crc32(buf + off, len));
+	return (ret);
+}
+
+/*
+ * Frames with a valid FCS leave a fixed residue, and a single flipped
+ * bit anywhere, including in the FCS itself, is always detected.
+ */
+static int
+t_crc32_fcs(char **desc CRYB_UNUSED, void *arg)
+{
+	uint8_t frame[1518];
+	uint32_t fcs;
+	size_t i, len;
+	int ret;
+
+	if (!t_compare_i(0, ether_crc32_select(arg)))
+		return (0);
+	srandom(802);
+	for (i = 0; i < sizeof frame; ++i)
+		frame[i] = random();
+	ret = 1;
+	for (len = 60; len <= 1514 && ret; len += 127) {
+		fcs = ~ether_crc32(frame, len);
+		frame[len] = fcs;
+		frame[len + 1] = fcs >> 8;
+		frame[len + 2] = fcs >> 16;
+		frame[len + 3] = fcs >> 24;
+		ret &= t_compare_x32(ETHER_CRC32_RESIDUE,
+		    ether_crc32(frame, len + 4));
+		i = random() % ((len + 4) * 8);
+		frame[i / 8] ^= 1 << (i % 8);
+		ret &= ether_crc32(frame, len + 4) != ETHER_CRC32_RESIDUE;
+		frame[i / 8] ^= 1 << (i % 8);
+	}
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_impls / sizeof t_impls[0]; ++i) {
+		if (ether_crc32_select(t_impls[i]) != 0)
+			continue;
+		t_add_test(t_crc32_check, t_impls[i], "%s check",
+		    t_impls[i]);
+		t_add_test(t_crc32_random, t_impls[i], "%s random",
+		    t_impls[i]);
+		t_add_test(t_crc32_fcs, t_impls[i], "%s fcs",
+		    t_impls[i]);
+	}
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,169 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/hash.h>
+
+#include <cryb/test.h>
+
+#define T_HASH_BUCKETS	256
+#define T_HASH_KEYS	(T_HASH_BUCKETS * 1024)
+
+static uint8_t t_buf[256];
+
+/*
+ * Two random seeds are unlikely to be the same.  The remaining tests
+ * use a fixed seed so their results are reproducible.
+ */
+static int
+t_hash_randomize(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint64_t seed;
+	int ret;
+
+	ft_hash_randomize();
+	seed = ft_hash_seed;
+	ft_hash_randomize();
+	ret = seed != ft_hash_seed;
+	ft_hash_seed = 0x0123456789abcdefULL;
+	return (ret);
+}
+
+/*
+ * Every length from 0 to the size of the buffer hashes differently, and
+ * differently with a different seed.
+ */
+static int
+t_hash_length(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint64_t h[sizeof t_buf + 1];
+	unsigned int i, j;
+	int ret;
+
+	ret = 1;
+	for (i = 0; i <= sizeof t_buf; ++i) {
+		h[i] = ft_hash64(1, t_buf, i);
+		ret &= t_compare_x64(h[i], ft_hash64(1, t_buf, i));
+		if (ft_hash64(2, t_buf, i) == h[i])
+			ret = 0;
+		for (j = 0; j < i; ++j)
+			if (h[j] == h[i])
+				ret = 0;
+	}
+	return (ret);
+}
+
+/*
+ * Flipping any one bit of the input should flip about half the bits of
+ * the output.
+ */
+static int
+t_hash_avalanche(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	static const size_t lens[] = { 3, 8, 13, 16, 31, 64 };
+	uint8_t key[64];
+	uint64_t h;
+	unsigned long flips, n;
+	unsigned int i, j;
+
+	flips = n = 0;
+	for (i = 0; i < sizeof lens / sizeof lens[0]; ++i) {
+		memcpy(key, t_buf, lens[i]);
+		h = ft_hash64(ft_hash_seed, key, lens[i]);
+		for (j = 0; j < lens[i] * 8; ++j) {
+			key[j / 8] ^= 1 << j % 8;
+			flips += __builtin_popcountll(h ^
+			    ft_hash64(ft_hash_seed, key, lens[i]));
+			key[j / 8] ^= 1 << j % 8;
+			n++;
+		}
+	}
+	t_verbose("%lu flips in %lu trials\n", flips, n);
+	return (flips > n * 30 && flips < n * 34);
+}
+
+/*
+ * Consecutive addresses and flows are spread evenly across buckets.
+ */
+static int
+t_hash_spread(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned int ip4[T_HASH_BUCKETS], flow[T_HASH_BUCKETS];
+	unsigned int i, lo, hi;
+
+	memset(ip4, 0, sizeof ip4);
+	memset(flow, 0, sizeof flow);
+	for (i = 0; i < T_HASH_KEYS; ++i) {
+		ip4[ft_hash_reduce(ft_hash_ip4(ft_hash_seed, 0xc0000200 + i),
+		    T_HASH_BUCKETS)]++;
+		flow[ft_hash_reduce(ft_hash_ip4_flow(ft_hash_seed,
+		    0xc6336401, 0xc0000201, i, i >> 16),
+		    T_HASH_BUCKETS)]++;
+	}
+	/* allow roughly five standard deviations either way */
+	lo = T_HASH_KEYS / T_HASH_BUCKETS * 85 / 100;
+	hi = T_HASH_KEYS / T_HASH_BUCKETS * 115 / 100;
+	for (i = 0; i < T_HASH_BUCKETS; ++i) {
+		if (ip4[i] < lo || ip4[i] > hi ||
+		    flow[i] < lo || flow[i] > hi) {
+			t_verbose("bucket %u: %u %u\n", i, ip4[i], flow[i]);
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	srandom(1990);
+	for (i = 0; i < sizeof t_buf; ++i)
+		t_buf[i] = random();
+	t_add_test(t_hash_randomize, NULL, "randomize");
+	t_add_test(t_hash_length, NULL, "lengths");
+	t_add_test(t_hash_avalanche, NULL, "avalanche");
+	t_add_test(t_hash_spread, NULL, "spread");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
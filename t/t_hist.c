@@ -0,0 +1,181 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/hist.h>
+
+#include <cryb/test.h>
+
+/*
+ * Every value must land in a bucket whose bounds contain it, and the
+ * bucket must be narrow enough to honour the precision guarantee.
+ */
+static int
+t_hist_check(uint64_t v)
+{
+	unsigned int idx;
+	uint64_t lo, hi;
+
+	idx = ft_hist_index(v);
+	hi = ft_hist_value(idx);
+	lo = idx > 0 ? ft_hist_value(idx - 1) + 1 : 0;
+	if (v < lo || v > hi || (hi - lo) * FT_HIST_SUB > v) {
+		t_verbose("%llu: bucket %u [%llu, %llu]\n",
+		    (unsigned long long)v, idx,
+		    (unsigned long long)lo, (unsigned long long)hi);
+		return (0);
+	}
+	return (1);
+}
+
+static int
+t_hist_index(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint64_t v;
+	unsigned int i;
+	int ret;
+
+	for (ret = 1, v = 0; v < (1U << 20) && ret; ++v)
+		ret &= t_hist_check(v);
+	srandom(1477555200);
+	for (i = 0; i < 100000 && ret; ++i) {
+		v = ((uint64_t)random() << 31 | random()) >>
+		    (random() % 63 + 1);
+		if (v >> FT_HIST_BITS)
+			continue;
+		ret &= t_hist_check(v);
+	}
+	ret &= t_compare_u(FT_HIST_BUCKETS - 1,
+	    ft_hist_index((uint64_t)1 << FT_HIST_BITS));
+	ret &= t_compare_u(FT_HIST_BUCKETS - 1, ft_hist_index(UINT64_MAX));
+	return (ret);
+}
+
+static int
+t_hist_quantile(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ft_hist *h;
+	uint64_t v;
+	int ret;
+
+	if ((h = calloc(1, sizeof *h)) == NULL)
+		return (0);
+	ret = t_compare_ull(0, ft_hist_quantile(h, 0.5));
+	/* small values are exact */
+	for (v = 0; v < 2 * FT_HIST_SUB; ++v)
+		ft_hist_add(h, v);
+	ret &= t_compare_ull(0, ft_hist_quantile(h, 0.0));
+	ret &= t_compare_ull(FT_HIST_SUB - 1, ft_hist_quantile(h, 0.5));
+	ret &= t_compare_ull(2 * FT_HIST_SUB - 1, ft_hist_quantile(h, 1.0));
+	/* larger ones are within the bucket width */
+	memset(h, 0, sizeof *h);
+	for (v = 1; v <= 100000; ++v)
+		ft_hist_add(h, v);
+	ret &= t_compare_ul(100000, h->count);
+	v = ft_hist_quantile(h, 0.5);
+	ret &= t_compare_i(1, v >= 50000 && v < 50000 + 50000 / FT_HIST_SUB);
+	v = ft_hist_quantile(h, 0.99);
+	ret &= t_compare_i(1, v >= 99000 && v <= 100000);
+	v = ft_hist_quantile(h, 0.999);
+	ret &= t_compare_i(1, v >= 99900 && v <= 100000);
+	ret &= t_compare_ull(100000, ft_hist_quantile(h, 1.0));
+	free(h);
+	return (ret);
+}
+
+static int
+t_hist_overflow(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ft_hist *h;
+	int ret;
+
+	if ((h = calloc(1, sizeof *h)) == NULL)
+		return (0);
+	ft_hist_add(h, 1);
+	ft_hist_add(h, UINT64_MAX);
+	ret = t_compare_ull(1, ft_hist_quantile(h, 0.5));
+	ret &= t_compare_ull(UINT64_MAX, ft_hist_quantile(h, 1.0));
+	free(h);
+	return (ret);
+}
+
+static int
+t_hist_merge(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ft_hist *a, *b, *all;
+	uint64_t v;
+	int ret;
+
+	a = calloc(1, sizeof *a);
+	b = calloc(1, sizeof *b);
+	all = calloc(1, sizeof *all);
+	if (a == NULL || b == NULL || all == NULL) {
+		free(a);
+		free(b);
+		free(all);
+		return (0);
+	}
+	for (v = 0; v < 10000; ++v) {
+		ft_hist_add(v % 3 ? a : b, v * v);
+		ft_hist_add(all, v * v);
+	}
+	ft_hist_merge(a, b);
+	ret = t_compare_ul(all->count, a->count);
+	ret &= t_compare_ull(all->max, a->max);
+	ret &= t_compare_mem(all->bucket, a->bucket, sizeof a->bucket);
+	free(a);
+	free(b);
+	free(all);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	t_add_test(t_hist_index, NULL, "bucket bounds");
+	t_add_test(t_hist_quantile, NULL, "quantiles");
+	t_add_test(t_hist_overflow, NULL, "overflow");
+	t_add_test(t_hist_merge, NULL, "merge");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,194 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cryb/test.h>
+
+#include "t_ip4.h"
+
+/* implementations to test, if the CPU supports them */
+static char *t_impls[] = { "generic", "sse2", "avx2", "neon" };
+
+/*
+ * Reference implementation: one big-endian word at a time.
+ */
+static uint16_t
+t_cksum_ref(uint16_t isum, const void *data, size_t len)
+{
+	const uint8_t *p;
+	uint32_t sum;
+
+	for (p = data, sum = isum; len > 1; len -= 2, p += 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += *p << 8;
+	while (sum > 0xffff)
+		sum -= 0xffff;
+	return (sum);
+}
+
+/*
+ * Example from RFC 1071 section 3
+ */
+static int
+t_cksum_rfc1071(char **desc CRYB_UNUSED, void *arg)
+{
+	static const uint8_t data[] =
+	    { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+	uint8_t buf[256];
+	unsigned int i;
+
+	if (!t_compare_i(0, ip4_cksum_select(arg)))
+		return (0);
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = data[i % sizeof data];
+	return (t_compare_x16(0xddf2, ip4_cksum(0, data, sizeof data)) &
+	    t_compare_x16(0xddf2 * 32 % 0xffff, ip4_cksum(0, buf, sizeof buf)));
+}
+
+/*
+ * Compare with the reference implementation for all lengths up to a
+ * full-sized frame, at every alignment, with random data.
+ */
+static int
+t_cksum_random(char **desc CRYB_UNUSED, void *arg)
+{
+	uint8_t buf[1600 + 8];
+	uint16_t isum;
+	size_t len, off;
+	int ret;
+
+	if (!t_compare_i(0, ip4_cksum_select(arg)))
+		return (0);
+	srandom(1071);
+	for (off = 0; off < sizeof buf; ++off)
+		buf[off] = random();
+	ret = 1;
+	for (len = 0; len <= 1600 && ret; ++len) {
+		for (off = 0; off < 8 && ret; ++off) {
+			isum = random();
+			ret &= t_compare_x16(t_cksum_ref(isum, buf + off, len),
+			    ip4_cksum(isum, buf + off, len));
+		}
+	}
+	return (ret);
+}
+
+/*
+ * A buffer large enough to overflow 32-bit vector lanes if they are not
+ * folded often enough.  The reference sum is computed in 64 kB chunks,
+ * as it would overflow otherwise.
+ */
+static int
+t_cksum_large(char **desc CRYB_UNUSED, void *arg)
+{
+	uint8_t *buf;
+	uint16_t sum;
+	size_t len, off;
+	int ret;
+
+	if (!t_compare_i(0, ip4_cksum_select(arg)))
+		return (0);
+	len = 3 << 20;
+	if ((buf = malloc(len + 1)) == NULL)
+		return (0);
+	srandom(65535);
+	for (off = 0; off < len + 1; ++off)
+		buf[off] = 0xf0 | random();
+	for (ret = 1, off = 0; off < 2; ++off) {
+		for (sum = 0, len = 0; len < 3 << 20; len += 1 << 16)
+			sum = t_cksum_ref(sum, buf + off + len, 1 << 16);
+		ret &= t_compare_x16(sum, ip4_cksum(0, buf + off, len));
+	}
+	free(buf);
+	return (ret);
+}
+
+/*
+ * Changing one word and adjusting the checksum must give the same
+ * result as recomputing it.
+ */
+static int
+t_cksum_adjust(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[64];
+	uint16_t o, n, sum;
+	unsigned int i, j, k;
+	int ret;
+
+	ip4_cksum_select(NULL);
+	srandom(1624);
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = random();
+	sum = ip4_cksum(0, buf, sizeof buf);
+	for (ret = 1, k = 0; k < 10000 && ret; ++k) {
+		j = (random() % (sizeof buf / 2)) * 2;
+		o = buf[j] << 8 | buf[j + 1];
+		n = k % 7 == 0 ? o : (uint16_t)random();
+		buf[j] = n >> 8;
+		buf[j + 1] = n;
+		sum = ip4_cksum_adjust(sum, o, n);
+		ret &= t_compare_x16(ip4_cksum(0, buf, sizeof buf), sum);
+	}
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_impls / sizeof t_impls[0]; ++i) {
+		if (ip4_cksum_select(t_impls[i]) != 0)
+			continue;
+		t_add_test(t_cksum_rfc1071, t_impls[i], "%s rfc1071",
+		    t_impls[i]);
+		t_add_test(t_cksum_random, t_impls[i], "%s random",
+		    t_impls[i]);
+		t_add_test(t_cksum_large, t_impls[i], "%s large",
+		    t_impls[i]);
+	}
+	t_add_test(t_cksum_adjust, NULL, "adjust");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -31,8 +31,11 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <cryb/test.h>
 
@@ -111,6 +114,7 @@ t_ip4a(char **desc CRYB_UNUSED, void *arg)
 	struct t_ip4s_case *t = arg;
 	ip4_addr addr, first, last;
 	const char *p, *q;
+	ip4s_frozen *f;
 	ip4s_node *n;
 	int ret;
 
@@ -130,10 +134,16 @@ t_ip4a(char **desc CRYB_UNUSED, void *arg)
 			return (-1);
 	}
 	ret = t_compare_ul(t->count, ip4s_count(n));
+	f = ip4s_freeze(n);
+	if (!t_is_not_null(f))
+		ret = 0;
+	else
+		ret &= t_compare_ul(t->count, ip4s_frozen_count(f));
 	for (p = q = t->present; q != NULL && *q != '\0'; p = q + 1) {
 		q = ip4_parse(p, &addr);
 		ft_assert(q != NULL && (*q == '\0' || *q == ','));
-		if (ip4s_lookup(n, be32toh(addr.q)) != 1) {
+		if (ip4s_lookup(n, be32toh(addr.q)) != 1 ||
+		    (f != NULL && ip4s_frozen_lookup(f, be32toh(addr.q)) != 1)) {
 			t_verbose("expected %d.%d.%d.%d present\n",
 			    addr.o[0], addr.o[1], addr.o[2], addr.o[3]);
 			ret = 0;
@@ -142,16 +152,346 @@ t_ip4a(char **desc CRYB_UNUSED, void *arg)
 	for (p = q = t->absent; q != NULL && *q != '\0'; p = q + 1) {
 		q = ip4_parse(p, &addr);
 		ft_assert(q != NULL && (*q == '\0' || *q == ','));
-		if (ip4s_lookup(n, be32toh(addr.q)) != 0) {
+		if (ip4s_lookup(n, be32toh(addr.q)) != 0 ||
+		    (f != NULL && ip4s_frozen_lookup(f, be32toh(addr.q)) != 0)) {
 			t_verbose("expected %d.%d.%d.%d absent\n",
 			    addr.o[0], addr.o[1], addr.o[2], addr.o[3]);
 			ret = 0;
 		}
 	}
+	ip4s_frozen_destroy(f);
 	ip4s_destroy(n);
 	return (ret);
 }
 
+/*
+ * Compare a frozen set against the tree it was made from, using both
+ * single and batch lookups, around every boundary of a set made up of
+ * many small, unaligned ranges.
+ */
+static int
+t_ip4s_frozen_batch(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint32_t addrs[1000];
+	uint8_t res[1000];
+	ip4s_frozen *f;
+	ip4s_node *n;
+	uint32_t a, base;
+	size_t hits, i, k;
+	int ret;
+
+	if ((n = ip4s_new()) == NULL)
+		return (0);
+	for (base = 0x0a000000, k = 0; k < 200; ++k)
+		ip4s_insert(n, base + k * 1237, base + k * 1237 + k % 300);
+	f = ip4s_freeze(n);
+	if (!t_is_not_null(f)) {
+		ip4s_destroy(n);
+		return (0);
+	}
+	ret = 1;
+	for (k = 0; k < 200 && ret; k += 5) {
+		/* five ranges' worth of boundaries per batch */
+		for (i = 0; i < 1000; ++i)
+			addrs[i] = base + (k + i / 200) * 1237 +
+			    (i % 200) * 3 - 100;
+		hits = ip4s_frozen_lookupv(f, addrs, res, 1000);
+		for (i = 0; i < 1000; ++i) {
+			a = addrs[i];
+			if (res[i] != ip4s_lookup(n, a) ||
+			    res[i] != ip4s_frozen_lookup(f, a)) {
+				t_verbose("mismatch at %08x\n", a);
+				ret = 0;
+			}
+			hits -= res[i];
+		}
+		ret &= t_compare_sz(0, hits);
+	}
+	ip4s_frozen_destroy(f);
+	ip4s_destroy(n);
+	return (ret);
+}
+
+/*
+ * Turning a frozen set back into ranges must give the same result as
+ * merging the ranges it was made from, and the count must not depend
+ * on how much room there is for the ranges themselves.
+ */
+static int
+t_ip4s_frozen_ranges(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ip4s_range r[300], fr[300];
+	ip4s_frozen *f;
+	ip4s_node *n;
+	uint32_t a;
+	size_t i, nr, nfr;
+	int ret;
+
+	/* pseudo-random, overlapping, adjacent and unaligned ranges */
+	for (a = 0x5eed1e55, i = 0; i < 300; ++i) {
+		a = a * 1103515245 + 12345;
+		r[i].first = a & 0xfffff000U;
+		r[i].last = r[i].first + (i % 5 == 0 ? 65535 : a % 4099);
+		if (i % 13 == 0 && i > 0)
+			r[i].first = r[i - 1].last + 1;
+	}
+	r[299].last = 0xffffffffU;
+	if ((n = ip4s_new()) == NULL)
+		return (0);
+	ip4s_insertv(n, r, 300);
+	f = ip4s_freeze(n);
+	ip4s_destroy(n);
+	if (!t_is_not_null(f))
+		return (0);
+	nr = ip4s_range_merge(r, 300);
+	nfr = ip4s_frozen_ranges(f, fr, 300);
+	ret = t_compare_sz(nr, nfr) &
+	    t_compare_sz(nr, ip4s_frozen_ranges(f, NULL, 0)) &
+	    t_compare_sz(nr, ip4s_frozen_ranges(f, fr, 10));
+	for (i = 0; i < nr && i < nfr && ret; ++i)
+		ret &= t_compare_x32(r[i].first, fr[i].first) &
+		    t_compare_x32(r[i].last, fr[i].last);
+	ip4s_frozen_destroy(f);
+	return (ret);
+}
+
+/*
+ * Print a tree to a string.
+ */
+static char *
+t_ip4s_str(const ip4s_node *n)
+{
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	if ((f = open_memstream(&buf, &len)) == NULL)
+		return (NULL);
+	ip4s_fprint(f, n);
+	fclose(f);
+	return (buf);
+}
+
+/*
+ * Check that bulk insertion and removal produce exactly the same tree
+ * as inserting or removing the same ranges one at a time, starting
+ * from an empty tree, a full tree, or one which is neither.
+ */
+static int
+t_ip4s_bulk(char **desc CRYB_UNUSED, void *arg)
+{
+	ip4s_range r[500];
+	ip4s_node *n, *bn;
+	char *s, *bs;
+	uint32_t a;
+	size_t i;
+	int remove = arg != NULL && strcmp(arg, "remove") == 0;
+	int merge = arg != NULL && strcmp(arg, "merge") == 0;
+	int ret;
+
+	/* pseudo-random, overlapping, adjacent and unaligned ranges */
+	for (a = 0x2545f491, i = 0; i < 500; ++i) {
+		a = a * 1103515245 + 12345;
+		r[i].first = (a >> 4) & 0x00ffffff;
+		r[i].last = r[i].first + (i % 7 == 0 ? 4095 : a % 97);
+		if (i % 11 == 0 && i > 0)
+			r[i].first = r[i - 1].last + 1;
+	}
+	r[0].first = 0;
+	r[499].last = 0xffffffffU;
+	n = ip4s_new();
+	bn = ip4s_new();
+	if (remove) {
+		ip4s_insert(n, 0U, ~0U);
+		ip4s_insert(bn, 0U, ~0U);
+	} else if (merge) {
+		ip4s_insert(n, 0x00100000, 0x00efffff);
+		ip4s_insert(bn, 0x00100000, 0x00efffff);
+	}
+	for (i = 0; i < 500; ++i) {
+		if (remove)
+			ip4s_remove(n, r[i].first, r[i].last);
+		else
+			ip4s_insert(n, r[i].first, r[i].last);
+	}
+	if (remove)
+		ret = t_compare_i(0, ip4s_removev(bn, r, 500));
+	else
+		ret = t_compare_i(0, ip4s_insertv(bn, r, 500));
+	ret &= t_compare_ul(ip4s_count(n), ip4s_count(bn));
+	s = t_ip4s_str(n);
+	bs = t_ip4s_str(bn);
+	if (t_is_not_null(s) && t_is_not_null(bs))
+		ret &= t_compare_str(s, bs);
+	else
+		ret = 0;
+	free(s);
+	free(bs);
+	ip4s_destroy(n);
+	ip4s_destroy(bn);
+	return (ret);
+}
+
+/*
+ * Build a tree from pseudo-random, overlapping and unaligned ranges
+ * in the bottom 16 MB, plus the top 4 kB.
+ */
+static ip4s_node *
+t_ip4s_random(uint32_t a)
+{
+	ip4s_node *n;
+	uint32_t first;
+	size_t i;
+
+	if ((n = ip4s_new()) == NULL)
+		return (NULL);
+	for (i = 0; i < 300; ++i) {
+		a = a * 1103515245 + 12345;
+		first = (a >> 4) & 0x00ffffff;
+		ip4s_insert(n, first, first + (i % 7 == 0 ? 4095 : a % 97));
+	}
+	ip4s_insert(n, 0xfffff000U, 0xffffffffU);
+	return (n);
+}
+
+/*
+ * Check union, intersection and difference against lookups in the
+ * operands, at every address where either operand changes.
+ */
+static int
+t_ip4s_ops(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ip4s_node *a, *b, *u, *x, *d;
+	ip4s_range r;
+	ip4s_iter it;
+	uint32_t v[4];
+	int ia, ib, j, k, ret;
+
+	a = t_ip4s_random(0x2545f491);
+	b = t_ip4s_random(0x5eed1e55);
+	if (!t_is_not_null(a) || !t_is_not_null(b))
+		return (0);
+	ip4s_remove(b, 0xfffff800U, 0xfffff8ffU);
+	u = ip4s_union(a, b);
+	x = ip4s_intersect(a, b);
+	d = ip4s_difference(a, b);
+	ret = t_is_not_null(u) & t_is_not_null(x) & t_is_not_null(d);
+	if (!ret)
+		goto done;
+	ret &= t_compare_ul(ip4s_count(a) + ip4s_count(b),
+	    ip4s_count(u) + ip4s_count(x));
+	ret &= t_compare_ul(ip4s_count(a), ip4s_count(d) + ip4s_count(x));
+	for (k = 0; k < 2 && ret; ++k) {
+		ip4s_iter_init(&it, k ? b : a);
+		while (ip4s_iter_next(&it, &r) && ret) {
+			v[0] = r.first - 1;
+			v[1] = r.first;
+			v[2] = r.last;
+			v[3] = r.last + 1;
+			for (j = 0; j < 4; ++j) {
+				ia = ip4s_lookup(a, v[j]);
+				ib = ip4s_lookup(b, v[j]);
+				ret &= t_compare_i(ia | ib, ip4s_lookup(u, v[j]));
+				ret &= t_compare_i(ia & ib, ip4s_lookup(x, v[j]));
+				ret &= t_compare_i(ia & !ib, ip4s_lookup(d, v[j]));
+			}
+		}
+	}
+done:
+	ip4s_destroy(a);
+	ip4s_destroy(b);
+	if (u != NULL)
+		ip4s_destroy(u);
+	if (x != NULL)
+		ip4s_destroy(x);
+	if (d != NULL)
+		ip4s_destroy(d);
+	return (ret);
+}
+
+/*
+ * Iterating over a tree must give the same ranges as freezing it and
+ * asking the frozen set for its ranges.
+ */
+static int
+t_ip4s_iter(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	ip4s_range fr[400], r;
+	ip4s_frozen *f;
+	ip4s_node *n;
+	ip4s_iter it;
+	size_t i, nfr;
+	int ret;
+
+	if ((n = t_ip4s_random(0x2545f491)) == NULL)
+		return (0);
+	f = ip4s_freeze(n);
+	if (!t_is_not_null(f)) {
+		ip4s_destroy(n);
+		return (0);
+	}
+	nfr = ip4s_frozen_ranges(f, fr, 400);
+	ret = 1;
+	ip4s_iter_init(&it, n);
+	for (i = 0; ip4s_iter_next(&it, &r) && ret; ++i) {
+		if (i >= nfr) {
+			ret = 0;
+			break;
+		}
+		ret &= t_compare_x32(fr[i].first, r.first) &
+		    t_compare_x32(fr[i].last, r.last);
+	}
+	ret &= t_compare_sz(nfr, i);
+	ip4s_frozen_destroy(f);
+	ip4s_destroy(n);
+	return (ret);
+}
+
+/*
+ * Read ranges from a file.
+ */
+static int
+t_ip4s_read(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	static char input[] =
+	    "# dark space\n"
+	    "10.0.0.0/8 192.168.1.1\n"
+	    "\n"
+	    "172.16.0.1-172.16.0.9 # trailing comment\n"
+	    "bogus\n";
+	ip4s_range *r;
+	size_t n;
+	FILE *f;
+	int lineno, ret;
+
+	if ((f = fmemopen(input, strlen(input), "r")) == NULL)
+		return (0);
+	lineno = 1;
+	r = ip4s_range_read(f, &n, &lineno);
+	fclose(f);
+	ret = t_is_null(r) & t_compare_i(EINVAL, errno) &
+	    t_compare_i(5, lineno);
+	free(r);
+	input[strlen(input) - 6] = '\0';
+	if ((f = fmemopen(input, strlen(input), "r")) == NULL)
+		return (0);
+	r = ip4s_range_read(f, &n, NULL);
+	fclose(f);
+	if (!t_is_not_null(r))
+		return (0);
+	ret &= t_compare_sz(3, n);
+	if (n == 3) {
+		ret &= t_compare_x32(0x0a000000, r[0].first);
+		ret &= t_compare_x32(0x0affffff, r[0].last);
+		ret &= t_compare_x32(0xc0a80101, r[1].first);
+		ret &= t_compare_x32(0xc0a80101, r[1].last);
+		ret &= t_compare_x32(0xac100001, r[2].first);
+		ret &= t_compare_x32(0xac100009, r[2].last);
+	}
+	free(r);
+	return (ret);
+}
+
 static int
 t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
 {
@@ -159,6 +499,14 @@ t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
 
 	for (i = 0; i < sizeof t_ip4s_cases / sizeof t_ip4s_cases[0]; ++i)
 		t_add_test(t_ip4a, &t_ip4s_cases[i], t_ip4s_cases[i].desc);
+	t_add_test(t_ip4s_frozen_batch, NULL, "frozen batch lookup");
+	t_add_test(t_ip4s_frozen_ranges, NULL, "frozen set ranges");
+	t_add_test(t_ip4s_bulk, NULL, "bulk insertion");
+	t_add_test(t_ip4s_bulk, "remove", "bulk removal");
+	t_add_test(t_ip4s_bulk, "merge", "bulk insertion into a non-empty tree");
+	t_add_test(t_ip4s_read, NULL, "read ranges");
+	t_add_test(t_ip4s_ops, NULL, "set operations");
+	t_add_test(t_ip4s_iter, NULL, "range iterator");
 	return (0);
 }
 
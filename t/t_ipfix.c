@@ -0,0 +1,205 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ip4.h>
+#include <ft/ipfix.h>
+#include <ft/logrec.h>
+
+#include <cryb/test.h>
+
+static const ft_logrec t_ipfix_tcp = {
+	.sec	 = 1477555200,
+	.usec	 = 42999,
+	.sa	 = { .o = { 192, 0, 2, 1 } },
+	.sp	 = 61234,
+	.da	 = { .o = { 198, 51, 100, 7 } },
+	.dp	 = 22,
+	.proto	 = ip_proto_tcp,
+	.flags	 = 0x112,
+	.len	 = 0,
+};
+
+static const ft_logrec t_ipfix_icmp = {
+	.sec	 = 1477555201,
+	.usec	 = 999999,
+	.sa	 = { .o = { 10, 0, 0, 1 } },
+	.da	 = { .o = { 10, 255, 255, 254 } },
+	.proto	 = ip_proto_icmp,
+	.flags	 = 8 << 8 | 0,
+	.len	 = 56,
+};
+
+/*
+ * Check a data record against the log record it was encoded from.
+ */
+static int
+t_ipfix_check_rec(const uint8_t *p, const ft_logrec *lr)
+{
+	int ret;
+
+	ret = t_compare_ull(lr->sec * 1000 + lr->usec / 1000, be64dec(p));
+	ret &= t_compare_mem(&lr->sa, p + 8, 4);
+	ret &= t_compare_u(lr->sp, be16dec(p + 12));
+	ret &= t_compare_mem(&lr->da, p + 14, 4);
+	ret &= t_compare_u(lr->dp, be16dec(p + 18));
+	ret &= t_compare_u(lr->proto, p[20]);
+	ret &= t_compare_x16(lr->proto == ip_proto_tcp ? lr->flags : 0,
+	    be16dec(p + 21));
+	ret &= t_compare_x16(lr->proto == ip_proto_icmp ? lr->flags : 0,
+	    be16dec(p + 23));
+	ret &= t_compare_ull(lr->len, be64dec(p + 25));
+	return (ret);
+}
+
+/*
+ * The template must describe exactly FT_IPFIX_RECSIZE bytes.
+ */
+static int
+t_ipfix_template(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_IPFIX_MINSIZE];
+	ft_ipfix fx;
+	unsigned int i, n, sum;
+	int ret;
+
+	ft_ipfix_init(&fx, buf, sizeof buf, 7);
+	ret = t_compare_i(0, ft_ipfix_template(&fx));
+	ret &= t_compare_sz(FT_IPFIX_HDRSIZE + FT_IPFIX_TMPLSIZE,
+	    ft_ipfix_finish(&fx, 1477555200));
+	ret &= t_compare_u(FT_IPFIX_VERSION, be16dec(buf));
+	ret &= t_compare_u(FT_IPFIX_HDRSIZE + FT_IPFIX_TMPLSIZE,
+	    be16dec(buf + 2));
+	ret &= t_compare_u(1477555200, be32dec(buf + 4));
+	ret &= t_compare_u(0, be32dec(buf + 8));
+	ret &= t_compare_u(7, be32dec(buf + 12));
+	ret &= t_compare_u(2, be16dec(buf + 16));
+	ret &= t_compare_u(FT_IPFIX_TMPLSIZE, be16dec(buf + 18));
+	ret &= t_compare_u(FT_IPFIX_TEMPLATE, be16dec(buf + 20));
+	n = be16dec(buf + 22);
+	ret &= t_compare_u((FT_IPFIX_TMPLSIZE - 8) / 4, n);
+	for (sum = 0, i = 0; i < n && ret; ++i)
+		sum += be16dec(buf + 24 + i * 4 + 2);
+	ret &= t_compare_u(FT_IPFIX_RECSIZE, sum);
+	return (ret);
+}
+
+/*
+ * A template followed by records in a single data set, then a second
+ * message whose sequence number counts the records in the first.
+ */
+static int
+t_ipfix_message(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[1400];
+	const uint8_t *set;
+	ft_ipfix fx;
+	size_t len;
+	int ret;
+
+	ft_ipfix_init(&fx, buf, sizeof buf, 0);
+	ret = t_compare_sz(0, ft_ipfix_finish(&fx, 0));
+	ret &= t_compare_i(0, ft_ipfix_template(&fx));
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_icmp));
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	len = FT_IPFIX_HDRSIZE + FT_IPFIX_TMPLSIZE + FT_IPFIX_SETSIZE +
+	    3 * FT_IPFIX_RECSIZE;
+	ret &= t_compare_sz(len, ft_ipfix_finish(&fx, 1));
+	ret &= t_compare_u(len, be16dec(buf + 2));
+	ret &= t_compare_u(0, be32dec(buf + 8));
+	set = buf + FT_IPFIX_HDRSIZE + FT_IPFIX_TMPLSIZE;
+	ret &= t_compare_u(FT_IPFIX_TEMPLATE, be16dec(set));
+	ret &= t_compare_u(FT_IPFIX_SETSIZE + 3 * FT_IPFIX_RECSIZE,
+	    be16dec(set + 2));
+	set += FT_IPFIX_SETSIZE;
+	ret &= t_ipfix_check_rec(set, &t_ipfix_tcp);
+	ret &= t_ipfix_check_rec(set + FT_IPFIX_RECSIZE, &t_ipfix_icmp);
+	ret &= t_ipfix_check_rec(set + 2 * FT_IPFIX_RECSIZE, &t_ipfix_tcp);
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_icmp));
+	len = FT_IPFIX_HDRSIZE + FT_IPFIX_SETSIZE + FT_IPFIX_RECSIZE;
+	ret &= t_compare_sz(len, ft_ipfix_finish(&fx, 2));
+	ret &= t_compare_u(3, be32dec(buf + 8));
+	ret &= t_ipfix_check_rec(buf + FT_IPFIX_HDRSIZE + FT_IPFIX_SETSIZE,
+	    &t_ipfix_icmp);
+	return (ret);
+}
+
+/*
+ * Records which do not fit are turned away, and a template in the
+ * middle of a message closes the data set before it.
+ */
+static int
+t_ipfix_full(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_IPFIX_MINSIZE + FT_IPFIX_RECSIZE];
+	ft_ipfix fx;
+	int ret;
+
+	ft_ipfix_init(&fx, buf, sizeof buf, 0);
+	ret = t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_i(0, ft_ipfix_template(&fx));
+	ret &= t_compare_i(-1, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_u(FT_IPFIX_SETSIZE + FT_IPFIX_RECSIZE,
+	    be16dec(buf + FT_IPFIX_HDRSIZE + 2));
+	ret &= t_compare_sz(FT_IPFIX_HDRSIZE + FT_IPFIX_SETSIZE +
+	    FT_IPFIX_RECSIZE + FT_IPFIX_TMPLSIZE, ft_ipfix_finish(&fx, 0));
+	ret &= t_compare_i(0, ft_ipfix_template(&fx));
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_i(0, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_i(-1, ft_ipfix_record(&fx, &t_ipfix_tcp));
+	ret &= t_compare_i(-1, ft_ipfix_template(&fx));
+	ret &= t_compare_sz(sizeof buf, ft_ipfix_finish(&fx, 0));
+	ret &= t_compare_u(1, be32dec(buf + 8));
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	t_add_test(t_ipfix_template, NULL, "template");
+	t_add_test(t_ipfix_message, NULL, "message");
+	t_add_test(t_ipfix_full, NULL, "full message");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
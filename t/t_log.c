@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/log.h>
+
+#include <cryb/test.h>
+
+#define T_LOG_FLOOD	 100
+
+static FILE *t_log_file;
+static int t_log_stderr;
+
+/*
+ * Send stderr to a temporary file while the code under test logs.
+ */
+static int
+t_log_begin(void)
+{
+
+	fflush(stderr);
+	if ((t_log_file = tmpfile()) == NULL ||
+	    (t_log_stderr = dup(STDERR_FILENO)) < 0 ||
+	    dup2(fileno(t_log_file), STDERR_FILENO) < 0)
+		return (0);
+	return (1);
+}
+
+/*
+ * Restore stderr and count the lines logged which contain the given
+ * string, as well as the number of messages reported as suppressed.
+ */
+static void
+t_log_end(const char *str, unsigned int *logged, unsigned int *suppressed)
+{
+	char line[1024];
+	const char *p;
+
+	ft_log_exit();
+	fflush(stderr);
+	dup2(t_log_stderr, STDERR_FILENO);
+	close(t_log_stderr);
+	rewind(t_log_file);
+	*logged = *suppressed = 0;
+	while (fgets(line, sizeof line, t_log_file) != NULL) {
+		t_verbose("%s", line);
+		if ((p = strstr(line, " similar message")) != NULL) {
+			while (p > line && p[-1] >= '0' && p[-1] <= '9')
+				--p;
+			*suppressed += strtoul(p, NULL, 10);
+		} else if (strstr(line, str) != NULL) {
+			(*logged)++;
+		}
+	}
+	fclose(t_log_file);
+}
+
+/*
+ * A flood from a single call site is cut down to the limit, and every
+ * message is accounted for.  The flood may straddle two seconds.
+ */
+static int
+t_log_limit(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned int k, logged, suppressed;
+	int ret;
+
+	ft_log_level = FT_LOG_LEVEL_NOTICE;
+	ft_log_ratelimit = 5;
+	if (!t_log_begin())
+		return (0);
+	for (k = 0; k < T_LOG_FLOOD; ++k)
+		ft_notice("flood %u", k);
+	t_log_end("flood", &logged, &suppressed);
+	ret = t_compare_u(T_LOG_FLOOD, logged + suppressed);
+	ret &= logged >= 5 && logged <= 10;
+	return (ret);
+}
+
+/*
+ * A flood from one call site does not affect the others.
+ */
+static int
+t_log_sites(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned int k, logged, suppressed;
+
+	ft_log_level = FT_LOG_LEVEL_NOTICE;
+	ft_log_ratelimit = 5;
+	if (!t_log_begin())
+		return (0);
+	for (k = 0; k < T_LOG_FLOOD; ++k)
+		ft_notice("flood %u", k);
+	ft_notice("other");
+	t_log_end("other", &logged, &suppressed);
+	return (t_compare_u(1, logged));
+}
+
+/*
+ * Debug messages, and all messages if the limit is zero, are never
+ * suppressed.
+ */
+static int
+t_log_unlimited(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned int k, logged, suppressed;
+	int ret;
+
+	ft_log_level = FT_LOG_LEVEL_DEBUG;
+	ft_log_ratelimit = 5;
+	if (!t_log_begin())
+		return (0);
+	for (k = 0; k < T_LOG_FLOOD; ++k)
+		ft_debug("flood %u", k);
+	t_log_end("flood", &logged, &suppressed);
+	ret = t_compare_u(T_LOG_FLOOD, logged);
+	ret &= t_compare_u(0, suppressed);
+	ft_log_level = FT_LOG_LEVEL_NOTICE;
+	ft_log_ratelimit = 0;
+	if (!t_log_begin())
+		return (0);
+	for (k = 0; k < T_LOG_FLOOD; ++k)
+		ft_notice("flood %u", k);
+	t_log_end("flood", &logged, &suppressed);
+	ret &= t_compare_u(T_LOG_FLOOD, logged);
+	ret &= t_compare_u(0, suppressed);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	ft_log_init("t_log", NULL);
+	t_add_test(t_log_limit, NULL, "one site");
+	t_add_test(t_log_sites, NULL, "separate sites");
+	t_add_test(t_log_unlimited, NULL, "unlimited");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
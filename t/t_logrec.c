@@ -0,0 +1,397 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/ip4.h>
+#include <ft/logrec.h>
+
+#include <cryb/test.h>
+
+static struct t_logrec_case {
+	const char		*desc;
+	ft_logrec		 lr;
+	const char		*text;
+} t_logrec_cases[] = {
+	{
+		.desc	 = "TCP",
+		.lr	 = {
+			.sec	 = 1477555200,
+			.usec	 = 42,
+			.sa	 = { .o = { 192, 0, 2, 1 } },
+			.sp	 = 61234,
+			.da	 = { .o = { 198, 51, 100, 7 } },
+			.dp	 = 22,
+			.proto	 = ip_proto_tcp,
+			.flags	 = 0x112,
+			.len	 = 0,
+		},
+		.text	 = "1477555200.000042,192.0.2.1,61234,"
+		    "198.51.100.7,22,TCP,0,N---A--S-",
+	},
+	{
+		.desc	 = "ICMP",
+		.lr	 = {
+			.sec	 = 1477555201,
+			.usec	 = 999999,
+			.sa	 = { .o = { 10, 0, 0, 1 } },
+			.da	 = { .o = { 10, 255, 255, 254 } },
+			.proto	 = ip_proto_icmp,
+			.flags	 = 8 << 8 | 0,
+			.len	 = 56,
+		},
+		.text	 = "1477555201.999999,10.0.0.1,0,"
+		    "10.255.255.254,0,ICMP,56,8.0",
+	},
+	{
+		.desc	 = "UDP",
+		.lr	 = {
+			.sec	 = 0x123456789ULL,
+			.usec	 = 0,
+			.sa	 = { .o = { 255, 255, 255, 255 } },
+			.sp	 = 65535,
+			.da	 = { .o = { 0, 0, 0, 0 } },
+			.dp	 = 53,
+			.proto	 = ip_proto_udp,
+			.len	 = 65535,
+		},
+		.text	 = "4886718345.000000,255.255.255.255,65535,"
+		    "0.0.0.0,53,UDP,65535,",
+	},
+};
+
+/*
+ * Encode a record, check that it decodes to the same thing, and check
+ * its text form.
+ */
+static int
+t_logrec(char **desc CRYB_UNUSED, void *arg)
+{
+	struct t_logrec_case *t = arg;
+	uint8_t buf[FT_LOGREC_SIZE + 1];
+	char line[128];
+	ft_logrec lr;
+	int ret;
+
+	memset(buf, 0xa5, sizeof buf);
+	ft_logrec_enc(buf, &t->lr);
+	ret = t_compare_x8(FT_LOGREC_MAGIC, buf[0]) &
+	    t_compare_x8(0xa5, buf[FT_LOGREC_SIZE]);
+	memset(&lr, 0, sizeof lr);
+	ret &= t_compare_i(0, ft_logrec_dec(&lr, buf));
+	ret &= t_compare_ull(t->lr.sec, lr.sec);
+	ret &= t_compare_u(t->lr.usec, lr.usec);
+	ret &= t_compare_x32(t->lr.sa.q, lr.sa.q);
+	ret &= t_compare_u(t->lr.sp, lr.sp);
+	ret &= t_compare_x32(t->lr.da.q, lr.da.q);
+	ret &= t_compare_u(t->lr.dp, lr.dp);
+	ret &= t_compare_u(t->lr.proto, lr.proto);
+	ret &= t_compare_x16(t->lr.flags, lr.flags);
+	ret &= t_compare_u(t->lr.len, lr.len);
+	ret &= t_compare_i(strlen(t->text),
+	    ft_logrec_text(line, sizeof line, &lr));
+	ret &= t_compare_str(t->text, line);
+	return (ret);
+}
+
+/*
+ * Corrupt records must be rejected.
+ */
+static int
+t_logrec_invalid(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_LOGREC_SIZE];
+	ft_logrec lr;
+	char line[128];
+	int ret;
+
+	ft_logrec_enc(buf, &t_logrec_cases[0].lr);
+	buf[0] = '1';
+	ret = t_compare_i(-1, ft_logrec_dec(&lr, buf));
+	buf[0] = FT_LOGREC_MAGIC;
+	buf[1] = FT_LOGREC_VERSION + 1;
+	ret &= t_compare_i(-1, ft_logrec_dec(&lr, buf));
+	lr = t_logrec_cases[0].lr;
+	lr.usec = 1000000;
+	ft_logrec_enc(buf, &lr);
+	ret &= t_compare_i(-1, ft_logrec_dec(&lr, buf));
+	lr.proto = 0;
+	ret &= t_compare_i(-1, ft_logrec_text(line, sizeof line, &lr));
+	return (ret);
+}
+
+/*
+ * Reference implementation using snprintf(3), as flytrap used to do it.
+ */
+static int
+t_logrec_ref(char *buf, size_t size, const ft_logrec *lr)
+{
+	char tcpfl[] = "NCEUAPRSF", info[sizeof tcpfl];
+	const char *proto;
+	unsigned int bit, mask;
+
+	switch (lr->proto) {
+	case ip_proto_icmp:
+		proto = "ICMP";
+		snprintf(info, sizeof info, "%u.%u",
+		    lr->flags >> 8, lr->flags & 0xff);
+		break;
+	case ip_proto_tcp:
+		proto = "TCP";
+		for (bit = 0, mask = 0x100; mask > 0; ++bit, mask >>= 1)
+			if (!(lr->flags & mask))
+				tcpfl[bit] = '-';
+		memcpy(info, tcpfl, sizeof info);
+		break;
+	case ip_proto_udp:
+		proto = "UDP";
+		*info = '\0';
+		break;
+	default:
+		return (-1);
+	}
+	return (snprintf(buf, size,
+	    "%llu.%06lu,%d.%d.%d.%d,%d,%d.%d.%d.%d,%d,%s,%u,%s",
+	    (unsigned long long)lr->sec, (unsigned long)lr->usec,
+	    lr->sa.o[0], lr->sa.o[1], lr->sa.o[2], lr->sa.o[3], lr->sp,
+	    lr->da.o[0], lr->da.o[1], lr->da.o[2], lr->da.o[3], lr->dp,
+	    proto, (unsigned int)lr->len, info));
+}
+
+/*
+ * Compare the formatter with the reference implementation on a large
+ * number of pseudo-random records.
+ */
+static int
+t_logrec_random(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	static const ip_proto protos[] =
+	    { ip_proto_icmp, ip_proto_tcp, ip_proto_udp };
+	char line[FT_LOGREC_TEXTMAX], ref[FT_LOGREC_TEXTMAX];
+	ft_logrec lr;
+	unsigned int i;
+	int len, ret;
+
+	srandom(1477555200);
+	for (ret = 1, i = 0; i < 100000 && ret; ++i) {
+		lr.sec = (uint64_t)random() << (random() % 32);
+		lr.usec = random() % 1000000;
+		lr.sa.q = random();
+		lr.sp = random();
+		lr.da.q = random();
+		lr.dp = random();
+		lr.proto = protos[i % 3];
+		lr.flags = random();
+		lr.len = random() >> (random() % 16);
+		len = ft_logrec_text(line, sizeof line, &lr);
+		ret &= t_compare_i(t_logrec_ref(ref, sizeof ref, &lr), len);
+		ret &= t_compare_str(ref, line);
+	}
+	return (ret);
+}
+
+/*
+ * Output which does not fit is truncated like snprintf(3) would.
+ */
+static int
+t_logrec_trunc(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct t_logrec_case *t = &t_logrec_cases[0];
+	char line[16];
+	int ret;
+
+	memset(line, 0xa5, sizeof line);
+	ret = t_compare_i(strlen(t->text),
+	    ft_logrec_text(line, 12, &t->lr));
+	ret &= t_compare_strn(t->text, line, 11);
+	ret &= t_compare_x8(0, line[11]);
+	ret &= t_compare_x8(0xa5, line[12]);
+	return (ret);
+}
+
+static ft_logsum t_logsum_rec = {
+	.fsec	 = 1477555200,
+	.fusec	 = 42,
+	.lsec	 = 1477555259,
+	.lusec	 = 999999,
+	.sa	 = { .o = { 192, 0, 2, 1 } },
+	.da	 = { .o = { 198, 51, 100, 7 } },
+	.dp	 = 23,
+	.proto	 = ip_proto_tcp,
+	.flags	 = 0x002,
+	.count	 = 70000,
+	.ndst	 = 254,
+};
+
+static const char t_logsum_str[] =
+    "+1477555200.000042,1477555259.999999,192.0.2.1,198.51.100.7,23,"
+    "TCP,70000,254,-------S-";
+
+/*
+ * Encode a summary record, check that it decodes to the same thing, and
+ * check its text form.
+ */
+static int
+t_logsum(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_LOGSUM_SIZE + 1];
+	char line[FT_LOGSUM_TEXTMAX];
+	ft_logsum ls;
+	int ret;
+
+	memset(buf, 0xa5, sizeof buf);
+	ft_logsum_enc(buf, &t_logsum_rec);
+	ret = t_compare_x8(FT_LOGSUM_MAGIC, buf[0]) &
+	    t_compare_x8(0xa5, buf[FT_LOGSUM_SIZE]);
+	memset(&ls, 0, sizeof ls);
+	ret &= t_compare_i(0, ft_logsum_dec(&ls, buf));
+	ret &= t_compare_ull(t_logsum_rec.fsec, ls.fsec);
+	ret &= t_compare_u(t_logsum_rec.fusec, ls.fusec);
+	ret &= t_compare_ull(t_logsum_rec.lsec, ls.lsec);
+	ret &= t_compare_u(t_logsum_rec.lusec, ls.lusec);
+	ret &= t_compare_x32(t_logsum_rec.sa.q, ls.sa.q);
+	ret &= t_compare_x32(t_logsum_rec.da.q, ls.da.q);
+	ret &= t_compare_u(t_logsum_rec.dp, ls.dp);
+	ret &= t_compare_u(t_logsum_rec.proto, ls.proto);
+	ret &= t_compare_x16(t_logsum_rec.flags, ls.flags);
+	ret &= t_compare_u(t_logsum_rec.count, ls.count);
+	ret &= t_compare_u(t_logsum_rec.ndst, ls.ndst);
+	ret &= t_compare_i(strlen(t_logsum_str),
+	    ft_logsum_text(line, sizeof line, &ls));
+	ret &= t_compare_str(t_logsum_str, line);
+	return (ret);
+}
+
+/*
+ * The widest summary line there can be, from a record which decodes
+ * without complaint, must fit in FT_LOGSUM_TEXTMAX.
+ */
+static const ft_logsum t_logsum_max_rec = {
+	.fsec	 = UINT64_MAX,
+	.fusec	 = 999999,
+	.lsec	 = UINT64_MAX,
+	.lusec	 = 999999,
+	.sa	 = { .o = { 255, 255, 255, 255 } },
+	.da	 = { .o = { 255, 255, 255, 255 } },
+	.dp	 = 65535,
+	.proto	 = ip_proto_tcp,
+	.flags	 = 0x1ff,
+	.count	 = UINT32_MAX,
+	.ndst	 = UINT32_MAX,
+};
+
+static const char t_logsum_max_str[] =
+    "+18446744073709551615.999999,18446744073709551615.999999,"
+    "255.255.255.255,255.255.255.255,65535,"
+    "TCP,4294967295,4294967295,NCEUAPRSF";
+
+static int
+t_logsum_max(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_LOGSUM_SIZE];
+	char line[FT_LOGSUM_TEXTMAX];
+	ft_logsum ls;
+	int ret;
+
+	ft_logsum_enc(buf, &t_logsum_max_rec);
+	ret = t_compare_i(0, ft_logsum_dec(&ls, buf));
+	ret &= t_compare_ull(t_logsum_max_rec.fsec, ls.fsec);
+	ret &= t_compare_ull(t_logsum_max_rec.lsec, ls.lsec);
+	ret &= t_compare_u(t_logsum_max_rec.count, ls.count);
+	ret &= t_compare_u(t_logsum_max_rec.ndst, ls.ndst);
+	ret &= t_compare_i(1, sizeof t_logsum_max_str <= FT_LOGSUM_TEXTMAX);
+	ret &= t_compare_i(strlen(t_logsum_max_str),
+	    ft_logsum_text(line, sizeof line, &ls));
+	ret &= t_compare_str(t_logsum_max_str, line);
+	/* truncated, so formatted in a scratch buffer */
+	ret &= t_compare_i(strlen(t_logsum_max_str),
+	    ft_logsum_text(line, 16, &ls));
+	ret &= t_compare_i(0, strncmp(t_logsum_max_str, line, 15));
+	ret &= t_compare_x8(0, line[15]);
+	return (ret);
+}
+
+/*
+ * Inconsistent summary records must be rejected.
+ */
+static int
+t_logsum_invalid(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint8_t buf[FT_LOGSUM_SIZE];
+	ft_logsum ls;
+	int ret;
+
+	ft_logsum_enc(buf, &t_logsum_rec);
+	buf[0] = FT_LOGREC_MAGIC;
+	ret = t_compare_i(-1, ft_logsum_dec(&ls, buf));
+	ls = t_logsum_rec;
+	ls.lsec = ls.fsec - 1;
+	ft_logsum_enc(buf, &ls);
+	ret &= t_compare_i(-1, ft_logsum_dec(&ls, buf));
+	ls = t_logsum_rec;
+	ls.ndst = ls.count + 1;
+	ft_logsum_enc(buf, &ls);
+	ret &= t_compare_i(-1, ft_logsum_dec(&ls, buf));
+	ls = t_logsum_rec;
+	ls.count = ls.ndst = 0;
+	ft_logsum_enc(buf, &ls);
+	ret &= t_compare_i(-1, ft_logsum_dec(&ls, buf));
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_logrec_cases / sizeof t_logrec_cases[0]; ++i)
+		t_add_test(t_logrec, &t_logrec_cases[i],
+		    t_logrec_cases[i].desc);
+	t_add_test(t_logrec_invalid, NULL, "invalid records");
+	t_add_test(t_logrec_random, NULL, "random records");
+	t_add_test(t_logrec_trunc, NULL, "truncation");
+	t_add_test(t_logsum, NULL, "summary");
+	t_add_test(t_logsum_max, NULL, "widest summary");
+	t_add_test(t_logsum_invalid, NULL, "invalid summaries");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
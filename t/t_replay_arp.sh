@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Replay ARP traffic through two workers and check that a reply from a
+# host which has been claimed reaches the worker holding the claim and
+# releases it.
+#
+
+flytrap=${FLYTRAP:-${top_builddir:-..}/sbin/flytrap/flytrap}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/t_replay_arp.XXXXXX") || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# write bytes given in decimal
+bytes() {
+	for b ; do
+		printf "\\$(printf %03o "$b")"
+	done
+}
+
+# write a 32-bit little-endian integer
+le32() {
+	bytes $(($1 & 255)) $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) \
+	    $(($1 >> 24 & 255))
+}
+
+# write a broadcast ARP frame: time oper sender-host target-host, where
+# host n is 10.0.0.n at 02:00:00:00:00:n
+arp() {
+	le32 $1 ; le32 0 ; le32 42 ; le32 42
+	bytes 255 255 255 255 255 255 2 0 0 0 0 $3 8 6
+	bytes 0 1 8 0 6 4 0 $2
+	bytes 2 0 0 0 0 $3 10 0 0 $3
+	if [ $2 -eq 2 ] ; then
+		bytes 2 0 0 0 0 $4
+	else
+		bytes 0 0 0 0 0 0
+	fi
+	bytes 10 0 0 $4
+}
+
+# 10.0.0.2 asks for 10.0.0.3 until flytrap claims it, then 10.0.0.3
+# shows up and answers.  The two addresses belong to different workers.
+{
+	bytes 212 195 178 161 2 0 4 0 0 0 0 0 0 0 0 0 255 255 0 0 1 0 0 0
+	for t in 1000 1001 1002 1003 1004 ; do
+		arp $t 1 2 3
+	done
+	arp 1005 2 3 2
+} >"$tmp/arp.pcap"
+
+echo "1..2"
+if ! "$flytrap" -o workers=2 -o statsfile="$tmp/stats" \
+    -r "$tmp/arp.pcap" >/dev/null ; then
+	echo "not ok 1 - replay"
+	echo "not ok 2 - claim released"
+	exit 1
+fi
+echo "ok 1 - replay"
+claims=$(awk '/^flytrap_arp_claims\{/ { n += $2 } END { print n + 0 }' \
+    "$tmp/stats")
+claimed=$(awk '/^flytrap_arp_claimed\{/ { n += $2 } END { print n + 0 }' \
+    "$tmp/stats")
+if [ "$claims" -eq 1 ] && [ "$claimed" -eq 0 ] ; then
+	echo "ok 2 - claim released"
+else
+	echo "not ok 2 - claim released ($claims claims, $claimed claimed)"
+	exit 1
+fi
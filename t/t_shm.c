@@ -0,0 +1,191 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/shm.h>
+
+#include <cryb/test.h>
+
+#define T_SHM_NIFACE	2
+#define T_SHM_NCOUNTER	3
+#define T_SHM_MAXARP	4
+
+struct t_shm {
+	void		*seg;
+	void		*copy;
+	size_t		 size;
+};
+
+static struct t_shm *
+t_shm_new(void)
+{
+	struct t_shm *ts;
+
+	if ((ts = calloc(1, sizeof *ts)) == NULL)
+		return (NULL);
+	ts->size = ft_shm_size(T_SHM_NIFACE, T_SHM_NCOUNTER, T_SHM_MAXARP);
+	ts->seg = calloc(1, ts->size);
+	ts->copy = calloc(1, ts->size);
+	if (ts->seg == NULL || ts->copy == NULL) {
+		free(ts->seg);
+		free(ts->copy);
+		free(ts);
+		return (NULL);
+	}
+	ft_shm_init(ts->seg, T_SHM_NIFACE, T_SHM_NCOUNTER, T_SHM_MAXARP);
+	return (ts);
+}
+
+static void
+t_shm_free(struct t_shm *ts)
+{
+
+	free(ts->seg);
+	free(ts->copy);
+	free(ts);
+}
+
+/*
+ * The tables follow the header back to back and fill the segment.
+ */
+static int
+t_shm_layout(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct t_shm *ts;
+	ft_shm_hdr *h;
+	int ret;
+
+	if ((ts = t_shm_new()) == NULL)
+		return (0);
+	h = ts->seg;
+	ret = t_compare_x32(FT_SHM_MAGIC, h->magic);
+	ret &= t_compare_u(FT_SHM_VERSION, h->version);
+	ret &= t_compare_u(sizeof *h, h->hdrsize);
+	ret &= t_compare_ull(0, h->seq);
+	ret &= t_compare_ull(ts->size, h->size);
+	ret &= t_compare_u(sizeof *h, h->iface_off);
+	ret &= t_compare_u(h->iface_off + T_SHM_NIFACE * sizeof(ft_shm_iface),
+	    h->counter_off);
+	ret &= t_compare_u(h->counter_off +
+	    T_SHM_NCOUNTER * sizeof(ft_shm_counter), h->arp_off);
+	ret &= t_compare_ull(h->arp_off + T_SHM_MAXARP * sizeof(ft_shm_arp),
+	    h->size);
+	ret &= t_compare_u(0, h->narp);
+	t_shm_free(ts);
+	return (ret);
+}
+
+/*
+ * A reader sees a completed update, but not one in progress.
+ */
+static int
+t_shm_update(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct t_shm *ts;
+	ft_shm_hdr *h;
+	ft_shm_arp *a;
+	int ret;
+
+	if ((ts = t_shm_new()) == NULL)
+		return (0);
+	h = ts->seg;
+	a = (ft_shm_arp *)(void *)((char *)ts->seg + h->arp_off);
+	ft_shm_begin(h);
+	ret = t_compare_ull(1, h->seq);
+	a[0].addr = 0xc0000201;
+	a[1].addr = 0xc0000202;
+	h->narp = 2;
+	ret &= t_compare_i(-1, ft_shm_read(ts->seg, ts->size, ts->copy, 8));
+	ret &= t_compare_i(EAGAIN, errno);
+	ft_shm_end(h);
+	ret &= t_compare_ull(2, h->seq);
+	ret &= t_compare_i(0, ft_shm_read(ts->seg, ts->size, ts->copy, 8));
+	ret &= t_compare_mem(ts->seg, ts->copy,
+	    h->arp_off + 2 * sizeof(ft_shm_arp));
+	t_shm_free(ts);
+	return (ret);
+}
+
+/*
+ * Segments which are not ours or do not add up are turned away.
+ */
+static int
+t_shm_invalid(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct t_shm *ts;
+	ft_shm_hdr *h;
+	int ret;
+
+	if ((ts = t_shm_new()) == NULL)
+		return (0);
+	h = ts->seg;
+	ret = t_compare_i(-1,
+	    ft_shm_read(ts->seg, ts->size - 1, ts->copy, 1));
+	ret &= t_compare_i(EINVAL, errno);
+	h->narp = T_SHM_MAXARP + 1;
+	ret &= t_compare_i(-1, ft_shm_read(ts->seg, ts->size, ts->copy, 1));
+	ret &= t_compare_i(EINVAL, errno);
+	h->narp = 0;
+	h->arp_off += sizeof(ft_shm_arp);
+	ret &= t_compare_i(-1, ft_shm_read(ts->seg, ts->size, ts->copy, 1));
+	ret &= t_compare_i(EINVAL, errno);
+	h->arp_off -= sizeof(ft_shm_arp);
+	h->version++;
+	ret &= t_compare_i(-1, ft_shm_read(ts->seg, ts->size, ts->copy, 1));
+	ret &= t_compare_i(EINVAL, errno);
+	h->version--;
+	ret &= t_compare_i(0, ft_shm_read(ts->seg, ts->size, ts->copy, 1));
+	t_shm_free(ts);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	t_add_test(t_shm_layout, NULL, "layout");
+	t_add_test(t_shm_update, NULL, "update");
+	t_add_test(t_shm_invalid, NULL, "invalid");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
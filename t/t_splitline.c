@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2016 Universitetet i Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft/strutil.h>
+
+#include <cryb/test.h>
+
+struct t_case {
+	const char	*desc;
+	const char	*in;
+	const char	*out;		/* words joined by |, lines by ; */
+	int		 lines;		/* final line number */
+	int		 err;
+};
+
+static struct t_case t_cases[] = {
+	{
+		.desc	= "empty",
+		.in	= "",
+		.out	= "",
+		.lines	= 0,
+	},
+	{
+		.desc	= "simple",
+		.in	= "a bc\n\tdef  g\n",
+		.out	= "a|bc;def|g;",
+		.lines	= 2,
+	},
+	{
+		.desc	= "no final newline",
+		.in	= "a b\nc",
+		.out	= "a|b;c;",
+		.lines	= 1,
+	},
+	{
+		.desc	= "blank lines",
+		.in	= "\n  \na\n",
+		.out	= ";;a;",
+		.lines	= 3,
+	},
+	{
+		.desc	= "comments",
+		.in	= "# comment \\\na # b\n#\n",
+		.out	= ";a;;",
+		.lines	= 3,
+	},
+	{
+		.desc	= "continuation",
+		.in	= "a \\\n b\\\nc\nd\n",
+		.out	= "a|bc;d;",
+		.lines	= 4,
+	},
+	{
+		.desc	= "escapes",
+		.in	= "a\\ b \\#c \\\\\n",
+		.out	= "a b|#c|\\;",
+		.lines	= 1,
+	},
+	{
+		.desc	= "single quotes",
+		.in	= "'a \\b' c'd\"e'\n",
+		.out	= "a \\b|cd\"e;",
+		.lines	= 1,
+	},
+	{
+		.desc	= "double quotes",
+		.in	= "\"a \\b\\\"\\\\\" x\"'\"y\n",
+		.out	= "a \\b\"\\|x'y;",
+		.lines	= 1,
+	},
+	{
+		.desc	= "empty quotes",
+		.in	= "'' \"\" a''\n",
+		.out	= "||a;",
+		.lines	= 1,
+	},
+	{
+		.desc	= "newline in quotes",
+		.in	= "'a\nb' c\nd\n",
+		.out	= "a\nb|c;d;",
+		.lines	= 3,
+	},
+	{
+		.desc	= "unterminated quote",
+		.in	= "a\n'b\n",
+		.out	= "a;",
+		.err	= EINVAL,
+	},
+	{
+		.desc	= "trailing escape",
+		.in	= "a\nb\\",
+		.out	= "a;",
+		.err	= EINVAL,
+	},
+};
+
+/*
+ * Split the input line by line and compare the words, the final line
+ * number and the error, if any, with what we expected.
+ */
+static int
+t_splitline(char **desc CRYB_UNUSED, void *arg)
+{
+	struct t_case *t = arg;
+	ft_wordv wv = { NULL, 0, 0 };
+	char *buf, *p, *end, *out;
+	size_t i, len, olen;
+	int lineno, ret, rv;
+
+	len = strlen(t->in);
+	olen = strlen(t->out) + 1;
+	if ((buf = malloc(len + 1)) == NULL || (out = malloc(olen)) == NULL) {
+		free(buf);
+		return (0);
+	}
+	memcpy(buf, t->in, len + 1);
+	out[0] = '\0';
+	p = buf;
+	end = buf + len;
+	lineno = 0;
+	while ((rv = ft_splitline(&p, end, &lineno, &wv)) > 0) {
+		for (i = 0; i < wv.nwords; ++i) {
+			if (i > 0)
+				strlcat(out, "|", olen);
+			strlcat(out, wv.words[i].str, olen);
+			if (strlen(wv.words[i].str) != wv.words[i].len)
+				strlcat(out, "!", olen);
+		}
+		strlcat(out, ";", olen);
+	}
+	ret = t_compare_str(t->out, out);
+	if (t->err) {
+		ret &= t_compare_i(-1, rv);
+		ret &= t_compare_i(t->err, errno);
+	} else {
+		ret &= t_compare_i(0, rv);
+		ret &= t_compare_i(t->lines, lineno);
+		ret &= t_compare_ptr(end, p);
+	}
+	ft_wordv_free(&wv);
+	free(out);
+	free(buf);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i)
+		t_add_test(t_splitline, &t_cases[i], "%s", t_cases[i].desc);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}